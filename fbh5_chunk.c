@@ -0,0 +1,333 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * fbh5_chunk.c                                                                *
+ * ------------                                                                *
+ * Write an FBH5 dump as directly written, precompressed chunks.               *
+ *                                                                             *
+ * When the "data" dataset uses the Bitshuffle filter with LZ4 compression     *
+ * (as created by fbh5_open) and each dump fills whole chunks, the chunks are  *
+ * gathered from the dump, bitshuffled and LZ4 compressed in parallel by a     *
+ * pool of threads and written with H5Dwrite_chunk, bypassing the filter       *
+ * pipeline of the HDF5 library.  The chunks are encoded exactly as the        *
+ * Bitshuffle filter would encode them, so the file is the same as one         *
+ * written by H5Dwrite.                                                        *
+ *                                                                             *
+ * HDF 5 library functions used:                                               *
+ * - H5Dwrite_chunk       - Write a precompressed chunk                        *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <unistd.h>
+#include "fbh5_defs.h"
+
+// H5Dwrite_chunk was added in HDF5 1.10.3; earlier versions only have the
+// high-level library's H5DOwrite_chunk.
+#if !H5_VERSION_GE(1,10,3)
+#include "hdf5_hl.h"
+#define H5Dwrite_chunk H5DOwrite_chunk
+#endif
+
+#ifdef RAWSPEC_HAVE_LZ4
+#include <lz4.h>
+
+/*
+ * Bitshuffle constants (must match the Bitshuffle filter).
+ */
+#define BSHUF_TARGET_BLOCK_SIZE_B   8192    // Target block size in bytes
+#define BSHUF_BLOCKED_MULT          8       // Block sizes are multiples of this
+#define BSHUF_MIN_RECOMMEND_BLOCK   128     // Minimum default block size
+#define BSHUF_HEADER_SIZE           12      // Chunk header size in bytes
+
+/***
+	Default Bitshuffle block size (in elements) for `elem_size` byte elements.
+***/
+static size_t bshuf_default_block_size(size_t elem_size) {
+    size_t block_size = BSHUF_TARGET_BLOCK_SIZE_B / elem_size;
+    block_size = (block_size / BSHUF_BLOCKED_MULT) * BSHUF_BLOCKED_MULT;
+    return block_size > BSHUF_MIN_RECOMMEND_BLOCK ? block_size : BSHUF_MIN_RECOMMEND_BLOCK;
+}
+
+static void write_uint64_BE(char * buf, uint64_t value) {
+    int i;
+    for(i = 7; i >= 0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static void write_uint32_BE(char * buf, uint32_t value) {
+    int i;
+    for(i = 3; i >= 0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/***
+	Bitshuffle `size` elements (a multiple of 8) of `elem_size` bytes from
+	`in` to `out`.  Bit b of byte j of element i goes to bit (i % 8) of byte
+	(j*8 + b) * size/8 + i/8 of `out`.
+***/
+static void bshuf_trans_bit_elem(const char * in, char * out, size_t size, size_t elem_size) {
+    size_t nbyte_row = size / 8;
+    size_t i, j, k;
+    uint64_t x, t;
+
+    for(j = 0; j < elem_size; j++) {
+        for(i = 0; i < nbyte_row; i++) {
+            // Gather byte j of elements 8i..8i+7 into the bytes of x
+            x = 0;
+            for(k = 0; k < 8; k++)
+                x |= (uint64_t)(uint8_t)in[(8*i + k) * elem_size + j] << (8*k);
+            // Transpose the 8x8 bit matrix so byte b of x holds bit b of each
+            t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+            x = x ^ t ^ (t << 7);
+            t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+            x = x ^ t ^ (t << 14);
+            t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+            x = x ^ t ^ (t << 28);
+            for(k = 0; k < 8; k++) {
+                out[(j*8 + k) * nbyte_row + i] = x & 0xff;
+                x >>= 8;
+            }
+        }
+    }
+}
+
+/***
+	Upper bound of the Bitshuffle/LZ4 encoded size of `size` elements.
+***/
+static size_t bshuf_lz4_bound(size_t size, size_t elem_size, size_t block_size) {
+    size_t bound = (size / block_size) * (LZ4_compressBound(block_size * elem_size) + 4);
+    size_t last = size % block_size;
+
+    last -= last % BSHUF_BLOCKED_MULT;
+    if(last)
+        bound += LZ4_compressBound(last * elem_size) + 4;
+    return BSHUF_HEADER_SIZE + bound + (size % BSHUF_BLOCKED_MULT) * elem_size;
+}
+
+/***
+	Encode `size` elements of `in` as the Bitshuffle filter does with LZ4
+	compression.  `tmp` must hold a block.  Returns the encoded size in bytes
+	or 0 on error.
+***/
+static size_t bshuf_lz4_encode(const char * in, char * out, char * tmp, size_t size, size_t elem_size, size_t block_size) {
+    size_t pos = BSHUF_HEADER_SIZE;
+    size_t done = 0;
+    size_t n;
+    int nbytes;
+
+    write_uint64_BE(out, (uint64_t)size * elem_size);
+    write_uint32_BE(out + 8, block_size * elem_size);
+
+    while(done < size) {
+        n = size - done;
+        if(n > block_size)
+            n = block_size;
+        n -= n % BSHUF_BLOCKED_MULT;
+        if(n == 0)
+            break;
+        bshuf_trans_bit_elem(in + done * elem_size, tmp, n, elem_size);
+        nbytes = LZ4_compress_default(tmp, out + pos + 4, n * elem_size, LZ4_compressBound(n * elem_size));
+        if(nbytes <= 0)
+            return 0;
+        write_uint32_BE(out + pos, nbytes);
+        pos += 4 + nbytes;
+        done += n;
+    }
+
+    // Leftover elements (fewer than 8) are stored as is
+    memcpy(out + pos, in + done * elem_size, (size - done) * elem_size);
+    return pos + (size - done) * elem_size;
+}
+
+/*
+ * Work shared by the compression threads of one dump.
+ */
+typedef struct {
+    fbh5_context_t * p_fbh5_ctx;
+    const char * p_buffer;      // Dump being written
+    size_t next;                // Index of next chunk to compress
+    pthread_mutex_t mutex;
+    int error;                  // Non-zero if compressing any chunk failed
+} chunk_work_t;
+
+/***
+	Compression thread: gathers, bitshuffles and compresses chunks until all
+	chunks of the dump are done.
+***/
+static void * chunk_thread_func(void * arg) {
+    chunk_work_t * work = (chunk_work_t *)arg;
+    fbh5_context_t * ctx = work->p_fbh5_ctx;
+    size_t elem_size = ctx->elem_size;
+    size_t nt = ctx->chunk_dims[0];
+    size_t nf = ctx->chunk_dims[2];
+    size_t chunks_per_if = ctx->filesz_dims[2] / nf;
+    size_t chunks_per_dt = ctx->filesz_dims[1] * chunks_per_if;
+    size_t block_size = bshuf_default_block_size(elem_size);
+    char * gather = malloc(nt * nf * elem_size);
+    char * tmp = malloc(block_size * elem_size);
+    size_t ci, t, t0, ifs, f0;
+
+    if(!gather || !tmp) {
+        pthread_mutex_lock(&work->mutex);
+        work->error = 1;
+        pthread_mutex_unlock(&work->mutex);
+        free(gather);
+        free(tmp);
+        return NULL;
+    }
+
+    for(;;) {
+        pthread_mutex_lock(&work->mutex);
+        ci = work->next++;
+        pthread_mutex_unlock(&work->mutex);
+        if(ci >= ctx->nchunks)
+            break;
+
+        // Gather the chunk's rows of nf channels from the (time, if, chan) dump
+        t0 = (ci / chunks_per_dt) * nt;
+        ifs = (ci % chunks_per_dt) / chunks_per_if;
+        f0 = (ci % chunks_per_if) * nf;
+        for(t = 0; t < nt; t++)
+            memcpy(gather + t * nf * elem_size,
+                   work->p_buffer + ((t0 + t) * ctx->tint_size) + (ifs * ctx->filesz_dims[2] + f0) * elem_size,
+                   nf * elem_size);
+
+        ctx->chunk_sizes[ci] = bshuf_lz4_encode(gather, ctx->chunk_bufs[ci], tmp, nt * nf, elem_size, block_size);
+        if(ctx->chunk_sizes[ci] == 0) {
+            pthread_mutex_lock(&work->mutex);
+            work->error = 1;
+            pthread_mutex_unlock(&work->mutex);
+        }
+    }
+
+    free(gather);
+    free(tmp);
+    return NULL;
+}
+#endif // RAWSPEC_HAVE_LZ4
+
+/***
+	Set up direct chunk writing of dumps of Nd time integrations to a dataset
+	with chunk dimensions `cdims` that uses the Bitshuffle filter with LZ4
+	compression.  Returns 1 if direct chunk writing is enabled, 0 if dumps must
+	be written with H5Dwrite.
+***/
+int fbh5_chunk_init(fbh5_context_t * p_fbh5_ctx, hsize_t * cdims, unsigned int Nd) {
+#ifdef RAWSPEC_HAVE_LZ4
+    size_t i;
+    size_t size = cdims[0] * cdims[1] * cdims[2];
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(cdims[1] != 1 || Nd % cdims[0] != 0 || p_fbh5_ctx->filesz_dims[2] % cdims[2] != 0)
+        return 0;
+
+    p_fbh5_ctx->dump_ntints = Nd;
+    p_fbh5_ctx->nchunks = (Nd / cdims[0]) * p_fbh5_ctx->filesz_dims[1] * (p_fbh5_ctx->filesz_dims[2] / cdims[2]);
+    p_fbh5_ctx->chunk_cap = bshuf_lz4_bound(size, p_fbh5_ctx->elem_size,
+                                            bshuf_default_block_size(p_fbh5_ctx->elem_size));
+    p_fbh5_ctx->chunk_bufs = calloc(p_fbh5_ctx->nchunks, sizeof(char *));
+    p_fbh5_ctx->chunk_sizes = calloc(p_fbh5_ctx->nchunks, sizeof(size_t));
+    if(!p_fbh5_ctx->chunk_bufs || !p_fbh5_ctx->chunk_sizes) {
+        fbh5_chunk_free(p_fbh5_ctx);
+        return 0;
+    }
+    for(i = 0; i < p_fbh5_ctx->nchunks; i++) {
+        p_fbh5_ctx->chunk_bufs[i] = malloc(p_fbh5_ctx->chunk_cap);
+        if(!p_fbh5_ctx->chunk_bufs[i]) {
+            fbh5_chunk_free(p_fbh5_ctx);
+            return 0;
+        }
+    }
+    memcpy(p_fbh5_ctx->chunk_dims, cdims, sizeof(p_fbh5_ctx->chunk_dims));
+    p_fbh5_ctx->nthreads = ncpus < 1 ? 1 : (ncpus > FBH5_MAX_CHUNK_THREADS ? FBH5_MAX_CHUNK_THREADS : ncpus);
+    if(p_fbh5_ctx->nthreads > p_fbh5_ctx->nchunks)
+        p_fbh5_ctx->nthreads = p_fbh5_ctx->nchunks;
+    p_fbh5_ctx->direct_chunk = 1;
+    return 1;
+#else
+    return 0;
+#endif // RAWSPEC_HAVE_LZ4
+}
+
+/***
+	Free the direct chunk writing buffers.
+***/
+void fbh5_chunk_free(fbh5_context_t * p_fbh5_ctx) {
+    size_t i;
+
+    if(p_fbh5_ctx->chunk_bufs) {
+        for(i = 0; i < p_fbh5_ctx->nchunks; i++)
+            free(p_fbh5_ctx->chunk_bufs[i]);
+    }
+    free(p_fbh5_ctx->chunk_bufs);
+    free(p_fbh5_ctx->chunk_sizes);
+    p_fbh5_ctx->chunk_bufs = NULL;
+    p_fbh5_ctx->chunk_sizes = NULL;
+    p_fbh5_ctx->direct_chunk = 0;
+}
+
+/***
+	Compress the chunks of a dump of dump_ntints time integrations in
+	`p_buffer` and write them at time offset offset_dims[0], which must be a
+	multiple of chunk_dims[0].  The dataset must already have been extended.
+	Returns 0 on success, 1 on error.
+***/
+int fbh5_write_chunks(fbh5_context_t * p_fbh5_ctx, void * p_buffer, int debug_callback) {
+#ifdef RAWSPEC_HAVE_LZ4
+    chunk_work_t work;
+    pthread_t threads[FBH5_MAX_CHUNK_THREADS];
+    int started[FBH5_MAX_CHUNK_THREADS];
+    hsize_t offset[NDIMS];
+    size_t chunks_per_if = p_fbh5_ctx->filesz_dims[2] / p_fbh5_ctx->chunk_dims[2];
+    size_t chunks_per_dt = p_fbh5_ctx->filesz_dims[1] * chunks_per_if;
+    size_t ci;
+    unsigned int i;
+    herr_t status;
+
+    work.p_fbh5_ctx = p_fbh5_ctx;
+    work.p_buffer = p_buffer;
+    work.next = 0;
+    work.error = 0;
+    pthread_mutex_init(&work.mutex, NULL);
+
+    // Compress all chunks, on this thread too
+    for(i = 1; i < p_fbh5_ctx->nthreads; i++)
+        started[i] = pthread_create(&threads[i], NULL, chunk_thread_func, &work) == 0;
+    chunk_thread_func(&work);
+    for(i = 1; i < p_fbh5_ctx->nthreads; i++) {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&work.mutex);
+    if(work.error) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_write_chunks: chunk compression FAILED");
+        return 1;
+    }
+
+    // Write the chunks in file order
+    for(ci = 0; ci < p_fbh5_ctx->nchunks; ci++) {
+        offset[0] = p_fbh5_ctx->offset_dims[0] + (ci / chunks_per_dt) * p_fbh5_ctx->chunk_dims[0];
+        offset[1] = (ci % chunks_per_dt) / chunks_per_if;
+        offset[2] = (ci % chunks_per_if) * p_fbh5_ctx->chunk_dims[2];
+        status = H5Dwrite_chunk(p_fbh5_ctx->dataset_id,        // Dataset handle
+                                H5P_DEFAULT,                   // Default data transfer properties
+                                0,                             // All filters were applied
+                                offset,                        // Offset of chunk
+                                p_fbh5_ctx->chunk_sizes[ci],   // Size of compressed chunk
+                                p_fbh5_ctx->chunk_bufs[ci]);   // Compressed chunk
+        if(status < 0) {
+            fbh5_error(__FILE__, __LINE__, "fbh5_write_chunks: H5Dwrite_chunk FAILED");
+            return 1;
+        }
+    }
+    if(debug_callback)
+        fbh5_info("fbh5_write_chunks: wrote %lu chunks using %u threads\n",
+                  p_fbh5_ctx->nchunks, p_fbh5_ctx->nthreads);
+    return 0;
+#else
+    return 1;
+#endif // RAWSPEC_HAVE_LZ4
+}
@@ -8,6 +8,7 @@
 
 #include "fbh5_defs.h"
 #define MILLION 1000000.0
+#define MAX(a,b) ((a > b) ? (a) : (b))
 
 
 /***
@@ -22,6 +23,16 @@ int fbh5_close(fbh5_context_t * p_fbh5_ctx, int debug_callback) {
     // Even if this function fails, mark the fbh5 context inactive.
     p_fbh5_ctx->active = 0;
 
+    /*
+     * Trim any unused preallocated extent (see fbh5_open).
+     */
+    if(p_fbh5_ctx->filesz_dims[0] != MAX(p_fbh5_ctx->offset_dims[0], 1)) {
+        p_fbh5_ctx->filesz_dims[0] = MAX(p_fbh5_ctx->offset_dims[0], 1);
+        status = H5Dset_extent(p_fbh5_ctx->dataset_id, p_fbh5_ctx->filesz_dims);
+        if(status < 0)
+            fbh5_warning(__FILE__, __LINE__, "fbh5_close: H5Dset_extent/dataset_id FAILED");
+    }
+
     // Compute some stats while the dataset is still open.
     sz_store = H5Dget_storage_size(p_fbh5_ctx->dataset_id);
     MiBlogical = (double) p_fbh5_ctx->tint_size * (double) p_fbh5_ctx->offset_dims[0] / MILLION;
@@ -43,6 +54,16 @@ int fbh5_close(fbh5_context_t * p_fbh5_ctx, int debug_callback) {
         return 1;
     }
         
+    /*
+     * Close valid sample fraction dataset.
+     */
+    status = H5Dclose(p_fbh5_ctx->valid_dataset_id);
+    if(status != 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_close H5Dclose dataset 'valid_frac' FAILED\n");
+        fbh5_show_context("fbh5_close", p_fbh5_ctx);
+         return 1;
+    }
+
     /*
      * Close dataset.
      */
@@ -53,6 +74,19 @@ int fbh5_close(fbh5_context_t * p_fbh5_ctx, int debug_callback) {
          return 1;
     }
         
+    /*
+     * Free direct chunk writing buffers.
+     */
+    fbh5_chunk_free(p_fbh5_ctx);
+
+    /*
+     * Store the reduced-precision scales if no dump fixed them, and free the
+     * conversion buffers.
+     */
+    if(fbh5_quant_finish(p_fbh5_ctx) != 0)
+        fbh5_warning(__FILE__, __LINE__, "fbh5_close: fbh5_quant_finish FAILED");
+    fbh5_quant_free(p_fbh5_ctx);
+
     /*
      * Close file.
      */
@@ -38,18 +38,58 @@
  * Global definitions
  */
 #define DATASETNAME         "data"  // FBH5 dataset name to hold the data matrix
+#define VALIDDATASETNAME    "valid_frac"    // FBH5 dataset name to hold the valid sample fraction of each time integration
 #define NDIMS               3       // # of data matrix dimensions (rank)
 #define FILTERBANK_CLASS    "FILTERBANK"    // File-level attribute "CLASS"
 #define FILTERBANK_VERSION  "2.0"   // File-level attribute "VERSION"
 #define ENABLER_FD_FOR_FBH5 42      // Fake fd value to enable dump_file_thread_func()
+#define FBH5_MAX_CHUNK_THREADS 8    // Maximum number of chunk compression threads
+#ifndef FBH5_CHUNK_TARGET_BYTES
+#define FBH5_CHUNK_TARGET_BYTES (1024*1024) // Default target chunk size in bytes
+#endif
+
+/*
+ * Output formats of the "data" dataset (see fbh5_quant.c)
+ */
+#define FBH5_QUANT_F32      0       // 32-bit float (as computed)
+#define FBH5_QUANT_F16      1       // IEEE half precision, per-channel scale
+#define FBH5_QUANT_BF16     2       // bfloat16
+#define FBH5_QUANT_U8       3       // 8-bit unsigned, per-channel scale and offset
+#define FBH5_QUANT_COUNT    4
+
+/*
+ * Target chunk size in bytes for fbh5_adaptive_chunking (defined in
+ * fbh5_open.c).  0 selects the legacy chunk shape of (Nd, 1, nfpc).
+ */
+extern size_t fbh5_chunk_target_bytes;
 
 /*
  * fbh5 API functions
  */
-int     fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nds, char * output_path, int debug_callback);
+int     fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nds, unsigned long est_ntints, int quant, char * output_path, int debug_callback);
 int     fbh5_write(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, void * buffer, size_t bufsize, int debug_callback);
+int     fbh5_write_valid_frac(fbh5_context_t * p_fbh5_ctx, float * p_valid_frac, size_t ntints, int debug_callback);
 int     fbh5_close(fbh5_context_t * p_fbh5_ctx, int debug_callback);
 
+/*
+ * fbh5_chunk.c functions
+ */
+int     fbh5_chunk_init(fbh5_context_t * p_fbh5_ctx, hsize_t * cdims, unsigned int Nd);
+void    fbh5_chunk_free(fbh5_context_t * p_fbh5_ctx);
+int     fbh5_write_chunks(fbh5_context_t * p_fbh5_ctx, void * p_buffer, int debug_callback);
+
+/*
+ * fbh5_quant.c functions
+ */
+int         fbh5_quant_parse(const char * name);
+const char* fbh5_quant_name(int quant);
+int         fbh5_quant_nbits(int quant);
+hid_t       fbh5_quant_h5type(int quant);
+int         fbh5_quant_init(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, const float * in, size_t ntints);
+int         fbh5_quant_finish(fbh5_context_t * p_fbh5_ctx);
+void        fbh5_quantize(fbh5_context_t * p_fbh5_ctx, const float * in, void * out, size_t ntints);
+void        fbh5_quant_free(fbh5_context_t * p_fbh5_ctx);
+
 /*
  * fbh5_util.c functions
  */
@@ -63,6 +103,7 @@ void    fbh5_write_metadata(hid_t dataset_id, fb_hdr_t * p_metadata, int debug_c
 void    fbh5_set_ds_label(fbh5_context_t * p_fbh5_ctx, char * label, int dims_index, int debug_callback);
 void    fbh5_show_context(char * caller, fbh5_context_t * p_fbh5_ctx);
 void    fbh5_blimpy_chunking(fb_hdr_t * p_fb_hdr, hsize_t * p_cdims);
+void    fbh5_adaptive_chunking(fb_hdr_t * p_fb_hdr, unsigned int Nd, size_t target_bytes, hsize_t * p_cdims);
 
 /*
  * HDF5 library ID of the Bitshuffle filter.
@@ -11,21 +11,73 @@
 #define MIN(a,b) ((a < b) ? (a) : (b))
 #define MAX(a,b) ((a > b) ? (a) : (b))
 
+// Target chunk size in bytes for fbh5_adaptive_chunking (0 for legacy chunking)
+size_t fbh5_chunk_target_bytes = FBH5_CHUNK_TARGET_BYTES;
+
 // Returns a pointer to a string containing the librawspec version
 const char * get_librawspec_version();
 // Returns a pointer to a string containing the cuFFT version
 const char * get_cufft_version();
 
 
+/***
+	Create the "valid_frac" dataset (initially empty).
+***/
+static int fbh5_create_valid_frac(fbh5_context_t * p_fbh5_ctx, unsigned int Nd) {
+    hid_t       dcpl;               // Chunking handle
+    hid_t       space_id;           // Dataspace handle
+    hsize_t     dims = 0;           // Initial dimensions
+    hsize_t     max_dims = H5S_UNLIMITED;
+    hsize_t     cdims = Nd;         // Chunking dimensions
+    herr_t      status;             // Status from HDF5 function call
+
+    space_id = H5Screate_simple(1, &dims, &max_dims);
+    if(space_id < 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_open: H5Screate_simple/valid_frac FAILED");
+        return 1;
+    }
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    if(dcpl < 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_open: H5Pcreate/valid_frac FAILED");
+        H5Sclose(space_id);
+        return 1;
+    }
+    status = H5Pset_chunk(dcpl, 1, &cdims);
+    if(status != 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_open: H5Pset_chunk/valid_frac FAILED");
+        H5Pclose(dcpl);
+        H5Sclose(space_id);
+        return 1;
+    }
+    p_fbh5_ctx->valid_dataset_id = H5Dcreate(p_fbh5_ctx->file_id,  // File handle
+                                             VALIDDATASETNAME,     // Dataset name
+                                             H5T_IEEE_F32LE,       // HDF5 data type
+                                             space_id,             // Dataspace handle
+                                             H5P_DEFAULT,          //
+                                             dcpl,                 // Dataset creation property list
+                                             H5P_DEFAULT);         // Default access properties
+    H5Pclose(dcpl);
+    H5Sclose(space_id);
+    if(p_fbh5_ctx->valid_dataset_id < 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_open: H5Dcreate/valid_frac FAILED");
+        return 1;
+    }
+    p_fbh5_ctx->valid_count = 0;
+
+    return 0;
+}
+
+
 /***
 	Open-file entry point.
 ***/
-int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd, char * output_path, int debug_callback) {
+int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd, unsigned long est_ntints, int quant, char * output_path, int debug_callback) {
     hid_t       dcpl;               // Chunking handle - needed until dataset handle is produced
     hsize_t     max_dims[NDIMS];    // Maximum dataset allocation dimensions
     herr_t      status;             // Status from HDF5 function call
     char        wstr[256];          // sprintf target
     unsigned    hdf5_majnum, hdf5_minnum, hdf5_relnum;  // Version/release info for the HDF5 library
+    fb_hdr_t    quant_hdr;          // Copy of *p_fb_hdr with nbits of the output format
 
     // Chunking parameters
     int         USE_BLIMPY = 0;     // 1 : use blimpy's algorithm; 0 : don't do that
@@ -49,6 +101,21 @@ int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd,
     // Default status: no longer active.  Will be updated later as active.
     p_fbh5_ctx->active = 0;
 
+    /*
+     * For a reduced-precision output format, describe the stored data
+     * (fbh5_write converts the float dumps).
+     */
+    if(quant < 0 || quant >= FBH5_QUANT_COUNT) {
+        sprintf(wstr, "fbh5_open: unknown output format %d", quant);
+        fbh5_error(__FILE__, __LINE__, wstr);
+        return 1;
+    }
+    if(quant != FBH5_QUANT_F32) {
+        quant_hdr = *p_fb_hdr;
+        quant_hdr.nbits = fbh5_quant_nbits(quant);
+        p_fb_hdr = &quant_hdr;
+    }
+
     /*
      * Check whether or not the Bitshuffle filter is available.
      */
@@ -86,6 +153,7 @@ int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd,
      * Initialize FBH5 context.
      */
     memset(p_fbh5_ctx, 0, sizeof(fbh5_context_t));
+    p_fbh5_ctx->quant = quant;
     p_fbh5_ctx->elem_size = p_fb_hdr->nbits / 8;
     p_fbh5_ctx->tint_size = p_fb_hdr->nifs * p_fb_hdr->nchans * p_fbh5_ctx->elem_size;
     p_fbh5_ctx->offset_dims[0] = 0;
@@ -154,8 +222,11 @@ int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd,
 
     /*
      * Initialise the total file size in terms of its shape.
+     * If the number of time integrations could be estimated from the input,
+     * size the dataset for all of them up front so that fbh5_write need not
+     * extend it on every dump.  fbh5_close trims it to the actual size.
      */
-    p_fbh5_ctx->filesz_dims[0] = 1;
+    p_fbh5_ctx->filesz_dims[0] = est_ntints > 0 ? est_ntints : 1;
     p_fbh5_ctx->filesz_dims[1] = p_fb_hdr->nifs;
     p_fbh5_ctx->filesz_dims[2] = p_fb_hdr->nchans;
     
@@ -193,6 +264,8 @@ int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd,
     printf("Number of fine channels per coarse channel (nfpc) = %u\n", p_fb_hdr->nfpc);
     if(USE_BLIMPY == 1)
         fbh5_blimpy_chunking(p_fb_hdr, &cdims[0]);
+    else if(fbh5_chunk_target_bytes > 0)
+        fbh5_adaptive_chunking(p_fb_hdr, Nd, fbh5_chunk_target_bytes, &cdims[0]);
     else {
         cdims[0] = Nd;
         cdims[1] = 1;
@@ -210,26 +283,33 @@ int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd,
      */
     if(bitshuffle_available) {
         status = H5Pset_filter(dcpl, FILTER_ID_BITSHUFFLE, H5Z_FLAG_MANDATORY, 2, bitshuffle_opts); // Bitshuffle Filter
-        if(status < 0)
+        if(status < 0) {
             fbh5_warning(__FILE__, __LINE__, "fbh5_open: H5Pset_filter FAILED; data will not be compressed");
+            bitshuffle_available = 0;
+        }
     }
     
     /* 
      * Define datatype for the data in the file.
      * We will store little endian values.
      */
-    switch(p_fb_hdr->nbits) {
-        case 8:
-            p_fbh5_ctx->elem_type = H5T_NATIVE_B8;
-            break;
-        case 16:
-            p_fbh5_ctx->elem_type = H5T_NATIVE_B16;
-            break;
-        case 32:
-            p_fbh5_ctx->elem_type = H5T_IEEE_F32LE;
-            break;
-        default: // 64
-            p_fbh5_ctx->elem_type = H5T_IEEE_F64LE;
+    if(quant != FBH5_QUANT_F32) {
+        p_fbh5_ctx->elem_type = fbh5_quant_h5type(quant);
+        printf("Output format = %s\n", fbh5_quant_name(quant));
+    } else {
+        switch(p_fb_hdr->nbits) {
+            case 8:
+                p_fbh5_ctx->elem_type = H5T_NATIVE_B8;
+                break;
+            case 16:
+                p_fbh5_ctx->elem_type = H5T_NATIVE_B16;
+                break;
+            case 32:
+                p_fbh5_ctx->elem_type = H5T_IEEE_F32LE;
+                break;
+            default: // 64
+                p_fbh5_ctx->elem_type = H5T_IEEE_F64LE;
+        }
     }
 
     /*
@@ -297,6 +377,27 @@ int fbh5_open(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, unsigned int Nd,
                         debug_callback);        // Tracing flag
     if(debug_callback)
         fbh5_info("fbh5_open: Dataset metadata stored; done.\n");
+    if(quant != FBH5_QUANT_F32)
+        fbh5_set_str_attr(p_fbh5_ctx->dataset_id,
+                          "data_format",
+                          (char *) fbh5_quant_name(quant),
+                          debug_callback);
+
+    /*
+     * Create the 1-D valid sample fraction dataset, which is extensible in the
+     * time dimension (one value per time integration of the data matrix).
+     */
+    if(fbh5_create_valid_frac(p_fbh5_ctx, Nd) != 0)
+        return 1;
+
+    /*
+     * If the data is Bitshuffle/LZ4 compressed, compress whole-chunk dumps in
+     * parallel and write the chunks directly (see fbh5_chunk.c).
+     */
+    if(bitshuffle_available && USE_BLIMPY == 0) {
+        if(fbh5_chunk_init(p_fbh5_ctx, cdims, Nd))
+            printf("Direct chunk compression threads = %u\n", p_fbh5_ctx->nthreads);
+    }
 
     /*
      * Bye-bye.
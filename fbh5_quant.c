@@ -0,0 +1,495 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * fbh5_quant.c                                                                *
+ * ------------                                                                *
+ * Reduced-precision output formats.                                           *
+ *                                                                             *
+ * Rawspec produces 32-bit float spectra.  fbh5_write can store them as:       *
+ * - float16  : IEEE half precision, divided by a per-channel power-of-two     *
+ *              scale so that the dynamic range of the data fits;              *
+ * - bfloat16 : the top 16 bits of the float (same range, 8-bit mantissa);     *
+ * - uint8    : (value - offset) / scale, rounded and clamped to [0, 255],     *
+ *              with per-channel offset and scale.                             *
+ * The per-channel scale and offset are derived from the first dump with data  *
+ * and are stored in the 2-D (nifs, nchans) datasets "scale" and "offset" so   *
+ * value = offset + scale * stored.  For uint8, zeros (including those of the  *
+ * dumps before the first dump with data) decode as offset rather than 0, so   *
+ * readers must use "valid_frac" to find missing data.  Dataset "data" gets a  *
+ * "data_format" attribute naming the format.                                  *
+ *                                                                             *
+ * On x86-64 CPUs with AVX2 and F16C, conversion uses vector instructions.     *
+ * The scalar code gives identical results (apart from NaN payloads).          *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <math.h>
+#include "fbh5_defs.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define FBH5_QUANT_SIMD 1
+#endif
+
+// uint8 window in units of the channel's standard deviation
+#define U8_SIGMAS_BELOW 4.0     // for non-negative channels (e.g. total power)
+#define U8_SIGMAS_SPAN  16.0    // total span of the window
+
+static const char * quant_names[] = {"f32", "f16", "bf16", "u8"};
+static const char * quant_formats[] = {"float32", "float16", "bfloat16", "uint8"};
+
+
+/***
+	Return the FBH5_QUANT_* format named `name` (e.g. "f16" or "float16"),
+	or -1 if unknown.
+***/
+int fbh5_quant_parse(const char * name) {
+    int q;
+
+    for(q = 0; q < FBH5_QUANT_COUNT; q++)
+        if(!strcmp(name, quant_names[q]) || !strcmp(name, quant_formats[q]))
+            return q;
+    return -1;
+}
+
+
+/***
+	Return the name of format `quant`.
+***/
+const char * fbh5_quant_name(int quant) {
+    if(quant < 0 || quant >= FBH5_QUANT_COUNT)
+        return "unknown";
+    return quant_formats[quant];
+}
+
+
+/***
+	Return the number of bits per element stored in format `quant`.
+***/
+int fbh5_quant_nbits(int quant) {
+    switch(quant) {
+        case FBH5_QUANT_F16:
+        case FBH5_QUANT_BF16:
+            return 16;
+        case FBH5_QUANT_U8:
+            return 8;
+        default:
+            return 32;
+    }
+}
+
+
+/***
+	Return the HDF5 file type of format `quant`.  Types created here (the
+	16-bit floats, which HDF5 1.10 does not predefine) must be closed by the
+	caller with H5Tclose.
+***/
+hid_t fbh5_quant_h5type(int quant) {
+    hid_t type;
+
+    switch(quant) {
+        case FBH5_QUANT_F16:
+            type = H5Tcopy(H5T_IEEE_F32LE);
+            H5Tset_fields(type, 15, 10, 5, 0, 10);
+            H5Tset_precision(type, 16);
+            H5Tset_size(type, 2);
+            H5Tset_ebias(type, 15);
+            return type;
+        case FBH5_QUANT_BF16:
+            type = H5Tcopy(H5T_IEEE_F32LE);
+            H5Tset_fields(type, 15, 7, 8, 0, 7);
+            H5Tset_precision(type, 16);
+            H5Tset_size(type, 2);
+            H5Tset_ebias(type, 127);
+            return type;
+        case FBH5_QUANT_U8:
+            return H5T_STD_U8LE;
+        default:
+            return H5T_IEEE_F32LE;
+    }
+}
+
+
+/***
+	Scalar conversions (round to nearest, ties to even).
+***/
+static uint16_t f32_to_f16(float f) {
+    uint32_t x, ax, sign, m, r, rem, half;
+    int shift;
+
+    memcpy(&x, &f, sizeof(x));
+    sign = (x >> 16) & 0x8000;
+    ax = x & 0x7fffffff;
+    if(ax >= 0x7f800000)                // Inf or NaN
+        return sign | (ax > 0x7f800000 ? 0x7e00 : 0x7c00);
+    if(ax >= 0x477ff000)                // Rounds to Inf
+        return sign | 0x7c00;
+    if(ax < 0x38800000) {               // Subnormal half
+        if(ax <= 0x33000000)
+            return sign;
+        m = (ax & 0x7fffff) | 0x800000;
+        shift = 126 - (ax >> 23);
+        r = m >> shift;
+        rem = m & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+        if(rem > half || (rem == half && (r & 1)))
+            r++;
+        return sign | r;
+    }
+    r = ax - 0x38000000;                // Rebias exponent from 127 to 15
+    return sign | ((r + 0xfff + ((r >> 13) & 1)) >> 13);
+}
+
+static uint16_t f32_to_bf16(float f) {
+    uint32_t x;
+
+    memcpy(&x, &f, sizeof(x));
+    if((x & 0x7fffffff) > 0x7f800000)   // NaN
+        return 0x7fc0;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static uint8_t f32_to_u8(float y) {
+    y = y > 0.0f ? y : 0.0f;            // Also maps NaN to 0
+    y = y < 255.0f ? y : 255.0f;
+    return (uint8_t)lrintf(y);
+}
+
+static void quantize_row_scalar(int quant, const float * in, void * out,
+                                const float * inv, const float * off,
+                                size_t begin, size_t n) {
+    uint16_t * out16 = (uint16_t *)out;
+    uint8_t * out8 = (uint8_t *)out;
+    size_t i;
+
+    switch(quant) {
+        case FBH5_QUANT_F16:
+            for(i = begin; i < n; i++)
+                out16[i] = f32_to_f16(in[i] * inv[i]);
+            break;
+        case FBH5_QUANT_BF16:
+            for(i = begin; i < n; i++)
+                out16[i] = f32_to_bf16(in[i]);
+            break;
+        case FBH5_QUANT_U8:
+            for(i = begin; i < n; i++)
+                out8[i] = f32_to_u8((in[i] - off[i]) * inv[i]);
+            break;
+    }
+}
+
+
+#ifdef FBH5_QUANT_SIMD
+/***
+	AVX2/F16C conversions of a row of `n` elements.  Returns the number of
+	elements converted (a multiple of the vector width); the caller converts
+	the rest.
+***/
+__attribute__((target("avx2,f16c")))
+static size_t quantize_row_avx2(int quant, const float * in, void * out,
+                                const float * inv, const float * off, size_t n) {
+    size_t i = 0;
+    __m256 x0, x1, x2, x3;
+    __m256i u0, u1, lsb, r;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 max8 = _mm256_set1_ps(255.0f);
+    const __m256i bias = _mm256_set1_epi32(0x7fff);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i qnan = _mm256_set1_epi32(0x7fc0);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    switch(quant) {
+        case FBH5_QUANT_F16:
+            for(; i + 8 <= n; i += 8) {
+                x0 = _mm256_mul_ps(_mm256_loadu_ps(in + i), _mm256_loadu_ps(inv + i));
+                _mm_storeu_si128((__m128i *)((uint16_t *)out + i),
+                                 _mm256_cvtps_ph(x0, _MM_FROUND_TO_NEAREST_INT));
+            }
+            break;
+        case FBH5_QUANT_BF16:
+            for(; i + 16 <= n; i += 16) {
+                x0 = _mm256_loadu_ps(in + i);
+                x1 = _mm256_loadu_ps(in + i + 8);
+                u0 = _mm256_castps_si256(x0);
+                lsb = _mm256_and_si256(_mm256_srli_epi32(u0, 16), one);
+                u0 = _mm256_srli_epi32(_mm256_add_epi32(u0, _mm256_add_epi32(bias, lsb)), 16);
+                u0 = _mm256_blendv_epi8(u0, qnan, _mm256_castps_si256(_mm256_cmp_ps(x0, x0, _CMP_UNORD_Q)));
+                u1 = _mm256_castps_si256(x1);
+                lsb = _mm256_and_si256(_mm256_srli_epi32(u1, 16), one);
+                u1 = _mm256_srli_epi32(_mm256_add_epi32(u1, _mm256_add_epi32(bias, lsb)), 16);
+                u1 = _mm256_blendv_epi8(u1, qnan, _mm256_castps_si256(_mm256_cmp_ps(x1, x1, _CMP_UNORD_Q)));
+                r = _mm256_permute4x64_epi64(_mm256_packus_epi32(u0, u1), 0xd8);
+                _mm256_storeu_si256((__m256i *)((uint16_t *)out + i), r);
+            }
+            break;
+        case FBH5_QUANT_U8:
+            for(; i + 32 <= n; i += 32) {
+#define U8_STEP(x, k) \
+                x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(in + i + k), _mm256_loadu_ps(off + i + k)), \
+                                  _mm256_loadu_ps(inv + i + k)); \
+                x = _mm256_min_ps(_mm256_max_ps(x, zero), max8);
+                U8_STEP(x0, 0)
+                U8_STEP(x1, 8)
+                U8_STEP(x2, 16)
+                U8_STEP(x3, 24)
+#undef U8_STEP
+                u0 = _mm256_packs_epi32(_mm256_cvtps_epi32(x0), _mm256_cvtps_epi32(x1));
+                u1 = _mm256_packs_epi32(_mm256_cvtps_epi32(x2), _mm256_cvtps_epi32(x3));
+                r = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(u0, u1), order);
+                _mm256_storeu_si256((__m256i *)((uint8_t *)out + i), r);
+            }
+            break;
+    }
+    return i;
+}
+#endif
+
+
+/***
+	Convert `ntints` time integrations of float data in `in` to the context's
+	format in `out`.
+***/
+void fbh5_quantize(fbh5_context_t * p_fbh5_ctx, const float * in, void * out, size_t ntints) {
+    size_t n = p_fbh5_ctx->tint_size / p_fbh5_ctx->elem_size;  // Elements per time integration
+    size_t t, done;
+#ifdef FBH5_QUANT_SIMD
+    int simd = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+#endif
+
+    for(t = 0; t < ntints; t++) {
+        done = 0;
+#ifdef FBH5_QUANT_SIMD
+        if(simd)
+            done = quantize_row_avx2(p_fbh5_ctx->quant, in, out,
+                                     p_fbh5_ctx->quant_inv, p_fbh5_ctx->quant_offset, n);
+#endif
+        quantize_row_scalar(p_fbh5_ctx->quant, in, out,
+                            p_fbh5_ctx->quant_inv, p_fbh5_ctx->quant_offset, done, n);
+        in += n;
+        out = (char *)out + p_fbh5_ctx->tint_size;
+    }
+}
+
+
+/***
+	Write the 2-D (nifs, nchans) float dataset `name` holding `values`.
+***/
+static int write_2d_dataset(fbh5_context_t * p_fbh5_ctx, char * name, float * values) {
+    hid_t space_id;
+    hid_t dset_id;
+    herr_t status;
+
+    space_id = H5Screate_simple(2, &(p_fbh5_ctx->filesz_dims[1]), NULL);
+    if(space_id < 0) {
+        fbh5_error(__FILE__, __LINE__, "write_2d_dataset: H5Screate_simple FAILED");
+        return 1;
+    }
+    dset_id = H5Dcreate(p_fbh5_ctx->file_id, name, H5T_IEEE_F32LE, space_id,
+                        H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    H5Sclose(space_id);
+    if(dset_id < 0) {
+        fbh5_error(__FILE__, __LINE__, "write_2d_dataset: H5Dcreate FAILED");
+        return 1;
+    }
+    status = H5Dwrite(dset_id, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, values);
+    H5Dclose(dset_id);
+    if(status < 0) {
+        fbh5_error(__FILE__, __LINE__, "write_2d_dataset: H5Dwrite FAILED");
+        return 1;
+    }
+    return 0;
+}
+
+
+/***
+	Statistics of the finite, non-zero values of a channel (or band).
+***/
+typedef struct {
+    double sum, sumsq, maxabs, lo;
+    size_t cnt;
+} quant_stats_t;
+
+static void stats_add(quant_stats_t * st, const float * in, size_t stride, size_t ntints) {
+    size_t t;
+    double x;
+
+    for(t = 0; t < ntints; t++) {
+        x = in[t * stride];
+        if(!isfinite(x) || x == 0.0)
+            continue;
+        if(fabs(x) > st->maxabs)
+            st->maxabs = fabs(x);
+        if(x < st->lo)
+            st->lo = x;
+        st->sum += x;
+        st->sumsq += x * x;
+        st->cnt++;
+    }
+}
+
+
+/***
+	Write the "scale" and "offset" datasets and mark the scales as fixed.
+***/
+static int write_scales(fbh5_context_t * p_fbh5_ctx, float * scale) {
+    p_fbh5_ctx->quant_ready = 1;
+    return write_2d_dataset(p_fbh5_ctx, "scale", scale)
+        || write_2d_dataset(p_fbh5_ctx, "offset", p_fbh5_ctx->quant_offset);
+}
+
+
+/***
+	Derive the per-channel scale and offset of the context's format from the
+	dump of `ntints` time integrations in `in` and store them in the "scale"
+	and "offset" datasets.  Exact zeros (e.g. from missing input blocks) and
+	non-finite values are ignored.  Until a dump has such data for some
+	channel, the scales are not fixed (the dump is converted with scale 1 and
+	offset 0) and this is called again for the next dump.  Channels without
+	data in the dump that fixes the scales use the scale and offset of all the
+	channels of their IF together.  The "scale" and "offset" datasets apply to
+	every dump, so the zeros of earlier dumps decode exactly for float16 but
+	as the offset for uint8 (such dumps have a valid_frac of 0 when they come
+	from missing input blocks).
+
+	float16: scale is the power of two that maps the largest magnitude in the
+	channel to [128, 256), leaving a factor of 256 of headroom below the
+	float16 maximum; offset is 0.
+
+	uint8: from the mean and standard deviation of the channel, the window
+	covers U8_SIGMAS_SPAN standard deviations starting U8_SIGMAS_BELOW below
+	the mean, or centred on the mean if the channel has negative values
+	(cross-polarization products).  The standard deviation is at least the
+	radiometer noise level of the first IF's mean, i.e. mean / sqrt(Na) where
+	Na = tsamp * |foff| is the number of spectra integrated.
+***/
+int fbh5_quant_init(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, const float * in, size_t ntints) {
+    size_t nchans = p_fb_hdr->nchans;
+    size_t nifs = p_fb_hdr->nifs;
+    size_t n = nifs * nchans;
+    double na = p_fb_hdr->tsamp * fabs(p_fb_hdr->foff) * 1e6;
+    float * scale;
+    float * mean0;              // Mean of the first IF of each channel
+    quant_stats_t * band;       // Statistics of each IF
+    quant_stats_t chan;
+    const quant_stats_t * st;
+    double mean, sigma, floor_sigma;
+    size_t i, cnt;
+    int rc;
+
+    if(p_fbh5_ctx->quant_inv == NULL) {
+        p_fbh5_ctx->quant_inv = malloc(n * sizeof(float));
+        p_fbh5_ctx->quant_offset = malloc(n * sizeof(float));
+        if(!p_fbh5_ctx->quant_inv || !p_fbh5_ctx->quant_offset) {
+            fbh5_error(__FILE__, __LINE__, "fbh5_quant_init: cannot allocate scale arrays");
+            return 1;
+        }
+    }
+    for(i = 0; i < n; i++) {
+        p_fbh5_ctx->quant_inv[i] = 1.0f;
+        p_fbh5_ctx->quant_offset[i] = 0.0f;
+    }
+
+    band = calloc(nifs, sizeof(quant_stats_t));
+    if(!band) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_quant_init: cannot allocate band statistics");
+        return 1;
+    }
+    for(i = 0; i < nifs; i++)
+        band[i].lo = INFINITY;
+    for(i = 0; i < n; i++)
+        stats_add(&band[i / nchans], in + i, n, ntints);
+    for(cnt = 0, i = 0; i < nifs; i++)
+        cnt += band[i].cnt;
+    if(cnt == 0) {
+        free(band);
+        return 0;
+    }
+
+    scale = malloc(n * sizeof(float));
+    mean0 = calloc(nchans, sizeof(float));
+    if(!scale || !mean0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_quant_init: cannot allocate scale arrays");
+        free(band);
+        free(scale);
+        free(mean0);
+        return 1;
+    }
+    if(na < 1.0)
+        na = 1.0;
+
+    for(i = 0; i < n; i++) {
+        memset(&chan, 0, sizeof(chan));
+        chan.lo = INFINITY;
+        stats_add(&chan, in + i, n, ntints);
+        st = chan.cnt > 0 ? &chan : &band[i / nchans];
+
+        scale[i] = 1.0f;
+        if(p_fbh5_ctx->quant == FBH5_QUANT_F16) {
+            if(st->maxabs > 0.0)
+                scale[i] = ldexp(1.0, ilogb(st->maxabs) - 7);
+        } else if(p_fbh5_ctx->quant == FBH5_QUANT_U8 && st->cnt > 0) {
+            mean = st->sum / st->cnt;
+            sigma = st->cnt > 1 ? sqrt(fmax(st->sumsq / st->cnt - mean * mean, 0.0)) : 0.0;
+            if(i < nchans)
+                mean0[i] = mean;
+            floor_sigma = fabs(mean0[i % nchans]) / sqrt(na);
+            if(sigma < floor_sigma)
+                sigma = floor_sigma;
+            if(sigma > 0.0 && isfinite(sigma)) {
+                scale[i] = U8_SIGMAS_SPAN * sigma / 255.0;
+                if(st->lo < 0.0)
+                    p_fbh5_ctx->quant_offset[i] = mean - 0.5 * U8_SIGMAS_SPAN * sigma;
+                else
+                    p_fbh5_ctx->quant_offset[i] = mean - U8_SIGMAS_BELOW * sigma;
+            }
+        }
+        p_fbh5_ctx->quant_inv[i] = 1.0f / scale[i];
+    }
+
+    rc = write_scales(p_fbh5_ctx, scale);
+    free(band);
+    free(scale);
+    free(mean0);
+    return rc;
+}
+
+
+/***
+	Store scale 1 and offset 0 if no dump had data to fix the scales.
+***/
+int fbh5_quant_finish(fbh5_context_t * p_fbh5_ctx) {
+    size_t n = p_fbh5_ctx->filesz_dims[1] * p_fbh5_ctx->filesz_dims[2];
+    float * scale;
+    size_t i;
+    int rc;
+
+    if(p_fbh5_ctx->quant == FBH5_QUANT_F32 || p_fbh5_ctx->quant_ready)
+        return 0;
+    scale = malloc(n * sizeof(float));
+    if(p_fbh5_ctx->quant_offset == NULL)
+        p_fbh5_ctx->quant_offset = calloc(n, sizeof(float));
+    if(!scale || !p_fbh5_ctx->quant_offset) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_quant_finish: cannot allocate scale arrays");
+        free(scale);
+        return 1;
+    }
+    for(i = 0; i < n; i++)
+        scale[i] = 1.0f;
+    rc = write_scales(p_fbh5_ctx, scale);
+    free(scale);
+    return rc;
+}
+
+
+/***
+	Free the conversion buffers and scale arrays of the context.
+***/
+void fbh5_quant_free(fbh5_context_t * p_fbh5_ctx) {
+    free(p_fbh5_ctx->quant_buf);
+    free(p_fbh5_ctx->quant_inv);
+    free(p_fbh5_ctx->quant_offset);
+    p_fbh5_ctx->quant_buf = NULL;
+    p_fbh5_ctx->quant_inv = NULL;
+    p_fbh5_ctx->quant_offset = NULL;
+    p_fbh5_ctx->quant_bufsize = 0;
+    if(p_fbh5_ctx->quant == FBH5_QUANT_F16 || p_fbh5_ctx->quant == FBH5_QUANT_BF16)
+        H5Tclose(p_fbh5_ctx->elem_type);
+}
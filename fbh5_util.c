@@ -283,3 +283,56 @@ void fbh5_blimpy_chunking(fb_hdr_t * p_fb_hdr, hsize_t * p_cdims) {
         if(p_fb_hdr->nchans < 512)
             *(p_cdims + 2) = p_fb_hdr->nchans;
 }
+
+
+/***
+	Return the largest divisor of n that does not exceed max (1 if max < 1).
+***/
+static hsize_t largest_divisor(hsize_t n, hsize_t max) {
+    hsize_t d;
+
+    if(max >= n)
+        return n;
+    for(d = max; d > 1; d--)
+        if(n % d == 0)
+            return d;
+    return 1;
+}
+
+
+/***
+	Choose chunk dimensions from the actual product shape and a target chunk
+	size in bytes.  Each chunk holds one IF, spans a divisor of the Nd time
+	integrations of a dump (so that every dump fills whole chunks), and spans
+	whole coarse channels of nfpc fine channels where possible:
+    * If (Nd, 1, nfpc) exceeds the target, the time span is reduced first,
+      then the channel span (to a divisor of nfpc).
+    * Otherwise, the chunk is widened by as many coarse channels as fit.
+	If nchans is not a multiple of nfpc, the whole band is treated as a single
+	coarse channel.
+***/
+void fbh5_adaptive_chunking(fb_hdr_t * p_fb_hdr, unsigned int Nd, size_t target_bytes, hsize_t * p_cdims) {
+    hsize_t elem_size = p_fb_hdr->nbits / 8;
+    hsize_t nfpc = p_fb_hdr->nfpc;
+    hsize_t ncoarse;
+    hsize_t nt, nf;
+
+    if(elem_size == 0)
+        elem_size = 1;
+    if(nfpc == 0 || p_fb_hdr->nchans % nfpc != 0)
+        nfpc = p_fb_hdr->nchans;
+    ncoarse = p_fb_hdr->nchans / nfpc;
+
+    nt = Nd > 0 ? Nd : 1;
+    nf = nfpc;
+    if(nt * nf * elem_size > target_bytes) {
+        nt = largest_divisor(nt, target_bytes / (nf * elem_size));
+        if(nt * nf * elem_size > target_bytes)
+            nf = largest_divisor(nf, target_bytes / elem_size);
+    } else
+        nf *= largest_divisor(ncoarse, target_bytes / (nt * nf * elem_size));
+
+    *p_cdims       = nt;
+    *(p_cdims + 1) = 1;
+    *(p_cdims + 2) = nf;
+}
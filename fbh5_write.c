@@ -9,6 +9,10 @@
  * - H5Sselect_hyperslab  - Define hyperslab offset and length in to write     *
  * - H5Dwrite             - Write the hyperslab                                *
  *                                                                             *
+ * Dumps covering whole chunks are written by fbh5_write_chunks instead.       *
+ *                                                                             *
+ * Also appends the valid sample fractions of a dump to dataset "valid_frac".  *
+ *                                                                             *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
@@ -20,6 +24,7 @@
 int fbh5_write(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, void * p_buffer, size_t bufsize, int debug_callback) {
     herr_t      status;          // Status from HDF5 function call
     size_t      ntints;          // Number of time integrations in the current dump
+    int         extend;          // Non-zero if the dataset must be extended
     hid_t       filespace_id;    // Identifier for a copy of the dataspace 
     hsize_t     selection[3];    // Current selection
     clock_t     clock_1;         // Debug time measurement
@@ -30,20 +35,44 @@ int fbh5_write(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, void * p_buffer
      */
     if(debug_callback)
         fbh5_show_context("fbh5_write", p_fbh5_ctx);
-    ntints = bufsize / p_fbh5_ctx->tint_size;  // Compute the number of time integrations in the current dump.
     p_fbh5_ctx->dump_count += 1;               // Bump the dump count.
 
     /*
-     * Bump the count of time integrations.
-     * One was already accounted for at open time - required by HDF5 library.
-     * So, 
-     *    If this is the very first write, bump by (ntints - 1);
-     *    Else, bumpy by ntints.
+     * For a reduced-precision output format, convert the float dump (see
+     * fbh5_quant.c).  The first dump with data sets the per-channel scales.
      */
-    if(p_fbh5_ctx->offset_dims[0] > 0)
-        p_fbh5_ctx->filesz_dims[0] += ntints;
-    else
-        p_fbh5_ctx->filesz_dims[0] += (ntints - 1);
+    if(p_fbh5_ctx->quant != FBH5_QUANT_F32) {
+        ntints = bufsize / (p_fbh5_ctx->tint_size / p_fbh5_ctx->elem_size * sizeof(float));
+        if(!p_fbh5_ctx->quant_ready
+        && fbh5_quant_init(p_fbh5_ctx, p_fb_hdr, p_buffer, ntints) != 0) {
+            fbh5_show_context("fbh5_write", p_fbh5_ctx);
+            p_fbh5_ctx->active = 0;
+            return 1;
+        }
+        bufsize = ntints * p_fbh5_ctx->tint_size;
+        if(p_fbh5_ctx->quant_bufsize < bufsize) {
+            free(p_fbh5_ctx->quant_buf);
+            p_fbh5_ctx->quant_buf = malloc(bufsize);
+            p_fbh5_ctx->quant_bufsize = p_fbh5_ctx->quant_buf ? bufsize : 0;
+            if(p_fbh5_ctx->quant_buf == NULL) {
+                fbh5_error(__FILE__, __LINE__, "fbh5_write: cannot allocate conversion buffer");
+                p_fbh5_ctx->active = 0;
+                return 1;
+            }
+        }
+        fbh5_quantize(p_fbh5_ctx, p_buffer, p_fbh5_ctx->quant_buf, ntints);
+        p_buffer = p_fbh5_ctx->quant_buf;
+    }
+    ntints = bufsize / p_fbh5_ctx->tint_size;  // Compute the number of time integrations in the current dump.
+
+    /*
+     * If the dump runs past the current extent of the dataset (which fbh5_open
+     * preallocated from the estimated number of time integrations), grow it to
+     * fit.  Any unused preallocated extent is trimmed by fbh5_close.
+     */
+    extend = p_fbh5_ctx->offset_dims[0] + ntints > p_fbh5_ctx->filesz_dims[0];
+    if(extend)
+        p_fbh5_ctx->filesz_dims[0] = p_fbh5_ctx->offset_dims[0] + ntints;
 
     /*
      * Define the current slab selection in terms of its shape.
@@ -68,10 +97,13 @@ int fbh5_write(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, void * p_buffer
      }
 
     /*
-     * Extend dataset.
+     * Extend dataset if needed.
      */
-    status = H5Dset_extent(p_fbh5_ctx->dataset_id,    // Dataset handle
-                           p_fbh5_ctx->filesz_dims);  // New dataset shape
+    if(extend)
+        status = H5Dset_extent(p_fbh5_ctx->dataset_id,    // Dataset handle
+                               p_fbh5_ctx->filesz_dims);  // New dataset shape
+    else
+        status = 0;
     if(status < 0) {
         fbh5_error(__FILE__, __LINE__, "fbh5_write: H5Dset_extent/dataset_id FAILED");
         fbh5_show_context("fbh5_write", p_fbh5_ctx);
@@ -79,6 +111,26 @@ int fbh5_write(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, void * p_buffer
         return 1;
     }
 
+    /*
+     * If the dump covers whole chunks, compress and write them directly.
+     */
+    if(p_fbh5_ctx->direct_chunk
+    && ntints == p_fbh5_ctx->dump_ntints
+    && p_fbh5_ctx->offset_dims[0] % p_fbh5_ctx->chunk_dims[0] == 0) {
+        if(fbh5_write_chunks(p_fbh5_ctx, p_buffer, debug_callback) != 0) {
+            fbh5_show_context("fbh5_write", p_fbh5_ctx);
+            p_fbh5_ctx->active = 0;
+            return 1;
+        }
+        p_fbh5_ctx->offset_dims[0] += ntints;
+        p_fbh5_ctx->byte_count += bufsize;
+        if(debug_callback) {
+            cpu_time_used = ((double) (clock() - clock_1)) / CLOCKS_PER_SEC;
+            fbh5_info("fbh5_write: dump %ld E.T. = %.3f s\n", p_fbh5_ctx->dump_count, cpu_time_used);
+        }
+        return 0;
+    }
+
     /*
      * Reset dataspace extent to match current slab selection.
      */
@@ -166,3 +218,63 @@ int fbh5_write(fbh5_context_t * p_fbh5_ctx, fb_hdr_t * p_fb_hdr, void * p_buffer
      */
     return 0;
 }
+
+
+/***
+	Append the valid sample fractions of the `ntints` time integrations of a
+	dump to the "valid_frac" dataset.
+***/
+int fbh5_write_valid_frac(fbh5_context_t * p_fbh5_ctx, float * p_valid_frac, size_t ntints, int debug_callback) {
+    herr_t      status;          // Status from HDF5 function call
+    hid_t       filespace_id;    // Identifier for a copy of the dataspace
+    hid_t       memspace_id;     // Dataspace of the values in memory
+    hsize_t     new_count;       // Number of values after this write
+    hsize_t     selection;       // Current selection
+
+    new_count = p_fbh5_ctx->valid_count + ntints;
+    selection = ntints;
+
+    /*
+     * Extend dataset.
+     */
+    status = H5Dset_extent(p_fbh5_ctx->valid_dataset_id, &new_count);
+    if(status < 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_write_valid_frac: H5Dset_extent FAILED");
+        p_fbh5_ctx->active = 0;
+        return 1;
+    }
+
+    /*
+     * Select the filespace hyperslab and write the values to it.
+     */
+    filespace_id = H5Dget_space(p_fbh5_ctx->valid_dataset_id);
+    if(filespace_id < 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_write_valid_frac: H5Dget_space FAILED");
+        p_fbh5_ctx->active = 0;
+        return 1;
+    }
+    memspace_id = H5Screate_simple(1, &selection, NULL);
+    status = H5Sselect_hyperslab(filespace_id, H5S_SELECT_SET,
+                                 &p_fbh5_ctx->valid_count, NULL, &selection, NULL);
+    if(memspace_id < 0 || status < 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_write_valid_frac: H5Sselect_hyperslab FAILED");
+        H5Sclose(filespace_id);
+        p_fbh5_ctx->active = 0;
+        return 1;
+    }
+    status = H5Dwrite(p_fbh5_ctx->valid_dataset_id, H5T_NATIVE_FLOAT,
+                      memspace_id, filespace_id, H5P_DEFAULT, p_valid_frac);
+    H5Sclose(memspace_id);
+    H5Sclose(filespace_id);
+    if(status < 0) {
+        fbh5_error(__FILE__, __LINE__, "fbh5_write_valid_frac: H5Dwrite FAILED");
+        p_fbh5_ctx->active = 0;
+        return 1;
+    }
+    if(debug_callback)
+        fbh5_info("fbh5_write_valid_frac: %lld values written\n", (long long)new_count);
+
+    p_fbh5_ctx->valid_count = new_count;
+
+    return 0;
+}
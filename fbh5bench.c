@@ -0,0 +1,334 @@
+// fbh5bench - Compares FBH5 chunk shapes by the write throughput of rawspec's
+// FBH5 writer and the read throughput of typical downstream access patterns.
+//
+// For each target chunk size (see fbh5_adaptive_chunking; 0 selects the
+// legacy chunk shape of (Nd, 1, nfpc)), a file of synthetic noise-like
+// spectra is written one dump at a time with fbh5_open/fbh5_write/fbh5_close,
+// then read back:
+//
+//   spectra  - all channels of Nd spectra at a time, over the whole file
+//   channels - a window of nfpc channels, over the whole file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "fbh5_defs.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+// Default target chunk sizes in bytes
+static const char * default_targets = "0,262144,1048576,4194304,16777216";
+
+static struct option long_opts[] = {
+  {"nchans",   1, NULL, 'c'},
+  {"nfpc",     1, NULL, 'f'},
+  {"nifs",     1, NULL, 'i'},
+  {"ndump",    1, NULL, 'd'},
+  {"dumps",    1, NULL, 'n'},
+  {"targets",  1, NULL, 't'},
+  {"noest",    0, NULL, 'E'},
+  {"quant",    1, NULL, 'q'},
+  {"output",   1, NULL, 'o'},
+  {"help",     0, NULL, 'h'},
+  {0,0,0,0}
+};
+
+void usage(const char * argv0) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "\n"
+    "Options:\n"
+    "  -c, --nchans=N         Number of fine channels [1048576]\n"
+    "  -f, --nfpc=N           Number of fine channels per coarse channel [16384]\n"
+    "  -i, --nifs=N           Number of IFs (1 or 4) [1]\n"
+    "  -d, --ndump=N          Number of spectra per dump (Nd) [16]\n"
+    "  -n, --dumps=N          Number of dumps [16]\n"
+    "  -t, --targets=T1[,T2]  Target chunk sizes in bytes (0 for legacy)\n"
+    "                         [%s]\n"
+    "  -E, --noest            Do not preallocate the dataset extent\n"
+    "  -q, --quant=FMT        Output format (f32, f16, bf16, or u8) [f32]\n"
+    "  -o, --output=FILE      Output file [fbh5bench.h5]\n"
+    "\n"
+    "  -h, --help             Show this message\n",
+    argv0, default_targets
+  );
+}
+
+// Returns the elapsed time between `start` and now in seconds.
+static double elapsed_since(struct timespec * start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ELAPSED_NS((*start), now) / 1e9;
+}
+
+// Reads `count` elements of dataset `dataset_id` starting at `start` into
+// `buf`.  Returns 0 on success, -1 on error.
+static int read_slab(hid_t dataset_id, hsize_t * start, hsize_t * count,
+                     float * buf)
+{
+  hid_t filespace_id;
+  hid_t memspace_id;
+  herr_t status;
+
+  filespace_id = H5Dget_space(dataset_id);
+  memspace_id = H5Screate_simple(NDIMS, count, NULL);
+  H5Sselect_hyperslab(filespace_id, H5S_SELECT_SET, start, NULL, count, NULL);
+  status = H5Dread(dataset_id, H5T_NATIVE_FLOAT, memspace_id, filespace_id,
+                   H5P_DEFAULT, buf);
+  H5Sclose(memspace_id);
+  H5Sclose(filespace_id);
+  return status < 0 ? -1 : 0;
+}
+
+// Writes `ndumps` dumps of `buf` (Nd spectra each) to `fname`.  Returns the
+// write time in seconds, or -1 on error.
+static double bench_write(fb_hdr_t * hdr, unsigned int Nd, unsigned int ndumps,
+                          unsigned long est_ntints, int quant, char * fname,
+                          float * buf, size_t bufsize)
+{
+  fbh5_context_t ctx;
+  struct timespec start;
+  unsigned int i;
+
+  memset(&ctx, 0, sizeof(ctx));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(fbh5_open(&ctx, hdr, Nd, est_ntints, quant, fname, 0)) {
+    return -1;
+  }
+  for(i=0; i<ndumps; i++) {
+    // Vary the data a little from dump to dump
+    buf[i % (bufsize / sizeof(float))] += 1.0;
+    if(fbh5_write(&ctx, hdr, buf, bufsize, 0)) {
+      fbh5_close(&ctx, 0);
+      return -1;
+    }
+  }
+  if(fbh5_close(&ctx, 0)) {
+    return -1;
+  }
+  return elapsed_since(&start);
+}
+
+// Reads back `fname` with the "spectra" and "channels" access patterns and
+// stores their times in seconds.  Returns 0 on success, -1 on error.
+static int bench_read(char * fname, fb_hdr_t * hdr, unsigned int Nd,
+                      unsigned int ndumps, float * buf,
+                      double * t_spectra, double * t_channels)
+{
+  hid_t file_id;
+  hid_t dataset_id;
+  hsize_t start[NDIMS];
+  hsize_t count[NDIMS];
+  struct timespec ts;
+  unsigned int i;
+  int rc = 0;
+
+  file_id = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if(file_id < 0) {
+    return -1;
+  }
+  dataset_id = H5Dopen(file_id, DATASETNAME, H5P_DEFAULT);
+  if(dataset_id < 0) {
+    H5Fclose(file_id);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  for(i=0; i<ndumps && rc == 0; i++) {
+    start[0] = (hsize_t)i * Nd;
+    start[1] = 0;
+    start[2] = 0;
+    count[0] = Nd;
+    count[1] = hdr->nifs;
+    count[2] = hdr->nchans;
+    rc = read_slab(dataset_id, start, count, buf);
+  }
+  *t_spectra = elapsed_since(&ts);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if(rc == 0) {
+    start[0] = 0;
+    start[1] = 0;
+    start[2] = (hdr->nchans / 2 / hdr->nfpc) * hdr->nfpc;
+    count[0] = (hsize_t)ndumps * Nd;
+    count[1] = 1;
+    count[2] = hdr->nfpc;
+    rc = read_slab(dataset_id, start, count, buf);
+  }
+  *t_channels = elapsed_since(&ts);
+
+  H5Dclose(dataset_id);
+  H5Fclose(file_id);
+  return rc;
+}
+
+int main(int argc, char * argv[])
+{
+  int opt;
+  fb_hdr_t hdr;
+  fb_hdr_t qhdr;
+  unsigned int Nd = 16;
+  unsigned int ndumps = 16;
+  int use_est = 1;
+  int quant = FBH5_QUANT_F32;
+  char * fname = "fbh5bench.h5";
+  char * targets;
+  char * tok;
+  float * buf;
+  size_t bufsize;
+  size_t nelem;
+  size_t i;
+  uint32_t seed = 1;
+  hsize_t cdims[NDIMS];
+  double t_write, t_spectra, t_channels;
+  double mb_total, mb_window;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.machine_id = 20;
+  hdr.telescope_id = 6;
+  hdr.data_type = 1;
+  hdr.nbeams = 1;
+  hdr.ibeam = 1;
+  hdr.nbits = 32;
+  hdr.nifs = 1;
+  hdr.nchans = 1048576;
+  hdr.nfpc = 16384;
+  hdr.fch1 = 1500.0;
+  hdr.foff = -187.5 / hdr.nchans;
+  hdr.tstart = 60000.0;
+  hdr.tsamp = 1.0;
+  strcpy(hdr.source_name, "fbh5bench");
+  strcpy(hdr.rawdatafile, "fbh5bench");
+  targets = strdup(default_targets);
+
+  while((opt=getopt_long(argc,argv,"c:f:i:d:n:t:Eq:o:h",long_opts,NULL))!=-1) {
+    switch (opt) {
+      case 'h': // Help
+        usage(argv[0]);
+        return 0;
+        break;
+
+      case 'c': // Number of fine channels
+        hdr.nchans = strtoul(optarg, NULL, 0);
+        hdr.foff = -187.5 / hdr.nchans;
+        break;
+
+      case 'f': // Number of fine channels per coarse channel
+        hdr.nfpc = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'i': // Number of IFs
+        hdr.nifs = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'd': // Spectra per dump
+        Nd = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'n': // Number of dumps
+        ndumps = strtoul(optarg, NULL, 0);
+        break;
+
+      case 't': // Target chunk sizes
+        free(targets);
+        targets = strdup(optarg);
+        break;
+
+      case 'E': // No extent estimate
+        use_est = 0;
+        break;
+
+      case 'q': // Output format
+        quant = fbh5_quant_parse(optarg);
+        if(quant < 0) {
+          fprintf(stderr, "unknown output format: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'o': // Output file
+        fname = optarg;
+        break;
+
+      case '?': // Command line parsing error
+      default:
+        usage(argv[0]);
+        return 1;
+        break;
+    }
+  }
+
+  if(Nd == 0 || ndumps == 0 || hdr.nchans == 0
+  || hdr.nfpc == 0 || hdr.nchans % hdr.nfpc != 0
+  || (hdr.nifs != 1 && hdr.nifs != 4)) {
+    fprintf(stderr, "invalid product shape\n");
+    return 1;
+  }
+
+  // Buffer for one dump, filled with noise-like spectra so that compression
+  // ratios are realistic.  It is also large enough for the channel window
+  // read.
+  nelem = (size_t)Nd * hdr.nifs * hdr.nchans;
+  bufsize = nelem * sizeof(float);
+  if(nelem < (size_t)ndumps * Nd * hdr.nfpc) {
+    nelem = (size_t)ndumps * Nd * hdr.nfpc;
+  }
+  buf = malloc(nelem * sizeof(float));
+  if(!buf) {
+    fprintf(stderr, "cannot allocate %lu byte buffer\n", nelem * sizeof(float));
+    return 1;
+  }
+  for(i=0; i<nelem; i++) {
+    seed = seed * 1664525 + 1013904223;
+    buf[i] = 1.0e6 + (seed >> 16);
+  }
+
+  mb_total = (double)bufsize * ndumps / 1e6;
+  mb_window = (double)ndumps * Nd * hdr.nfpc * sizeof(float) / 1e6;
+  printf("# nchans=%u nfpc=%u nifs=%u Nd=%u dumps=%u (%.1f MB) preallocate=%s format=%s\n",
+         hdr.nchans, hdr.nfpc, hdr.nifs, Nd, ndumps, mb_total,
+         use_est ? "yes" : "no", fbh5_quant_name(quant));
+
+  for(tok = strtok(targets, ","); tok; tok = strtok(NULL, ",")) {
+    fbh5_chunk_target_bytes = strtoul(tok, NULL, 0);
+    if(fbh5_chunk_target_bytes > 0) {
+      qhdr = hdr;
+      qhdr.nbits = fbh5_quant_nbits(quant);
+      fbh5_adaptive_chunking(&qhdr, Nd, fbh5_chunk_target_bytes, cdims);
+    } else {
+      cdims[0] = Nd;
+      cdims[1] = 1;
+      cdims[2] = hdr.nfpc;
+    }
+
+    t_write = bench_write(&hdr, Nd, ndumps, use_est ? (unsigned long)ndumps * Nd : 0,
+                          quant, fname, buf, bufsize);
+    if(t_write < 0) {
+      fprintf(stderr, "write failed for target %s\n", tok);
+      break;
+    }
+    if(bench_read(fname, &hdr, Nd, ndumps, buf, &t_spectra, &t_channels)) {
+      fprintf(stderr, "read failed for target %s\n", tok);
+      break;
+    }
+
+    printf("# target %lu chunk (%llu, %llu, %llu)\n", fbh5_chunk_target_bytes,
+           cdims[0], cdims[1], cdims[2]);
+    printf("write    %10.1f MB/s\n", mb_total / t_write);
+    printf("spectra  %10.1f MB/s\n", mb_total / t_spectra);
+    printf("channels %10.1f MB/s\n", mb_window / t_channels);
+  }
+
+  unlink(fname);
+  free(targets);
+  free(buf);
+  return 0;
+}
@@ -72,6 +72,33 @@ struct rawspec_context_s {
   //                   must have integer input buffers per integration
   unsigned int Nas[MAX_OUTPUTS]; // Array of Na values
 
+  // sk is an array of flags, one per output product.  If an output product's
+  // flag is non-zero, the spectral kurtosis of each fine channel of each
+  // dumped spectrum is computed along with its power and dumped to the output
+  // spectral kurtosis buffer (h_skbuf[i]).  This is only supported in total
+  // power mode (Npolout == 1).  Changes to this field take effect on the next
+  // call to rawspec_initialize().
+  int sk[MAX_OUTPUTS];
+
+  // excise is an array of RFI excision thresholds, one per output product.  If
+  // an output product's threshold is positive, the total power of each FFT
+  // spectrum (i.e. Nts[i] fine channels of one coarse channel) is compared
+  // with the coarse channel's reference power, a running mean of the total
+  // powers of its recent unflagged FFT spectra.  FFT spectra whose power
+  // exceeds the threshold times the reference power are flagged and left out
+  // of the integration, and the fraction of each dumped spectrum's FFT
+  // spectra that were flagged is reported per coarse channel in the output
+  // flagged-fraction buffer (h_flagfrac[i]).  This is only supported in total
+  // power mode (Npolout == 1).  Changes to this field take effect on the next
+  // call to rawspec_initialize().
+  float excise[MAX_OUTPUTS];
+  // Flag indicating that flagged FFT spectra are to be replaced by the mean of
+  // the unflagged FFT spectra integrated into the same dumped spectrum (by
+  // scaling the integrated power of each coarse channel) rather than left out
+  // (i.e. zeroed).  Changes to this field take effect on the next call to
+  // rawspec_initialize().
+  int excise_fill;
+
   // dump_callback is a pointer to a user-supplied output callback function.
   // This function will be called twice per dump: one time just before data are
   // dumped to the the output power buffer (h_pwrbuf[i]) and a second time just
@@ -138,6 +165,42 @@ struct rawspec_context_s {
   // and will have sizes equal to h_pwrbuf_size[i]/Nant
   float * h_icsbuf[MAX_OUTPUTS];
 
+  // Host pointers to the output spectral kurtosis buffers.  This is only
+  // assigned for output products whose sk flag is set, and will have sizes
+  // equal to h_pwrbuf_size[i].  Each value is the generalized spectral
+  // kurtosis estimator (Nita & Gary 2010) of the corresponding value of
+  // h_pwrbuf[i]:
+  //     SK = (M+1)/(M-1) * (M*S2/S1^2 - 1)
+  // where S1 is the sum of the M power values |X|^2 integrated into the fine
+  // channel, S2 is the sum of their squares, and M is Np times the number of
+  // FFT spectra integrated (i.e. Nas[i] times the spectrum's valid fraction,
+  // less any flagged FFT spectra).  SK is close to 1 for Gaussian noise.  Values
+  // for fine channels without power or with M <= 1 are 0.
+  float * h_skbuf[MAX_OUTPUTS];
+
+  // Array of Nb_host flags, one per host input block buffer.  Rather than
+  // filling a block buffer with zeros when a block is missing (e.g. due to a
+  // gap in the input), the caller sets the block buffer's flag to zero (and
+  // sets it to non-zero for blocks of data).  Missing blocks are zeroed on the
+  // GPU instead of being copied from the host.  All flags are set to non-zero
+  // by rawspec_initialize().
+  char * h_blkvalid;
+
+  // Host pointers to the output valid-fraction buffers, which hold one value
+  // per dumped spectrum (i.e. Nds[i] values).  Each value is the fraction of
+  // the time samples integrated into the spectrum that came from valid (i.e.
+  // not missing) blocks.  These are updated right before the post-dump
+  // callback.
+  float * h_validfrac[MAX_OUTPUTS];
+
+  // Host pointers to the output flagged-fraction buffers.  These are only
+  // assigned for output products with a positive excise threshold and hold
+  // Nc values per dumped spectrum (i.e. Nds[i] * Nc values).  Each value is
+  // the fraction of the Nas[i] FFT spectra of a coarse channel integrated into
+  // the dumped spectrum that were flagged.  These are updated right before
+  // the post-dump callback.
+  float * h_flagfrac[MAX_OUTPUTS];
+
   // Array of Nd values (number of spectra per dump)
   unsigned int Nds[MAX_OUTPUTS];
 
@@ -150,7 +213,8 @@ struct rawspec_context_s {
 // enum for output mode
 typedef enum {
   RAWSPEC_FILE,
-  RAWSPEC_NET
+  RAWSPEC_NET,
+  RAWSPEC_SHM
 } rawspec_output_mode_t;
 
 #ifdef __cplusplus
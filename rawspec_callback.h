@@ -4,12 +4,16 @@
 #include <pthread.h>
 #include "hdf5.h"
 #include "rawspec_fbutils.h"
+#include "rawspec_dio.h"
+#include "rawspec_hits.h"
 
 typedef struct {
     int active;                 // Still active? 1=yes, 0=no
     hid_t file_id;              // File-level handle (similar to an fd)
     hid_t dataset_id;           // Dataset "data" handle
     hid_t dataspace_id;         // Dataspace handle for dataset "data"
+    hid_t valid_dataset_id;     // Dataset "valid_frac" handle
+    hsize_t valid_count;        // Number of values in dataset "valid_frac"
     unsigned int elem_size;     // Byte size of one spectra element (E.g. 4 if nbits=32)
     hid_t elem_type;            // HDF5 type for all elements (derived from nbits in fbh5_open)
     size_t tint_size;           // Size of a time integration (computed in fbh5_open)
@@ -18,18 +22,55 @@ typedef struct {
     hsize_t filesz_dims[3];     // Accumulated file size in dimensions
     unsigned long byte_count;   // Number of bytes output so far
     unsigned long dump_count;   // Number of dumps processed so far
+    // Direct chunk writing (see fbh5_chunk.c)
+    int direct_chunk;           // Write precompressed chunks? 1=yes, 0=no (H5Dwrite)
+    hsize_t chunk_dims[3];      // Chunk dimensions of dataset "data"
+    hsize_t dump_ntints;        // Number of time integrations per dump
+    size_t nchunks;             // Number of chunks per dump
+    char ** chunk_bufs;         // Compressed chunks of the current dump
+    size_t * chunk_sizes;       // Compressed sizes of the chunks
+    size_t chunk_cap;           // Capacity of each chunk buffer
+    unsigned int nthreads;      // Number of compression threads
+    // Reduced-precision output (see fbh5_quant.c)
+    int quant;                  // Output format (FBH5_QUANT_*)
+    float * quant_inv;          // Reciprocal of the scale of each (IF, channel)
+    float * quant_offset;       // Offset of each (IF, channel)
+    int quant_ready;            // Non-zero once the scales are fixed
+    void * quant_buf;           // Converted dump
+    size_t quant_bufsize;       // Size of quant_buf
 } fbh5_context_t;
 
+// Auxiliary output file of an output product (e.g. its spectral kurtosis),
+// which has its own Filterbank header and is output in the same format as the
+// product's power (see rawspec_file.c)
+typedef struct {
+  int fd;                       // File descriptor (-1 if not open)
+  fb_hdr_t fb_hdr;              // Filterbank header
+  fbh5_context_t fbh5_ctx;      // FBH5 context (if FBH5 output)
+  rawspec_dio_t dio;            // Direct I/O writer (if direct I/O)
+} rawspec_aux_file_t;
+
 typedef struct {
   int *fd; // Output file descriptors (one for each antenna) or socket (at most 1)
   int fd_ics; // Output file descriptor or socket
   unsigned int Nant; // Number of antenna, splitting Nf per fd
+  unsigned int * ants; // Antenna number of each of the Nant antennas (NULL for 0..Nant-1)
   char per_ant_out; // Flag to account for Nant
   unsigned int total_spectra;
+  unsigned int stem_spectra; // Spectra dumped since fb_hdr.tstart
   unsigned int total_packets;
+  unsigned int total_error_packets;
+  unsigned int total_syscalls;
   unsigned int total_bytes;
   uint64_t total_ns;
-  double rate;
+  // Network output destinations of this product (see rawspec_socket.c)
+  struct rawspec_route * routes;
+  int nroutes;
+  // Shared memory output rings of this product (see rawspec_shmout.h)
+  struct rawspec_shmout * shm;
+  struct rawspec_shmout * shm_ics;
+  // Per-antenna output file writer threads (see rawspec_file.c)
+  struct rawspec_ant_writers * ant_writers;
   int debug_callback;
   // No way to tell if output_thread is valid expect via separate flag
   int output_thread_valid;
@@ -39,8 +80,13 @@ typedef struct {
   float * h_pwrbuf;
   size_t h_pwrbuf_size;
   float * h_icsbuf;
+  float * h_skbuf; // Spectral kurtosis (NULL if not computed)
+  float * h_validfrac; // Valid sample fraction of each of the Nds spectra
+  float * h_flagfrac; // Flagged fraction of each coarse channel (NULL if no RFI excision)
   unsigned int Nds;
   unsigned int Nf; // Number of fine channels (== Nc*Nts[i])
+  unsigned long est_ntints; // Estimated number of spectra to be output (0 if unknown)
+  int quant; // FBH5 output format (FBH5_QUANT_*, see fbh5_quant.c)
   // Filterbank header
   fb_hdr_t fb_hdr;
   
@@ -49,6 +95,16 @@ typedef struct {
   fbh5_context_t fbh5_ctx_ics;    // Singleton fbh5 ctx for ics
   fbh5_context_t * fbh5_ctx_ant;  // Pointer to array of fbh5 ctx for individual antennas
 
+  // Direct I/O output of SIGPROC files (see rawspec_dio.h)
+  int flag_direct_io;             // 1=direct I/O, 0=write()
+  rawspec_dio_t dio_ics;          // Direct I/O writer for ics
+  rawspec_dio_t * dio_ant;        // Pointer to array of direct I/O writers for individual antennas
+
+  // Auxiliary output files
+  rawspec_aux_file_t sk_file;     // Spectral kurtosis
+  rawspec_aux_file_t flags_file;  // Flagged fraction of each coarse channel
+  rawspec_hits_t hits;            // Narrowband hits (see rawspec_hits.h)
+
   // Exit soon flag.
   // 0 : No output errors have occurred so far.
   // 1 : At least one output error has occured.
@@ -0,0 +1,311 @@
+// rawspec_compress - Converts the RAW files of a stem into block-compressed
+// RAWZ files (see rawspec_rawz.h), which rawspec reads directly.  Each
+// STEM.NNNN.raw file becomes a STEM.NNNN.rawz file with a frame index.
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <endian.h>
+
+#ifdef RAWSPEC_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef RAWSPEC_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "rawspec_input.h"
+
+static struct option long_opts[] = {
+  {"codec", 1, NULL, 'c'},
+  {"level", 1, NULL, 'l'},
+  {"help",  0, NULL, 'h'},
+  {0,0,0,0}
+};
+
+void usage(const char * argv0) {
+  fprintf(stderr,
+    "Usage: %s [options] STEM\n"
+    "\n"
+    "Options:\n"
+    "  -c, --codec=CODEC      Compression codec (zstd, lz4, or none) [zstd]\n"
+    "  -l, --level=N          Compression level (zstd only) [3]\n"
+    "\n"
+    "  -h, --help             Show this message\n",
+    argv0
+  );
+}
+
+// Compresses `len` bytes of `src` into `dst`, which has room for `cap` bytes,
+// using `codec`.  Returns the compressed size, or 0 on error.
+static size_t compress_block(int codec, int level, const char * src,
+                             size_t len, char * dst, size_t cap)
+{
+#ifdef RAWSPEC_HAVE_ZSTD
+  size_t zstd_size;
+#endif
+
+  switch(codec) {
+#ifdef RAWSPEC_HAVE_ZSTD
+    case RAWSPEC_RAWZ_ZSTD:
+      zstd_size = ZSTD_compress(dst, cap, src, len, level);
+      return ZSTD_isError(zstd_size) ? 0 : zstd_size;
+#endif
+#ifdef RAWSPEC_HAVE_LZ4
+    case RAWSPEC_RAWZ_LZ4:
+      return LZ4_compress_default(src, dst, len, cap);
+#endif
+    default:
+      return 0;
+  }
+}
+
+// Returns the maximum compressed size of `len` bytes using `codec`.
+static size_t compress_bound(int codec, size_t len)
+{
+  switch(codec) {
+#ifdef RAWSPEC_HAVE_ZSTD
+    case RAWSPEC_RAWZ_ZSTD:
+      return ZSTD_compressBound(len);
+#endif
+#ifdef RAWSPEC_HAVE_LZ4
+    case RAWSPEC_RAWZ_LZ4:
+      return LZ4_compressBound(len);
+#endif
+    default:
+      return len;
+  }
+}
+
+// Appends an 80 byte card to `hdr` at offset `len`.  Returns the new length.
+static size_t add_card(char * hdr, size_t len, const char * card)
+{
+  memset(hdr + len, ' ', 80);
+  memcpy(hdr + len, card, strlen(card));
+  return len + 80;
+}
+
+// Writes the frame index of `nframes` frames at `offsets` to `fd` and closes
+// `fd`.  Returns 0 on success, -1 on error.
+static int finish_file(int fd, uint64_t * offsets, uint64_t nframes)
+{
+  uint64_t i;
+  uint64_t trailer[2];
+  int rc = 0;
+
+  for(i=0; i<nframes; i++) {
+    offsets[i] = htole64(offsets[i]);
+  }
+  trailer[0] = htole64(nframes);
+  memcpy(&trailer[1], RAWSPEC_RAWZ_INDEX_MAGIC, sizeof(trailer[1]));
+  if(write(fd, offsets, nframes * sizeof(uint64_t))
+      != nframes * sizeof(uint64_t)
+  || write(fd, trailer, sizeof(trailer)) != sizeof(trailer)) {
+    perror("write");
+    rc = -1;
+  }
+  close(fd);
+  return rc;
+}
+
+int main(int argc, char * argv[])
+{
+  int opt;
+  int codec = -1;
+  const char * codec_name = "zstd";
+  int level = 3;
+  const char * stem;
+  rawspec_input_t in;
+  rawspec_raw_hdr_t raw_hdr;
+  off_t pos;
+  char fname[PATH_MAX+1];
+  char card[81];
+  char * hdr = NULL;
+  char * data = NULL;
+  char * zbuf = NULL;
+  size_t data_cap = 0;
+  size_t zcap = 0;
+  size_t hdr_len;
+  size_t zsize;
+  size_t i;
+  int block_codec;
+  int fd = -1;
+  int fi = -1;
+  off_t fpos = 0;
+  uint64_t * offsets = NULL;
+  uint64_t nframes = 0;
+  uint64_t max_frames = 0;
+  uint64_t total_in = 0;
+  uint64_t total_out = 0;
+  int rc = 1;
+
+  while((opt=getopt_long(argc,argv,"c:l:h",long_opts,NULL))!=-1) {
+    switch (opt) {
+      case 'h': // Help
+        usage(argv[0]);
+        return 0;
+        break;
+
+      case 'c': // Codec
+        codec_name = optarg;
+        break;
+
+      case 'l': // Compression level
+        level = strtol(optarg, NULL, 0);
+        break;
+
+      case '?': // Command line parsing error
+      default:
+        usage(argv[0]);
+        return 1;
+        break;
+    }
+  }
+
+  if(optind != argc-1) {
+    usage(argv[0]);
+    return 1;
+  }
+  stem = argv[optind];
+
+  codec = rawspec_rawz_codec(codec_name);
+  if(codec == -1) {
+    fprintf(stderr, "unsupported codec: %s\n", codec_name);
+    return 1;
+  }
+
+  in.follow_timeout = 0;
+  if(rawspec_input_open(&in, stem, 0)) {
+    return 1;
+  }
+  if(in.type != RAWSPEC_INPUT_FILES) {
+    fprintf(stderr, "%s is not a stem of RAW files\n", stem);
+    rawspec_input_close(&in);
+    return 1;
+  }
+
+  hdr = malloc(MAX_RAW_HDR_SIZE + 3*80);
+  if(!hdr) {
+    goto done;
+  }
+
+  for(pos = rawspec_input_read_header(&in, &raw_hdr); pos > 0;
+      pos = rawspec_input_read_header(&in, &raw_hdr)) {
+    // Start new output file when input moves on to a new file
+    if(in.fi != fi) {
+      if(fd != -1 && finish_file(fd, offsets, nframes)) {
+        fd = -1;
+        goto done;
+      }
+      fi = in.fi;
+      rawspec_rawz_fname(fname, stem, fi);
+      printf("writing file: %s\n", fname);
+      fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+      if(fd == -1) {
+        perror(fname);
+        goto done;
+      }
+      fpos = 0;
+      nframes = 0;
+    }
+
+    // Grow buffers as needed
+    if(raw_hdr.blocsize > data_cap) {
+      free(data);
+      free(zbuf);
+      data_cap = raw_hdr.blocsize;
+      zcap = compress_bound(codec, data_cap);
+      data = malloc(data_cap);
+      zbuf = malloc(zcap);
+      if(!data || !zbuf) {
+        fprintf(stderr, "cannot allocate block buffers\n");
+        goto done;
+      }
+    }
+    if(nframes == max_frames) {
+      max_frames = max_frames ? 2 * max_frames : 1024;
+      offsets = realloc(offsets, max_frames * sizeof(uint64_t));
+      if(!offsets) {
+        fprintf(stderr, "cannot allocate frame index\n");
+        goto done;
+      }
+    }
+
+    // Read header and data
+    if(pread(in.fd, hdr, raw_hdr.hdr_size, raw_hdr.hdr_pos) != raw_hdr.hdr_size
+    || rawspec_input_read(&in, data, raw_hdr.blocsize) != raw_hdr.blocsize) {
+      fprintf(stderr, "error reading block from %s\n", in.fname);
+      goto done;
+    }
+
+    // Compress data, storing it uncompressed if it does not compress
+    block_codec = codec;
+    zsize = 0;
+    if(codec != RAWSPEC_RAWZ_NONE) {
+      zsize = compress_block(codec, level, data, raw_hdr.blocsize, zbuf, zcap);
+    }
+    if(zsize == 0 || zsize >= raw_hdr.blocsize) {
+      block_codec = RAWSPEC_RAWZ_NONE;
+      zsize = raw_hdr.blocsize;
+    }
+
+    // Copy all cards except END (and any stale compression cards), then add
+    // compression cards and END
+    for(i=0, hdr_len=0; i+80 <= raw_hdr.hdr_size; i+=80) {
+      if(!strncmp(hdr+i, "END ", 4)) {
+        break;
+      }
+      if(strncmp(hdr+i, "ZCODEC  =", 9) && strncmp(hdr+i, "ZBLOCSIZ=", 9)) {
+        memmove(hdr+hdr_len, hdr+i, 80);
+        hdr_len += 80;
+      }
+    }
+    snprintf(card, sizeof(card), "ZCODEC  = '%-8s'",
+        block_codec == RAWSPEC_RAWZ_ZSTD ? "zstd" :
+        block_codec == RAWSPEC_RAWZ_LZ4  ? "lz4"  : "none");
+    hdr_len = add_card(hdr, hdr_len, card);
+    snprintf(card, sizeof(card), "ZBLOCSIZ= %20lu", zsize);
+    hdr_len = add_card(hdr, hdr_len, card);
+    hdr_len = add_card(hdr, hdr_len, "END");
+
+    if(write(fd, hdr, hdr_len) != hdr_len
+    || write(fd, block_codec == RAWSPEC_RAWZ_NONE ? data : zbuf, zsize)
+        != zsize) {
+      perror("write");
+      goto done;
+    }
+    offsets[nframes++] = fpos;
+    fpos += hdr_len + zsize;
+    total_in += raw_hdr.blocsize;
+    total_out += zsize;
+  }
+
+  if(pos == 0 && fd != -1) {
+    rc = finish_file(fd, offsets, nframes) ? 1 : 0;
+    fd = -1;
+  }
+
+  if(total_in) {
+    printf("compressed %lu bytes of block data to %lu bytes (%.1f%%)\n",
+        total_in, total_out, 100.0 * total_out / total_in);
+  }
+
+done:
+  if(fd != -1) {
+    close(fd);
+  }
+  rawspec_input_close(&in);
+  free(hdr);
+  free(data);
+  free(zbuf);
+  free(offsets);
+
+  return rc;
+}
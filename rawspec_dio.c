@@ -0,0 +1,326 @@
+// Direct I/O writer for SIGPROC filterbank files (see rawspec_dio.h).  The
+// io_uring interface is used directly through its system calls so that no
+// additional library is needed.
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "rawspec_dio.h"
+
+// Sets up an io_uring with room for RAWSPEC_DIO_DEPTH writes.  Returns 0 on
+// success or -1 if io_uring is not available (d->ring_fd stays -1).
+static int uring_setup(rawspec_dio_t * d)
+{
+  struct io_uring_params p;
+  char * sq;
+  char * cq;
+
+  memset(&p, 0, sizeof(p));
+  d->ring_fd = syscall(__NR_io_uring_setup, RAWSPEC_DIO_DEPTH, &p);
+  if(d->ring_fd == -1) {
+    return -1;
+  }
+
+  d->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  d->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(d->cq_ring_size > d->sq_ring_size) {
+      d->sq_ring_size = d->cq_ring_size;
+    }
+    d->cq_ring_size = 0;
+  }
+  d->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  d->sq_ring = mmap(NULL, d->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, d->ring_fd, IORING_OFF_SQ_RING);
+  if(d->sq_ring == MAP_FAILED) {
+    d->sq_ring = NULL;
+    goto fail;
+  }
+  if(d->cq_ring_size) {
+    d->cq_ring = mmap(NULL, d->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, d->ring_fd, IORING_OFF_CQ_RING);
+    if(d->cq_ring == MAP_FAILED) {
+      d->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  d->sqes = mmap(NULL, d->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, d->ring_fd, IORING_OFF_SQES);
+  if(d->sqes == MAP_FAILED) {
+    d->sqes = NULL;
+    goto fail;
+  }
+
+  sq = d->sq_ring;
+  cq = d->cq_ring_size ? d->cq_ring : d->sq_ring;
+  d->sq_head  = (unsigned *)(sq + p.sq_off.head);
+  d->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+  d->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+  d->sq_array = (unsigned *)(sq + p.sq_off.array);
+  d->cq_head  = (unsigned *)(cq + p.cq_off.head);
+  d->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+  d->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+  d->cqes     = cq + p.cq_off.cqes;
+  return 0;
+
+fail:
+  if(d->sqes) {
+    munmap(d->sqes, d->sqes_size);
+    d->sqes = NULL;
+  }
+  if(d->cq_ring) {
+    munmap(d->cq_ring, d->cq_ring_size);
+    d->cq_ring = NULL;
+  }
+  if(d->sq_ring) {
+    munmap(d->sq_ring, d->sq_ring_size);
+    d->sq_ring = NULL;
+  }
+  close(d->ring_fd);
+  d->ring_fd = -1;
+  return -1;
+}
+
+static void uring_teardown(rawspec_dio_t * d)
+{
+  if(d->ring_fd == -1) {
+    return;
+  }
+  munmap(d->sqes, d->sqes_size);
+  if(d->cq_ring) {
+    munmap(d->cq_ring, d->cq_ring_size);
+  }
+  munmap(d->sq_ring, d->sq_ring_size);
+  close(d->ring_fd);
+  d->ring_fd = -1;
+  d->sq_ring = d->cq_ring = d->sqes = NULL;
+}
+
+// Reaps completed writes, waiting for at least `min_complete` of them.
+// Returns 0 on success or -1 if waiting failed.
+static int uring_reap(rawspec_dio_t * d, unsigned min_complete)
+{
+  struct io_uring_cqe * cqe;
+  unsigned head;
+  int bi;
+
+  while(syscall(__NR_io_uring_enter, d->ring_fd, 0, min_complete,
+                min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1) {
+    if(errno != EINTR) {
+      perror("io_uring_enter");
+      return -1;
+    }
+  }
+
+  head = *d->cq_head;
+  while(head != __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = (struct io_uring_cqe *)d->cqes + (head & *d->cq_mask);
+    bi = cqe->user_data & 0xffff;
+    // A short write leaves a gap in the file, so treat it as an error
+    if(cqe->res != (int)(cqe->user_data >> 16)) {
+      fprintf(stderr, "direct I/O write failed: %s\n",
+          cqe->res < 0 ? strerror(-cqe->res) : "short write");
+      d->error = 1;
+    }
+    d->busy[bi] = 0;
+    d->inflight--;
+    head++;
+  }
+  __atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Writes `len` bytes of buffer `bi` at file offset `pos`, asynchronously if
+// io_uring is available.  Returns 0 on success or -1 on error.
+static int submit_write(rawspec_dio_t * d, int bi, size_t len, off_t pos)
+{
+  struct io_uring_sqe * sqe;
+  unsigned tail;
+  unsigned idx;
+  ssize_t n;
+  size_t done;
+
+  if(d->ring_fd == -1) {
+    for(done = 0; done < len; done += n) {
+      n = pwrite(d->fd, d->bufs[bi] + done, len - done, pos + done);
+      if(n <= 0) {
+        if(n == -1 && errno == EINTR) {
+          n = 0;
+          continue;
+        }
+        perror("pwrite");
+        d->error = 1;
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  tail = *d->sq_tail;
+  idx = tail & *d->sq_mask;
+  sqe = (struct io_uring_sqe *)d->sqes + idx;
+  // IORING_OP_WRITEV (unlike IORING_OP_WRITE, added in Linux 5.6) is
+  // supported by every kernel with io_uring.  The iovec must stay valid until
+  // the write completes.
+  d->iovs[bi].iov_base = d->bufs[bi];
+  d->iovs[bi].iov_len = len;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = d->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&d->iovs[bi];
+  sqe->len = 1;
+  sqe->off = pos;
+  // Completion carries the expected length and the buffer index
+  sqe->user_data = ((uint64_t)len << 16) | bi;
+  d->sq_array[idx] = idx;
+  __atomic_store_n(d->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while(syscall(__NR_io_uring_enter, d->ring_fd, 1, 0, 0, NULL, 0) == -1) {
+    if(errno != EINTR) {
+      perror("io_uring_enter");
+      d->error = 1;
+      return -1;
+    }
+  }
+  d->busy[bi] = 1;
+  d->inflight++;
+  return 0;
+}
+
+// Writes the full current buffer and moves on to the next buffer, waiting for
+// it to become free.  Returns 0 on success or -1 on error.
+static int flush_buffer(rawspec_dio_t * d)
+{
+  if(submit_write(d, d->cur, d->fill, d->pos)) {
+    return -1;
+  }
+  d->pos += d->fill;
+  d->fill = 0;
+  d->cur = (d->cur + 1) % RAWSPEC_DIO_DEPTH;
+  while(d->busy[d->cur]) {
+    if(uring_reap(d, 1)) {
+      d->error = 1;
+      return -1;
+    }
+  }
+  return d->error ? -1 : 0;
+}
+
+int rawspec_dio_open(rawspec_dio_t * d, const char * fname, const fb_hdr_t * hdr,
+                     unsigned int nds)
+{
+  static int uring_notice = 0;
+  int i;
+  char * end;
+  size_t dump_size = (size_t)nds * hdr->nifs * hdr->nchans * hdr->nbits / 8;
+
+  memset(d, 0, sizeof(rawspec_dio_t));
+  d->fd = -1;
+  d->ring_fd = -1;
+
+  // Size the buffers to hold one dump
+  d->bufsize = (dump_size + RAWSPEC_DIO_ALIGN - 1)
+             / RAWSPEC_DIO_ALIGN * RAWSPEC_DIO_ALIGN;
+  if(d->bufsize < RAWSPEC_DIO_MIN_BUFSIZE) {
+    d->bufsize = RAWSPEC_DIO_MIN_BUFSIZE;
+  } else if(d->bufsize > RAWSPEC_DIO_BUFSIZE) {
+    d->bufsize = RAWSPEC_DIO_BUFSIZE;
+  }
+
+  for(i=0; i<RAWSPEC_DIO_DEPTH; i++) {
+    if(posix_memalign((void **)&d->bufs[i], RAWSPEC_DIO_ALIGN, d->bufsize)) {
+      fprintf(stderr, "cannot allocate direct I/O buffers\n");
+      goto fail;
+    }
+  }
+
+  d->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0664);
+  if(d->fd == -1 && errno == EINVAL) {
+    fprintf(stderr, "%s: O_DIRECT not supported, using buffered I/O\n", fname);
+    d->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  } else if(d->fd != -1) {
+    d->direct = 1;
+  }
+  if(d->fd == -1) {
+    perror(fname);
+    goto fail;
+  }
+
+  if(uring_setup(d) && !__atomic_exchange_n(&uring_notice, 1, __ATOMIC_RELAXED)) {
+    fprintf(stderr, "io_uring not available (%s), writing direct I/O files "
+        "synchronously\n", strerror(errno));
+  }
+
+  // Start the first buffer with the header, padded so the data is aligned
+  end = fb_buf_write_padded_header(d->bufs[0], hdr, RAWSPEC_DIO_ALIGN);
+  d->fill = end - d->bufs[0];
+  return d->fd;
+
+fail:
+  rawspec_dio_close(d);
+  return -1;
+}
+
+int rawspec_dio_write(rawspec_dio_t * d, const void * buf, size_t len)
+{
+  size_t n;
+
+  if(d->error) {
+    return -1;
+  }
+  while(len > 0) {
+    n = d->bufsize - d->fill;
+    if(n > len) {
+      n = len;
+    }
+    memcpy(d->bufs[d->cur] + d->fill, buf, n);
+    d->fill += n;
+    buf = (const char *)buf + n;
+    len -= n;
+    if(d->fill == d->bufsize && flush_buffer(d)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int rawspec_dio_close(rawspec_dio_t * d)
+{
+  int i;
+  int flags;
+
+  if(d->fd != -1) {
+    // Write the final partial buffer.  Its length is generally not aligned, so
+    // it is written without O_DIRECT once all other writes have completed.
+    while(d->inflight > 0 && uring_reap(d, 1) == 0);
+    if(d->fill > 0 && !d->error) {
+      if(d->direct) {
+        flags = fcntl(d->fd, F_GETFL);
+        fcntl(d->fd, F_SETFL, flags & ~O_DIRECT);
+      }
+      submit_write(d, d->cur, d->fill, d->pos);
+      while(d->inflight > 0 && uring_reap(d, 1) == 0);
+    }
+    if(close(d->fd) == -1) {
+      perror("close");
+      d->error = 1;
+    }
+    d->fd = -1;
+  }
+  uring_teardown(d);
+  for(i=0; i<RAWSPEC_DIO_DEPTH; i++) {
+    free(d->bufs[i]);
+    d->bufs[i] = NULL;
+  }
+  return d->error ? -1 : 0;
+}
@@ -0,0 +1,94 @@
+#ifndef _RAWSPEC_DIO_H_
+#define _RAWSPEC_DIO_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "rawspec_fbutils.h"
+
+// Direct I/O writer for SIGPROC filterbank files
+//
+// Data written to a direct I/O file is copied into one of a small number of
+// aligned staging buffers.  Each full buffer is written to the file (opened
+// with O_DIRECT, bypassing the page cache) by an asynchronous write submitted
+// through io_uring, so that writing continues while the next buffer is being
+// filled and dirty pages never accumulate on the host.  At most
+// RAWSPEC_DIO_DEPTH writes are in flight per file.  The buffers are sized to
+// hold one dump of the file (rounded up to RAWSPEC_DIO_ALIGN bytes, between
+// RAWSPEC_DIO_MIN_BUFSIZE and RAWSPEC_DIO_BUFSIZE), so that files of small
+// products, e.g. many per-antenna files, do not pin much more memory than
+// they need.  If the kernel does not support io_uring (or it cannot be set
+// up), the buffers are written synchronously with pwrite().  If the
+// filesystem does not support O_DIRECT, the file is written through the page
+// cache.
+//
+// The filterbank header is padded to RAWSPEC_DIO_ALIGN bytes so that the data
+// starts at an aligned file offset.
+
+// Alignment of buffers, file offsets and write lengths for O_DIRECT
+#define RAWSPEC_DIO_ALIGN (4096)
+
+// Maximum and minimum size of each staging buffer (multiples of
+// RAWSPEC_DIO_ALIGN).  The minimum leaves room for the padded header.
+#define RAWSPEC_DIO_BUFSIZE (8*1024*1024)
+#define RAWSPEC_DIO_MIN_BUFSIZE (64*1024)
+
+// Number of staging buffers (maximum number of writes in flight)
+#define RAWSPEC_DIO_DEPTH (4)
+
+typedef struct {
+  int fd;                       // File descriptor (-1 if not open)
+  int direct;                   // Non-zero if fd was opened with O_DIRECT
+  size_t bufsize;               // Size of each buffer
+  char * bufs[RAWSPEC_DIO_DEPTH];
+  int busy[RAWSPEC_DIO_DEPTH];  // Non-zero while buffer is being written
+  struct iovec iovs[RAWSPEC_DIO_DEPTH]; // Vector of each buffer's write
+  int cur;                      // Buffer being filled
+  size_t fill;                  // Number of bytes in current buffer
+  off_t pos;                    // File offset of current buffer
+  int inflight;                 // Number of writes in flight
+  int error;                    // Non-zero once a write has failed
+  // io_uring state (ring_fd is -1 if io_uring is not used)
+  int ring_fd;
+  void * sq_ring;
+  size_t sq_ring_size;
+  void * cq_ring;
+  size_t cq_ring_size;
+  void * sqes;
+  size_t sqes_size;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  void * cqes;
+} rawspec_dio_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Creates (or truncates) file `fname` for direct I/O using `d` and writes
+// filterbank header `hdr` to it.  Each dump written to the file holds `nds`
+// spectra of the shape given by `hdr`.  Returns the file descriptor on success
+// or -1 on error.
+int rawspec_dio_open(rawspec_dio_t * d, const char * fname, const fb_hdr_t * hdr,
+                     unsigned int nds);
+
+// Appends `len` bytes of `buf` to the file.  Returns 0 on success or -1 on
+// error (including the failure of an earlier asynchronous write).
+int rawspec_dio_write(rawspec_dio_t * d, const void * buf, size_t len);
+
+// Writes any buffered data, waits for all writes to complete, closes the file
+// and frees the buffers of `d`.  Returns 0 on success or -1 if any write
+// failed.
+int rawspec_dio_close(rawspec_dio_t * d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RAWSPEC_DIO_H_
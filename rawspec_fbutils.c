@@ -39,6 +39,13 @@ double fb_dms_to_ddd(double dms)
   return sign * dd;
 }
 
+// The MJD is computed from tstart rather than accumulated from spectrum to
+// spectrum, since MJD values cannot represent small increments exactly.
+double fb_spectrum_mjd(const fb_hdr_t * hdr, uint64_t spectrum)
+{
+  return hdr->tstart + spectrum * hdr->tsamp / 86400.0;
+}
+
 // Write utilities
 
 ssize_t fb_fd_write_int(int fd, int32_t i)
@@ -293,6 +300,16 @@ ssize_t fb_fd_write_padded_header(int fd, const fb_hdr_t * hdr, int32_t minlen)
     n += fb_fd_write_string(fd, "pulsarcentric");
     n += fb_fd_write_int(   fd, hdr->pulsarcentric);
   }
+  if(hdr->net_npkts) {
+    n += fb_fd_write_string(fd, "net_route");
+    n += fb_fd_write_int(   fd, hdr->net_route);
+    n += fb_fd_write_string(fd, "net_dump");
+    n += fb_fd_write_int(   fd, hdr->net_dump);
+    n += fb_fd_write_string(fd, "net_pkt");
+    n += fb_fd_write_int(   fd, hdr->net_pkt);
+    n += fb_fd_write_string(fd, "net_npkts");
+    n += fb_fd_write_int(   fd, hdr->net_npkts);
+  }
   n += fb_fd_write_string(fd, "source_name");
   n += fb_fd_write_string(fd, hdr->source_name);
 
@@ -322,7 +339,7 @@ ssize_t fb_fd_write_padded_header(int fd, const fb_hdr_t * hdr, int32_t minlen)
 
 ssize_t fb_fd_write_header(int fd, const fb_hdr_t * hdr)
 {
-  fb_fd_write_padded_header(fd, hdr, 0);
+  return fb_fd_write_padded_header(fd, hdr, 0);
 }
 
 // Writes a filterbank header padded as close to minlen as possible.  See
@@ -376,6 +393,16 @@ void * fb_buf_write_padded_header(void * buf, const fb_hdr_t * hdr, int32_t minl
     buf = fb_buf_write_string(buf, "pulsarcentric");
     buf = fb_buf_write_int(   buf, hdr->pulsarcentric);
   }
+  if(hdr->net_npkts) {
+    buf = fb_buf_write_string(buf, "net_route");
+    buf = fb_buf_write_int(   buf, hdr->net_route);
+    buf = fb_buf_write_string(buf, "net_dump");
+    buf = fb_buf_write_int(   buf, hdr->net_dump);
+    buf = fb_buf_write_string(buf, "net_pkt");
+    buf = fb_buf_write_int(   buf, hdr->net_pkt);
+    buf = fb_buf_write_string(buf, "net_npkts");
+    buf = fb_buf_write_int(   buf, hdr->net_npkts);
+  }
   buf = fb_buf_write_string(buf, "source_name");
   buf = fb_buf_write_string(buf, hdr->source_name);
 
@@ -405,7 +432,7 @@ void * fb_buf_write_padded_header(void * buf, const fb_hdr_t * hdr, int32_t minl
 
 void * fb_buf_write_header(void * buf, const fb_hdr_t * hdr)
 {
-  fb_buf_write_padded_header(buf, hdr, 0);
+  return fb_buf_write_padded_header(buf, hdr, 0);
 }
 
 // TODO Make this more robust by using the value of *hdr_len on enrty as the
@@ -449,6 +476,14 @@ void * fb_buf_read_header(void * buf, fb_hdr_t * hdr, size_t * hdr_len)
       p = fb_buf_read_int(p, &hdr->barycentric);
     } else if(!strncmp(kw, "pulsarcentric", len)) {
       p = fb_buf_read_int(p, &hdr->pulsarcentric);
+    } else if(!strncmp(kw, "net_route", len)) {
+      p = fb_buf_read_int(p, &hdr->net_route);
+    } else if(!strncmp(kw, "net_dump", len)) {
+      p = fb_buf_read_int(p, &hdr->net_dump);
+    } else if(!strncmp(kw, "net_pkt", len)) {
+      p = fb_buf_read_int(p, &hdr->net_pkt);
+    } else if(!strncmp(kw, "net_npkts", len)) {
+      p = fb_buf_read_int(p, &hdr->net_npkts);
     } else if(!strncmp(kw, "src_raj", len)) {
       p = fb_buf_read_angle(p, &hdr->src_raj);
     } else if(!strncmp(kw, "src_dej", len)) {
@@ -115,6 +115,18 @@ typedef struct {
   int nfpc;
   // Reference beam (i.e. the beam that was tracking the source)
   int refbeam;
+
+  // ------------------------ network output ----------------------------------
+  // Packet sequence keywords of network output (only output if net_npkts is
+  // non-zero, see rawspec_socket.c)
+  // Route (i.e. destination) of the packet within its output product
+  int net_route;
+  // Dump number of the packet
+  int net_dump;
+  // Index of the packet within its dump
+  int net_pkt;
+  // Number of packets of the route per dump
+  int net_npkts;
   
 } fb_hdr_t;
 
@@ -127,6 +139,9 @@ extern "C" {
 double fb_ddd_to_dms(double ddd);
 double fb_dms_to_ddd(double dms);
 
+// Returns the MJD of the start of spectrum `spectrum` (counted from tstart)
+double fb_spectrum_mjd(const fb_hdr_t * hdr, uint64_t spectrum);
+
 // Write utilities
 
 ssize_t fb_fd_write_int(int fd, int32_t i);
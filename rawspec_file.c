@@ -1,30 +1,68 @@
+#define _GNU_SOURCE 1
+
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #include "rawspec_file.h"
 #include "fbh5_defs.h"
 
-// Open a single Filterbank file for one of the following:
-//   * nants = 0
-//   * a single antenna of a set
-//   * ICS
-int open_output_file(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx, int antenna_index)
+// Maximum number of threads writing the per-antenna files of one dump
+#define MAX_ANT_WRITERS (8)
+
+typedef struct rawspec_ant_writers ant_writers_t;
+
+// Writes the per-antenna output files of antennas first, first+step, ...
+typedef struct {
+  ant_writers_t * pool;
+  callback_data_t * cb_data;
+  unsigned int first;
+  unsigned int step;
+  unsigned int nants;  // Number of antennas with open output files
+  float * stage;       // FBH5 staging buffer
+  struct iovec * iov;  // SIGPROC gather list
+  int retcode;
+  pthread_t thread;
+} ant_writer_t;
+
+// Persistent threads writing the per-antenna output files of an output
+// product.  They are started when the files are opened and stopped when the
+// files are closed, and are handed each dump by write_per_antenna().
+struct rawspec_ant_writers {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_work;     // Signaled when a dump is handed out or stopping
+  pthread_cond_t cond_done;     // Signaled when the last writer finishes a dump
+  unsigned int nwriters;        // Writers including the output thread
+  unsigned int dump;            // Number of dumps handed out
+  unsigned int pending;         // Writer threads still writing the dump
+  int stop;                     // Non-zero once the threads should exit
+  int error;                    // Non-zero if buffers could not be allocated
+  ant_writer_t writers[MAX_ANT_WRITERS];
+};
+
+static int start_ant_writers(callback_data_t * cb_data);
+
+// Formats the name of an output file of output product `output_idx` into
+// `fname` (which must hold PATH_MAX+1 chars).  `kind` is inserted before the
+// file extension (e.g. "sk." gives STEM.rawspec.NNNN.sk.fil), which is that
+// of the output format unless `ext` is given.
+static void output_file_name(char * fname, callback_data_t *cb_data, const char * dest, const char *stem, int output_idx, const char * kind, const char * ext)
 {
-  int fd;
   const char * basename;
-  char fname[PATH_MAX+1];
   char fileext[4] = {'\0'};
-  int retcode;
 
-  // If dest is given and it's not empty
-  if(cb_data->flag_fbh5_output)
+  if(ext)
+      snprintf(fileext, sizeof(fileext), "%s", ext);
+  else if(cb_data->flag_fbh5_output)
       strcpy(fileext, "h5");
   else
       strcpy(fileext, "fil");
+  // If dest is given and it's not empty
   if(dest && dest[0]) {
     // Look for last '/' in stem
     basename = strrchr(stem, '/');
@@ -35,21 +73,34 @@ int open_output_file(callback_data_t *cb_data, const char * dest, const char *st
       // If not found, use stem as basename
       basename = stem;
     }
-    snprintf(fname, PATH_MAX, "%s/%s.rawspec.%04d.%s", dest, basename, output_idx, fileext);
+    snprintf(fname, PATH_MAX, "%s/%s.rawspec.%04d.%s%s", dest, basename, output_idx, kind, fileext);
   } else {
-    snprintf(fname, PATH_MAX, "%s.rawspec.%04d.%s", stem, output_idx, fileext);
+    snprintf(fname, PATH_MAX, "%s.rawspec.%04d.%s%s", stem, output_idx, kind, fileext);
   }
   fname[PATH_MAX] = '\0';
+}
+
+// Open a single Filterbank file for one of the following:
+//   * nants = 0
+//   * a single antenna of a set
+//   * ICS
+int open_output_file(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx, int antenna_index)
+{
+  int fd;
+  char fname[PATH_MAX+1];
+  int retcode;
+
+  output_file_name(fname, cb_data, dest, stem, output_idx, "", NULL);
   if(cb_data->flag_fbh5_output) {
       // Open an FBH5 output file.
       // If antenna_index < 0, then use the ICS context;
       // Else, use the indicated antenna context.
       if(antenna_index < 0)
           cb_data->exit_soon = fbh5_open(&(cb_data->fbh5_ctx_ics), &(cb_data->fb_hdr), 
-                                         cb_data->Nds, fname, cb_data->debug_callback);
+                                         cb_data->Nds, cb_data->est_ntints, cb_data->quant, fname, cb_data->debug_callback);
       else
           cb_data->exit_soon = fbh5_open(&(cb_data->fbh5_ctx_ant[antenna_index]), &(cb_data->fb_hdr),
-                                         cb_data->Nds, fname, cb_data->debug_callback);
+                                         cb_data->Nds, cb_data->est_ntints, cb_data->quant, fname, cb_data->debug_callback);
       if(cb_data->exit_soon != 0)
           return -1;  // Indicate that fbh5_open failed.
       if(cb_data->debug_callback)
@@ -57,6 +108,17 @@ int open_output_file(callback_data_t *cb_data, const char * dest, const char *st
       return ENABLER_FD_FOR_FBH5;
   }
 
+  if(cb_data->flag_direct_io) {
+      // Open a SIGPROC Filterbank output file for direct I/O and write its
+      // header.
+      fd = rawspec_dio_open(antenna_index < 0 ? &(cb_data->dio_ics)
+                                              : &(cb_data->dio_ant[antenna_index]),
+                            fname, &(cb_data->fb_hdr), cb_data->Nds);
+      if(fd == -1)
+          cb_data->exit_soon = 1;
+      return fd;
+  }
+
   // Open a SIGPROC Filterbank output file.
   fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
   if(fd == -1) {
@@ -77,7 +139,8 @@ int open_output_file_per_antenna_and_write_header(callback_data_t *cb_data, cons
     
   for(int i = 0; i < (cb_data->per_ant_out ? cb_data->Nant : 1); i++) {
     if(cb_data->per_ant_out) {
-      snprintf(ant_stem, PATH_MAX, "%s-ant%03d", stem, i);
+      snprintf(ant_stem, PATH_MAX, "%s-ant%03d", stem,
+               cb_data->ants ? cb_data->ants[i] : i);
     }
     else {
       snprintf(ant_stem, PATH_MAX, "%s", stem);
@@ -93,19 +156,445 @@ int open_output_file_per_antenna_and_write_header(callback_data_t *cb_data, cons
     }
 
     // Write filterbank header to output file if SIGPROC.
-    if(! cb_data->flag_fbh5_output)
+    // If direct I/O, the header was already written by rawspec_dio_open().
+    if(! cb_data->flag_fbh5_output && ! cb_data->flag_direct_io)
         fb_fd_write_header(cb_data->fd[i], &cb_data->fb_hdr);
   }
+
+  // Start the threads that write the antenna files of each dump
+  if(cb_data->per_ant_out && cb_data->Nant > 1 && !cb_data->ant_writers
+  && start_ant_writers(cb_data) != 0) {
+    cb_data->exit_soon = 1;
+    return 1;
+  }
+  return 0;
+}
+
+// Open an auxiliary output file of an output product (STEM.rawspec.NNNN.KIND
+// followed by fil or h5, see output_file_name) and write its header
+// (aux->fb_hdr).  Auxiliary output is always 32-bit floats.  Returns 0 on
+// success, non-zero on error.
+static int open_aux_output_file(callback_data_t *cb_data, rawspec_aux_file_t *aux, const char * dest, const char *stem, int output_idx, const char * kind)
+{
+  char fname[PATH_MAX+1];
+
+  output_file_name(fname, cb_data, dest, stem, output_idx, kind, NULL);
+  if(cb_data->flag_fbh5_output) {
+      if(fbh5_open(&(aux->fbh5_ctx), &(aux->fb_hdr),
+                   cb_data->Nds, cb_data->est_ntints, FBH5_QUANT_F32, fname,
+                   cb_data->debug_callback) != 0) {
+          cb_data->exit_soon = 1;
+          return 1;
+      }
+      aux->fd = ENABLER_FD_FOR_FBH5;
+  } else if(cb_data->flag_direct_io) {
+      aux->fd = rawspec_dio_open(&(aux->dio), fname, &(aux->fb_hdr),
+                                 cb_data->Nds);
+  } else {
+      aux->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+      if(aux->fd == -1) {
+        perror(fname);
+      } else {
+        posix_fadvise(aux->fd, 0, 0, POSIX_FADV_DONTNEED);
+        fb_fd_write_header(aux->fd, &aux->fb_hdr);
+      }
+  }
+  if(aux->fd == -1) {
+    cb_data->exit_soon = 1;
+    return 1;
+  }
+  return 0;
+}
+
+// Open the spectral kurtosis output file of an output product
+// (STEM.rawspec.NNNN.sk.fil or .sk.h5) and write its header, which is the same
+// as the power's.  Returns 0 on success, non-zero on error.
+int open_sk_output_file_and_write_header(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx)
+{
+  cb_data->sk_file.fb_hdr = cb_data->fb_hdr;
+  return open_aux_output_file(cb_data, &cb_data->sk_file, dest, stem, output_idx, "sk.");
+}
+
+// Open the flagged fraction output file of an output product with RFI
+// excision (STEM.rawspec.NNNN.flags.fil or .flags.h5) and write its header.
+// It has one channel per coarse channel, centered on the coarse channel, and
+// the same spectra (in time) as the power.  Returns 0 on success, non-zero on
+// error.
+int open_flags_output_file_and_write_header(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx)
+{
+  fb_hdr_t * hdr = &cb_data->flags_file.fb_hdr;
+
+  *hdr = cb_data->fb_hdr;
+  hdr->fch1 += (hdr->nfpc / 2) * hdr->foff;
+  hdr->foff *= hdr->nfpc;
+  hdr->nchans /= hdr->nfpc;
+  hdr->nfpc = 1;
+  hdr->nifs = 1;
+  return open_aux_output_file(cb_data, &cb_data->flags_file, dest, stem, output_idx, "flags.");
+}
+
+// Open the hits file of an output product with hit detection
+// (STEM.rawspec.NNNN.hits.csv, see rawspec_hits.h).  Returns 0 on success,
+// non-zero on error.
+int open_hits_output_file(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx)
+{
+  char fname[PATH_MAX+1];
+
+  output_file_name(fname, cb_data, dest, stem, output_idx, "hits.", "csv");
+  if(rawspec_hits_open(&cb_data->hits, fname, &cb_data->fb_hdr) != 0) {
+    cb_data->exit_soon = 1;
+    return 1;
+  }
+  return 0;
+}
+
+// Close an auxiliary output file (if open).  Returns 0 on success, non-zero
+// on error.
+static int close_aux_output_file(callback_data_t *cb_data, rawspec_aux_file_t *aux, const char * kind)
+{
+  int retcode = 0;
+
+  if(aux->fd == -1) {
+    return 0;
+  }
+  if(cb_data->flag_fbh5_output) {
+      retcode = fbh5_close(&(aux->fbh5_ctx), cb_data->debug_callback);
+  } else if(cb_data->flag_direct_io) {
+      retcode = rawspec_dio_close(&(aux->dio));
+  } else {
+      retcode = close(aux->fd);
+  }
+  if(retcode != 0 && !cb_data->flag_fbh5_output) {
+    fprintf(stderr, "SIGPROC-CLOSE-ERROR %s\n", kind);
+  }
+  aux->fd = -1;
+  return retcode != 0;
+}
+
+// Close the auxiliary output files and hits file of an output product (if
+// open).  Returns 0 on success, non-zero on error.
+int close_aux_output_files(callback_data_t *cb_data)
+{
+  int retcode = 0;
+
+  retcode |= close_aux_output_file(cb_data, &cb_data->sk_file, "sk");
+  retcode |= close_aux_output_file(cb_data, &cb_data->flags_file, "flags");
+  retcode |= rawspec_hits_close(&cb_data->hits) != 0;
+  return retcode;
+}
+
+// Write `size` bytes of `buf` (one dump) to an auxiliary output file (if
+// open), along with the valid fractions if FBH5.  Returns 0 on success,
+// non-zero on error.
+static int write_aux_output_file(callback_data_t *cb_data, rawspec_aux_file_t *aux, float * buf, size_t size)
+{
+  int retcode = 0;
+
+  if(aux->fd == -1 || !buf) {
+    return 0;
+  }
+  if(cb_data->flag_fbh5_output) {
+      retcode = fbh5_write(&(aux->fbh5_ctx),
+                 &(aux->fb_hdr),
+                 buf,
+                 size,
+                 cb_data->debug_callback);
+      if(retcode == 0 && cb_data->h_validfrac) {
+          retcode = fbh5_write_valid_frac(&(aux->fbh5_ctx),
+                     cb_data->h_validfrac,
+                     cb_data->Nds,
+                     cb_data->debug_callback);
+      }
+  } else if(cb_data->flag_direct_io) { // SIGPROC Filterbank, direct I/O
+      if(rawspec_dio_write(&(aux->dio), buf, size) != 0) {
+          fprintf(stderr, "SIGPROC-WRITE-ERROR\n");
+          retcode = 1;
+      }
+  } else { // SIGPROC Filterbank
+      if(write(aux->fd, buf, size) < 0) {
+          fprintf(stderr, "SIGPROC-WRITE-ERROR\n");
+          retcode = 1;
+      }
+  }
+  return retcode;
+}
+
+// Writes all `iovcnt` buffers of `iov` to `fd`, batching them into calls of
+// at most IOV_MAX buffers and resuming after partial writes.  Modifies `iov`.
+// Returns 0 on success, -1 on error.
+static int writev_fully(int fd, struct iovec * iov, int iovcnt)
+{
+  ssize_t n;
+
+  while(iovcnt > 0) {
+    n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    // Skip fully written buffers and advance into a partially written one
+    while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+// Writes the output files of the antennas assigned to writer `w` for the
+// current dump.  In the power buffer, each of the Nds spectra holds nifs
+// polarization products, each of which holds the fine channels of all Nant
+// antennas.  The Nds*nifs pieces belonging to an antenna are gathered into a
+// single writev() for SIGPROC output or into a staging buffer for a single
+// fbh5_write().
+static void write_ant_share(ant_writer_t * w)
+{
+  callback_data_t * cb_data = w->cb_data;
+  size_t spectra_stride = cb_data->h_pwrbuf_size / (cb_data->Nds * sizeof(float));
+  size_t pol_stride = spectra_stride / cb_data->fb_hdr.nifs;
+  size_t ant_stride = pol_stride / cb_data->Nant;
+  size_t npieces = (size_t)cb_data->Nds * cb_data->fb_hdr.nifs;
+  size_t i, j, k, n;
+
+  w->retcode = 0;
+  for(i = w->first; i < w->nants; i += w->step) {
+    if(cb_data->debug_callback)
+        printf("dump_file_thread_func: write for antenna %ld\n", i);
+    for(n = 0, k = 0; k < cb_data->Nds; k++) {// Spectra out
+      for(j = 0; j < cb_data->fb_hdr.nifs; j++, n++) {// Npolout
+        float * piece = cb_data->h_pwrbuf + i * ant_stride + j * pol_stride + k * spectra_stride;
+        if(w->stage) {
+          memcpy(w->stage + n * ant_stride, piece, ant_stride * sizeof(float));
+        } else if(cb_data->flag_direct_io) {
+          // Direct I/O gathers the pieces in its staging buffers
+          if(rawspec_dio_write(&(cb_data->dio_ant[i]), piece,
+                               ant_stride * sizeof(float)) != 0) {
+            fprintf(stderr, "SIGPROC-WRITE-ERROR\n");
+            w->retcode = -1;
+          }
+        } else {
+          w->iov[n].iov_base = piece;
+          w->iov[n].iov_len = ant_stride * sizeof(float);
+        }
+      }
+    }
+
+    if(cb_data->flag_fbh5_output) {
+        if(fbh5_write(&(cb_data->fbh5_ctx_ant[i]),
+                      &(cb_data->fb_hdr),
+                      w->stage,
+                      npieces * ant_stride * sizeof(float),
+                      cb_data->debug_callback) != 0) {
+            w->retcode = -1;
+        }
+        // Valid sample fractions are the same for all antennas
+        else if(cb_data->h_validfrac &&
+                fbh5_write_valid_frac(&(cb_data->fbh5_ctx_ant[i]),
+                                      cb_data->h_validfrac,
+                                      cb_data->Nds,
+                                      cb_data->debug_callback) != 0) {
+            w->retcode = -1;
+        }
+    } else if(!cb_data->flag_direct_io) { // SIGPROC Filterbank
+        if(writev_fully(cb_data->fd[i], w->iov, npieces) != 0) {
+          fprintf(stderr, "SIGPROC-WRITE-ERROR\n");
+          w->retcode = -1;
+        }
+    } // if(cb_data->flag_fbh5_output)
+  }
+}
+
+// Writer thread function.  Writes the share of `arg` (an ant_writer_t) of each
+// dump handed out by write_per_antenna() until the writers are stopped.
+static void * ant_writer_thread_func(void * arg)
+{
+  ant_writer_t * w = (ant_writer_t *)arg;
+  ant_writers_t * pool = w->pool;
+  unsigned int dump;
+
+  pthread_mutex_lock(&pool->mutex);
+  dump = pool->dump;
+  for(;;) {
+    while(!pool->stop && pool->dump == dump) {
+      pthread_cond_wait(&pool->cond_work, &pool->mutex);
+    }
+    if(pool->stop) {
+      break;
+    }
+    dump = pool->dump;
+    pthread_mutex_unlock(&pool->mutex);
+
+    write_ant_share(w);
+
+    pthread_mutex_lock(&pool->mutex);
+    if(--pool->pending == 0) {
+      pthread_cond_signal(&pool->cond_done);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+// Stops the per-antenna writer threads of an output product (if any) and frees
+// their buffers.  The output thread must not be writing a dump.
+void stop_ant_writers(callback_data_t * cb_data)
+{
+  ant_writers_t * pool = cb_data->ant_writers;
+  unsigned int i;
+  int rc;
+
+  if(!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond_work);
+  pthread_mutex_unlock(&pool->mutex);
+  for(i = 1; i < pool->nwriters; i++) {
+    if((rc=pthread_join(pool->writers[i].thread, NULL))) {
+      fprintf(stderr, "pthread_join: %s\n", strerror(rc));
+    }
+  }
+
+  for(i = 0; i < pool->nwriters; i++) {
+    free(pool->writers[i].stage);
+    free(pool->writers[i].iov);
+  }
+  pthread_cond_destroy(&pool->cond_done);
+  pthread_cond_destroy(&pool->cond_work);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+  cb_data->ant_writers = NULL;
+}
+
+// Starts up to MAX_ANT_WRITERS-1 threads that, along with the output thread,
+// write the per-antenna output files of each dump.  FBH5 files are written by
+// the output thread alone unless the HDF5 library is thread-safe.  The gather
+// buffers of each writer are allocated here once rather than for every dump.
+// Returns 0 on success, -1 on error.
+static int start_ant_writers(callback_data_t * cb_data)
+{
+  ant_writers_t * pool;
+  ant_writer_t * w;
+  size_t spectra_stride = cb_data->h_pwrbuf_size / (cb_data->Nds * sizeof(float));
+  size_t ant_stride = spectra_stride / cb_data->fb_hdr.nifs / cb_data->Nant;
+  size_t npieces = (size_t)cb_data->Nds * cb_data->fb_hdr.nifs;
+  unsigned int nants;
+  unsigned int nwriters;
+  unsigned int i;
+  hbool_t threadsafe = 0;
+  int rc;
+
+  pool = calloc(1, sizeof(ant_writers_t));
+  if(!pool) {
+    fprintf(stderr, "cannot allocate per-antenna writers\n");
+    return -1;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond_work, NULL);
+  pthread_cond_init(&pool->cond_done, NULL);
+  cb_data->ant_writers = pool;
+
+  // Antennas after the first without an output file aren't valid
+  for(nants = 0; nants < cb_data->Nant && cb_data->fd[nants] != -1; nants++);
+
+  nwriters = nants < MAX_ANT_WRITERS ? nants : MAX_ANT_WRITERS;
+  if(nwriters < 1 || (cb_data->flag_fbh5_output
+  && (H5is_library_threadsafe(&threadsafe) < 0 || !threadsafe))) {
+    nwriters = 1;
+  }
+
+  // Start writer threads (writer 0 is the output thread itself).  If a thread
+  // cannot be started, the antennas are spread over those that were.
+  pool->nwriters = 1;
+  pool->writers[0].pool = pool;
+  for(i = 1; i < nwriters; i++) {
+    pool->writers[i].pool = pool;
+    if((rc=pthread_create(&pool->writers[i].thread, NULL,
+                          ant_writer_thread_func, &pool->writers[i]))) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      break;
+    }
+    pool->nwriters++;
+  }
+
+  // The threads only look at their assignments once a dump is handed out
+  pthread_mutex_lock(&pool->mutex);
+  for(i = 0; i < pool->nwriters; i++) {
+    w = &pool->writers[i];
+    w->cb_data = cb_data;
+    w->first = i;
+    w->step = pool->nwriters;
+    w->nants = nants;
+    if(cb_data->flag_fbh5_output) {
+      w->stage = malloc(npieces * ant_stride * sizeof(float));
+    } else if(!cb_data->flag_direct_io) {
+      w->iov = malloc(npieces * sizeof(struct iovec));
+    }
+    if(!w->stage && !w->iov && !cb_data->flag_direct_io) {
+      pool->error = 1;
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if(pool->error) {
+    fprintf(stderr, "cannot allocate per-antenna output buffers\n");
+    stop_ant_writers(cb_data);
+    return -1;
+  }
   return 0;
 }
 
+// Writes the per-antenna output files of a dump, handing each writer thread its
+// share of the antennas and writing the first share on this thread.  Returns 0
+// on success, -1 on error.
+static int write_per_antenna(callback_data_t * cb_data)
+{
+  ant_writers_t * pool = cb_data->ant_writers;
+  unsigned int i;
+  int retcode = 0;
+
+  if(!pool) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->pending = pool->nwriters - 1;
+  pool->dump++;
+  pthread_cond_broadcast(&pool->cond_work);
+  pthread_mutex_unlock(&pool->mutex);
+
+  write_ant_share(&pool->writers[0]);
+
+  pthread_mutex_lock(&pool->mutex);
+  while(pool->pending > 0) {
+    pthread_cond_wait(&pool->cond_done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  for(i = 0; i < pool->nwriters; i++) {
+    if(pool->writers[i].retcode != 0) {
+      retcode = -1;
+    }
+  }
+  return retcode;
+}
+
 void * dump_file_thread_func(void *arg)
 {
   callback_data_t * cb_data = (callback_data_t *)arg;
   int retcode;
 
-  // Single antenna case
-  if(cb_data->fd && cb_data->h_pwrbuf && (cb_data->Nant == 1)) {
+  // Single antenna case (the power is not output if only hits are)
+  if(cb_data->fd && cb_data->fd[0] != -1 && cb_data->h_pwrbuf && (cb_data->Nant == 1)) {
       if(cb_data->debug_callback)
         printf("dump_file_thread_func: write for nants=0\n");
       if(cb_data->flag_fbh5_output) {
@@ -114,10 +603,24 @@ void * dump_file_thread_func(void *arg)
                    cb_data->h_pwrbuf, 
                    cb_data->h_pwrbuf_size,
                    cb_data->debug_callback);
+        if(retcode == 0 && cb_data->h_validfrac) {
+            retcode = fbh5_write_valid_frac(&(cb_data->fbh5_ctx_ant[0]),
+                       cb_data->h_validfrac,
+                       cb_data->Nds,
+                       cb_data->debug_callback);
+        }
         if(retcode != 0) {
             cb_data->exit_soon = 1;
             cb_data->output_thread_valid = 0;
         }
+      } else if(cb_data->flag_direct_io) { // SIGPROC Filterbank, direct I/O
+        if(rawspec_dio_write(&(cb_data->dio_ant[0]),
+              cb_data->h_pwrbuf,
+              cb_data->h_pwrbuf_size) != 0) {
+            cb_data->exit_soon = 1;
+            cb_data->output_thread_valid = 0;
+            fprintf(stderr, "SIGPROC-WRITE-ERROR\n");
+        }
       } else { // SIGPROC Filterbank
         if(write(cb_data->fd[0], 
               cb_data->h_pwrbuf, 
@@ -130,43 +633,12 @@ void * dump_file_thread_func(void *arg)
   }
 
   // Multiple antennas, split output
-  if(cb_data->fd && cb_data->h_pwrbuf && (cb_data->Nant > 1)) {
+  if(cb_data->fd && cb_data->fd[0] != -1 && cb_data->h_pwrbuf && (cb_data->Nant > 1)) {
     if(cb_data->per_ant_out) {
-      size_t spectra_stride = cb_data->h_pwrbuf_size / (cb_data->Nds * sizeof(float));
-      size_t pol_stride = spectra_stride / cb_data->fb_hdr.nifs;
-      size_t ant_stride = pol_stride / cb_data->Nant;
-
-      for(size_t k = 0; k < cb_data->Nds; k++){// Spectra out
-        for(size_t j = 0; j < cb_data->fb_hdr.nifs; j++){// Npolout
-          for(size_t i = 0; i < cb_data->Nant; i++){ 
-            if(cb_data->fd[i] == -1){
-              // Assume that the following file-descriptors aren't valid
-              break;
-            }
-            if(cb_data->debug_callback)
-                printf("dump_file_thread_func: write for antenna %ld-%ld-%ld\n", k, j, i);
-            if(cb_data->flag_fbh5_output) {
-                retcode = fbh5_write(&(cb_data->fbh5_ctx_ant[i]),
-                           &(cb_data->fb_hdr), 
-                           cb_data->h_pwrbuf + i * ant_stride + j * pol_stride + k * spectra_stride, 
-                           ant_stride * sizeof(float),
-                           cb_data->debug_callback);
-                if(retcode != 0) {
-                    cb_data->exit_soon = 1;
-                    cb_data->output_thread_valid = 0;
-                }
-            } else { // SIGPROC Filterbank
-                if(write(cb_data->fd[i], 
-                      cb_data->h_pwrbuf + i * ant_stride + j * pol_stride + k * spectra_stride, 
-                      ant_stride * sizeof(float)) < 0) {
-                  cb_data->exit_soon = 1;
-                  cb_data->output_thread_valid = 0;
-                  fprintf(stderr, "SIGPROC-WRITE-ERROR\n");
-                }
-            } // if(cb_data->flag_fbh5_output)
-          } // for(size_t i = 0; i < cb_data->Nant; i++)
-        } // for(size_t j = 0; j < cb_data->fb_hdr.nifs; j++)
-      } // for(size_t k = 0; k < cb_data->Nds; k++)
+      if(write_per_antenna(cb_data) != 0) {
+        cb_data->exit_soon = 1;
+        cb_data->output_thread_valid = 0;
+      }
     } // if(cb_data->per_ant_out)
   } // if(cb_data->fd && cb_data->h_pwrbuf)
 
@@ -180,10 +652,24 @@ void * dump_file_thread_func(void *arg)
                    cb_data->h_icsbuf,
                    cb_data->h_pwrbuf_size/cb_data->Nant,
                    cb_data->debug_callback);
+        if(retcode == 0 && cb_data->h_validfrac) {
+            retcode = fbh5_write_valid_frac(&(cb_data->fbh5_ctx_ics),
+                       cb_data->h_validfrac,
+                       cb_data->Nds,
+                       cb_data->debug_callback);
+        }
         if(retcode != 0) {
             cb_data->exit_soon = 1;
             cb_data->output_thread_valid = 0;
         }
+    } else if(cb_data->flag_direct_io) { // SIGPROC Filterbank, direct I/O
+        if(rawspec_dio_write(&(cb_data->dio_ics),
+              cb_data->h_icsbuf,
+              cb_data->h_pwrbuf_size/cb_data->Nant) != 0) {
+            cb_data->exit_soon = 1;
+            cb_data->output_thread_valid = 0;
+            fprintf(stderr, "SIGPROC-WRITE-ERROR\n");
+        }
     } else { // SIGPROC Filterbank
         if(write(cb_data->fd_ics, 
               cb_data->h_icsbuf, 
@@ -195,8 +681,32 @@ void * dump_file_thread_func(void *arg)
     }
   }
 
+  // Spectral kurtosis output (same layout as the power) and flagged fraction
+  // output (one value per coarse channel per spectrum)
+  if(cb_data->debug_callback && (cb_data->sk_file.fd != -1 || cb_data->flags_file.fd != -1))
+      printf("dump_file_thread_func: write for SK/flags\n");
+  if(write_aux_output_file(cb_data, &cb_data->sk_file,
+                           cb_data->h_skbuf, cb_data->h_pwrbuf_size) != 0
+  || write_aux_output_file(cb_data, &cb_data->flags_file,
+                           cb_data->h_flagfrac,
+                           cb_data->Nds * (cb_data->Nf / cb_data->fb_hdr.nfpc) * sizeof(float)) != 0) {
+    cb_data->exit_soon = 1;
+    cb_data->output_thread_valid = 0;
+  }
+
+  // Narrowband hits
+  if(cb_data->hits.fp && cb_data->h_pwrbuf) {
+    if(rawspec_hits_find(&cb_data->hits, &cb_data->fb_hdr, cb_data->h_pwrbuf,
+                         cb_data->Nds, cb_data->Nant, cb_data->ants,
+                         cb_data->stem_spectra) != 0) {
+      cb_data->exit_soon = 1;
+      cb_data->output_thread_valid = 0;
+    }
+  }
+
   // Increment total spectra counter for this output product
   cb_data->total_spectra += cb_data->Nds;
+  cb_data->stem_spectra += cb_data->Nds;
 
   return NULL;
 }
@@ -12,6 +12,16 @@ int open_output_file(callback_data_t *cb_data, const char * dest, const char *st
 
 int open_output_file_per_antenna_and_write_header(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx);
 
+int open_sk_output_file_and_write_header(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx);
+
+int open_flags_output_file_and_write_header(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx);
+
+int open_hits_output_file(callback_data_t *cb_data, const char * dest, const char *stem, int output_idx);
+
+int close_aux_output_files(callback_data_t *cb_data);
+
+void stop_ant_writers(callback_data_t *cb_data);
+
 void dump_file_callback(rawspec_context * ctx, int output_product, int callback_type);
 
 #ifdef __cplusplus
@@ -8,6 +8,8 @@
 #include <cufftXt.h>
 #include "cufft_error_name.h"
 
+#include <string.h>
+
 #define NO_PLAN   ((cufftHandle)-1)
 #define NO_STREAM ((cudaStream_t)-1)
 
@@ -15,6 +17,7 @@
 #define LOAD_TEXTURE_WIDTH_MASK (unsigned int)((1<<LOAD_TEXTURE_WIDTH_POWER)-1)
 
 #define MIN(a,b) ((a < b) ? (a) : (b))
+#define MAX(a,b) ((a > b) ? (a) : (b))
 
 #define PRINT_CUDA_ERRMSG(error)             \
   fprintf(stderr, "got error %s at %s:%d\n", \
@@ -59,6 +62,10 @@ typedef struct {
 // buffer, accumulates the complex pol0-pol1 power in the third (real) and
 // fourth (imaginary) quarters of the 4x-sized power buffer.
 //
+// For total-power-only mode with spectral kurtosis, the store_callback_sk
+// function accumulates the power into the first power buffer, as
+// store_callback does, and the square of the power into the second one.
+//
 // We use a "store_cb_data_t" structure to pass device pointers to the
 // various buffers involved.
 typedef struct {
@@ -67,8 +74,18 @@ typedef struct {
   float * pwr_buf_p11_q;
   float * pwr_buf_p01_re_u;
   float * pwr_buf_p01_im_v;
+  float * pwr_sq_buf;
 } store_cb_data_t;
 
+// The load_callback needs the FFT input buffer (to compute offsets) and the
+// texture object bound to it.  These are per-context (rather than global
+// __device__ variables) so that multiple contexts can coexist in one process,
+// so we use a "load_cb_data_t" structure to pass them to the callback.
+typedef struct {
+  char * fft_in;
+  cudaTextureObject_t tex_obj;
+} load_cb_data_t;
+
 // GPU context structure
 typedef struct {
   // Device pointer to FFT input buffer
@@ -81,6 +98,10 @@ typedef struct {
   cufftComplex * d_fft_out;
   // Array of device pointers to power buffers (sized for Nbc)
   float * d_pwr_out[MAX_OUTPUTS];
+  // Array of numbers of Nb*Ntpb*Nbc sized planes in the power buffers: one per
+  // output polarization value, plus one for the sum of squared power if
+  // ctx->sk[i] is set
+  unsigned int Npwr[MAX_OUTPUTS];
   // Array of device pointers to power buffers (sized for Nc if Ni > 1)
   float * d_prev_pwr_out_cache[MAX_OUTPUTS];
   // Array of device pointers to incoherent-sum buffers
@@ -92,6 +113,8 @@ typedef struct {
   // Array of device pointers to store_cb_data_t structures
   // (one per output product)
   store_cb_data_t *d_scb_data[MAX_OUTPUTS];
+  // Device pointer to load_cb_data_t structure (shared by all plans)
+  load_cb_data_t *d_lcb_data;
   // Device pointer to work area (shared by all plans!)
   void * d_work_area;
   // Size of work area
@@ -106,6 +129,30 @@ typedef struct {
   int nthreads[MAX_OUTPUTS];
   // Array of Ni values (number of input buffers per dump)
   unsigned int Nis[MAX_OUTPUTS];
+  // Validity flags of the Nb blocks in the GPU input buffer
+  char * blkvalid;
+  // Array of per output product counts of valid time samples in each of the
+  // Nd spectra of the next dump
+  size_t * valid_samples[MAX_OUTPUTS];
+  // Array of per output product valid fractions of the Nd spectra of the
+  // next dump (copied to h_validfrac before the post-dump callback)
+  float * pending_validfrac[MAX_OUTPUTS];
+  // Array of device pointers to the valid fractions of the Nd spectra of the
+  // next dump (only for output products with spectral kurtosis or RFI
+  // excision)
+  float * d_validfrac[MAX_OUTPUTS];
+  // Arrays of device pointers to the per coarse channel (i.e. Nc) RFI
+  // excision reference powers and the sums and counts of the powers of the
+  // unflagged FFT spectra of the current input buffer (only for output
+  // products with RFI excision)
+  float * d_rfi_ref[MAX_OUTPUTS];
+  float * d_rfi_sum[MAX_OUTPUTS];
+  unsigned int * d_rfi_cnt[MAX_OUTPUTS];
+  // Arrays of device and host pointers to the per coarse channel counts of
+  // flagged FFT spectra of the Nd spectra of the next dump, i.e. Nd*Nc counts
+  // (only for output products with RFI excision)
+  unsigned int * d_nflagged[MAX_OUTPUTS];
+  unsigned int * h_nflagged[MAX_OUTPUTS];
   // A count of the number of input buffers processed
   unsigned int inbuf_count;
   // Array of dump_cb_data_t structures for dump callback
@@ -124,10 +171,6 @@ typedef struct {
   size_t guppi_channel_stride;
 } rawspec_gpu_context;
 
-// Device-side texture object declaration
-__device__ cudaTextureObject_t d_tex_obj;
-__device__ cudaTextureObject_t d_comp4_exp_tex_obj;
-
 // The load_callback gets the input value through the texture memory to achieve
 // a "for free" mapping of 8-bit integer values into 32-bit float values.
 __device__ cufftComplex load_callback(void *p_v_in,
@@ -136,12 +179,14 @@ __device__ cufftComplex load_callback(void *p_v_in,
                                       void *p_v_shared)
 {
   cufftComplex c;
+  load_cb_data_t * d_lcb_data = (load_cb_data_t *)p_v_user;
+  cudaTextureObject_t d_tex_obj = d_lcb_data->tex_obj;
   // p_v_in is input buffer (cast to cufftComplex*) plus polarization offset.
-  // p_v_user is input buffer.  offset is complex element offset from start of
-  // input buffer, but does not include any polarization offset so we compute
-  // the polarization offset by subtracting p_v_user from p_v_in and add it to
-  // offset.
-  offset += (cufftComplex *)p_v_in - (cufftComplex *)p_v_user;
+  // d_lcb_data->fft_in is input buffer.  offset is complex element offset from
+  // start of input buffer, but does not include any polarization offset so we
+  // compute the polarization offset by subtracting d_lcb_data->fft_in from
+  // p_v_in and add it to offset.
+  offset += (cufftComplex *)p_v_in - (cufftComplex *)d_lcb_data->fft_in;
   c.x = tex2D<float>(d_tex_obj, ((2*offset  ) & LOAD_TEXTURE_WIDTH_MASK), ((  offset  ) >> (LOAD_TEXTURE_WIDTH_POWER-1)));
   c.y = tex2D<float>(d_tex_obj, ((2*offset+1) & LOAD_TEXTURE_WIDTH_MASK), ((2*offset+1) >> LOAD_TEXTURE_WIDTH_POWER));
   return c;
@@ -160,6 +205,21 @@ __device__ void store_callback(void *p_v_out,
   ((float *)p_v_user)[offset] += pwr;
 }
 
+// For total-power-only mode with spectral kurtosis, the store_callback_sk
+// function also accumulates the squared power, which is needed to compute
+// the spectral kurtosis when the power is dumped.
+__device__ void store_callback_sk(void *p_v_out,
+                                  size_t offset,
+                                  cufftComplex element,
+                                  void *p_v_user,
+                                  void *p_v_shared)
+{
+  store_cb_data_t * d_scb_data = (store_cb_data_t *)p_v_user;
+  float pwr = element.x * element.x + element.y * element.y;
+  d_scb_data->pwr_buf_p00_i[offset] += pwr;
+  d_scb_data->pwr_sq_buf[offset] += pwr * pwr;
+}
+
 // For full-Stokes mode, the store_callback_pol0_iquv function stores the
 // voltage data into the first half of the 2x-sized FFT output buffer and
 // accummulates (i.e. adds) the pol0 power into the first two quarters (I and
@@ -268,6 +328,7 @@ __device__ void store_callback_pol1_conj(void *p_v_out,
 
 __device__ cufftCallbackLoadC d_cufft_load_callback = load_callback;
 __device__ cufftCallbackStoreC d_cufft_store_callback = store_callback;
+__device__ cufftCallbackStoreC d_cufft_store_callback_sk = store_callback_sk;
 __device__ cufftCallbackStoreC d_cufft_store_callback_pol0 = store_callback_pol0;
 __device__ cufftCallbackStoreC d_cufft_store_callback_pol1 = store_callback_pol1;
 __device__ cufftCallbackStoreC d_cufft_store_callback_pol1_conj = store_callback_pol1_conj;
@@ -317,6 +378,192 @@ __global__ void accumulate(float * pwr_buf, unsigned int Na, size_t xpitch, size
   pwr_buf[offset0] = sum;
 }
 
+// Spectral kurtosis kernel
+// Replaces the integrated squared power (S2) of each fine channel of the Nd
+// spectra of a dump with the generalized spectral kurtosis estimator
+// (Nita & Gary 2010):
+//
+//   SK = (M+1)/(M-1) * (M*S2/S1^2 - 1)
+//
+// where S1 is the integrated power and M is the number of power values that
+// were integrated, i.e. Np times Na times the spectrum's valid fraction
+// (missing blocks contribute zeros to S1 and S2) less Np times the number of
+// flagged FFT spectra of the coarse channel (nflagged is NULL if RFI
+// excision is not enabled).  Uses the same grid as the accumulate kernel.
+__global__ void spectral_kurtosis(float * pwr_buf, float * pwr_sq_buf,
+                                  float * validfrac,
+                                  unsigned int * nflagged, size_t Nc,
+                                  unsigned int Np, unsigned int Na,
+                                  unsigned int Nt, size_t ypitch, size_t zpitch)
+{
+  const unsigned int fine_chan_idx = blockIdx.x * MAX_THREADS + threadIdx.x;
+
+  if(fine_chan_idx >= Nt) {
+    return;
+  }
+
+  const off_t offset = blockIdx.z * zpitch
+                     + blockIdx.y * ypitch
+                     + fine_chan_idx;
+
+  float N = Na * validfrac[blockIdx.y];
+  if(nflagged) {
+    N -= nflagged[blockIdx.y * Nc + blockIdx.z];
+  }
+  const float M = Np * N;
+  const float s1 = pwr_buf[offset];
+  const float s2 = pwr_sq_buf[offset];
+
+  pwr_sq_buf[offset] = (M > 1.0f && s1 > 0.0f)
+                     ? (M + 1.0f) / (M - 1.0f) * (M * s2 / (s1 * s1) - 1.0f)
+                     : 0.0f;
+}
+
+// Number of unflagged FFT spectra over which the RFI excision reference power
+// of a coarse channel is (roughly) averaged
+#define RFI_REF_FRAMES (64)
+
+// RFI excision kernel
+// Used instead of the store callbacks for output products with RFI excision.
+// Each block handles one FFT spectrum (blockIdx.x) of one coarse channel of
+// the batch (blockIdx.y).  The total power of the FFT spectrum (over all Nt
+// fine channels and Np polarizations of the FFT output buffers) is compared
+// with thresh times the coarse channel's reference power.  The power (and, if
+// pwr_sq_buf is not NULL, the squared power) of an unflagged FFT spectrum is
+// accumulated into the power buffer slot that the store callback would have
+// used and its total power is added to the coarse channel's ref_sum/ref_cnt
+// for update_rfi_ref.  A flagged FFT spectrum is counted in the nflagged
+// entry of the coarse channel for the dumped spectrum that it belongs to.
+// FFT spectrum s is FFT spectrum frame0+s of the dump.  No FFT spectra are
+// flagged until a coarse channel has a reference power.
+//
+// Expectation of blockDim, with up to MAX_THREADS threads each:
+// grid.x = Nss;
+// grid.y = Nbc;
+// grid.z = 1;
+__global__ void excise_rfi(const cufftComplex * fft_out, size_t pol_pitch,
+                           unsigned int Np, unsigned int Nt, size_t zpitch,
+                           float * pwr_buf, float * pwr_sq_buf,
+                           const float * ref, float thresh,
+                           float * ref_sum, unsigned int * ref_cnt,
+                           unsigned int * nflagged, size_t Nc,
+                           unsigned int frame0, unsigned int Na)
+{
+  __shared__ float partial[MAX_THREADS];
+  __shared__ int flagged;
+  const size_t frame_offset = blockIdx.y * zpitch + blockIdx.x * Nt;
+  cufftComplex v;
+  float pwr;
+  float pwr_sq;
+  float sum = 0.0f;
+  unsigned int k;
+  unsigned int p;
+  unsigned int n;
+
+  for(k=threadIdx.x; k<Nt; k+=blockDim.x) {
+    for(p=0; p<Np; p++) {
+      v = fft_out[p*pol_pitch + frame_offset + k];
+      sum += v.x*v.x + v.y*v.y;
+    }
+  }
+
+  // Sum the partial sums of all threads
+  partial[threadIdx.x] = sum;
+  __syncthreads();
+  for(n=1; n<blockDim.x; n*=2) {
+    if(threadIdx.x % (2*n) == 0 && threadIdx.x + n < blockDim.x) {
+      partial[threadIdx.x] += partial[threadIdx.x + n];
+    }
+    __syncthreads();
+  }
+
+  if(threadIdx.x == 0) {
+    sum = partial[0];
+    flagged = ref[blockIdx.y] > 0.0f && sum > thresh * ref[blockIdx.y];
+    if(flagged) {
+      atomicAdd(nflagged + ((frame0 + blockIdx.x) / Na) * Nc + blockIdx.y, 1u);
+    } else if(sum > 0.0f) {
+      // Missing blocks (zeros) do not contribute to the reference power
+      atomicAdd(ref_sum + blockIdx.y, sum);
+      atomicAdd(ref_cnt + blockIdx.y, 1u);
+    }
+  }
+  __syncthreads();
+
+  if(flagged) {
+    return;
+  }
+
+  for(k=threadIdx.x; k<Nt; k+=blockDim.x) {
+    pwr = 0.0f;
+    pwr_sq = 0.0f;
+    for(p=0; p<Np; p++) {
+      v = fft_out[p*pol_pitch + frame_offset + k];
+      pwr += v.x*v.x + v.y*v.y;
+      pwr_sq += (v.x*v.x + v.y*v.y) * (v.x*v.x + v.y*v.y);
+    }
+    pwr_buf[frame_offset + k] += pwr;
+    if(pwr_sq_buf) {
+      pwr_sq_buf[frame_offset + k] += pwr_sq;
+    }
+  }
+}
+
+// RFI excision reference update kernel
+// Moves the reference power of each of the n coarse channels towards the
+// mean power of the unflagged FFT spectra counted by excise_rfi (weighting
+// the mean by their number relative to RFI_REF_FRAMES), then clears the
+// counts.  A coarse channel's first mean becomes its reference power.
+__global__ void update_rfi_ref(float * ref, float * ref_sum,
+                               unsigned int * ref_cnt, unsigned int n)
+{
+  const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  float mean;
+  float w;
+
+  if(i >= n) {
+    return;
+  }
+
+  if(ref_cnt[i] > 0) {
+    mean = ref_sum[i] / ref_cnt[i];
+    w = MIN(1.0f, (float)ref_cnt[i] / RFI_REF_FRAMES);
+    ref[i] = ref[i] > 0.0f ? ref[i] + w * (mean - ref[i]) : mean;
+  }
+  ref_sum[i] = 0.0f;
+  ref_cnt[i] = 0;
+}
+
+// Flagged FFT spectrum fill kernel
+// Scales the integrated power of each fine channel of the Nd spectra of a
+// dump by N/(N-F), where N is Na times the spectrum's valid fraction and F is
+// the number of flagged FFT spectra of the coarse channel, as if each flagged
+// FFT spectrum had been replaced by the mean of the unflagged ones.  Coarse
+// channels without unflagged FFT spectra are left as is (i.e. zero).  Uses
+// the same grid as the accumulate kernel.
+__global__ void fill_flagged(float * pwr_buf, float * validfrac,
+                             unsigned int * nflagged, size_t Nc,
+                             unsigned int Na, unsigned int Nt,
+                             size_t ypitch, size_t zpitch)
+{
+  const unsigned int fine_chan_idx = blockIdx.x * MAX_THREADS + threadIdx.x;
+
+  if(fine_chan_idx >= Nt) {
+    return;
+  }
+
+  const off_t offset = blockIdx.z * zpitch
+                     + blockIdx.y * ypitch
+                     + fine_chan_idx;
+
+  const float N = Na * validfrac[blockIdx.y];
+  const float F = nflagged[blockIdx.y * Nc + blockIdx.z];
+
+  if(F > 0.0f && N - F >= 1.0f) {
+    pwr_buf[offset] *= N / (N - F);
+  }
+}
+
 // Incoherent summation kernel (across antenna)
 __global__ void incoherent_sum(float * pwr_buf, float * incoh_buf, float * ant_weights, unsigned int Nant, size_t Nt,
                                 size_t ant_pitch, size_t chan_pitch, size_t pol_pitch, size_t spectra_pitch,
@@ -361,7 +608,8 @@ __global__ void complex4_expansion(char2 *lut){
 // grid.y = ctx->Nc;
 // grid.z = num_blocks;
 __global__ void copy_expand_complex4(char *comp8_dst, char *comp4_src, size_t num_blocks,
-                                     size_t block_pitch, size_t channel_pitch)
+                                     size_t block_pitch, size_t channel_pitch,
+                                     cudaTextureObject_t d_comp4_exp_tex_obj)
 {                                     
   char* comp8_dst_offset = comp8_dst + 2*(blockIdx.y*num_blocks*channel_pitch +
                                           blockIdx.z*channel_pitch +
@@ -394,6 +642,20 @@ static void CUDART_CB post_dump_stream_callback(cudaStream_t stream,
                                                 void *data)
 {
   dump_cb_data_t * dump_cb_data = (dump_cb_data_t *)data;
+  rawspec_context * ctx = dump_cb_data->ctx;
+  rawspec_gpu_context * gpu_ctx = (rawspec_gpu_context *)ctx->gpu_ctx;
+  int i = dump_cb_data->output_product;
+
+  // The output thread of the previous dump (if any) was joined by the
+  // pre-dump callback, so h_validfrac can be updated now.
+  memcpy(ctx->h_validfrac[i], gpu_ctx->pending_validfrac[i],
+         ctx->Nds[i] * sizeof(float));
+  if(ctx->h_flagfrac[i]) {
+    for(size_t j=0; j < ctx->Nds[i]*ctx->Nc; j++) {
+      ctx->h_flagfrac[i][j] = (float)gpu_ctx->h_nflagged[i][j] / ctx->Nas[i];
+    }
+  }
+
   if(dump_cb_data->ctx->dump_callback) {
     dump_cb_data->ctx->dump_callback(dump_cb_data->ctx,
                                      dump_cb_data->output_product,
@@ -445,6 +707,34 @@ const char * get_cufft_version()
 // Creates CuFFT plans.
 // Creates streams.
 // Returns 0 on success, non-zero on error.
+// Clears the RFI excision reference powers, sums, counts, and flagged FFT
+// spectra counts of output product i.  Returns 0 on success, non-zero on
+// error.
+static int reset_rfi_excision(rawspec_context * ctx, int i)
+{
+  cudaError_t cuda_rc;
+  rawspec_gpu_context * gpu_ctx = (rawspec_gpu_context *)ctx->gpu_ctx;
+
+  if(!gpu_ctx->d_rfi_ref[i]) {
+    return 0;
+  }
+
+  if((cuda_rc = cudaMemset(gpu_ctx->d_rfi_ref[i], 0, ctx->Nc*sizeof(float)))
+       != cudaSuccess
+  || (cuda_rc = cudaMemset(gpu_ctx->d_rfi_sum[i], 0, ctx->Nc*sizeof(float)))
+       != cudaSuccess
+  || (cuda_rc = cudaMemset(gpu_ctx->d_rfi_cnt[i], 0, ctx->Nc*sizeof(unsigned int)))
+       != cudaSuccess
+  || (cuda_rc = cudaMemset(gpu_ctx->d_nflagged[i], 0,
+                           ctx->Nds[i]*ctx->Nc*sizeof(unsigned int)))
+       != cudaSuccess) {
+    PRINT_CUDA_ERRMSG(cuda_rc);
+    return 1;
+  }
+
+  return 0;
+}
+
 int rawspec_initialize(rawspec_context * ctx)
 {
   int i;
@@ -455,6 +745,7 @@ int rawspec_initialize(rawspec_context * ctx)
   uint64_t buf_size;
   size_t work_size = 0;
   store_cb_data_t h_scb_data;
+  load_cb_data_t h_lcb_data;
   cudaError_t cuda_rc;
   cufftResult cufft_rc;
   cudaResourceDesc res_desc;
@@ -465,6 +756,7 @@ int rawspec_initialize(rawspec_context * ctx)
   // Host copies of cufft callback pointers
   cufftCallbackLoadC h_cufft_load_callback;
   cufftCallbackStoreC h_cufft_store_callback;
+  cufftCallbackStoreC h_cufft_store_callback_sk;
   cufftCallbackStoreC h_cufft_store_callback_pols[2];
   cufftCallbackStoreC h_cufft_store_callback_iquv[2];
 
@@ -491,6 +783,29 @@ int rawspec_initialize(rawspec_context * ctx)
     }
   }
 
+  // Validate sk flags
+  for(i=0; i<ctx->No; i++) {
+    if(ctx->sk[i] && ctx->Npolout[i] != 1) {
+      fprintf(stderr,
+          "spectral kurtosis requires total power output (Npolout[%d] is %d)\n",
+          i, ctx->Npolout[i]);
+      fflush(stderr);
+      return 1;
+    }
+  }
+
+  // Validate excise thresholds
+  for(i=0; i<ctx->No; i++) {
+    if(ctx->excise[i] < 0 || (ctx->excise[i] > 0 && ctx->Npolout[i] != 1)) {
+      fprintf(stderr,
+          "invalid RFI excision threshold %g for output product %d "
+          "(must be positive and requires total power output)\n",
+          ctx->excise[i], i);
+      fflush(stderr);
+      return 1;
+    }
+  }
+
   // Validate Ntpb
   if(ctx->Ntpb == 0) {
     fprintf(stderr, "number of time samples per block cannot be zero\n");
@@ -645,7 +960,11 @@ int rawspec_initialize(rawspec_context * ctx)
   for(i=0; i < MAX_OUTPUTS; i++) {
     ctx->h_pwrbuf[i] = NULL;
     ctx->h_icsbuf[i] = NULL;
+    ctx->h_skbuf[i] = NULL;
+    ctx->h_validfrac[i] = NULL;
+    ctx->h_flagfrac[i] = NULL;
   }
+  ctx->h_blkvalid = NULL;
   ctx->gpu_ctx = NULL;
 
   // Set CUDA device (validates gpu_index)
@@ -672,16 +991,29 @@ int rawspec_initialize(rawspec_context * ctx)
 
   // NULL out pointers (and invalidate plans)
   gpu_ctx->d_fft_in = NULL;
+  gpu_ctx->d_lcb_data = NULL;
+  gpu_ctx->d_Aws = NULL;
   gpu_ctx->d_comp4_exp_LUT = NULL;
   gpu_ctx->d_blk_expansion_buf = NULL;
   gpu_ctx->d_fft_out = NULL;
   gpu_ctx->d_work_area = NULL;
   gpu_ctx->work_size = 0;
   gpu_ctx->compute_stream = NO_STREAM;
+  gpu_ctx->blkvalid = NULL;
   for(i=0; i<MAX_OUTPUTS; i++) {
+    gpu_ctx->valid_samples[i] = NULL;
+    gpu_ctx->pending_validfrac[i] = NULL;
+    gpu_ctx->d_validfrac[i] = NULL;
+    gpu_ctx->d_rfi_ref[i] = NULL;
+    gpu_ctx->d_rfi_sum[i] = NULL;
+    gpu_ctx->d_rfi_cnt[i] = NULL;
+    gpu_ctx->d_nflagged[i] = NULL;
+    gpu_ctx->h_nflagged[i] = NULL;
     gpu_ctx->d_pwr_out[i] = NULL;
+    gpu_ctx->Npwr[i] = 0;
     gpu_ctx->d_prev_pwr_out_cache[i] = NULL;
     gpu_ctx->d_scb_data[i] = NULL;
+    gpu_ctx->d_ics_out[i] = NULL;
     gpu_ctx->plan[i][0] = NO_PLAN;
     gpu_ctx->plan[i][1] = NO_PLAN;
     gpu_ctx->dump_cb_data[i].ctx = ctx;
@@ -728,6 +1060,17 @@ int rawspec_initialize(rawspec_context * ctx)
     }
   }
 
+  // Allocate block validity flags (all blocks valid)
+  ctx->h_blkvalid = (char *)malloc(ctx->Nb_host);
+  gpu_ctx->blkvalid = (char *)malloc(ctx->Nb);
+  if(!ctx->h_blkvalid || !gpu_ctx->blkvalid) {
+    fprintf(stderr, "unable to allocate block validity flags\n");
+    rawspec_cleanup(ctx);
+    return 1;
+  }
+  memset(ctx->h_blkvalid, 1, ctx->Nb_host);
+  memset(gpu_ctx->blkvalid, 1, ctx->Nb);
+
   // Calculate Ns and allocate host power output buffers
   for(i=0; i < ctx->No; i++) {
     // Ns[i] is number of specta (FFTs) per coarse channel for one input buffer
@@ -746,6 +1089,17 @@ int rawspec_initialize(rawspec_context * ctx)
       gpu_ctx->Nis[i] = 1;
     }
 
+    // Allocate valid sample counts and fractions of dumped spectra
+    gpu_ctx->valid_samples[i] = (size_t *)calloc(ctx->Nds[i], sizeof(size_t));
+    gpu_ctx->pending_validfrac[i] = (float *)calloc(ctx->Nds[i], sizeof(float));
+    ctx->h_validfrac[i] = (float *)calloc(ctx->Nds[i], sizeof(float));
+    if(!gpu_ctx->valid_samples[i] || !gpu_ctx->pending_validfrac[i]
+    || !ctx->h_validfrac[i]) {
+      fprintf(stderr, "unable to allocate valid fraction buffers\n");
+      rawspec_cleanup(ctx);
+      return 1;
+    }
+
     // Calculate grid dimensions
     gpu_ctx->grid[i].x = (ctx->Nts[i] + MAX_THREADS - 1) / MAX_THREADS;
     gpu_ctx->grid[i].y = ctx->Nds[i];
@@ -779,6 +1133,33 @@ int rawspec_initialize(rawspec_context * ctx)
         return 1;
       }
     }
+    if(ctx->sk[i]) {
+      cuda_rc = cudaHostAlloc(&ctx->h_skbuf[i], ctx->h_pwrbuf_size[i],
+                        cudaHostAllocDefault);
+
+      if(cuda_rc != cudaSuccess) {
+        PRINT_CUDA_ERRMSG(cuda_rc);
+        rawspec_cleanup(ctx);
+        return 1;
+      }
+    }
+    if(ctx->excise[i] > 0) {
+      cuda_rc = cudaHostAlloc(&gpu_ctx->h_nflagged[i],
+                        ctx->Nds[i]*ctx->Nc*sizeof(unsigned int),
+                        cudaHostAllocDefault);
+
+      if(cuda_rc != cudaSuccess) {
+        PRINT_CUDA_ERRMSG(cuda_rc);
+        rawspec_cleanup(ctx);
+        return 1;
+      }
+      ctx->h_flagfrac[i] = (float *)calloc(ctx->Nds[i]*ctx->Nc, sizeof(float));
+      if(!ctx->h_flagfrac[i]) {
+        fprintf(stderr, "unable to allocate flagged fraction buffer\n");
+        rawspec_cleanup(ctx);
+        return 1;
+      }
+    }
   }
 
   gpu_ctx->guppi_channel_stride = (ctx->Ntpb * ctx->Np * 2 /*complex*/ * ctx->Nbps)/8;
@@ -871,11 +1252,21 @@ int rawspec_initialize(rawspec_context * ctx)
     return 1;
   }
 
-  // Copy texture object to device
-  cuda_rc = cudaMemcpyToSymbol(d_tex_obj,
-                               &gpu_ctx->tex_obj,
-                               sizeof(cudaTextureObject_t));
+  // Copy input buffer pointer and texture object to device for load_callback
+  h_lcb_data.fft_in = gpu_ctx->d_fft_in;
+  h_lcb_data.tex_obj = gpu_ctx->tex_obj;
 
+  cuda_rc = cudaMalloc(&gpu_ctx->d_lcb_data, sizeof(load_cb_data_t));
+  if(cuda_rc != cudaSuccess) {
+    PRINT_CUDA_ERRMSG(cuda_rc);
+    rawspec_cleanup(ctx);
+    return 1;
+  }
+
+  cuda_rc = cudaMemcpy(gpu_ctx->d_lcb_data,
+                       &h_lcb_data,
+                       sizeof(load_cb_data_t),
+                       cudaMemcpyHostToDevice);
   if(cuda_rc != cudaSuccess) {
     PRINT_CUDA_ERRMSG(cuda_rc);
     rawspec_cleanup(ctx);
@@ -923,23 +1314,14 @@ int rawspec_initialize(rawspec_context * ctx)
       rawspec_cleanup(ctx);
       return 1;
     }
-  
-    cuda_rc = cudaMemcpyToSymbol(d_comp4_exp_tex_obj,
-                                &gpu_ctx->comp4_exp_tex_obj,
-                                sizeof(cudaTextureObject_t));
-
-    if(cuda_rc != cudaSuccess) {
-      PRINT_CUDA_ERRMSG(cuda_rc);
-      rawspec_cleanup(ctx);
-      return 1;
-    }
   }
 
   // FFT output buffer
   buf_size = ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(cufftComplex);
-  // If any output product is full-pol then we need to double output buffer
+  // If any output product is full-pol (or uses RFI excision, which needs the
+  // FFT output of both pols) then we need to double output buffer
   for(i=0; i < ctx->No; i++) {
-    if(abs(ctx->Npolout[i]) == 4) {
+    if(abs(ctx->Npolout[i]) == 4 || ctx->excise[i] > 0) {
       buf_size *= 2;
       break;
     }
@@ -956,14 +1338,16 @@ int rawspec_initialize(rawspec_context * ctx)
 
   // For each output product
   for(i=0; i < ctx->No; i++) {
-    // Power output buffer
+    // Power output buffer (with an extra plane for the squared power when
+    // computing spectral kurtosis)
+    gpu_ctx->Npwr[i] = abs(ctx->Npolout[i]) + (ctx->sk[i] ? 1 : 0);
 #ifdef VERBOSE_ALLOC
     printf("Power output buffer size == %u * %lu == %lu\n",
-        abs(ctx->Npolout[i]),  ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float),
-        abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float));
+        gpu_ctx->Npwr[i],  ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float),
+        gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float));
 #endif
     cuda_rc = cudaMalloc(&gpu_ctx->d_pwr_out[i],
-        abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float));
+        gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float));
     if(cuda_rc != cudaSuccess) {
       PRINT_CUDA_ERRMSG(cuda_rc);
       rawspec_cleanup(ctx);
@@ -971,7 +1355,7 @@ int rawspec_initialize(rawspec_context * ctx)
     }
     // Clear power output buffer
     cuda_rc = cudaMemset(gpu_ctx->d_pwr_out[i], 0,
-        abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float));
+        gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float));
     if(cuda_rc != cudaSuccess) {
       PRINT_CUDA_ERRMSG(cuda_rc);
       rawspec_cleanup(ctx);
@@ -981,11 +1365,11 @@ int rawspec_initialize(rawspec_context * ctx)
       // Full power output buffer
 #ifdef VERBOSE_ALLOC
       printf("Full power output buffer cache size == %u * %lu == %lu\n",
-          abs(ctx->Npolout[i]),  ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float),
-          abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float));
+          gpu_ctx->Npwr[i],  ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float),
+          gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float));
 #endif
       cuda_rc = cudaMalloc(&gpu_ctx->d_prev_pwr_out_cache[i],
-          abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float));
+          gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float));
       if(cuda_rc != cudaSuccess) {
         PRINT_CUDA_ERRMSG(cuda_rc);
         rawspec_cleanup(ctx);
@@ -993,7 +1377,7 @@ int rawspec_initialize(rawspec_context * ctx)
       }
       // Clear power output buffer
       cuda_rc = cudaMemset(gpu_ctx->d_prev_pwr_out_cache[i], 0,
-          abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float));
+          gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float));
       if(cuda_rc != cudaSuccess) {
         PRINT_CUDA_ERRMSG(cuda_rc);
         rawspec_cleanup(ctx);
@@ -1004,6 +1388,39 @@ int rawspec_initialize(rawspec_context * ctx)
       gpu_ctx->d_prev_pwr_out_cache[i] = gpu_ctx->d_pwr_out[i];
     }
 
+    if(ctx->sk[i] || ctx->excise[i] > 0) {
+      // Valid fractions of the dumped spectra (for spectral_kurtosis and
+      // fill_flagged kernels)
+      cuda_rc = cudaMalloc(&gpu_ctx->d_validfrac[i], ctx->Nds[i]*sizeof(float));
+      if(cuda_rc != cudaSuccess) {
+        PRINT_CUDA_ERRMSG(cuda_rc);
+        rawspec_cleanup(ctx);
+        return 1;
+      }
+    }
+
+    if(ctx->excise[i] > 0) {
+      // RFI excision reference powers, sums, and counts and flagged FFT
+      // spectra counts
+      if((cuda_rc = cudaMalloc(&gpu_ctx->d_rfi_ref[i], ctx->Nc*sizeof(float)))
+           != cudaSuccess
+      || (cuda_rc = cudaMalloc(&gpu_ctx->d_rfi_sum[i], ctx->Nc*sizeof(float)))
+           != cudaSuccess
+      || (cuda_rc = cudaMalloc(&gpu_ctx->d_rfi_cnt[i], ctx->Nc*sizeof(unsigned int)))
+           != cudaSuccess
+      || (cuda_rc = cudaMalloc(&gpu_ctx->d_nflagged[i],
+                               ctx->Nds[i]*ctx->Nc*sizeof(unsigned int)))
+           != cudaSuccess) {
+        PRINT_CUDA_ERRMSG(cuda_rc);
+        rawspec_cleanup(ctx);
+        return 1;
+      }
+      if(reset_rfi_excision(ctx, i)) {
+        rawspec_cleanup(ctx);
+        return 1;
+      }
+    }
+
     if(ctx->incoherently_sum){
 #ifdef VERBOSE_ALLOC
       printf("ICS output buffer size == %u * %lu / %u == %lu\n",
@@ -1068,6 +1485,9 @@ int rawspec_initialize(rawspec_context * ctx)
         gpu_ctx->d_pwr_out[i] + 2*ctx->Nb*ctx->Ntpb*ctx->Nbc;
     h_scb_data.pwr_buf_p01_im_v =
         gpu_ctx->d_pwr_out[i] + 3*ctx->Nb*ctx->Ntpb*ctx->Nbc;
+    // The squared power follows the power (only used if ctx->sk[i])
+    h_scb_data.pwr_sq_buf =
+        gpu_ctx->d_pwr_out[i] + abs(ctx->Npolout[i])*ctx->Nb*ctx->Ntpb*ctx->Nbc;
 
     // Allocate device memory for store_cb_data_t array
     cuda_rc = cudaMalloc(&gpu_ctx->d_scb_data[i], sizeof(store_cb_data_t));
@@ -1108,6 +1528,15 @@ int rawspec_initialize(rawspec_context * ctx)
     return 1;
   }
 
+  cuda_rc = cudaMemcpyFromSymbol(&h_cufft_store_callback_sk,
+                                 d_cufft_store_callback_sk,
+                                 sizeof(h_cufft_store_callback_sk));
+  if(cuda_rc != cudaSuccess) {
+    PRINT_CUDA_ERRMSG(cuda_rc);
+    rawspec_cleanup(ctx);
+    return 1;
+  }
+
   cuda_rc = cudaMemcpyFromSymbol(&h_cufft_store_callback_pols[0],
                                  d_cufft_store_callback_pol0,
                                  sizeof(h_cufft_store_callback_pols[0]));
@@ -1208,14 +1637,22 @@ int rawspec_initialize(rawspec_context * ctx)
       cufft_rc = cufftXtSetCallback(gpu_ctx->plan[i][p],
                                     (void **)&h_cufft_load_callback,
                                     CUFFT_CB_LD_COMPLEX,
-                                    (void **)&gpu_ctx->d_fft_in);
+                                    (void **)&gpu_ctx->d_lcb_data);
       if(cufft_rc != CUFFT_SUCCESS) {
         PRINT_CUFFT_ERRMSG(cufft_rc);
         rawspec_cleanup(ctx);
         return 1;
       }
-      // Store callback(s)
-      if(ctx->Npolout[i] == 1) {
+      // Store callback(s).  Output products with RFI excision have none, their
+      // power is accumulated by the excise_rfi kernel instead.
+      if(ctx->excise[i] > 0) {
+        cufft_rc = CUFFT_SUCCESS;
+      } else if(ctx->Npolout[i] == 1 && ctx->sk[i]) {
+        cufft_rc = cufftXtSetCallback(gpu_ctx->plan[i][p],
+                                      (void **)&h_cufft_store_callback_sk,
+                                      CUFFT_CB_ST_COMPLEX,
+                                      (void **)&gpu_ctx->d_scb_data[i]);
+      } else if(ctx->Npolout[i] == 1) {
         cufft_rc = cufftXtSetCallback(gpu_ctx->plan[i][p],
                                       (void **)&h_cufft_store_callback,
                                       CUFFT_CB_ST_COMPLEX,
@@ -1312,7 +1749,17 @@ void rawspec_cleanup(rawspec_context * ctx)
       cudaFreeHost(ctx->h_icsbuf[i]);
       ctx->h_icsbuf[i] = NULL;
     }
+    if(ctx->h_skbuf[i]) {
+      cudaFreeHost(ctx->h_skbuf[i]);
+      ctx->h_skbuf[i] = NULL;
+    }
+    free(ctx->h_validfrac[i]);
+    ctx->h_validfrac[i] = NULL;
+    free(ctx->h_flagfrac[i]);
+    ctx->h_flagfrac[i] = NULL;
   }
+  free(ctx->h_blkvalid);
+  ctx->h_blkvalid = NULL;
 
   if(ctx->gpu_ctx) {
     gpu_ctx = (rawspec_gpu_context *)ctx->gpu_ctx;
@@ -1338,6 +1785,10 @@ void rawspec_cleanup(rawspec_context * ctx)
       cudaFree(gpu_ctx->d_fft_in);
     }
 
+    if(gpu_ctx->d_lcb_data) {
+      cudaFree(gpu_ctx->d_lcb_data);
+    }
+
     if(gpu_ctx->d_blk_expansion_buf) {
       cudaFree(gpu_ctx->d_blk_expansion_buf);
     }
@@ -1369,6 +1820,29 @@ void rawspec_cleanup(rawspec_context * ctx)
       if(gpu_ctx->d_ics_out[i]) {
         cudaFree(gpu_ctx->d_ics_out[i]);
       }
+      if(gpu_ctx->d_validfrac[i]) {
+        cudaFree(gpu_ctx->d_validfrac[i]);
+      }
+      if(gpu_ctx->d_rfi_ref[i]) {
+        cudaFree(gpu_ctx->d_rfi_ref[i]);
+      }
+      if(gpu_ctx->d_rfi_sum[i]) {
+        cudaFree(gpu_ctx->d_rfi_sum[i]);
+      }
+      if(gpu_ctx->d_rfi_cnt[i]) {
+        cudaFree(gpu_ctx->d_rfi_cnt[i]);
+      }
+      if(gpu_ctx->d_nflagged[i]) {
+        cudaFree(gpu_ctx->d_nflagged[i]);
+      }
+      if(gpu_ctx->h_nflagged[i]) {
+        cudaFreeHost(gpu_ctx->h_nflagged[i]);
+      }
+      if(gpu_ctx->d_scb_data[i]) {
+        cudaFree(gpu_ctx->d_scb_data[i]);
+      }
+      free(gpu_ctx->valid_samples[i]);
+      free(gpu_ctx->pending_validfrac[i]);
       for(p=0; p<2; p++) {
         if(gpu_ctx->plan[i][p] != NO_PLAN) {
           cufftDestroy(gpu_ctx->plan[i][p]);
@@ -1376,10 +1850,10 @@ void rawspec_cleanup(rawspec_context * ctx)
       }
     }
 
+    free(gpu_ctx->blkvalid);
+
+    // ctx->Aws belongs to the caller (and may be shared by several contexts)
     if(ctx->incoherently_sum){
-      if(ctx->Aws){
-        cudaFreeHost(ctx->Aws);
-      }
       if(gpu_ctx->d_Aws){
         cudaFree(gpu_ctx->d_Aws);
       }
@@ -1413,8 +1887,15 @@ int rawspec_copy_blocks_to_gpu_expanding_complex4(rawspec_context * ctx,
   for(b=0; b < num_blocks; b++) {
     sblk = (src_idx + b) % ctx->Nb_host;
     dblk = (dst_idx + b) % ctx->Nb;
-    rc = cudaMemcpyAsync(gpu_ctx->d_blk_expansion_buf + (dblk * block_size), ctx->h_blkbufs[sblk],
-                          block_size, cudaMemcpyHostToDevice, gpu_ctx->compute_stream);
+    gpu_ctx->blkvalid[dblk] = ctx->h_blkvalid[sblk];
+    if(ctx->h_blkvalid[sblk]) {
+      rc = cudaMemcpyAsync(gpu_ctx->d_blk_expansion_buf + (dblk * block_size), ctx->h_blkbufs[sblk],
+                            block_size, cudaMemcpyHostToDevice, gpu_ctx->compute_stream);
+    } else {
+      // Missing block, zero complex4 samples expand to zero
+      rc = cudaMemsetAsync(gpu_ctx->d_blk_expansion_buf + (dblk * block_size), 0,
+                            block_size, gpu_ctx->compute_stream);
+    }
 
     if(rc != cudaSuccess) {
       PRINT_CUDA_ERRMSG(rc);
@@ -1431,7 +1912,8 @@ int rawspec_copy_blocks_to_gpu_expanding_complex4(rawspec_context * ctx,
   
   copy_expand_complex4<<<grid, thread_count, 0, gpu_ctx->compute_stream>>>(
                                               gpu_ctx->d_fft_in, gpu_ctx->d_blk_expansion_buf, 
-                                              num_blocks, block_size, gpu_ctx->guppi_channel_stride/2);
+                                              num_blocks, block_size, gpu_ctx->guppi_channel_stride/2,
+                                              gpu_ctx->comp4_exp_tex_obj);
 
   return 0;
 }
@@ -1451,6 +1933,15 @@ int rawspec_copy_blocks_to_gpu(rawspec_context * ctx,
     sblk = (src_idx + b) % ctx->Nb_host;
     dblk = (dst_idx + b) % ctx->Nb;
 
+    // Zero missing blocks on the GPU rather than copying them
+    if(!ctx->h_blkvalid[sblk]) {
+      if(rawspec_zero_blocks_to_gpu(ctx, dblk, 1)) {
+        return 1;
+      }
+      continue;
+    }
+    gpu_ctx->blkvalid[dblk] = 1;
+
     rc = cudaMemcpy2D(gpu_ctx->d_fft_in + dblk * gpu_ctx->guppi_channel_stride,
                       ctx->Nb * gpu_ctx->guppi_channel_stride,  // dpitch
                       ctx->h_blkbufs[sblk],                     // *src
@@ -1483,6 +1974,7 @@ int rawspec_zero_blocks_to_gpu(rawspec_context * ctx,
 
   for(b=0; b < num_blocks; b++) {
     dblk = (dst_idx + b) % ctx->Nb;
+    gpu_ctx->blkvalid[dblk] = 0;
 
     rc = cudaMemset2D(gpu_ctx->d_fft_in + dblk * gpu_ctx->guppi_channel_stride,
                       ctx->Nb * gpu_ctx->guppi_channel_stride,  // pitch
@@ -1499,6 +1991,46 @@ int rawspec_zero_blocks_to_gpu(rawspec_context * ctx,
   return 0;
 }
 
+// Adds the time samples of the valid blocks in the GPU input buffer to the
+// valid sample counts of the spectra of output product `i`'s next dump.  If it
+// is time to dump, computes the valid fractions of the dumped spectra and
+// resets the counts.
+static void count_valid_samples(rawspec_context * ctx, int i)
+{
+  rawspec_gpu_context * gpu_ctx = (rawspec_gpu_context *)ctx->gpu_ctx;
+  // Time samples per dumped spectrum
+  const size_t Nspec = (size_t)ctx->Nts[i] * ctx->Nas[i];
+  // Offset of the input buffer's first time sample within the dump
+  const size_t toff = ((gpu_ctx->inbuf_count - 1) % gpu_ctx->Nis[i])
+                    * ctx->Nb * ctx->Ntpb;
+  size_t t0, t1;
+  size_t lo, hi;
+  unsigned int b;
+  unsigned int d;
+
+  for(b=0; b < ctx->Nb; b++) {
+    if(!gpu_ctx->blkvalid[b]) {
+      continue;
+    }
+    t0 = toff + b * ctx->Ntpb;
+    t1 = t0 + ctx->Ntpb;
+    for(d=0; d < ctx->Nds[i]; d++) {
+      lo = MAX(t0, d * Nspec);
+      hi = MIN(t1, (d+1) * Nspec);
+      if(hi > lo) {
+        gpu_ctx->valid_samples[i][d] += hi - lo;
+      }
+    }
+  }
+
+  if(gpu_ctx->inbuf_count % gpu_ctx->Nis[i] == 0) {
+    for(d=0; d < ctx->Nds[i]; d++) {
+      gpu_ctx->pending_validfrac[i][d] = (float)gpu_ctx->valid_samples[i][d] / Nspec;
+      gpu_ctx->valid_samples[i][d] = 0;
+    }
+  }
+}
+
 // Launches FFTs of data in input buffer.  Whenever an output product
 // integration is complete, the power spectrum is copied to the host power
 // output buffer and the user provided callback, if any, is called.  This
@@ -1532,6 +2064,7 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
   rawspec_gpu_context * gpu_ctx = (rawspec_gpu_context *)ctx->gpu_ctx;
   size_t fft_outbuf_length;
   dim3 grid_ics;
+  dim3 grid_excise;
   dim3 grid_full_pwr;
   grid_full_pwr.x = ctx->Nb*ctx->Ntpb*ctx->Nbc;
   grid_full_pwr.z = 1;
@@ -1542,14 +2075,20 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
   // Increment inbuf_count
   gpu_ctx->inbuf_count++;
 
+  // Count valid samples of the spectra to be dumped
+  for(i=0; i < ctx->No; i++) {
+    count_valid_samples(ctx, i);
+  }
+
   // For each output product
   for(i=0; i < ctx->No; i++) {
-    // Length of an FFT output buffer when abs(Npotout)==4, must be 0 when
-    // Npolout==1
-    fft_outbuf_length = ctx->Npolout[i] == 1 ? 0 : ctx->Nb*ctx->Ntpb*ctx->Nbc;
+    // Length of an FFT output buffer when abs(Npotout)==4 or with RFI
+    // excision, must be 0 otherwise when Npolout==1
+    fft_outbuf_length = ctx->Npolout[i] == 1 && !(ctx->excise[i] > 0)
+                      ? 0 : ctx->Nb*ctx->Ntpb*ctx->Nbc;
     for(c=0; c < ctx->Nc; c += ctx->Nbc) {
       is_last_channel_batch = c + ctx->Nbc >= ctx->Nc;
-      grid_full_pwr.y = abs(ctx->Npolout[i]);
+      grid_full_pwr.y = gpu_ctx->Npwr[i];
 
       // For each input polarization
       for(p=0; p < ctx->Np; p++) {
@@ -1568,17 +2107,57 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
         }
       }
 
+      // With RFI excision, accumulate the power of the unflagged FFT spectra
+      // and update the reference powers of the batch's coarse channels
+      if(ctx->excise[i] > 0) {
+        grid_excise.x = gpu_ctx->Nss[i];
+        grid_excise.y = ctx->Nbc;
+        grid_excise.z = 1;
+        excise_rfi<<<grid_excise,
+                     gpu_ctx->nthreads[i],
+                     0, gpu_ctx->compute_stream>>>
+                       (
+                         gpu_ctx->d_fft_out,
+                         fft_outbuf_length,                 // pol_pitch
+                         ctx->Np,
+                         ctx->Nts[i],                       // Nt
+                         ctx->Nb*ctx->Ntpb,                 // zpitch
+                         gpu_ctx->d_pwr_out[i],
+                         ctx->sk[i] ? gpu_ctx->d_pwr_out[i] + ctx->Nb*ctx->Ntpb*ctx->Nbc : NULL,
+                         gpu_ctx->d_rfi_ref[i] + c,
+                         ctx->excise[i],                    // thresh
+                         gpu_ctx->d_rfi_sum[i] + c,
+                         gpu_ctx->d_rfi_cnt[i] + c,
+                         gpu_ctx->d_nflagged[i] + c,
+                         ctx->Nc,
+                         ((gpu_ctx->inbuf_count - 1) % gpu_ctx->Nis[i]) * gpu_ctx->Nss[i], // frame0
+                         ctx->Nas[i]                        // Na
+                       );
+
+        update_rfi_ref<<<(ctx->Nbc + MAX_THREADS - 1) / MAX_THREADS,
+                         MIN(ctx->Nbc, MAX_THREADS),
+                         0, gpu_ctx->compute_stream>>>
+                           (
+                             gpu_ctx->d_rfi_ref[i] + c,
+                             gpu_ctx->d_rfi_sum[i] + c,
+                             gpu_ctx->d_rfi_cnt[i] + c,
+                             ctx->Nbc
+                           );
+      }
+
       // If time to dump
       if(gpu_ctx->inbuf_count % gpu_ctx->Nis[i] == 0){
         // If previous d_pwr_buf were cached
         if(gpu_ctx->Nis[i] > 1 && ctx->Nbc < ctx->Nc){
           // Accumulate previously cached d_pwr_buf
           // mem2dAccumMoveFloat memset(0)s the source (d_prev_pwr_out_cache)
+          // The cache holds the Npwr planes of each batch of channels one
+          // after the other, so the planes of a batch are Nb*Ntpb*Nbc apart.
           mem2dAccumMoveFloat<<<grid_full_pwr, 1, 0, gpu_ctx->compute_stream
           >>>(gpu_ctx->d_pwr_out[i],
               ctx->Nb*ctx->Ntpb*ctx->Nbc,
-              gpu_ctx->d_prev_pwr_out_cache[i] + (c * abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb),
-              ctx->Nb*ctx->Ntpb*ctx->Nc
+              gpu_ctx->d_prev_pwr_out_cache[i] + (c * gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb),
+              ctx->Nb*ctx->Ntpb*ctx->Nbc
             );
         }
 
@@ -1586,7 +2165,7 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
         // number of spectra per input buffer, then we need to accumulate the
         // sub-integrations together.
         if(ctx->Nds[i] < gpu_ctx->Nss[i]) {
-          for(p=0; p < abs(ctx->Npolout[i]); p++) {
+          for(p=0; p < gpu_ctx->Npwr[i]; p++) {
             accumulate<<<gpu_ctx->grid[i],
                         gpu_ctx->nthreads[i],
                         0, gpu_ctx->compute_stream>>>
@@ -1600,6 +2179,56 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
           }
         }
 
+        // The valid fractions are needed for spectral kurtosis and RFI
+        // excision fill
+        if(c == 0 && gpu_ctx->d_validfrac[i]) {
+          cuda_rc = cudaMemcpyAsync(gpu_ctx->d_validfrac[i],
+                                    gpu_ctx->pending_validfrac[i],
+                                    ctx->Nds[i] * sizeof(float),
+                                    cudaMemcpyHostToDevice,
+                                    gpu_ctx->compute_stream);
+          if(cuda_rc != cudaSuccess) {
+            PRINT_CUDA_ERRMSG(cuda_rc);
+            return 1;
+          }
+        }
+
+        // Replace the integrated squared power with the spectral kurtosis
+        if(ctx->sk[i]) {
+          spectral_kurtosis<<<gpu_ctx->grid[i],
+                              gpu_ctx->nthreads[i],
+                              0, gpu_ctx->compute_stream>>>
+                                (
+                                  gpu_ctx->d_pwr_out[i],
+                                  gpu_ctx->d_pwr_out[i] + abs(ctx->Npolout[i])*ctx->Nb*ctx->Ntpb*ctx->Nbc,
+                                  gpu_ctx->d_validfrac[i],
+                                  gpu_ctx->d_nflagged[i] ? gpu_ctx->d_nflagged[i] + c : NULL,
+                                  ctx->Nc,
+                                  ctx->Np,
+                                  ctx->Nas[i],                  // Na
+                                  ctx->Nts[i],                  // Nt
+                                  ctx->Nas[i]*ctx->Nts[i],      // ypitch
+                                  ctx->Nb*ctx->Ntpb             // zpitch
+                                );
+        }
+
+        // Replace flagged FFT spectra with the mean of the unflagged ones
+        if(ctx->excise[i] > 0 && ctx->excise_fill) {
+          fill_flagged<<<gpu_ctx->grid[i],
+                         gpu_ctx->nthreads[i],
+                         0, gpu_ctx->compute_stream>>>
+                           (
+                             gpu_ctx->d_pwr_out[i],
+                             gpu_ctx->d_validfrac[i],
+                             gpu_ctx->d_nflagged[i] + c,
+                             ctx->Nc,
+                             ctx->Nas[i],                  // Na
+                             ctx->Nts[i],                  // Nt
+                             ctx->Nas[i]*ctx->Nts[i],      // ypitch
+                             ctx->Nb*ctx->Ntpb             // zpitch
+                           );
+        }
+
         if(ctx->incoherently_sum){
           grid_ics.x = (ctx->Nts[i] * ctx->Nbc)/gpu_ctx->nthreads[i];
           grid_ics.y = abs(ctx->Npolout[i]);
@@ -1644,12 +2273,17 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
           }
         }
 
-        for(p=0; p < abs(ctx->Npolout[i]); p++) {
+        for(p=0; p < gpu_ctx->Npwr[i]; p++) {
           // Copy integrated power spectra (or spectrum) to host.  This is done as
           // two 2D copies to get channel 0 in the center of the spectrum.  Special
-          // care is taken in the unlikely event that Nt is odd.
+          // care is taken in the unlikely event that Nt is odd.  The spectral
+          // kurtosis (if any) follows the power and is copied the same way.
           src    = gpu_ctx->d_pwr_out[i] + p*ctx->Nb*ctx->Ntpb*ctx->Nbc;
-          dst    = ctx->h_pwrbuf[i] + (p*ctx->Nts[i]*ctx->Nc) + (c*ctx->Nts[i]);
+          if(p < abs(ctx->Npolout[i])) {
+            dst  = ctx->h_pwrbuf[i] + (p*ctx->Nts[i]*ctx->Nc) + (c*ctx->Nts[i]);
+          } else {
+            dst  = ctx->h_skbuf[i] + (c*ctx->Nts[i]);
+          }
           spitch = gpu_ctx->Nss[i] * ctx->Nts[i] * sizeof(float);
           dpitch = ctx->Nts[i] * sizeof(float);
           height = ctx->Nbc;
@@ -1696,6 +2330,24 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
           }
         }
 
+        if(is_last_channel_batch && ctx->excise[i] > 0){
+          // Copy flagged FFT spectra counts to host and clear them
+          cuda_rc = cudaMemcpyAsync(gpu_ctx->h_nflagged[i],
+                                    gpu_ctx->d_nflagged[i],
+                                    ctx->Nds[i]*ctx->Nc*sizeof(unsigned int),
+                                    cudaMemcpyDeviceToHost,
+                                    gpu_ctx->compute_stream);
+          if(cuda_rc == cudaSuccess) {
+            cuda_rc = cudaMemsetAsync(gpu_ctx->d_nflagged[i], 0,
+                                      ctx->Nds[i]*ctx->Nc*sizeof(unsigned int),
+                                      gpu_ctx->compute_stream);
+          }
+          if(cuda_rc != cudaSuccess) {
+            PRINT_CUDA_ERRMSG(cuda_rc);
+            return 1;
+          }
+        }
+
         if(is_last_channel_batch){
           // Add post-dump stream callback
           cuda_rc = cudaStreamAddCallback(gpu_ctx->compute_stream,
@@ -1710,7 +2362,7 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
 
         // Add power buffer clearing cudaMemset call to stream
         cuda_rc = cudaMemsetAsync(gpu_ctx->d_pwr_out[i], 0,
-                                  abs(ctx->Npolout[i])*ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float),
+                                  gpu_ctx->Npwr[i]*ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float),
                                   gpu_ctx->compute_stream);
 
         if(cuda_rc != cudaSuccess) {
@@ -1734,8 +2386,8 @@ int rawspec_start_processing(rawspec_context * ctx, int fft_dir)
         // Cache d_pwr_buf to d_prev_pwr_out_cache for later
         // mem2dAccumMoveFloat memset(0)s the source (d_pwr_buf)
         mem2dAccumMoveFloat<<<grid_full_pwr, 1, 0, gpu_ctx->compute_stream
-          >>>(gpu_ctx->d_prev_pwr_out_cache[i] + (c * abs(ctx->Npolout[i]) * ctx->Nb*ctx->Ntpb),
-              ctx->Nb*ctx->Ntpb*ctx->Nc,
+          >>>(gpu_ctx->d_prev_pwr_out_cache[i] + (c * gpu_ctx->Npwr[i] * ctx->Nb*ctx->Ntpb),
+              ctx->Nb*ctx->Ntpb*ctx->Nbc,
               gpu_ctx->d_pwr_out[i],
               ctx->Nb*ctx->Ntpb*ctx->Nbc
             );
@@ -1778,15 +2430,22 @@ int rawspec_reset_integration(rawspec_context * ctx)
   for(i=0; i < ctx->No; i++) {
     // Clear power output buffer
     cuda_rc = cudaMemset(gpu_ctx->d_pwr_out[i], 0,
-        abs(ctx->Npolout[i])*ctx->Nb*ctx->Ntpb*ctx->Nc*sizeof(float));
+        gpu_ctx->Npwr[i]*ctx->Nb*ctx->Ntpb*ctx->Nbc*sizeof(float));
     if(cuda_rc != cudaSuccess) {
       PRINT_CUDA_ERRMSG(cuda_rc);
       return 1;
     }
+    // Start over with the RFI excision reference powers
+    if(reset_rfi_excision(ctx, i)) {
+      return 1;
+    }
   }
 
-  // Reset inbuf_count
+  // Reset inbuf_count and valid sample counts
   gpu_ctx->inbuf_count = 0;
+  for(i=0; i < ctx->No; i++) {
+    memset(gpu_ctx->valid_samples[i], 0, ctx->Nds[i] * sizeof(size_t));
+  }
 
   return 0;
 }
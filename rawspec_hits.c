@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rawspec_hits.h"
+
+// Ratio of the standard deviation of Gaussian noise to its MAD
+#define MAD_TO_SIGMA (1.4826f)
+
+// Returns the k-th smallest of the `n` values of `a`, which are reordered.
+static float select_kth(float * a, long n, long k)
+{
+  long lo = 0;
+  long hi = n - 1;
+  long i, j;
+  float pivot;
+  float tmp;
+
+  while(lo < hi) {
+    pivot = a[lo + (hi - lo) / 2];
+    i = lo;
+    j = hi;
+    while(i <= j) {
+      while(a[i] < pivot) {
+        i++;
+      }
+      while(a[j] > pivot) {
+        j--;
+      }
+      if(i <= j) {
+        tmp = a[i];
+        a[i] = a[j];
+        a[j] = tmp;
+        i++;
+        j--;
+      }
+    }
+    // Now a[lo..j] <= pivot, a[i..hi] >= pivot, and a[j+1..i-1] == pivot
+    if(k <= j) {
+      hi = j;
+    } else if(k >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
+
+  return a[k];
+}
+
+int rawspec_hits_open(rawspec_hits_t * h, const char * fname,
+                      const fb_hdr_t * hdr)
+{
+  h->nfpc = hdr->nfpc;
+  h->nhits = 0;
+  h->work = (float *)malloc(h->nfpc * sizeof(float));
+  if(!h->work) {
+    fprintf(stderr, "%s: cannot allocate work buffer\n", fname);
+    return -1;
+  }
+
+  h->fp = fopen(fname, "w");
+  if(!h->fp) {
+    perror(fname);
+    free(h->work);
+    h->work = NULL;
+    return -1;
+  }
+
+  fprintf(h->fp, "# source_name=%s tstart=%.10f tsamp=%g fch1=%.9f foff=%g"
+      " nchans=%d nfpc=%u snr=%g\n",
+      hdr->source_name, hdr->tstart, hdr->tsamp, hdr->fch1, hdr->foff,
+      hdr->nchans, h->nfpc, h->snr);
+  fprintf(h->fp, "spectrum,mjd,freq_mhz,snr,ant,coarse_chan,fine_chan,power\n");
+
+  return 0;
+}
+
+int rawspec_hits_find(rawspec_hits_t * h, const fb_hdr_t * hdr,
+                      const float * pwr, unsigned int nspec,
+                      unsigned int nants, const unsigned int * ants,
+                      uint64_t spectrum0)
+{
+  const unsigned int nfpc = h->nfpc;
+  const unsigned int ncpa = hdr->nchans / nfpc; // Coarse channels per antenna
+  const unsigned int dc = nfpc / 2;             // DC fine channel
+  const float * x;
+  unsigned int d;
+  unsigned int c;
+  unsigned int k;
+  unsigned int peak;
+  float median;
+  float sigma;
+  double mjd;
+
+  if(!h->fp) {
+    return 0;
+  }
+
+  for(d=0; d < nspec; d++) {
+    mjd = fb_spectrum_mjd(hdr, spectrum0 + d);
+    for(c=0; c < nants*ncpa; c++) {
+      x = pwr + ((size_t)d*nants*ncpa + c) * nfpc;
+
+      // Robust noise statistics of the coarse channel
+      memcpy(h->work, x, nfpc * sizeof(float));
+      median = select_kth(h->work, nfpc, nfpc / 2);
+      for(k=0; k < nfpc; k++) {
+        h->work[k] = fabsf(x[k] - median);
+      }
+      sigma = MAD_TO_SIGMA * select_kth(h->work, nfpc, nfpc / 2);
+      // Skip coarse channels without noise (e.g. missing data)
+      if(!(sigma > 0)) {
+        continue;
+      }
+
+      // Report the peak of each run of fine channels above the threshold
+      k = 0;
+      while(k < nfpc) {
+        if(k == dc || (x[k] - median) / sigma < h->snr) {
+          k++;
+          continue;
+        }
+        peak = k;
+        while(k < nfpc && k != dc && (x[k] - median) / sigma >= h->snr) {
+          if(x[k] > x[peak]) {
+            peak = k;
+          }
+          k++;
+        }
+        fprintf(h->fp, "%lu,%.10f,%.9f,%.2f,%u,%u,%u,%g\n",
+            (unsigned long)(spectrum0 + d), mjd,
+            hdr->fch1 + ((double)(c % ncpa) * nfpc + peak) * hdr->foff,
+            (x[peak] - median) / sigma,
+            ants ? ants[c / ncpa] : c / ncpa,
+            c % ncpa, peak, x[peak]);
+        h->nhits++;
+      }
+    }
+  }
+
+  if(ferror(h->fp)) {
+    fprintf(stderr, "HITS-WRITE-ERROR\n");
+    return -1;
+  }
+  return 0;
+}
+
+int rawspec_hits_close(rawspec_hits_t * h)
+{
+  int rc = 0;
+
+  if(h->fp) {
+    if(fclose(h->fp)) {
+      perror("hits");
+      rc = -1;
+    }
+    h->fp = NULL;
+  }
+  free(h->work);
+  h->work = NULL;
+
+  return rc;
+}
@@ -0,0 +1,67 @@
+#ifndef _RAWSPEC_HITS_H_
+#define _RAWSPEC_HITS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rawspec_fbutils.h"
+
+// Narrowband hit detection
+//
+// After each dump of a total power output product, each coarse channel of
+// each spectrum is normalized by the median and median absolute deviation
+// (MAD) of its fine channels, i.e. the SNR of fine channel k is
+//
+//   SNR = (P[k] - median(P)) / (1.4826 * MAD(P))
+//
+// (1.4826 * MAD is the standard deviation of Gaussian noise).  Fine channels
+// whose SNR reaches the threshold are reported as hits.  A run of adjacent
+// fine channels above the threshold is reported as one hit at its peak, so a
+// narrowband signal spread over neighboring fine channels gives one hit.  The
+// center (DC) fine channel of each coarse channel is skipped.
+//
+// Hits are written to a CSV file with one line per hit:
+//
+//   spectrum,mjd,freq_mhz,snr,ant,coarse_chan,fine_chan,power
+//
+// where spectrum is the index of the spectrum in the stem, mjd is its start
+// time, and coarse_chan and fine_chan are counted from 0 within antenna ant.
+// The column names are preceded by a comment line (starting with '#')
+// describing the output product.
+
+typedef struct {
+  FILE * fp;                    // Hits file (NULL if not open)
+  float snr;                    // SNR threshold (0 if disabled)
+  unsigned int nfpc;            // Fine channels per coarse channel
+  float * work;                 // Work buffer (nfpc floats)
+  uint64_t nhits;               // Hits written to fp
+} rawspec_hits_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opens hits file `fname` for output product `hdr` and writes its comment
+// and column names.  Returns 0 on success, -1 on error.
+int rawspec_hits_open(rawspec_hits_t * h, const char * fname,
+                      const fb_hdr_t * hdr);
+
+// Finds the hits of the `nspec` total power spectra of `pwr`, each of which
+// has `nants` antennas of hdr->nchans fine channels, and writes them to the
+// hits file.  `spectrum0` is the index of the first spectrum in the stem.
+// `ants` holds the antenna numbers (NULL for 0..nants-1).  Returns 0 on
+// success, -1 on error.
+int rawspec_hits_find(rawspec_hits_t * h, const fb_hdr_t * hdr,
+                      const float * pwr, unsigned int nspec,
+                      unsigned int nants, const unsigned int * ants,
+                      uint64_t spectrum0);
+
+// Closes the hits file (if open) and frees the work buffer.  Returns 0 on
+// success, -1 on error.
+int rawspec_hits_close(rawspec_hits_t * h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RAWSPEC_HITS_H_
@@ -0,0 +1,1249 @@
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "rawspec_input.h"
+
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
+#define ELAPSED_SEC(start,stop) \
+  ((stop.tv_sec-start.tv_sec)+(stop.tv_nsec-start.tv_nsec)/1e9)
+
+// Reads `bytes_to_read` bytes from `fd` into the buffer pointed to by `buf`.
+// Returns the total bytes read or -1 on error.  A non-negative return value
+// will be less than `bytes_to_read` only of EOF is reached.
+ssize_t read_fully(int fd, void * buf, size_t bytes_to_read)
+{
+  ssize_t bytes_read;
+  ssize_t total_bytes_read = 0;
+
+  while(bytes_to_read > 0) {
+    bytes_read = read(fd, buf, bytes_to_read);
+    if(bytes_read <= 0) {
+      if(bytes_read == 0) {
+        break;
+      } else {
+        return -1;
+      }
+    }
+    buf += bytes_read;
+    bytes_to_read -= bytes_read;
+    total_bytes_read += bytes_read;
+  }
+
+  return total_bytes_read;
+}
+
+// Builds the name of file `fi` of `stem` in `fname`, which must have room for
+// PATH_MAX+1 chars.
+static void rawspec_input_fname(char * fname, const char * stem, int fi)
+{
+  snprintf(fname, PATH_MAX, "%s.%04d.raw", stem, fi);
+  fname[PATH_MAX] = '\0';
+}
+
+// Returns the PKTIDX of the first block in file `fi` of `stem`, or -1 if the
+// file cannot be opened or read.
+static int64_t get_first_pktidx(const char * stem, int fi)
+{
+  int fd;
+  char fname[PATH_MAX+1];
+  rawspec_raw_hdr_t raw_hdr;
+  int64_t pktidx = -1;
+
+  rawspec_input_fname(fname, stem, fi);
+  fd = open(fname, O_RDONLY);
+  if(fd != -1) {
+    if(rawspec_raw_read_header(fd, &raw_hdr) > 0) {
+      pktidx = raw_hdr.pktidx;
+    }
+    close(fd);
+  }
+  return pktidx;
+}
+
+// Returns the index of the last file of `stem`, starting at file `fi`, whose
+// first block has a PKTIDX less than or equal to `pktidx`.  File `fi` itself is
+// assumed to meet that criterion.  Files are binary searched by reading only
+// their first header.
+static int find_file_for_pktidx(const char * stem, int fi, int64_t pktidx)
+{
+  int lo = fi;
+  int hi;
+  int mid;
+  int64_t mid_pktidx;
+  char fname[PATH_MAX+1];
+
+  // Count files
+  for(hi = fi+1; ; hi++) {
+    rawspec_input_fname(fname, stem, hi);
+    if(access(fname, R_OK) != 0) {
+      break;
+    }
+  }
+
+  // File lo always starts at or before pktidx, file hi is beyond the search
+  // range or starts after pktidx.
+  while(hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    mid_pktidx = get_first_pktidx(stem, mid);
+    if(mid_pktidx != -1 && mid_pktidx <= pktidx) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+// Sets up an inotify watch on the directory containing the stem's files.  If
+// that fails, in->inotify_fd is left as -1 and waiting falls back to polling.
+static void rawspec_input_watch(rawspec_input_t * in)
+{
+  char dir[PATH_MAX+1];
+  char * slash;
+
+  in->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(in->inotify_fd == -1) {
+    return;
+  }
+
+  strncpy(dir, in->stem, PATH_MAX);
+  dir[PATH_MAX] = '\0';
+  slash = strrchr(dir, '/');
+  if(!slash) {
+    strcpy(dir, ".");
+  } else if(slash == dir) {
+    slash[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+
+  if(inotify_add_watch(in->inotify_fd, dir,
+        IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) == -1) {
+    close(in->inotify_fd);
+    in->inotify_fd = -1;
+  }
+}
+
+// Returns non-zero if the end-of-scan marker file of the stem exists.
+static int rawspec_input_eos(rawspec_input_t * in)
+{
+  char fname[PATH_MAX+1];
+
+  snprintf(fname, PATH_MAX, "%s%s", in->stem, RAWSPEC_INPUT_EOS_SUFFIX);
+  fname[PATH_MAX] = '\0';
+  return access(fname, F_OK) == 0;
+}
+
+// Called when following and no new data is available.  Waits for a change in
+// the stem's directory or for the polling interval to elapse.  Returns 0 if the
+// caller should check for new data again, or -1 if following has ended (i.e.
+// the stream has been idle for longer than follow_timeout or the end-of-scan
+// marker exists).  Callers should check for new data once more after following
+// has ended.
+static int rawspec_input_idle(rawspec_input_t * in)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd;
+  struct timespec now;
+  double idle_sec;
+
+  if(in->follow_timeout <= 0 || in->ended) {
+    return -1;
+  }
+
+  if(rawspec_input_eos(in)) {
+    printf("found end-of-scan marker for %s\n", in->stem);
+    in->ended = 1;
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  idle_sec = ELAPSED_SEC(in->last_data, now);
+  if(idle_sec >= in->follow_timeout) {
+    printf("no new data for %s in %.1f seconds\n", in->stem, idle_sec);
+    in->ended = 1;
+    return -1;
+  }
+
+  if(in->inotify_fd != -1) {
+    pfd.fd = in->inotify_fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, RAWSPEC_INPUT_POLL_MS) > 0) {
+      // Drain pending events (we only care that something changed)
+      while(read(in->inotify_fd, buf, sizeof(buf)) > 0);
+    }
+  } else {
+    usleep(RAWSPEC_INPUT_POLL_MS * 1000);
+  }
+
+  return 0;
+}
+
+// Returns non-zero if the current file contains a complete header (i.e. one
+// with an END card) at the current position.
+static int rawspec_input_have_header(rawspec_input_t * in)
+{
+  char hdr[MAX_RAW_HDR_SIZE];
+  ssize_t len;
+  ssize_t i;
+
+  len = pread(in->fd, hdr, MAX_RAW_HDR_SIZE, in->pos);
+  for(i=0; i+80 <= len; i+=80) {
+    if(!strncmp(hdr+i, "END ", 4)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Makes `fd` the current file of `in`.
+static void rawspec_input_set_current(rawspec_input_t * in, int fd)
+{
+  struct stat st;
+
+  in->fd = fd;
+  in->pos = 0;
+  in->size = fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+// Opens the file after the current file as the next file (if it exists).
+static void rawspec_input_open_next(rawspec_input_t * in)
+{
+  char fname[PATH_MAX+1];
+
+  rawspec_input_fname(fname, in->stem, in->fi+1);
+  in->next_fd = open(fname, O_RDONLY);
+  in->next_prefetched = 0;
+  if(in->next_fd != -1) {
+    posix_fadvise(in->next_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+}
+
+// Updates the size of the current file and, when following, tries to open
+// the next file if it has not been opened yet.  The next file is checked first
+// so that once it exists, the size of the current file is known to be final.
+static void rawspec_input_refresh(rawspec_input_t * in)
+{
+  struct stat st;
+
+  if(in->next_fd == -1) {
+    rawspec_input_open_next(in);
+    if(in->next_fd != -1) {
+      clock_gettime(CLOCK_MONOTONIC, &in->last_data);
+    }
+  }
+
+  if(fstat(in->fd, &st) == 0 && st.st_size > in->size) {
+    in->size = st.st_size;
+    clock_gettime(CLOCK_MONOTONIC, &in->last_data);
+  }
+}
+
+// When following, waits until the current file has at least `len` bytes
+// beyond the current position (or, if `header` is non-zero, a complete header
+// at the current position) or the current file is complete (i.e. the next file
+// exists or following has ended).
+static void rawspec_input_follow(rawspec_input_t * in, off_t len, int header)
+{
+  if(in->follow_timeout <= 0) {
+    return;
+  }
+
+  for(;;) {
+    rawspec_input_refresh(in);
+    if(in->size - in->pos >= len || in->next_fd != -1 || in->ended
+    || (header && rawspec_input_have_header(in))) {
+      break;
+    }
+    if(rawspec_input_idle(in)) {
+      rawspec_input_refresh(in);
+      break;
+    }
+  }
+}
+
+// Starts prefetching the next file once the current position is within
+// prefetch_size bytes of the end of the current file.
+static void rawspec_input_prefetch(rawspec_input_t * in)
+{
+  if(in->next_fd != -1 && !in->next_prefetched
+  && in->size - in->pos <= in->prefetch_size) {
+    posix_fadvise(in->next_fd, 0, in->prefetch_size, POSIX_FADV_WILLNEED);
+    in->next_prefetched = 1;
+  }
+}
+
+// Closes the current file and makes the next file the current file.
+// Returns 0 on success, -1 if the next file could not be opened.
+static int rawspec_input_next_file(rawspec_input_t * in)
+{
+  int fd = in->next_fd;
+
+  close(in->fd);
+  in->fd = -1;
+  in->next_fd = -1;
+  in->fi++;
+  rawspec_input_fname(in->fname, in->stem, in->fi);
+
+  printf("opening file: %s", in->fname);
+  // If the next file did not exist when the current file was opened, it might
+  // now.
+  if(fd == -1) {
+    fd = open(in->fname, O_RDONLY);
+    if(fd == -1) {
+      printf(" [%s]\n", strerror(errno));
+      return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  printf("\n");
+
+  rawspec_input_set_current(in, fd);
+  rawspec_input_open_next(in);
+  return 0;
+}
+
+// Updates position and prefetch size of `in` after reading the header of a
+// block whose data starts at `pos`.
+static void rawspec_input_got_header(rawspec_input_t * in, off_t pos,
+                                     const rawspec_raw_hdr_t * raw_hdr)
+{
+  in->pos = pos;
+  // Prefetch two blocks worth of the next file
+  in->prefetch_size = 2 * (pos - raw_hdr->hdr_pos + raw_hdr->blocsize);
+  rawspec_input_prefetch(in);
+}
+
+// Returns a pointer to block `bi` of the shared memory ring buffer of `in`.
+static char * rawspec_shm_block(rawspec_input_t * in, int bi)
+{
+  return (char *)in->ring + in->ring->header_size
+                          + (size_t)bi * in->ring->block_size;
+}
+
+// Attaches to the shared memory ring buffer named by the stem of `in`.
+// Returns 0 on success, -1 on error.
+static int rawspec_shm_open(rawspec_input_t * in)
+{
+  const char * spec = in->stem + strlen(RAWSPEC_INPUT_SHM_PREFIX);
+  char * end;
+  key_t key;
+  int shmid;
+  void * shm;
+
+  key = (key_t)strtol(spec, &end, 0);
+  in->shm_hdr_size = RAWSPEC_INPUT_SHM_HDR_SIZE;
+  if(end != spec && *end == ':') {
+    in->shm_hdr_size = strtoul(end+1, &end, 0);
+  }
+  if(end == spec || *end != '\0' || in->shm_hdr_size < 80) {
+    fprintf(stderr, "invalid shared memory input: %s\n", in->stem);
+    return -1;
+  }
+  snprintf(in->output_stem, PATH_MAX, "shm_%.*s",
+      (int)strcspn(spec, ":"), spec);
+
+  printf("attaching to shared memory: %s", in->stem);
+  shmid = shmget(key, 0, 0);
+  if(shmid == -1 || (shm = shmat(shmid, NULL, SHM_RDONLY)) == (void *)-1) {
+    printf(" [%s]\n", strerror(errno));
+    return -1;
+  }
+  in->ring = (rawspec_shm_ring_t *)shm;
+  printf(" [%d blocks of %lu bytes]\n", in->ring->n_block,
+      in->ring->block_size);
+
+  if(in->ring->n_block <= 0 || in->ring->block_size <= in->shm_hdr_size) {
+    fprintf(stderr, "bad shared memory ring geometry: %d blocks of %lu bytes\n",
+        in->ring->n_block, in->ring->block_size);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Waits for block `bi` of the ring to be filled.  Returns 0 once it is filled,
+// or -1 if the ring has been idle for longer than follow_timeout or on error.
+static int rawspec_shm_wait_filled(rawspec_input_t * in, int bi)
+{
+  // Wait for the semaphore to be 1 without changing it
+  struct sembuf op[2] = {
+    {.sem_num = bi, .sem_op = -1, .sem_flg = 0},
+    {.sem_num = bi, .sem_op = +1, .sem_flg = 0}
+  };
+  struct timespec timeout = {0, RAWSPEC_INPUT_POLL_MS * 1000000L};
+  struct timespec now;
+  double idle_sec;
+
+  for(;;) {
+    if(semtimedop(in->ring->semid, op, 2, &timeout) == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &in->last_data);
+      return 0;
+    }
+    if(errno != EAGAIN && errno != EINTR) {
+      perror("semtimedop");
+      return -1;
+    }
+    if(in->follow_timeout > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      idle_sec = ELAPSED_SEC(in->last_data, now);
+      if(idle_sec >= in->follow_timeout) {
+        printf("no new data for %s in %.1f seconds\n", in->stem, idle_sec);
+        in->ended = 1;
+        return -1;
+      }
+    }
+  }
+}
+
+// Marks the current block as free (if it is held) and moves on to the next
+// block of the ring.
+static void rawspec_shm_release(rawspec_input_t * in)
+{
+  struct sembuf op = {.sem_num = in->shm_block, .sem_op = -1,
+                      .sem_flg = IPC_NOWAIT};
+
+  if(in->shm_held) {
+    semop(in->ring->semid, &op, 1);
+    in->shm_held = 0;
+    in->shm_block = (in->shm_block + 1) % in->ring->n_block;
+  }
+}
+
+// Parses the obs params of the current block into `raw_hdr` and positions the
+// stream at the start of its data.  Returns the offset of the data within the
+// block, 0 at an end-of-stream block, or -1 on error.
+static off_t rawspec_shm_parse_header(rawspec_input_t * in,
+                                      rawspec_raw_hdr_t * raw_hdr)
+{
+  char * blk = rawspec_shm_block(in, in->shm_block);
+
+  if(!strncmp(blk, "END ", 4)) {
+    printf("found end-of-stream block in %s\n", in->stem);
+    in->ended = 1;
+    return 0;
+  }
+
+  if(rawspec_raw_buf_read_header(blk, in->shm_hdr_size, raw_hdr) <= 0) {
+    fprintf(stderr, "error getting obs params from %s block %d\n",
+        in->stem, in->shm_block);
+    return -1;
+  }
+  if(raw_hdr->blocsize > in->ring->block_size - in->shm_hdr_size) {
+    fprintf(stderr, "BLOCSIZE %lu exceeds %s block size\n",
+        raw_hdr->blocsize, in->stem);
+    return -1;
+  }
+
+  raw_hdr->hdr_pos = 0;
+  in->pos = in->shm_hdr_size;
+  in->size = in->shm_hdr_size + raw_hdr->blocsize;
+  return in->pos;
+}
+
+// Frees the current block (if held), waits for the next block to be filled,
+// and parses its obs params into `raw_hdr`.  Return values are the same as for
+// rawspec_input_read_header().
+static off_t rawspec_shm_read_header(rawspec_input_t * in,
+                                     rawspec_raw_hdr_t * raw_hdr)
+{
+  if(in->ended) {
+    return 0;
+  }
+
+  rawspec_shm_release(in);
+  if(rawspec_shm_wait_filled(in, in->shm_block)) {
+    return in->ended ? 0 : -1;
+  }
+  in->shm_held = 1;
+
+  return rawspec_shm_parse_header(in, raw_hdr);
+}
+
+// Listens on the local address `addr` (given as [HOST]:PORT) and accepts one
+// TCP connection.  Returns the connected socket, or -1 on error.
+static int rawspec_stream_listen(const char * addr)
+{
+  int rc;
+  int sfd = -1;
+  int cfd;
+  int one = 1;
+  int rcvbuf = 16*1024*1024;
+  char host[PATH_MAX+1];
+  char * port;
+  struct addrinfo hints;
+  struct addrinfo * result;
+  struct addrinfo * rp;
+
+  strncpy(host, addr, PATH_MAX);
+  host[PATH_MAX] = '\0';
+  port = strrchr(host, ':');
+  if(!port) {
+    fprintf(stderr, "invalid TCP input address: %s\n", addr);
+    return -1;
+  }
+  *port++ = '\0';
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;        // Allow IPv4 only (for now)
+  hints.ai_socktype = SOCK_STREAM;  // Stream socket
+  hints.ai_flags = AI_PASSIVE;      // For bind(2)
+
+  rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &result);
+  if (rc != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+    return -1;
+  }
+
+  // Try each address until we successfully bind(2)
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sfd == -1)
+      continue;
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
+      break; // Success
+
+    close(sfd);
+    sfd = -1;
+  }
+
+  freeaddrinfo(result); // No longer needed
+
+  if(sfd == -1 || listen(sfd, 1) == -1) {
+    fprintf(stderr, "could not listen on %s [%s]\n", addr, strerror(errno));
+    if(sfd != -1) {
+      close(sfd);
+    }
+    return -1;
+  }
+
+  printf("listening for connection on %s\n", addr);
+  fflush(stdout);
+  cfd = accept(sfd, NULL, NULL);
+  close(sfd);
+  if(cfd == -1) {
+    perror("accept");
+    return -1;
+  }
+
+  // A large receive buffer helps keep up with bursty senders (best effort)
+  setsockopt(cfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  return cfd;
+}
+
+// Opens the byte stream named by the stem of `in`.  Returns 0 on success, -1
+// on error.
+static int rawspec_stream_open(rawspec_input_t * in)
+{
+  in->hdr_buf = malloc(MAX_RAW_HDR_SIZE);
+  in->skip_buf = malloc(RAWSPEC_INPUT_SKIP_SIZE);
+  if(!in->hdr_buf || !in->skip_buf) {
+    fprintf(stderr, "cannot allocate input stream buffers\n");
+    return -1;
+  }
+
+  if(!strcmp(in->stem, RAWSPEC_INPUT_STDIN)) {
+    strcpy(in->output_stem, "stdin");
+    printf("reading stdin\n");
+    in->fd = STDIN_FILENO;
+  } else {
+    in->fd = rawspec_stream_listen(in->stem + strlen(RAWSPEC_INPUT_TCP_PREFIX));
+    if(in->fd == -1) {
+      return -1;
+    }
+    snprintf(in->output_stem, PATH_MAX, "tcp_%s",
+        strrchr(in->stem, ':') + 1);
+    printf("accepted connection on %s\n", in->stem);
+  }
+
+  in->pos = 0;
+  in->size = 0;
+  in->blk_pos = 0;
+  return 0;
+}
+
+// Consumes `len` bytes from the byte stream of `in`.
+// Returns the new offset within the stream or -1 on error (or EOF).
+static off_t rawspec_stream_consume(rawspec_input_t * in, off_t len)
+{
+  ssize_t bytes_read;
+
+  while(len > 0) {
+    bytes_read = read(in->fd, in->skip_buf, MIN(len, RAWSPEC_INPUT_SKIP_SIZE));
+    if(bytes_read <= 0) {
+      if(bytes_read == -1 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    len -= bytes_read;
+    in->pos += bytes_read;
+  }
+  return in->pos;
+}
+
+// Parses the obs params of the header in hdr_buf into `raw_hdr`.  Returns the
+// offset of the block's data within the stream, or -1 on error.
+static off_t rawspec_stream_parse_header(rawspec_input_t * in,
+                                         rawspec_raw_hdr_t * raw_hdr)
+{
+  if(rawspec_raw_buf_read_header(in->hdr_buf, in->hdr_len, raw_hdr) <= 0) {
+    fprintf(stderr, "error getting obs params from %s\n", in->stem);
+    return -1;
+  }
+  raw_hdr->hdr_pos = in->hdr_pos;
+  return in->blk_pos;
+}
+
+// Consumes the rest of the current block and reads the header of the next
+// block from the byte stream.  Return values are the same as for
+// rawspec_input_read_header().
+static off_t rawspec_stream_read_header(rawspec_input_t * in,
+                                        rawspec_raw_hdr_t * raw_hdr)
+{
+  ssize_t bytes_read;
+  size_t len;
+  int hdr_size;
+
+  if(in->pos < in->size && rawspec_stream_consume(in, in->size - in->pos) == -1) {
+    fprintf(stderr, "incomplete block at end of %s\n", in->stem);
+    return 0;
+  }
+
+  // Read 80 byte header records up to and including the END record
+  for(len=0; len < MAX_RAW_HDR_SIZE; len += 80) {
+    bytes_read = read_fully(in->fd, in->hdr_buf + len, 80);
+    if(bytes_read != 80) {
+      if(bytes_read == -1) {
+        fprintf(stderr, "error reading header from %s [%s]\n",
+            in->stem, strerror(errno));
+        return -1;
+      } else if(len > 0 || bytes_read > 0) {
+        fprintf(stderr, "incomplete header at end of %s\n", in->stem);
+      } else if(in->pos == 0) {
+        fprintf(stderr, "no data found in %s\n", in->stem);
+      }
+      return 0;
+    }
+    if(!strncmp(in->hdr_buf + len, "END ", 4)) {
+      len += 80;
+      break;
+    }
+  }
+
+  hdr_size = rawspec_raw_buf_read_header(in->hdr_buf, len, raw_hdr);
+  if(hdr_size <= 0) {
+    fprintf(stderr, "error getting obs params from %s\n", in->stem);
+    return -1;
+  }
+  in->hdr_len = len;
+  in->hdr_pos = in->pos;
+  in->pos += len;
+
+  // Consume any DIRECTIO padding
+  if(rawspec_stream_consume(in, hdr_size - len) == -1) {
+    fprintf(stderr, "incomplete header at end of %s\n", in->stem);
+    return 0;
+  }
+
+  raw_hdr->hdr_pos = in->hdr_pos;
+  in->blk_pos = in->pos;
+  in->size = in->pos + raw_hdr->blocsize;
+  return in->pos;
+}
+
+// Gets the next frame from the RAWZ reader of `in` and parses its obs params
+// into `raw_hdr`.  Return values are the same as for
+// rawspec_input_read_header().
+static off_t rawspec_rawz_read_header(rawspec_input_t * in,
+                                      rawspec_raw_hdr_t * raw_hdr)
+{
+  int rc;
+  rawspec_rawz_frame_t * f;
+  // Whether no block has been read yet
+  int first = (in->frame == NULL);
+
+  rc = rawspec_rawz_next(in->rawz, &in->frame);
+  if(rc <= 0) {
+    in->frame = NULL;
+    if(rc == 0 && first) {
+      fprintf(stderr, "no data found in %s\n", in->fname);
+    }
+    return rc;
+  }
+  f = in->frame;
+
+  if(f->fi != in->fi) {
+    in->fi = f->fi;
+    rawspec_rawz_fname(in->fname, in->stem, in->fi);
+  }
+  if(rawspec_raw_buf_read_header(f->hdr, f->hdr_len, raw_hdr) <= 0) {
+    fprintf(stderr, "error getting obs params from %s\n", in->fname);
+    return -1;
+  }
+  if(f->dsize != raw_hdr->blocsize) {
+    fprintf(stderr, "ZBLOCSIZ decompresses to %lu bytes, not BLOCSIZE, in %s\n",
+        f->dsize, in->fname);
+    return -1;
+  }
+  raw_hdr->hdr_pos = f->hdr_pos;
+
+  // Positions are within the decompressed data of the current block
+  in->pos = 0;
+  in->size = f->dsize;
+  return f->hdr_pos + f->hdr_len;
+}
+
+int rawspec_input_open(rawspec_input_t * in, const char * stem, int fi)
+{
+  int fd;
+
+  // Initialize every field (except the caller-set follow_timeout) before
+  // branching so that rawspec_input_close() is safe on any error path
+  in->type = RAWSPEC_INPUT_FILES;
+  in->stem = stem;
+  in->fi = fi;
+  in->fd = -1;
+  in->fname[0] = '\0';
+  in->pos = 0;
+  in->size = 0;
+  in->next_fd = -1;
+  in->next_prefetched = 0;
+  in->prefetch_size = RAWSPEC_INPUT_PREFETCH_SIZE;
+  in->inotify_fd = -1;
+  in->ended = 0;
+  in->ring = NULL;
+  in->shm_hdr_size = 0;
+  in->shm_block = 0;
+  in->shm_held = 0;
+  in->hdr_buf = NULL;
+  in->hdr_len = 0;
+  in->hdr_pos = 0;
+  in->blk_pos = 0;
+  in->skip_buf = NULL;
+  in->rawz = NULL;
+  in->frame = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &in->last_data);
+  strncpy(in->output_stem, stem, PATH_MAX);
+  in->output_stem[PATH_MAX] = '\0';
+
+  if(!strcmp(stem, RAWSPEC_INPUT_STDIN)
+  || !strncmp(stem, RAWSPEC_INPUT_TCP_PREFIX,
+              strlen(RAWSPEC_INPUT_TCP_PREFIX))) {
+    in->type = RAWSPEC_INPUT_STREAM;
+    strncpy(in->fname, stem, PATH_MAX);
+    in->fname[PATH_MAX] = '\0';
+    if(rawspec_stream_open(in)) {
+      rawspec_input_close(in);
+      return -1;
+    }
+    return 0;
+  }
+
+  if(!strncmp(stem, RAWSPEC_INPUT_SHM_PREFIX,
+              strlen(RAWSPEC_INPUT_SHM_PREFIX))) {
+    in->type = RAWSPEC_INPUT_SHM;
+    strncpy(in->fname, stem, PATH_MAX);
+    in->fname[PATH_MAX] = '\0';
+    if(rawspec_shm_open(in)) {
+      rawspec_input_close(in);
+      return -1;
+    }
+    return 0;
+  }
+
+  rawspec_input_fname(in->fname, stem, fi);
+
+  // Use RAWZ files if there is no RAW file (and not following)
+  if(in->follow_timeout <= 0 && access(in->fname, F_OK) != 0) {
+    rawspec_rawz_fname(in->fname, stem, fi);
+    if(access(in->fname, F_OK) == 0) {
+      in->type = RAWSPEC_INPUT_RAWZ;
+      in->rawz = rawspec_rawz_open(stem, fi, 0);
+      if(!in->rawz) {
+        rawspec_input_close(in);
+        return -1;
+      }
+      return 0;
+    }
+    rawspec_input_fname(in->fname, stem, fi);
+  }
+
+  if(in->follow_timeout > 0) {
+    rawspec_input_watch(in);
+  }
+
+  fd = open(in->fname, O_RDONLY);
+  // When following, wait for file to appear
+  if(fd == -1 && errno == ENOENT && in->follow_timeout > 0) {
+    printf("waiting for file: %s\n", in->fname);
+    fflush(stdout);
+    while(fd == -1 && rawspec_input_idle(in) == 0) {
+      fd = open(in->fname, O_RDONLY);
+    }
+    if(fd == -1) {
+      // Check once more after following has ended
+      fd = open(in->fname, O_RDONLY);
+    }
+    if(fd == -1) {
+      errno = ENOENT;
+    }
+  }
+  printf("opening file: %s", in->fname);
+  if(fd == -1) {
+    printf(" [%s]\n", strerror(errno));
+    rawspec_input_close(in);
+    return -1;
+  }
+  printf("\n");
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  rawspec_input_set_current(in, fd);
+  rawspec_input_open_next(in);
+  return 0;
+}
+
+off_t rawspec_input_read_header(rawspec_input_t * in,
+                                rawspec_raw_hdr_t * raw_hdr)
+{
+  off_t pos;
+  // Whether this is the first header of the current file
+  int first = (in->pos == 0);
+
+  if(in->type == RAWSPEC_INPUT_SHM) {
+    return rawspec_shm_read_header(in, raw_hdr);
+  }
+  if(in->type == RAWSPEC_INPUT_STREAM) {
+    return rawspec_stream_read_header(in, raw_hdr);
+  }
+  if(in->type == RAWSPEC_INPUT_RAWZ) {
+    return rawspec_rawz_read_header(in, raw_hdr);
+  }
+
+  rawspec_input_follow(in, MAX_RAW_HDR_SIZE, /*header*/ 1);
+  pos = rawspec_raw_read_header(in->fd, raw_hdr);
+
+  // If end of current file, continue with next file
+  if(pos == 0 && !first) {
+    if(rawspec_input_next_file(in)) {
+      return 0;
+    }
+    first = 1;
+    rawspec_input_follow(in, MAX_RAW_HDR_SIZE, /*header*/ 1);
+    pos = rawspec_raw_read_header(in->fd, raw_hdr);
+  }
+
+  if(pos <= 0) {
+    if(pos == -1) {
+      if(first) {
+        fprintf(stderr, "error getting obs params from %s\n", in->fname);
+      } else {
+        fprintf(stderr, "error getting obs params from %s [%s]\n",
+                in->fname, strerror(errno));
+      }
+    } else if(first) {
+      fprintf(stderr, "no data found in %s\n", in->fname);
+    }
+    return pos;
+  }
+
+  rawspec_input_got_header(in, pos, raw_hdr);
+  return pos;
+}
+
+ssize_t rawspec_input_read(rawspec_input_t * in, void * buf, size_t len)
+{
+  ssize_t bytes_read;
+
+  if(in->type == RAWSPEC_INPUT_SHM || in->type == RAWSPEC_INPUT_RAWZ) {
+    if(len > in->size - in->pos) {
+      len = in->size - in->pos;
+    }
+    if(in->type == RAWSPEC_INPUT_SHM) {
+      memcpy(buf, rawspec_shm_block(in, in->shm_block) + in->pos, len);
+    } else {
+      memcpy(buf, in->frame->data + in->pos, len);
+    }
+    in->pos += len;
+    return len;
+  }
+
+  if(in->type == RAWSPEC_INPUT_STREAM) {
+    bytes_read = read_fully(in->fd, buf, len);
+    if(bytes_read > 0) {
+      in->pos += bytes_read;
+    }
+    return bytes_read;
+  }
+
+  rawspec_input_follow(in, len, /*header*/ 0);
+  bytes_read = read_fully(in->fd, buf, len);
+
+  if(bytes_read > 0) {
+    in->pos += bytes_read;
+    rawspec_input_prefetch(in);
+  }
+  return bytes_read;
+}
+
+// Reads the `niov` buffers of `iov` from `fd` starting at offset `off`,
+// retrying after short reads.  `iov` is modified.  Returns the total bytes
+// read (less than the total length only at EOF) or -1 on error.
+static ssize_t preadv_fully(int fd, struct iovec * iov, int niov, off_t off)
+{
+  ssize_t total = 0;
+  ssize_t bytes_read;
+
+  while(niov > 0) {
+    bytes_read = preadv(fd, iov, niov, off + total);
+    if(bytes_read == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return -1;
+    } else if(bytes_read == 0) {
+      break; // EOF
+    }
+    total += bytes_read;
+
+    // Advance past fully read buffers and into a partially read one
+    while(niov > 0 && bytes_read >= iov->iov_len) {
+      bytes_read -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if(niov > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytes_read;
+      iov->iov_len -= bytes_read;
+    }
+  }
+
+  return total;
+}
+
+ssize_t rawspec_input_read_segs(rawspec_input_t * in,
+                                const rawspec_input_seg_t * segs, int nsegs,
+                                size_t blocsize, void * buf)
+{
+  struct iovec iov[IOV_MAX];
+  int niov = 0;
+  off_t start = in->pos;   // File offset of block data
+  off_t off = 0;           // Block offset of end of last range
+  off_t iov_off = 0;       // Block offset of start of pending iov
+  size_t iov_len = 0;      // Total length of pending iov
+  size_t data_len = 0;     // Range bytes in pending iov
+  ssize_t total = 0;
+  ssize_t bytes_read;
+  char * dst = buf;
+  int i;
+
+  // Other input types copy or consume the ranges one at a time
+  if(in->type != RAWSPEC_INPUT_FILES) {
+    for(i=0; i<nsegs; i++) {
+      if(rawspec_input_skip(in, segs[i].offset - off) == -1) {
+        return -1;
+      }
+      bytes_read = rawspec_input_read(in, dst, segs[i].len);
+      if(bytes_read <= 0) {
+        return bytes_read ? -1 : total;
+      }
+      total += bytes_read;
+      dst += bytes_read;
+      if(bytes_read < segs[i].len) {
+        return total;
+      }
+      off = segs[i].offset + segs[i].len;
+    }
+    if(rawspec_input_skip(in, blocsize - off) == -1) {
+      return -1;
+    }
+    return total;
+  }
+
+  if(!in->skip_buf) {
+    in->skip_buf = malloc(RAWSPEC_INPUT_GAP_SIZE);
+    if(!in->skip_buf) {
+      return -1;
+    }
+  }
+
+  rawspec_input_follow(in, blocsize, /*header*/ 0);
+
+  for(i=0; i<=nsegs; i++) {
+    // Issue pending reads before a large gap, when out of iovs, or at the end
+    if(niov > 0 && (i == nsegs || niov >= IOV_MAX - 1
+                 || segs[i].offset - off > RAWSPEC_INPUT_GAP_SIZE)) {
+      bytes_read = preadv_fully(in->fd, iov, niov, start + iov_off);
+      if(bytes_read == -1) {
+        return -1;
+      } else if(bytes_read < iov_len) {
+        // EOF, count only range bytes that are known to have been read
+        return total;
+      }
+      total += data_len;
+      niov = 0;
+      iov_len = 0;
+      data_len = 0;
+    }
+    if(i == nsegs) {
+      break;
+    }
+
+    if(niov == 0) {
+      iov_off = segs[i].offset;
+    } else if(segs[i].offset > off) {
+      // Read small gap into scratch buffer
+      iov[niov].iov_base = in->skip_buf;
+      iov[niov].iov_len = segs[i].offset - off;
+      iov_len += iov[niov++].iov_len;
+    }
+    iov[niov].iov_base = dst;
+    iov[niov].iov_len = segs[i].len;
+    iov_len += segs[i].len;
+    data_len += segs[i].len;
+    niov++;
+    dst += segs[i].len;
+    off = segs[i].offset + segs[i].len;
+  }
+
+  // Position stream at end of block data
+  if(lseek(in->fd, start + blocsize, SEEK_SET) == -1) {
+    return -1;
+  }
+  in->pos = start + blocsize;
+  rawspec_input_prefetch(in);
+
+  return total;
+}
+
+off_t rawspec_input_skip(rawspec_input_t * in, off_t len)
+{
+  off_t pos;
+
+  // Avoid a syscall when not skipping
+  if(len == 0) {
+    return in->pos;
+  }
+
+  if(in->type == RAWSPEC_INPUT_SHM || in->type == RAWSPEC_INPUT_RAWZ) {
+    in->pos += len;
+    return in->pos;
+  }
+
+  if(in->type == RAWSPEC_INPUT_STREAM) {
+    return rawspec_stream_consume(in, len);
+  }
+
+  pos = lseek(in->fd, len, SEEK_CUR);
+  if(pos != -1) {
+    in->pos = pos;
+    rawspec_input_prefetch(in);
+  }
+  return pos;
+}
+
+off_t rawspec_input_peek_header(rawspec_input_t * in,
+                                const rawspec_raw_hdr_t * raw_hdr,
+                                rawspec_raw_hdr_t * next_hdr)
+{
+  off_t cur;
+  off_t pos;
+  int bi;
+  rawspec_rawz_frame_t * frame;
+
+  if(in->type == RAWSPEC_INPUT_SHM) {
+    // The producer cannot fill the next block of a single block ring before
+    // the current block is freed
+    if(in->ended || in->ring->n_block < 2) {
+      return 0;
+    }
+    bi = (in->shm_block + 1) % in->ring->n_block;
+    if(rawspec_shm_wait_filled(in, bi)) {
+      return in->ended ? 0 : -1;
+    }
+    if(!strncmp(rawspec_shm_block(in, bi), "END ", 4)) {
+      return 0;
+    }
+    return rawspec_raw_buf_read_header(rawspec_shm_block(in, bi),
+                                       in->shm_hdr_size, next_hdr);
+  }
+
+  if(in->type == RAWSPEC_INPUT_STREAM) {
+    return -1;
+  }
+
+  if(in->type == RAWSPEC_INPUT_RAWZ) {
+    if(rawspec_rawz_peek(in->rawz, &frame) <= 0) {
+      return -1;
+    }
+    return rawspec_raw_buf_read_header(frame->hdr, frame->hdr_len, next_hdr);
+  }
+
+  // Seek past current block's data, read header, and seek back
+  cur = lseek(in->fd, 0, SEEK_CUR);
+  if(cur == -1 || lseek(in->fd, in->pos + raw_hdr->blocsize, SEEK_SET) == -1) {
+    return -1;
+  }
+  rawspec_input_follow(in, raw_hdr->blocsize + MAX_RAW_HDR_SIZE, /*header*/ 0);
+  pos = rawspec_raw_read_header(in->fd, next_hdr);
+  lseek(in->fd, cur, SEEK_SET);
+  return pos;
+}
+
+ssize_t rawspec_input_save_header(rawspec_input_t * in, int fd,
+                                  rawspec_raw_hdr_t * raw_hdr)
+{
+  off_t hdr_pos = raw_hdr->hdr_pos;
+
+  if(in->type == RAWSPEC_INPUT_SHM) {
+    return write(fd, rawspec_shm_block(in, in->shm_block), raw_hdr->hdr_size);
+  }
+
+  if(in->type == RAWSPEC_INPUT_STREAM) {
+    return write(fd, in->hdr_buf, raw_hdr->hdr_size);
+  }
+
+  if(in->type == RAWSPEC_INPUT_RAWZ) {
+    return write(fd, in->frame->hdr, raw_hdr->hdr_size);
+  }
+
+  return sendfile(fd, in->fd, &hdr_pos, raw_hdr->hdr_size);
+}
+
+off_t rawspec_input_seek_pktidx(rawspec_input_t * in, int64_t pktidx,
+                                rawspec_raw_hdr_t * raw_hdr)
+{
+  const char * stem = in->stem;
+  char fname[PATH_MAX+1];
+  int fi;
+  off_t pos;
+
+  if(in->type == RAWSPEC_INPUT_RAWZ) {
+    if(rawspec_rawz_seek_pktidx(in->rawz, pktidx)) {
+      return -1;
+    }
+    return rawspec_rawz_read_header(in, raw_hdr);
+  }
+
+  // Ring buffer and byte stream blocks can only be consumed in order
+  if(in->type != RAWSPEC_INPUT_FILES) {
+    if(in->type == RAWSPEC_INPUT_SHM) {
+      pos = rawspec_shm_parse_header(in, raw_hdr);
+    } else {
+      pos = rawspec_stream_parse_header(in, raw_hdr);
+    }
+    while(pos > 0 && raw_hdr->pktidx < pktidx) {
+      pos = rawspec_input_read_header(in, raw_hdr);
+    }
+    return pos;
+  }
+
+  // Find file containing pktidx
+  fi = find_file_for_pktidx(stem, in->fi, pktidx);
+  if(fi != in->fi) {
+    rawspec_input_close(in);
+    if(rawspec_input_open(in, stem, fi)) {
+      return -1;
+    }
+  }
+
+  // Find first block at or after pktidx
+  pos = rawspec_raw_seek_pktidx(in->fd, pktidx, raw_hdr);
+  if(pos > 0) {
+    rawspec_input_got_header(in, pos, raw_hdr);
+    return pos;
+  }
+
+  // If pktidx falls in a gap after the last block of this file, the first
+  // block of the next file (which starts after pktidx) is the one wanted
+  if(pos == 0) {
+    rawspec_input_fname(fname, stem, in->fi + 1);
+    if(in->next_fd != -1 || access(fname, R_OK) == 0) {
+      if(rawspec_input_next_file(in)) {
+        return -1;
+      }
+      pos = rawspec_input_read_header(in, raw_hdr);
+    }
+  }
+  return pos;
+}
+
+uint64_t rawspec_input_remaining(rawspec_input_t * in)
+{
+  char fname[PATH_MAX+1];
+  struct stat sb;
+  uint64_t remaining;
+  int fi;
+
+  if(in->type != RAWSPEC_INPUT_FILES || in->follow_timeout > 0) {
+    return 0;
+  }
+
+  remaining = in->size - in->pos;
+  for(fi = in->fi + 1; ; fi++) {
+    rawspec_input_fname(fname, in->stem, fi);
+    if(stat(fname, &sb) == -1) {
+      break;
+    }
+    remaining += sb.st_size;
+  }
+  return remaining;
+}
+
+void rawspec_input_close(rawspec_input_t * in)
+{
+  if(in->rawz) {
+    rawspec_rawz_close(in->rawz);
+    in->rawz = NULL;
+    in->frame = NULL;
+  }
+  if(in->type == RAWSPEC_INPUT_STREAM) {
+    // Leave stdin open
+    if(in->fd == STDIN_FILENO) {
+      in->fd = -1;
+    }
+    free(in->hdr_buf);
+    in->hdr_buf = NULL;
+  }
+  free(in->skip_buf);
+  in->skip_buf = NULL;
+  if(in->ring) {
+    rawspec_shm_release(in);
+    shmdt(in->ring);
+    in->ring = NULL;
+  }
+  if(in->fd != -1) {
+    close(in->fd);
+    in->fd = -1;
+  }
+  if(in->next_fd != -1) {
+    close(in->next_fd);
+    in->next_fd = -1;
+  }
+  if(in->inotify_fd != -1) {
+    close(in->inotify_fd);
+    in->inotify_fd = -1;
+  }
+}
@@ -0,0 +1,224 @@
+#ifndef _RAWSPEC_INPUT_H_
+#define _RAWSPEC_INPUT_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "rawspec_rawutils.h"
+#include "rawspec_rawz.h"
+
+// Number of bytes of the next file to prefetch before any header has been
+// read (after that, two blocks worth are prefetched).
+#define RAWSPEC_INPUT_PREFETCH_SIZE (64*1024*1024)
+
+// When following files that are still being written, the longest time to wait
+// for an inotify event before checking the files again (changes made by other
+// hosts to files on network filesystems do not generate inotify events).
+#define RAWSPEC_INPUT_POLL_MS (250)
+
+// When following files that are still being written, the existence of a file
+// named STEM.done (the end-of-scan marker) indicates that the recorder has
+// finished writing the stem.
+#define RAWSPEC_INPUT_EOS_SUFFIX ".done"
+
+// Stems starting with this prefix name a shared memory ring buffer rather than
+// a sequence of RAW files.  The full syntax is "shm:KEY[:HDRSIZE]", where KEY
+// is the SysV IPC key of the ring (decimal or 0x-prefixed hex) and HDRSIZE is
+// the offset of the data within each block (i.e. the size of the header area
+// reserved at the start of each block).
+#define RAWSPEC_INPUT_SHM_PREFIX "shm:"
+
+// Default size of the header area of each shared memory ring block.  This
+// matches the BLOCK_HDR_SIZE of hpguppi_daq style recorders.
+#define RAWSPEC_INPUT_SHM_HDR_SIZE (5*80*512)
+
+// Control structure at the start of a shared memory ring buffer segment.  This
+// is the same layout as a hashpipe databuf: the `n_block` blocks of
+// `block_size` bytes each follow the first `header_size` bytes of the segment.
+// Each block holds a GUPPI RAW header at its start and the block's data at a
+// fixed offset (see RAWSPEC_INPUT_SHM_HDR_SIZE).  Semaphore `i` of the
+// `semid` semaphore set is 1 when block `i` is filled and 0 when it is free.
+// A block whose header starts with the END card marks the end of the stream.
+typedef struct {
+  char data_type[64];
+  size_t header_size;
+  size_t block_size;
+  int n_block;
+  int shmid;
+  int semid;
+} rawspec_shm_ring_t;
+
+// A stem of "-" reads a RAW byte stream from stdin.
+#define RAWSPEC_INPUT_STDIN "-"
+
+// Stems starting with this prefix read a RAW byte stream from the first TCP
+// connection accepted on a local address.  The full syntax is
+// "tcp://[HOST]:PORT", where HOST (if given) is the local address to listen on.
+#define RAWSPEC_INPUT_TCP_PREFIX "tcp://"
+
+// Size of buffer used to consume unwanted bytes of byte streams
+#define RAWSPEC_INPUT_SKIP_SIZE (1024*1024)
+
+// When reading selected byte ranges of a block from a file, unwanted gaps of
+// up to this many bytes between ranges are read into a scratch buffer so that
+// the ranges can be read with a single preadv() call.  Larger gaps are seeked
+// over (i.e. start another preadv() call).
+#define RAWSPEC_INPUT_GAP_SIZE (64*1024)
+
+// A byte range of a block's data
+typedef struct {
+  off_t offset;                // Offset from start of block data
+  size_t len;
+} rawspec_input_seg_t;
+
+// Types of input streams
+typedef enum {
+  RAWSPEC_INPUT_FILES,
+  RAWSPEC_INPUT_SHM,
+  RAWSPEC_INPUT_STREAM,
+  RAWSPEC_INPUT_RAWZ
+} rawspec_input_type_t;
+
+// Input stream over the sequence of RAW files of a stem (i.e. STEM.0000.raw,
+// STEM.0001.raw, ...).  The next file of the sequence is opened as soon as the
+// current file is opened, and its first region is prefetched (via
+// posix_fadvise(POSIX_FADV_WILLNEED)) when reading gets close to the end of
+// the current file.  Reaching the end of one file while reading headers
+// continues seamlessly with the first header of the next file, so the file
+// sequence can be read as a single continuous stream.
+//
+// If `follow_timeout` is set to a positive value before the stream is opened,
+// the stream follows files that are still being written: upon reaching the end
+// of the data currently in the current file, it waits for more data or for the
+// next file to appear.  The stream only ends when it has been idle (no new
+// data) for `follow_timeout` seconds or the end-of-scan marker file exists.
+// Waiting uses inotify on the stem's directory, falling back to polling if
+// inotify is unavailable.
+//
+// If the stem has the RAWSPEC_INPUT_SHM_PREFIX prefix, the stream instead
+// consumes the blocks of a shared memory ring buffer in order, freeing each
+// block once the stream has moved on to the next one.  The stream ends at an
+// end-of-stream block or, if `follow_timeout` is positive, when no block has
+// been filled for `follow_timeout` seconds.  Without a timeout, the stream
+// waits indefinitely for the next block.
+//
+// If the stem is RAWSPEC_INPUT_STDIN or has the RAWSPEC_INPUT_TCP_PREFIX
+// prefix, the stream reads the concatenated RAW blocks from a non-seekable byte
+// stream, so skipping consumes bytes rather than seeking and the header of the
+// block after the current block cannot be peeked at.
+//
+// If the stem has no STEM.NNNN.raw file but has a STEM.NNNN.rawz file, the
+// stream reads the stem's block-compressed RAWZ files (see rawspec_rawz.h),
+// decompressing blocks in parallel ahead of their use.  Following is not
+// supported for RAWZ files.
+typedef struct {
+  rawspec_input_type_t type;
+  const char * stem;
+  char output_stem[PATH_MAX+1]; // Stem for naming output files
+  int fi;                      // Index of current file
+  int fd;                      // Current file descriptor (-1 if none)
+  char fname[PATH_MAX+1];      // Name of current file
+  off_t pos;                   // Offset within current file
+  off_t size;                  // Size of current file
+  off_t prefetch_size;         // Number of bytes of next file to prefetch
+  int next_fd;                 // Next file descriptor (-1 if not open)
+  int next_prefetched;         // Non-zero once next file has been prefetched
+  double follow_timeout;       // Idle timeout in seconds (0 to not follow)
+  int inotify_fd;              // inotify instance when following (-1 if none)
+  int ended;                   // Non-zero once following has ended
+  struct timespec last_data;   // When new data was last seen (when following)
+  // Shared memory ring buffer fields
+  rawspec_shm_ring_t * ring;   // Attached ring buffer (NULL if none)
+  size_t shm_hdr_size;         // Offset of data within each block
+  int shm_block;               // Index of current block
+  int shm_held;                // Non-zero while current block is held
+  // Byte stream fields
+  char * hdr_buf;              // Header of current block
+  size_t hdr_len;              // Length of header in hdr_buf
+  off_t hdr_pos;               // Offset of current block's header in stream
+  off_t blk_pos;               // Offset of current block's data in stream
+  char * skip_buf;             // Scratch buffer for consuming bytes
+  // RAWZ fields
+  rawspec_rawz_t * rawz;       // RAWZ reader (NULL if none)
+  rawspec_rawz_frame_t * frame; // Current frame
+} rawspec_input_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reads `bytes_to_read` bytes from `fd` into the buffer pointed to by `buf`.
+// Returns the total bytes read or -1 on error.  A non-negative return value
+// will be less than `bytes_to_read` only of EOF is reached.
+ssize_t read_fully(int fd, void * buf, size_t bytes_to_read);
+
+// Opens file `fi` of `stem` as the current file of `in` (and the following
+// file, if it exists, as the next file).  `in` must not already be open.  When
+// following, this waits for the file to appear.  Returns 0 on success, -1 on
+// error.
+int rawspec_input_open(rawspec_input_t * in, const char * stem, int fi);
+
+// Reads the obs params of the next block of the stream into `raw_hdr`.  When
+// the end of the current file is reached, this continues with the first block
+// of the next file.  Returns the offset of the block's data within the current
+// file, 0 at the end of the stream, or -1 on error.
+off_t rawspec_input_read_header(rawspec_input_t * in,
+                                rawspec_raw_hdr_t * raw_hdr);
+
+// Reads up to `len` bytes of block data from the current file into `buf`.
+// Returns the number of bytes read (less than `len` only at EOF) or -1 on
+// error.
+ssize_t rawspec_input_read(rawspec_input_t * in, void * buf, size_t len);
+
+// Reads the `nsegs` byte ranges `segs` of the current block's data, which is
+// `blocsize` bytes long, into consecutive locations of `buf`, leaving the
+// stream at the end of the block's data.  The ranges must be in increasing
+// order and must not overlap.  The stream must be positioned at the start of
+// the block's data.  For files, the ranges are read using as few preadv()
+// calls as possible (usually one).  Returns the number of bytes read (less
+// than the total length of the ranges only at EOF) or -1 on error.
+ssize_t rawspec_input_read_segs(rawspec_input_t * in,
+                                const rawspec_input_seg_t * segs, int nsegs,
+                                size_t blocsize, void * buf);
+
+// Skips `len` bytes of block data in the current file.
+// Returns the new offset within the current file or -1 on error.
+off_t rawspec_input_skip(rawspec_input_t * in, off_t len);
+
+// Reads the obs params of the block following the current block into
+// `next_hdr` without changing the position of the stream.  `raw_hdr` must hold
+// the obs params of the current block.  Returns a positive value on success,
+// 0 if there is no next block, or -1 on error (or for byte streams, which
+// cannot be peeked at).
+off_t rawspec_input_peek_header(rawspec_input_t * in,
+                                const rawspec_raw_hdr_t * raw_hdr,
+                                rawspec_raw_hdr_t * next_hdr);
+
+// Writes the header of the current block (whose obs params are in `raw_hdr`)
+// to `fd`.  Returns the number of bytes written or -1 on error.
+ssize_t rawspec_input_save_header(rawspec_input_t * in, int fd,
+                                  rawspec_raw_hdr_t * raw_hdr);
+
+// Positions the stream at the first block whose PKTIDX is greater than or equal
+// to `pktidx`, opening a later file of the stem if needed, and reads its obs
+// params into `raw_hdr`.  Return values are the same as for
+// rawspec_input_read_header().
+off_t rawspec_input_seek_pktidx(rawspec_input_t * in, int64_t pktidx,
+                                rawspec_raw_hdr_t * raw_hdr);
+
+// Returns the number of bytes of the stream from the current position to the
+// end of the last file of the stem, or 0 if this is not known in advance (for
+// anything other than RAW files that are not being followed).
+uint64_t rawspec_input_remaining(rawspec_input_t * in);
+
+// Closes all files opened by `in` (or detaches from its shared memory ring
+// buffer after freeing any block it holds).
+void rawspec_input_close(rawspec_input_t * in);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RAWSPEC_INPUT_H_
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "rawspec_pacer.h"
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE (47)
+#endif
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds.
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000*1000*1000 + ts.tv_nsec;
+}
+
+int rawspec_pacer_init(rawspec_pacer_t * pacer, double gbps, int fd)
+{
+  int rc;
+  uint64_t rate64;
+  unsigned int rate32;
+
+  if(gbps <= 0) {
+    fprintf(stderr, "invalid output rate %g Gbps\n", gbps);
+    return -1;
+  }
+
+  memset(pacer, 0, sizeof(rawspec_pacer_t));
+  pthread_mutex_init(&pacer->mutex, NULL);
+  pacer->gbps = gbps;
+  pacer->ns_per_byte = 8.0 / gbps;
+
+  if(fd != -1) {
+    // Kernels before 4.20 only accept a 32 bit rate
+    rate64 = (uint64_t)(gbps * 1e9 / 8);
+    if(rate64 <= UINT_MAX) {
+      rate32 = rate64;
+      rc = setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof(rate32));
+    } else {
+      rc = setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate64, sizeof(rate64));
+    }
+    if(rc < 0) {
+      perror("setsockopt");
+      fprintf(stderr, "warning: could not set SO_MAX_PACING_RATE\n");
+    }
+  }
+
+  return 0;
+}
+
+void rawspec_pacer_destroy(rawspec_pacer_t * pacer)
+{
+  pthread_mutex_destroy(&pacer->mutex);
+}
+
+size_t rawspec_pacer_quantum(const rawspec_pacer_t * pacer)
+{
+  return RAWSPEC_PACER_QUANTUM_NS / pacer->ns_per_byte;
+}
+
+void rawspec_pacer_wait(rawspec_pacer_t * pacer, size_t nbytes)
+{
+  uint64_t now;
+  uint64_t send_ns;
+  struct timespec ts;
+
+  pthread_mutex_lock(&pacer->mutex);
+  now = now_ns();
+  if(pacer->start_ns == 0) {
+    pacer->start_ns = now;
+  }
+  // Limit credit accumulated while idle
+  if(pacer->next_ns + RAWSPEC_PACER_BURST_NS < now) {
+    pacer->next_ns = now - RAWSPEC_PACER_BURST_NS;
+  }
+  send_ns = pacer->next_ns;
+  pacer->next_ns += nbytes * pacer->ns_per_byte;
+  pacer->total_bytes += nbytes;
+  pthread_mutex_unlock(&pacer->mutex);
+
+  // Sleep until send time.  Since the pacer's clock is absolute,
+  // oversleeping does not accumulate.
+  if(send_ns > now) {
+    ts.tv_sec  = send_ns / (1000*1000*1000);
+    ts.tv_nsec = send_ns % (1000*1000*1000);
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+  }
+}
+
+void rawspec_pacer_sent(rawspec_pacer_t * pacer)
+{
+  uint64_t now = now_ns();
+
+  pthread_mutex_lock(&pacer->mutex);
+  if(pacer->stop_ns < now) {
+    pacer->stop_ns = now;
+  }
+  pthread_mutex_unlock(&pacer->mutex);
+}
+
+double rawspec_pacer_gbps(rawspec_pacer_t * pacer)
+{
+  double gbps = 0;
+
+  pthread_mutex_lock(&pacer->mutex);
+  if(pacer->stop_ns > pacer->start_ns) {
+    gbps = 8.0 * pacer->total_bytes / (pacer->stop_ns - pacer->start_ns);
+  }
+  pthread_mutex_unlock(&pacer->mutex);
+  return gbps;
+}
@@ -0,0 +1,68 @@
+#ifndef _RAWSPEC_PACER_H_
+#define _RAWSPEC_PACER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Token bucket pacer for network output
+//
+// Each network destination has a pacer that is shared by the output threads
+// of all output products (of all jobs) sent to it, so that their aggregate
+// output rate is smooth at the requested rate, regardless of when the
+// individual products dump.  Before sending a
+// batch of packets, a thread reserves the batch's bytes with
+// rawspec_pacer_wait(), which sleeps until the pacer's virtual clock allows
+// them to be sent.  Senders that are idle accumulate at most
+// RAWSPEC_PACER_BURST_NS worth of credit, and batches are limited to
+// rawspec_pacer_quantum() bytes (RAWSPEC_PACER_QUANTUM_NS at the requested
+// rate) so that no thread sends long bursts at line rate.
+//
+// When possible, the socket's SO_MAX_PACING_RATE is also set to the requested
+// rate so that the kernel (fq qdisc) paces the packets on the wire.
+
+// Maximum credit accumulated while idle
+#define RAWSPEC_PACER_BURST_NS (200*1000)
+
+// Sending time of one batch of packets
+#define RAWSPEC_PACER_QUANTUM_NS (200*1000)
+
+typedef struct {
+  pthread_mutex_t mutex;
+  double gbps;                  // Requested rate in Gbps
+  double ns_per_byte;           // Sending time of one byte
+  uint64_t next_ns;             // Time at which the next byte may be sent
+  uint64_t start_ns;            // Time of first reservation (0 if none)
+  uint64_t stop_ns;             // Time last batch was sent
+  uint64_t total_bytes;         // Bytes reserved so far
+} rawspec_pacer_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Initializes `pacer` for a total rate of `gbps` Gbps and, if `fd` is not -1,
+// sets the SO_MAX_PACING_RATE of socket `fd`.  Returns 0 on success, -1 on
+// error.
+int rawspec_pacer_init(rawspec_pacer_t * pacer, double gbps, int fd);
+
+// Destroys `pacer`.
+void rawspec_pacer_destroy(rawspec_pacer_t * pacer);
+
+// Returns the maximum number of bytes to send per batch.
+size_t rawspec_pacer_quantum(const rawspec_pacer_t * pacer);
+
+// Reserves `nbytes` bytes and sleeps until they may be sent.
+void rawspec_pacer_wait(rawspec_pacer_t * pacer, size_t nbytes);
+
+// Records that the bytes of the last reservation have been sent.
+void rawspec_pacer_sent(rawspec_pacer_t * pacer);
+
+// Returns the achieved rate in Gbps (0 if nothing has been sent).
+double rawspec_pacer_gbps(rawspec_pacer_t * pacer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RAWSPEC_PACER_H_
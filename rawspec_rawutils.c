@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "rawspec_rawutils.h"
 #include "hget.h"
@@ -167,6 +168,7 @@ void rawspec_raw_parse_header(const char * buf, rawspec_raw_hdr_t * raw_hdr)
   raw_hdr->tbin     = rawspec_raw_get_dbl(buf, "TBIN",     0.0);
   raw_hdr->directio = rawspec_raw_get_s32(buf, "DIRECTIO", 0);
   raw_hdr->pktidx   = rawspec_raw_get_u64(buf, "PKTIDX",  -1);
+  raw_hdr->piperblk = rawspec_raw_get_s64(buf, "PIPERBLK", 0);
   raw_hdr->beam_id  = rawspec_raw_get_s32(buf, "BEAM_ID", -1);
   raw_hdr->nbeam    = rawspec_raw_get_s32(buf, "NBEAM",   -1);
   raw_hdr->refbeam  = rawspec_raw_get_s32(buf, "REFBEAM", -1);
@@ -191,21 +193,12 @@ void rawspec_raw_parse_header(const char * buf, rawspec_raw_hdr_t * raw_hdr)
 // of the subsequent data block and the file descriptor `fd` will also refer to
 // that location in the file.  On EOF, this function returns 0.  On failure,
 // this function returns -1 and the location to which fd refers is undefined.
-off_t rawspec_raw_read_header(int fd, rawspec_raw_hdr_t * raw_hdr)
+int rawspec_raw_buf_read_header(const char * hdr, size_t len,
+                                rawspec_raw_hdr_t * raw_hdr)
 {
-  int i;
-  // Ensure that hdr is aligned to a 512-byte boundary so that it can be used
-  // with files opened with O_DIRECT.
-  char hdr[MAX_RAW_HDR_SIZE] __attribute__ ((aligned (512)));
   int hdr_size;
-  off_t pos = lseek(fd, 0, SEEK_CUR);
-
-  // Read header (plus some data, probably)
-  hdr_size = read(fd, hdr, MAX_RAW_HDR_SIZE);
 
-  if(hdr_size == -1) {
-    return -1;
-  } else if(hdr_size < 80) {
+  if(len < 80) {
     return 0;
   }
 
@@ -245,17 +238,133 @@ off_t rawspec_raw_read_header(int fd, rawspec_raw_hdr_t * raw_hdr)
     raw_hdr->npol = 2;
   }
 
-  // Save header pos/size
-  raw_hdr->hdr_pos = pos;
-  raw_hdr->hdr_size = rawspec_raw_header_size(hdr, hdr_size, 0);
+  // Save header size
+  raw_hdr->hdr_size = rawspec_raw_header_size((char *)hdr, len, 0);
 
   // Get actual size of header (plus any padding)
-  hdr_size = rawspec_raw_header_size(hdr, hdr_size, raw_hdr->directio);
+  hdr_size = rawspec_raw_header_size((char *)hdr, len, raw_hdr->directio);
   //printf("RRP: hdr=%lu\n", hdr_size);
 
+  return hdr_size;
+}
+
+off_t rawspec_raw_read_header(int fd, rawspec_raw_hdr_t * raw_hdr)
+{
+  // Ensure that hdr is aligned to a 512-byte boundary so that it can be used
+  // with files opened with O_DIRECT.
+  char hdr[MAX_RAW_HDR_SIZE] __attribute__ ((aligned (512)));
+  int hdr_size;
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+
+  // Read header (plus some data, probably)
+  hdr_size = read(fd, hdr, MAX_RAW_HDR_SIZE);
+
+  if(hdr_size == -1) {
+    return -1;
+  }
+
+  // Parse header and get actual size of header (plus any padding)
+  hdr_size = rawspec_raw_buf_read_header(hdr, hdr_size, raw_hdr);
+  if(hdr_size <= 0) {
+    return hdr_size;
+  }
+
+  // Save header pos
+  raw_hdr->hdr_pos = pos;
+
   // Seek forward from original position past header (and any padding)
   pos = lseek(fd, pos + hdr_size, SEEK_SET);
   //printf("RRP: seek=%ld\n", pos);
 
   return pos;
 }
+
+// Returns non-zero if the 80 bytes at offset `pos` of fd look like the first
+// card of a RAW header (i.e. are all printable ASCII characters).
+static int rawspec_raw_is_header_at(int fd, off_t pos)
+{
+  int i;
+  char card[80];
+
+  if(pread(fd, card, sizeof(card), pos) != sizeof(card)) {
+    return 0;
+  }
+  for(i=0; i<sizeof(card); i++) {
+    if(card[i] < 0x20 || card[i] > 0x7e) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Reads obs params of the first block in the file referred to by fd whose
+// PKTIDX is greater than or equal to `pktidx`.  Blocks are located by a binary
+// search over the file assuming that every block has the same header and data
+// sizes as the first block, falling back to a linear walk of the headers if
+// that assumption does not hold.  Return values and the resulting location of
+// fd are the same as for rawspec_raw_read_header(), with 0 being returned if
+// all blocks in the file have a PKTIDX less than `pktidx`.
+off_t rawspec_raw_seek_pktidx(int fd, int64_t pktidx,
+                              rawspec_raw_hdr_t * raw_hdr)
+{
+  struct stat st;
+  off_t pos;
+  off_t stride;
+  int64_t lo, hi, mid;
+  int64_t nblocks;
+
+  // Read first header of file
+  if(lseek(fd, 0, SEEK_SET) != 0) {
+    return -1;
+  }
+  pos = rawspec_raw_read_header(fd, raw_hdr);
+  if(pos <= 0 || raw_hdr->pktidx >= pktidx) {
+    return pos;
+  }
+
+  // Size of one header (plus any padding) and data block
+  stride = pos + raw_hdr->blocsize;
+  if(fstat(fd, &st) != 0) {
+    return -1;
+  }
+  nblocks = st.st_size / stride;
+
+  // Binary search for the first block with PKTIDX >= pktidx.  Block lo is
+  // always known to precede pktidx, block hi is the candidate.
+  lo = 0;
+  hi = nblocks;
+  while(hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if(!rawspec_raw_is_header_at(fd, mid * stride)
+    || lseek(fd, mid * stride, SEEK_SET) != mid * stride
+    || rawspec_raw_read_header(fd, raw_hdr) != mid * stride + pos) {
+      // Blocks are not uniformly sized, give up on binary search
+      break;
+    }
+    if(raw_hdr->pktidx < pktidx) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if(hi - lo <= 1) {
+    if(hi >= nblocks) {
+      // All (complete) blocks precede pktidx
+      return 0;
+    }
+    lseek(fd, hi * stride, SEEK_SET);
+    return rawspec_raw_read_header(fd, raw_hdr);
+  }
+
+  // Linear walk through headers
+  lseek(fd, 0, SEEK_SET);
+  while((pos = rawspec_raw_read_header(fd, raw_hdr)) > 0) {
+    if(raw_hdr->pktidx >= pktidx) {
+      break;
+    }
+    lseek(fd, raw_hdr->blocsize, SEEK_CUR);
+  }
+
+  return pos;
+}
@@ -11,6 +11,7 @@ typedef struct {
   unsigned int obsnchan;
   unsigned int nbits;
   int64_t pktidx; // TODO make uint64_t?
+  int64_t piperblk; // PKTIDX step per block (0 if not present)
   double obsfreq;
   double obsbw;
   double tbin;
@@ -56,6 +57,13 @@ int rawspec_raw_header_size(char * hdr, size_t len, int directio);
 // Parses rawspec related RAW header params from buf into raw_hdr.
 void rawspec_raw_parse_header(const char * buf, rawspec_raw_hdr_t * raw_hdr);
 
+// Parses and validates rawspec related RAW header params from the `len` bytes
+// of `hdr` into raw_hdr (except for raw_hdr->hdr_pos).  Returns the size of the
+// header (plus any DIRECTIO padding), 0 if `len` is too short to hold a header,
+// or -1 if required params are missing.
+int rawspec_raw_buf_read_header(const char * hdr, size_t len,
+                                rawspec_raw_hdr_t * raw_hdr);
+
 // Reads obs params from fd.  On entry, fd is assumed to be at the start of a
 // RAW header section.  On success, this function returns the file offset of
 // the subsequent data block and the file descriptor `fd` will also refer to
@@ -63,6 +71,16 @@ void rawspec_raw_parse_header(const char * buf, rawspec_raw_hdr_t * raw_hdr);
 // this function returns -1 and the location to which fd refers is undefined.
 off_t rawspec_raw_read_header(int fd, rawspec_raw_hdr_t * raw_hdr);
 
+// Reads obs params of the first block in the file referred to by fd whose
+// PKTIDX is greater than or equal to `pktidx`.  Blocks are located by a binary
+// search over the file assuming that every block has the same header and data
+// sizes as the first block, falling back to a linear walk of the headers if
+// that assumption does not hold.  Return values and the resulting location of
+// fd are the same as for rawspec_raw_read_header(), with 0 being returned if
+// all blocks in the file have a PKTIDX less than `pktidx`.
+off_t rawspec_raw_seek_pktidx(int fd, int64_t pktidx,
+                              rawspec_raw_hdr_t * raw_hdr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,570 @@
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#ifdef RAWSPEC_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef RAWSPEC_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "rawspec_rawz.h"
+
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
+void rawspec_rawz_fname(char * fname, const char * stem, int fi)
+{
+  snprintf(fname, PATH_MAX, "%s.%04d.%s", stem, fi, RAWSPEC_RAWZ_EXT);
+  fname[PATH_MAX] = '\0';
+}
+
+int rawspec_rawz_codec(const char * name)
+{
+  if(!strcmp(name, "none")) {
+    return RAWSPEC_RAWZ_NONE;
+  }
+#ifdef RAWSPEC_HAVE_ZSTD
+  if(!strcmp(name, "zstd")) {
+    return RAWSPEC_RAWZ_ZSTD;
+  }
+#endif
+#ifdef RAWSPEC_HAVE_LZ4
+  if(!strcmp(name, "lz4")) {
+    return RAWSPEC_RAWZ_LZ4;
+  }
+#endif
+  return -1;
+}
+
+// Decompresses the data of frame `f`.  Returns 0 on success, -1 on error.
+static int rawspec_rawz_decode(rawspec_rawz_frame_t * f)
+{
+#ifdef RAWSPEC_HAVE_ZSTD
+  size_t zstd_size;
+#endif
+
+  switch(f->codec) {
+#ifdef RAWSPEC_HAVE_ZSTD
+    case RAWSPEC_RAWZ_ZSTD:
+      zstd_size = ZSTD_decompress(f->data, f->dsize, f->zbuf, f->zsize);
+      return (ZSTD_isError(zstd_size) || zstd_size != f->dsize) ? -1 : 0;
+#endif
+#ifdef RAWSPEC_HAVE_LZ4
+    case RAWSPEC_RAWZ_LZ4:
+      return LZ4_decompress_safe(f->zbuf, f->data, f->zsize, f->dsize)
+          == (int)f->dsize ? 0 : -1;
+#endif
+    default:
+      return -1;
+  }
+}
+
+// Decompression thread.  Decompresses queued frames, oldest first, until told
+// to stop.
+static void * rawspec_rawz_thread_func(void * arg)
+{
+  rawspec_rawz_t * z = (rawspec_rawz_t *)arg;
+  rawspec_rawz_frame_t * f;
+  int i;
+
+  pthread_mutex_lock(&z->mutex);
+  while(!z->stop) {
+    // Find oldest queued frame
+    f = NULL;
+    for(i=0; i<z->nqueued; i++) {
+      if(z->frames[(z->head + i) % z->nframes].state == RAWSPEC_RAWZ_QUEUED) {
+        f = &z->frames[(z->head + i) % z->nframes];
+        break;
+      }
+    }
+    if(!f) {
+      pthread_cond_wait(&z->cond, &z->mutex);
+      continue;
+    }
+
+    f->state = RAWSPEC_RAWZ_DECODING;
+    pthread_mutex_unlock(&z->mutex);
+    f->error = rawspec_rawz_decode(f);
+    pthread_mutex_lock(&z->mutex);
+    f->state = RAWSPEC_RAWZ_DONE;
+    pthread_cond_broadcast(&z->cond);
+  }
+  pthread_mutex_unlock(&z->mutex);
+
+  return NULL;
+}
+
+// Reads the header of the frame at offset `pos` of `fd` (whose frames end at
+// `end`) and gets its PKTIDX and the offset of the following frame.  Returns 0
+// on success, -1 on error.
+static int rawspec_rawz_frame_info(int fd, off_t pos, off_t end,
+                                   int64_t * pktidx, off_t * next)
+{
+  char hdr[MAX_RAW_HDR_SIZE];
+  ssize_t len;
+  ssize_t i;
+  int64_t zsize;
+
+  len = pread(fd, hdr, MIN(MAX_RAW_HDR_SIZE, end - pos), pos);
+  for(i=0; i+80 <= len; i+=80) {
+    if(!strncmp(hdr+i, "END ", 4)) {
+      break;
+    }
+  }
+  if(i+80 > len) {
+    return -1;
+  }
+
+  zsize = rawspec_raw_get_s64(hdr, "ZBLOCSIZ", -1);
+  *pktidx = rawspec_raw_get_s64(hdr, "PKTIDX", -1);
+  *next = pos + i + 80 + zsize;
+  return (zsize < 0 || *pktidx == -1) ? -1 : 0;
+}
+
+// Returns the PKTIDX of the first frame in RAWZ file `fi` of `stem`, or -1 if
+// the file cannot be opened or read.
+static int64_t rawspec_rawz_first_pktidx(const char * stem, int fi)
+{
+  int fd;
+  char fname[PATH_MAX+1];
+  int64_t pktidx = -1;
+  off_t next;
+
+  rawspec_rawz_fname(fname, stem, fi);
+  fd = open(fname, O_RDONLY);
+  if(fd != -1) {
+    if(rawspec_rawz_frame_info(fd, 0, MAX_RAW_HDR_SIZE, &pktidx, &next)) {
+      pktidx = -1;
+    }
+    close(fd);
+  }
+  return pktidx;
+}
+
+// Opens RAWZ file `fi` as the current file and loads its frame index (if any).
+// Returns 0 on success, -1 on error.
+static int rawspec_rawz_open_file(rawspec_rawz_t * z, int fi)
+{
+  struct stat st;
+  uint64_t trailer[2];
+  uint64_t i;
+
+  if(z->fd != -1) {
+    close(z->fd);
+  }
+  free(z->index);
+  z->index = NULL;
+  z->nindex = 0;
+
+  z->fi = fi;
+  rawspec_rawz_fname(z->fname, z->stem, fi);
+  printf("opening file: %s", z->fname);
+  z->fd = open(z->fname, O_RDONLY);
+  if(z->fd == -1) {
+    printf(" [%s]\n", strerror(errno));
+    return -1;
+  }
+  printf("\n");
+  posix_fadvise(z->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  z->pos = 0;
+  z->end = fstat(z->fd, &st) == 0 ? st.st_size : 0;
+
+  // Load frame index, if present
+  if(z->end >= sizeof(trailer)
+  && pread(z->fd, trailer, sizeof(trailer), z->end - sizeof(trailer))
+      == sizeof(trailer)
+  && !memcmp(&trailer[1], RAWSPEC_RAWZ_INDEX_MAGIC, sizeof(trailer[1]))) {
+    z->nindex = le64toh(trailer[0]);
+    if(z->nindex * sizeof(uint64_t) + sizeof(trailer) <= z->end
+    && (z->index = malloc(z->nindex * sizeof(uint64_t)))) {
+      z->end -= z->nindex * sizeof(uint64_t) + sizeof(trailer);
+      if(pread(z->fd, z->index, z->nindex * sizeof(uint64_t), z->end)
+          != z->nindex * sizeof(uint64_t)) {
+        free(z->index);
+        z->index = NULL;
+        z->nindex = 0;
+      }
+      for(i=0; i<z->nindex; i++) {
+        z->index[i] = le64toh(z->index[i]);
+      }
+    } else {
+      z->nindex = 0;
+    }
+  }
+
+  return 0;
+}
+
+// Grows the buffer `*buf` of capacity `*cap` to hold at least `size` bytes.
+// Returns 0 on success, -1 on error.
+static int rawspec_rawz_reserve(char ** buf, size_t * cap, size_t size)
+{
+  char * p;
+
+  if(size > *cap) {
+    p = realloc(*buf, size);
+    if(!p) {
+      return -1;
+    }
+    *buf = p;
+    *cap = size;
+  }
+  return 0;
+}
+
+// Reads the next frame of the stem into `f`, moving on to the next file when
+// the end of the current file is reached.  Returns 1 on success, 0 at the end
+// of the stem, or -1 on error.
+static int rawspec_rawz_read_frame(rawspec_rawz_t * z, rawspec_rawz_frame_t * f)
+{
+  ssize_t len;
+  ssize_t i;
+  int64_t zsize;
+  int64_t dsize;
+  int codec;
+  char codec_name[81];
+
+  while(z->fd == -1 || z->pos >= z->end) {
+    if(rawspec_rawz_open_file(z, z->fi+1)) {
+      z->eof = 1;
+      return 0;
+    }
+  }
+
+  len = pread(z->fd, f->hdr, MIN(MAX_RAW_HDR_SIZE, z->end - z->pos), z->pos);
+  for(i=0; i+80 <= len; i+=80) {
+    if(!strncmp(f->hdr+i, "END ", 4)) {
+      break;
+    }
+  }
+  if(i+80 > len) {
+    fprintf(stderr, "incomplete header in %s at offset %ld\n",
+        z->fname, z->pos);
+    return -1;
+  }
+  f->hdr_len = i + 80;
+
+  zsize = rawspec_raw_get_s64(f->hdr, "ZBLOCSIZ", -1);
+  dsize = rawspec_raw_get_s64(f->hdr, "BLOCSIZE", -1);
+  rawspec_raw_get_str(f->hdr, "ZCODEC", "none", codec_name, 80);
+  codec = rawspec_rawz_codec(codec_name);
+  if(zsize < 0 || dsize < 0) {
+    fprintf(stderr, "ZBLOCSIZ or BLOCSIZE not found in %s at offset %ld\n",
+        z->fname, z->pos);
+    return -1;
+  }
+  if(codec == -1) {
+    fprintf(stderr, "unsupported ZCODEC '%s' in %s\n", codec_name, z->fname);
+    return -1;
+  }
+  if(codec == RAWSPEC_RAWZ_NONE && zsize != dsize) {
+    fprintf(stderr, "ZBLOCSIZ != BLOCSIZE for uncompressed data in %s\n",
+        z->fname);
+    return -1;
+  }
+
+  f->fi = z->fi;
+  f->hdr_pos = z->pos;
+  f->codec = codec;
+  f->zsize = zsize;
+  f->dsize = dsize;
+  f->error = 0;
+  if(rawspec_rawz_reserve(&f->data, &f->dcap, dsize)
+  || (codec != RAWSPEC_RAWZ_NONE
+      && rawspec_rawz_reserve(&f->zbuf, &f->zcap, zsize))) {
+    fprintf(stderr, "cannot allocate frame buffers\n");
+    return -1;
+  }
+
+  // Uncompressed data is read directly into the data buffer
+  len = pread(z->fd, codec == RAWSPEC_RAWZ_NONE ? f->data : f->zbuf, zsize,
+              z->pos + f->hdr_len);
+  if(len != zsize) {
+    fprintf(stderr, "incomplete block in %s at offset %ld\n",
+        z->fname, z->pos);
+    return -1;
+  }
+
+  z->pos += f->hdr_len + zsize;
+  return 1;
+}
+
+// Reads frames ahead into free slots and queues them for decompression.
+// Returns 0 on success, -1 on error.
+static int rawspec_rawz_fill(rawspec_rawz_t * z)
+{
+  rawspec_rawz_frame_t * f;
+  int rc;
+
+  while(!z->eof && z->nqueued < z->nframes) {
+    // Free slots are not touched by the decompression threads
+    f = &z->frames[(z->head + z->nqueued) % z->nframes];
+    rc = rawspec_rawz_read_frame(z, f);
+    if(rc <= 0) {
+      return rc;
+    }
+
+    pthread_mutex_lock(&z->mutex);
+    f->state = f->codec == RAWSPEC_RAWZ_NONE ? RAWSPEC_RAWZ_DONE
+                                             : RAWSPEC_RAWZ_QUEUED;
+    z->nqueued++;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->mutex);
+  }
+
+  return 0;
+}
+
+// Discards all frames that have been read (waiting for any that are being
+// decompressed).
+static void rawspec_rawz_discard(rawspec_rawz_t * z)
+{
+  int i;
+  int busy;
+
+  pthread_mutex_lock(&z->mutex);
+  do {
+    busy = 0;
+    for(i=0; i<z->nframes; i++) {
+      if(z->frames[i].state == RAWSPEC_RAWZ_DECODING) {
+        busy = 1;
+      } else {
+        z->frames[i].state = RAWSPEC_RAWZ_EMPTY;
+      }
+    }
+    if(busy) {
+      pthread_cond_wait(&z->cond, &z->mutex);
+    }
+  } while(busy);
+  z->nqueued = 0;
+  z->held = 0;
+  pthread_mutex_unlock(&z->mutex);
+}
+
+rawspec_rawz_t * rawspec_rawz_open(const char * stem, int fi, int nthreads)
+{
+  rawspec_rawz_t * z;
+  int i;
+
+  z = calloc(1, sizeof(rawspec_rawz_t));
+  if(!z) {
+    return NULL;
+  }
+  z->stem = stem;
+  z->fd = -1;
+  pthread_mutex_init(&z->mutex, NULL);
+  pthread_cond_init(&z->cond, NULL);
+
+  if(nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > RAWSPEC_RAWZ_MAX_THREADS) {
+      nthreads = RAWSPEC_RAWZ_MAX_THREADS;
+    } else if(nthreads < 1) {
+      nthreads = 1;
+    }
+  }
+
+  // Read ahead enough frames to keep all threads busy while one frame is
+  // being consumed and the next one is being read.
+  z->nframes = nthreads + 2;
+  z->frames = calloc(z->nframes, sizeof(rawspec_rawz_frame_t));
+  z->threads = calloc(nthreads, sizeof(pthread_t));
+  if(!z->frames || !z->threads) {
+    rawspec_rawz_close(z);
+    return NULL;
+  }
+  for(i=0; i<z->nframes; i++) {
+    z->frames[i].hdr = malloc(MAX_RAW_HDR_SIZE);
+    if(!z->frames[i].hdr) {
+      rawspec_rawz_close(z);
+      return NULL;
+    }
+  }
+
+  if(rawspec_rawz_open_file(z, fi)) {
+    rawspec_rawz_close(z);
+    return NULL;
+  }
+
+  for(i=0; i<nthreads; i++) {
+    if(pthread_create(&z->threads[i], NULL, rawspec_rawz_thread_func, z)) {
+      break;
+    }
+    z->nthreads++;
+  }
+  if(z->nthreads == 0) {
+    fprintf(stderr, "cannot start decompression threads\n");
+    rawspec_rawz_close(z);
+    return NULL;
+  }
+
+  return z;
+}
+
+int rawspec_rawz_next(rawspec_rawz_t * z, rawspec_rawz_frame_t ** frame)
+{
+  rawspec_rawz_frame_t * f;
+
+  // Release previously returned frame
+  if(z->held) {
+    pthread_mutex_lock(&z->mutex);
+    z->frames[z->head].state = RAWSPEC_RAWZ_EMPTY;
+    z->head = (z->head + 1) % z->nframes;
+    z->nqueued--;
+    z->held = 0;
+    pthread_mutex_unlock(&z->mutex);
+  }
+
+  if(rawspec_rawz_fill(z)) {
+    return -1;
+  }
+  if(z->nqueued == 0) {
+    return 0;
+  }
+
+  // Wait for oldest frame to be decompressed
+  f = &z->frames[z->head];
+  pthread_mutex_lock(&z->mutex);
+  while(f->state != RAWSPEC_RAWZ_DONE) {
+    pthread_cond_wait(&z->cond, &z->mutex);
+  }
+  pthread_mutex_unlock(&z->mutex);
+  z->held = 1;
+
+  if(f->error) {
+    fprintf(stderr, "error decompressing block at offset %ld of file %d\n",
+        f->hdr_pos, f->fi);
+    return -1;
+  }
+
+  *frame = f;
+  return 1;
+}
+
+int rawspec_rawz_peek(rawspec_rawz_t * z, rawspec_rawz_frame_t ** frame)
+{
+  int i = z->held ? 1 : 0;
+
+  if(rawspec_rawz_fill(z)) {
+    return -1;
+  }
+  if(z->nqueued <= i) {
+    return 0;
+  }
+
+  // Headers of queued frames are not modified by the decompression threads
+  *frame = &z->frames[(z->head + i) % z->nframes];
+  return 1;
+}
+
+int rawspec_rawz_seek_pktidx(rawspec_rawz_t * z, int64_t pktidx)
+{
+  int lo = z->fi;
+  int hi;
+  int mid;
+  int64_t mid_pktidx;
+  char fname[PATH_MAX+1];
+  uint64_t ilo;
+  uint64_t ihi;
+  uint64_t imid;
+  off_t pos;
+  off_t next;
+
+  rawspec_rawz_discard(z);
+  z->eof = 0;
+
+  // Count files
+  for(hi = lo+1; ; hi++) {
+    rawspec_rawz_fname(fname, z->stem, hi);
+    if(access(fname, R_OK) != 0) {
+      break;
+    }
+  }
+
+  // Binary search for last file whose first frame is at or before pktidx
+  while(hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    mid_pktidx = rawspec_rawz_first_pktidx(z->stem, mid);
+    if(mid_pktidx != -1 && mid_pktidx <= pktidx) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  if((lo != z->fi || z->fd == -1) && rawspec_rawz_open_file(z, lo)) {
+    return -1;
+  }
+
+  // Find first frame at or after pktidx
+  if(z->index) {
+    // Binary search frame index
+    ilo = 0;
+    ihi = z->nindex;
+    while(ilo < ihi) {
+      imid = ilo + (ihi - ilo) / 2;
+      if(rawspec_rawz_frame_info(z->fd, z->index[imid], z->end,
+                                 &mid_pktidx, &next)) {
+        return -1;
+      }
+      if(mid_pktidx < pktidx) {
+        ilo = imid + 1;
+      } else {
+        ihi = imid;
+      }
+    }
+    z->pos = ilo < z->nindex ? z->index[ilo] : z->end;
+  } else {
+    // Walk the frame headers
+    for(pos = 0; pos < z->end; pos = next) {
+      if(rawspec_rawz_frame_info(z->fd, pos, z->end, &mid_pktidx, &next)) {
+        return -1;
+      }
+      if(mid_pktidx >= pktidx) {
+        break;
+      }
+    }
+    z->pos = pos;
+  }
+
+  return 0;
+}
+
+void rawspec_rawz_close(rawspec_rawz_t * z)
+{
+  int i;
+
+  pthread_mutex_lock(&z->mutex);
+  z->stop = 1;
+  pthread_cond_broadcast(&z->cond);
+  pthread_mutex_unlock(&z->mutex);
+  for(i=0; i<z->nthreads; i++) {
+    pthread_join(z->threads[i], NULL);
+  }
+
+  if(z->frames) {
+    for(i=0; i<z->nframes; i++) {
+      free(z->frames[i].hdr);
+      free(z->frames[i].zbuf);
+      free(z->frames[i].data);
+    }
+  }
+  if(z->fd != -1) {
+    close(z->fd);
+  }
+  free(z->index);
+  free(z->frames);
+  free(z->threads);
+  pthread_mutex_destroy(&z->mutex);
+  pthread_cond_destroy(&z->cond);
+  free(z);
+}
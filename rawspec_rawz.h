@@ -0,0 +1,128 @@
+#ifndef _RAWSPEC_RAWZ_H_
+#define _RAWSPEC_RAWZ_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "rawspec_rawutils.h"
+
+// Block-compressed RAW container ("RAWZ")
+//
+// A RAWZ file (STEM.NNNN.rawz) holds the same sequence of blocks as the RAW
+// file STEM.NNNN.raw, but each block's data is compressed individually.  Each
+// frame consists of the block's GUPPI header (without any DIRECTIO padding),
+// which has two additional cards:
+//
+//   ZCODEC  = 'zstd'   Compression codec of data ('zstd', 'lz4', or 'none')
+//   ZBLOCSIZ=   12345  Size of compressed data in bytes
+//
+// followed by ZBLOCSIZ bytes of compressed data that decompress to BLOCSIZE
+// bytes.  A file may end with a frame index: the file offsets of the frames as
+// little endian uint64 values, followed by the number of frames (uint64) and
+// the 8 byte magic RAWSPEC_RAWZ_INDEX_MAGIC.  The index lets readers find
+// frames without walking the headers.
+
+#define RAWSPEC_RAWZ_EXT "rawz"
+#define RAWSPEC_RAWZ_INDEX_MAGIC "RAWZIDX1"
+
+// Default maximum number of decompression threads
+#define RAWSPEC_RAWZ_MAX_THREADS (8)
+
+typedef enum {
+  RAWSPEC_RAWZ_NONE,
+  RAWSPEC_RAWZ_ZSTD,
+  RAWSPEC_RAWZ_LZ4
+} rawspec_rawz_codec_t;
+
+// States of frame slots
+typedef enum {
+  RAWSPEC_RAWZ_EMPTY,    // Free for reading the next frame into
+  RAWSPEC_RAWZ_QUEUED,   // Read, waiting for a decompression thread
+  RAWSPEC_RAWZ_DECODING, // Being decompressed
+  RAWSPEC_RAWZ_DONE,     // Decompressed (or decompression failed)
+} rawspec_rawz_state_t;
+
+// A frame read from a RAWZ file
+typedef struct {
+  rawspec_rawz_state_t state;
+  int fi;                      // Index of file containing frame
+  off_t hdr_pos;               // Offset of frame within file
+  char * hdr;                  // Header (MAX_RAW_HDR_SIZE bytes)
+  size_t hdr_len;              // Length of header
+  rawspec_rawz_codec_t codec;
+  char * zbuf;                 // Compressed data
+  size_t zsize;
+  size_t zcap;
+  char * data;                 // Decompressed data
+  size_t dsize;
+  size_t dcap;
+  int error;                   // Non-zero if decompression failed
+} rawspec_rawz_frame_t;
+
+// Reader of the sequence of RAWZ files of a stem.  Frames are read ahead (in
+// order) by the thread calling rawspec_rawz_next() and decompressed in
+// parallel by a pool of decompression threads.
+typedef struct {
+  const char * stem;
+  int fi;                      // Index of current file
+  int fd;                      // Current file descriptor (-1 if none)
+  char fname[PATH_MAX+1];      // Name of current file
+  off_t pos;                   // Offset of next frame within current file
+  off_t end;                   // End of frames within current file
+  uint64_t * index;            // Frame index of current file (NULL if none)
+  uint64_t nindex;             // Number of entries in index
+  int eof;                     // Non-zero once all files have been read
+  int nthreads;
+  pthread_t * threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int stop;                    // Tells decompression threads to exit
+  int nframes;                 // Number of frame slots
+  rawspec_rawz_frame_t * frames;
+  int head;                    // Slot of oldest frame
+  int nqueued;                 // Number of frames read but not released
+  int held;                    // Non-zero if frame at head has been returned
+} rawspec_rawz_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Builds the name of RAWZ file `fi` of `stem` in `fname`, which must have room
+// for PATH_MAX+1 chars.
+void rawspec_rawz_fname(char * fname, const char * stem, int fi);
+
+// Returns the codec named `name` or -1 if it is unknown or was not compiled in.
+int rawspec_rawz_codec(const char * name);
+
+// Opens RAWZ file `fi` of `stem` and starts `nthreads` decompression threads
+// (0 for the number of online CPUs, up to RAWSPEC_RAWZ_MAX_THREADS).  Returns
+// NULL on error.
+rawspec_rawz_t * rawspec_rawz_open(const char * stem, int fi, int nthreads);
+
+// Releases the frame returned by the previous call (if any) and returns the
+// next decompressed frame in `*frame`.  Returns 1 on success, 0 at the end of
+// the stem, or -1 on error.
+int rawspec_rawz_next(rawspec_rawz_t * z, rawspec_rawz_frame_t ** frame);
+
+// Returns the frame after the one returned by rawspec_rawz_next() in `*frame`
+// without decompressing it (only its header may be used).  Return values are
+// the same as for rawspec_rawz_next().
+int rawspec_rawz_peek(rawspec_rawz_t * z, rawspec_rawz_frame_t ** frame);
+
+// Discards all frames read so far and positions `z` so that the next call to
+// rawspec_rawz_next() returns the first frame whose PKTIDX is greater than or
+// equal to `pktidx`, searching from the current file onwards.  Returns 0 on
+// success or -1 on error.
+int rawspec_rawz_seek_pktidx(rawspec_rawz_t * z, int64_t pktidx);
+
+// Stops the decompression threads, closes the current file and frees `z`.
+void rawspec_rawz_close(rawspec_rawz_t * z);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RAWSPEC_RAWZ_H_
@@ -0,0 +1,1119 @@
+// rawspec_recv - Receives the UDP spectra packets (or TCP frames) sent by
+// rawspec's network output (see dump_net_callback), reassembles the spectra,
+// and optionally writes them to SIGPROC filterbank or FBH5 files.  Packet loss and receive
+// throughput are reported at the end, so rawspec_recv can also be used over
+// loopback as a benchmark for the sender.
+//
+// Each packet holds a filterbank header (parsed with fb_buf_read_header)
+// followed by one or more spectra of a range of fine channels.  Packets are
+// grouped into streams (one per output product) by their foff, tsamp and
+// nifs.  The channel extent of a stream is learned from the packets of its
+// first few spectra, then each packet is placed by its fch1 (channel) and
+// tstart (spectrum) in a window of spectra that are output in order.  Channels
+// that were not received are output as zeros and counted as lost.
+//
+// If the packets carry sequence keywords (see rawspec's --seq option), lost
+// packets are counted exactly for each route (destination) of each stream,
+// reordered packets are counted separately, and histograms of the lengths of
+// runs of lost packets and of the positions of lost packets within their dump
+// are reported.  These show whether losses occur in bursts at the start of
+// each dump (send or receive buffers too small for the pacing) or are spread
+// evenly (the link or receiver too slow).
+//
+// With a tcp:// address, rawspec_recv instead accepts connections from
+// rawspec's TCP output.  Each frame of a connection is handled like a packet
+// holding all of the spectra of one dump of a route, so nothing is lost or
+// reordered.
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "rawspec_fbutils.h"
+#include "fbh5_defs.h"
+#include "rawspec_socket.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+// Maximum size of a packet
+#define MAX_PACKET_BYTES (16384)
+
+// Number of packets received per recvmmsg() call
+#define BATCH_PACKETS (64)
+
+// Maximum number of TCP connections
+#define MAX_CONNS (16)
+
+// Maximum size of a TCP frame's filterbank header
+#define MAX_FRAME_HEADER_BYTES (65536)
+
+// Maximum number of streams (output products)
+#define MAX_STREAMS (16)
+
+// Default size of each stream's reassembly window
+#define WINDOW_BYTES (64*1024*1024)
+
+// Number of spectra and maximum size of the packets buffered while learning a
+// stream's channel extent
+#define LEARN_SPECTRA (4)
+#define LEARN_BYTES (64*1024*1024)
+
+// Size of a buffered packet record (length followed by packet, padded so that
+// lengths stay aligned)
+#define LEARN_RECORD_BYTES(len) (sizeof(size_t) + (((len) + 7) & ~(size_t)7))
+
+// Number of spectra per FBH5 write
+#define H5_NSPECTRA (16)
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL (40)
+#endif
+
+// Maximum number of routes per stream (see MAX_DESTS)
+#define MAX_ROUTES (64)
+
+// Number of loss histogram bins: run lengths of 1, 2-3, 4-7, ... packets and
+// tenths of a dump
+#define NBURST (16)
+#define NPOS (10)
+
+// Packet sequence of one route of a stream
+typedef struct {
+  int valid;
+  int npkts;                    // Packets per dump
+  int64_t next;                 // Next expected sequence number
+  uint64_t packets;
+  uint64_t lost;
+  uint64_t reordered;
+} seq_t;
+
+// Histograms of lost packets
+typedef struct {
+  uint64_t burst[NBURST];       // Runs of lost packets by log2 of length
+  uint64_t pos[NPOS];           // Lost packets by position in dump
+} loss_hist_t;
+
+typedef struct {
+  fb_hdr_t hdr;                 // Header of the stream's spectra
+  double fch1_ref;              // fch1 of the stream's first packet
+  double tstart0;               // tstart of the stream's first spectrum
+  int learning;                 // Non-zero while learning the extent
+  char * learn_buf;             // Packets buffered while learning
+  size_t learn_len;
+  long chan_lo;                 // First channel relative to fch1_ref
+  unsigned int nchans;
+  unsigned int nifs;
+  size_t spec_floats;           // Floats per spectrum (nifs * nchans)
+  // Reassembly window
+  unsigned int window;          // Number of spectra in window
+  float * win;                  // window spectra
+  uint32_t * nrecv;             // Channels received of each spectrum
+  int64_t base;                 // Spectrum index of oldest spectrum in window
+  // Output
+  int fd;                       // SIGPROC output file (-1 if none)
+  fbh5_context_t h5;            // FBH5 output file (if h5.active)
+  float * h5_buf;               // H5_NSPECTRA spectra to be written
+  float h5_valid[H5_NSPECTRA];  // Valid fraction of the spectra in h5_buf
+  unsigned int h5_n;            // Number of spectra in h5_buf
+  // Statistics
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t values;              // Channel-spectra received
+  uint64_t spectra;             // Spectra output
+  uint64_t missing;             // Channel-spectra output as zeros
+  uint64_t late;                // Packets that arrived after their spectra were output
+  uint64_t outside;             // Packets outside the stream's channel extent
+  seq_t seqs[MAX_ROUTES];       // Packet sequences of the stream's routes
+} stream_t;
+
+typedef struct {
+  const char * output_stem;     // NULL to discard spectra
+  int fbh5;                     // Write FBH5 rather than SIGPROC files?
+  unsigned int ncoarse;         // Coarse channels (for FBH5 chunking)
+  unsigned int window;          // Window size in spectra (0 for default)
+} recv_opts_t;
+
+// TCP connection
+typedef struct {
+  int fd;
+  char * buf;                   // Frame being received
+  size_t size;                  // Allocated size of buf
+  size_t len;                   // Bytes of frame received so far
+  size_t need;                  // Bytes of frame (only the prefix until known)
+} conn_t;
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+static struct option long_opts[] = {
+  {"fbh5",     0, NULL, 'j'},
+  {"ncoarse",  1, NULL, 'c'},
+  {"output",   1, NULL, 'o'},
+  {"rcvbuf",   1, NULL, 'b'},
+  {"timeout",  1, NULL, 't'},
+  {"window",   1, NULL, 'w'},
+  {"help",     0, NULL, 'h'},
+  {0,0,0,0}
+};
+
+void usage(const char * argv0) {
+  fprintf(stderr,
+    "Usage: %s [options] [tcp://][HOST:]PORT\n"
+    "\n"
+    "Receives rawspec network output on UDP PORT (of HOST, which may be a\n"
+    "multicast group), or accepts TCP output connections on PORT.\n"
+    "\n"
+    "Options:\n"
+    "  -b, --rcvbuf=BYTES     Socket receive buffer size [%d]\n"
+    "  -c, --ncoarse=N        Number of coarse channels (for FBH5 chunking) [1]\n"
+    "  -j, --fbh5             Write FBH5 files rather than SIGPROC files\n"
+    "  -o, --output=STEM      Write spectra of stream N to STEM.NNNN.fil (or .h5)\n"
+    "                         [discard]\n"
+    "  -t, --timeout=SECS     Stop after SECS seconds without packets (or\n"
+    "                         connections) [2]\n"
+    "  -w, --window=N         Reassembly window in spectra [%d MiB worth]\n"
+    "\n"
+    "  -h, --help             Show this message\n",
+    argv0, 64*1024*1024, WINDOW_BYTES/1024/1024
+  );
+}
+
+// Opens a UDP socket bound to `host` (or any address if NULL) and `port`,
+// joining `host` if it is a multicast group.  Returns the socket or -1 on
+// error.
+static int open_input_socket(const char * host, const char * port, int rcvbuf)
+{
+  int rc;
+  int sfd;
+  int one = 1;
+  socklen_t ss = sizeof(int);
+  struct addrinfo hints;
+  struct addrinfo * result;
+  struct sockaddr_in * sin;
+  struct ip_mreq mreq;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;      // Allow IPv4 only (for now)
+  hints.ai_socktype = SOCK_DGRAM; // Datagram socket
+  hints.ai_flags = AI_PASSIVE;
+
+  rc = getaddrinfo(host, port, &hints, &result);
+  if (rc != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+    return -1;
+  }
+
+  sfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if(sfd == -1) {
+    perror("socket");
+    freeaddrinfo(result);
+    return -1;
+  }
+  setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+
+  if(bind(sfd, result->ai_addr, result->ai_addrlen) == -1) {
+    perror("bind");
+    freeaddrinfo(result);
+    close(sfd);
+    return -1;
+  }
+
+  sin = (struct sockaddr_in *)result->ai_addr;
+  if(IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) {
+    mreq.imr_multiaddr = sin->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if(setsockopt(sfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      perror("setsockopt");
+      fprintf(stderr, "could not join multicast group %s\n", host);
+      freeaddrinfo(result);
+      close(sfd);
+      return -1;
+    }
+  }
+  freeaddrinfo(result);
+
+  // Request a large receive buffer and report if it was limited
+  if(setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) < 0) {
+    perror("setsockopt");
+  }
+  rc = 0;
+  getsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &rc, &ss);
+  // Linux reports twice the usable size
+  if(rc / 2 < rcvbuf) {
+    fprintf(stderr, "warning: receive buffer limited to %d bytes "
+        "(see net.core.rmem_max)\n", rc / 2);
+  }
+
+  // Report the number of packets dropped because the receive buffer was full
+  if(setsockopt(sfd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(int)) < 0) {
+    perror("setsockopt");
+    fprintf(stderr, "warning: could not set SO_RXQ_OVFL\n");
+  }
+
+  // Wake up periodically to check for timeout and signals
+  struct timeval tv = {0, 100*1000};
+  setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  return sfd;
+}
+
+// Returns the stream of packet header `hdr`, creating it if needed.  Returns
+// NULL if there are too many streams.
+static stream_t * find_stream(stream_t * streams, int * nstreams,
+                              const fb_hdr_t * hdr, const recv_opts_t * opts)
+{
+  int i;
+  stream_t * s;
+
+  for(i=0; i<*nstreams; i++) {
+    s = &streams[i];
+    if(s->hdr.foff == hdr->foff && s->hdr.tsamp == hdr->tsamp
+    && s->hdr.nifs == hdr->nifs) {
+      return s;
+    }
+  }
+  if(*nstreams == MAX_STREAMS) {
+    return NULL;
+  }
+
+  s = &streams[(*nstreams)++];
+  memset(s, 0, sizeof(stream_t));
+  s->hdr = *hdr;
+  s->hdr.net_route = 0;
+  s->hdr.net_dump = 0;
+  s->hdr.net_pkt = 0;
+  s->hdr.net_npkts = 0;
+  s->fch1_ref = hdr->fch1;
+  s->tstart0 = hdr->tstart;
+  s->nifs = hdr->nifs;
+  s->learning = 1;
+  s->fd = -1;
+  s->window = opts->window;
+  return s;
+}
+
+// Counts the `n` lost packets of route `q` starting at sequence number `first`
+// in `hist`.
+static void count_lost(seq_t * q, int64_t first, int64_t n, loss_hist_t * hist)
+{
+  int b = 0;
+  int64_t i;
+
+  while(b < NBURST-1 && (2 << b) <= n) {
+    b++;
+  }
+  hist->burst[b]++;
+  for(i=first; i<first+n; i++) {
+    hist->pos[(i % q->npkts) * NPOS / q->npkts]++;
+  }
+  q->lost += n;
+}
+
+// Tracks the sequence number of packet header `hdr` in stream `s`.
+static void track_seq(stream_t * s, const fb_hdr_t * hdr, loss_hist_t * hist)
+{
+  seq_t * q;
+  int64_t seq;
+
+  if(hdr->net_route < 0 || hdr->net_route >= MAX_ROUTES
+  || hdr->net_pkt < 0 || hdr->net_pkt >= hdr->net_npkts) {
+    return;
+  }
+  q = &s->seqs[hdr->net_route];
+  seq = (int64_t)hdr->net_dump * hdr->net_npkts + hdr->net_pkt;
+  q->packets++;
+
+  if(!q->valid) {
+    q->valid = 1;
+    q->npkts = hdr->net_npkts;
+    q->next = seq + 1;
+  } else if(seq >= q->next) {
+    if(seq > q->next) {
+      count_lost(q, q->next, seq - q->next, hist);
+    }
+    q->next = seq + 1;
+  } else {
+    // A packet that was counted as lost arrived late
+    q->reordered++;
+    if(q->lost > 0 && hist->pos[(seq % q->npkts) * NPOS / q->npkts] > 0) {
+      q->lost--;
+      hist->pos[(seq % q->npkts) * NPOS / q->npkts]--;
+    }
+  }
+}
+
+// Returns the channel of `hdr` relative to the stream's first packet.
+static long packet_chan(const stream_t * s, const fb_hdr_t * hdr)
+{
+  return lrint((hdr->fch1 - s->fch1_ref) / s->hdr.foff);
+}
+
+// Outputs the oldest spectrum of the window of stream `s` and advances the
+// window.  Returns 0 on success, -1 on output error.
+static int emit_spectrum(stream_t * s)
+{
+  int rc = 0;
+  unsigned int slot = s->base % s->window;
+  float * spec = s->win + slot * s->spec_floats;
+  uint32_t nrecv = s->nrecv[slot];
+
+  if(nrecv > s->nchans) {
+    nrecv = s->nchans;
+  }
+  s->missing += (uint64_t)(s->nchans - nrecv) * s->nifs;
+  s->spectra++;
+
+  if(s->fd != -1) {
+    if(write(s->fd, spec, s->spec_floats * sizeof(float))
+        != (ssize_t)(s->spec_floats * sizeof(float))) {
+      perror("write");
+      rc = -1;
+    }
+  } else if(s->h5.active) {
+    memcpy(s->h5_buf + s->h5_n * s->spec_floats, spec,
+           s->spec_floats * sizeof(float));
+    s->h5_valid[s->h5_n++] = (float)nrecv / s->nchans;
+    if(s->h5_n == H5_NSPECTRA) {
+      if(fbh5_write(&s->h5, &s->hdr, s->h5_buf,
+                    s->h5_n * s->spec_floats * sizeof(float), 0)
+      || fbh5_write_valid_frac(&s->h5, s->h5_valid, s->h5_n, 0)) {
+        rc = -1;
+      }
+      s->h5_n = 0;
+    }
+  }
+
+  memset(spec, 0, s->spec_floats * sizeof(float));
+  s->nrecv[slot] = 0;
+  s->base++;
+  return rc;
+}
+
+// Places the spectra of packet `pkt` (of `len` bytes, with parsed header
+// `hdr` of `hdr_len` bytes) in the window of stream `s`.  Returns 0 on
+// success, -1 on output error.
+static int place_packet(stream_t * s, const char * pkt, size_t len,
+                        const fb_hdr_t * hdr, size_t hdr_len)
+{
+  unsigned int i;
+  unsigned int j;
+  long chan = packet_chan(s, hdr) - s->chan_lo;
+  int64_t spec = llrint((hdr->tstart - s->tstart0) * 86400.0 / s->hdr.tsamp);
+  size_t pkt_floats = (len - hdr_len) / sizeof(float);
+  unsigned int nspec;
+  unsigned int slot;
+  const float * data = (const float *)(pkt + hdr_len);
+
+  if(hdr->nchans <= 0 || chan < 0 || chan + hdr->nchans > s->nchans) {
+    s->outside++;
+    return 0;
+  }
+  nspec = pkt_floats / (hdr->nchans * s->nifs);
+
+  if(spec < s->base) {
+    s->late++;
+    return 0;
+  }
+
+  for(i=0; i<nspec; i++, spec++) {
+    // Output spectra that no longer fit in the window
+    while(spec >= s->base + s->window) {
+      if(emit_spectrum(s)) {
+        return -1;
+      }
+    }
+    slot = spec % s->window;
+    for(j=0; j<s->nifs; j++) {
+      memcpy(s->win + slot * s->spec_floats + j * s->nchans + chan,
+             data + (i * s->nifs + j) * hdr->nchans,
+             hdr->nchans * sizeof(float));
+    }
+    s->nrecv[slot] += hdr->nchans;
+    s->values += (uint64_t)hdr->nchans * s->nifs;
+  }
+
+  return 0;
+}
+
+// Ends the learning phase of stream `s` (number `idx`): determines its channel
+// extent and first spectrum from the buffered packets, opens its output file,
+// and places the buffered packets.  Returns 0 on success, -1 on error.
+static int start_stream(stream_t * s, int idx, const recv_opts_t * opts)
+{
+  char fname[4096];
+  size_t off;
+  size_t len;
+  size_t hdr_len;
+  fb_hdr_t hdr;
+  long chan;
+  long chan_hi = 0;
+  int first = 1;
+
+  // Channel extent and first spectrum of buffered packets
+  for(off=0; off < s->learn_len; off += LEARN_RECORD_BYTES(len)) {
+    len = *(size_t *)(s->learn_buf + off);
+    fb_buf_read_header(s->learn_buf + off + sizeof(size_t), &hdr, &hdr_len);
+    if(hdr.tstart < s->tstart0) {
+      s->tstart0 = hdr.tstart;
+    }
+    chan = packet_chan(s, &hdr);
+    if(first || chan < s->chan_lo) {
+      s->chan_lo = chan;
+    }
+    if(first || chan + hdr.nchans > chan_hi) {
+      chan_hi = chan + hdr.nchans;
+    }
+    first = 0;
+  }
+  s->learning = 0;
+  s->nchans = chan_hi - s->chan_lo;
+  s->spec_floats = (size_t)s->nifs * s->nchans;
+  s->hdr.nchans = s->nchans;
+  s->hdr.fch1 = s->fch1_ref + s->chan_lo * s->hdr.foff;
+  s->hdr.tstart = s->tstart0;
+  s->hdr.nfpc = s->nchans;
+  if(opts->ncoarse > 1) {
+    if(s->nchans % opts->ncoarse == 0) {
+      s->hdr.nfpc = s->nchans / opts->ncoarse;
+    } else {
+      fprintf(stderr, "stream %d: nchans %u is not a multiple of %u coarse "
+          "channels, ignoring\n", idx, s->nchans, opts->ncoarse);
+    }
+  }
+  if(s->window == 0) {
+    s->window = WINDOW_BYTES / (s->spec_floats * sizeof(float));
+    if(s->window < 2) {
+      s->window = 2;
+    }
+  }
+
+  printf("stream %d: nchans %u nifs %u fch1 %.6f foff %.6g tsamp %.6g "
+      "(window %u spectra)\n", idx, s->nchans, s->nifs, s->hdr.fch1,
+      s->hdr.foff, s->hdr.tsamp, s->window);
+
+  s->win = calloc((size_t)s->window * s->spec_floats, sizeof(float));
+  s->nrecv = calloc(s->window, sizeof(uint32_t));
+  if(!s->win || !s->nrecv) {
+    fprintf(stderr, "cannot allocate reassembly window\n");
+    return -1;
+  }
+
+  if(opts->output_stem) {
+    snprintf(fname, sizeof(fname), "%s.%04d.%s", opts->output_stem, idx,
+             opts->fbh5 ? "h5" : "fil");
+    printf("stream %d: writing %s\n", idx, fname);
+    if(opts->fbh5) {
+      s->h5_buf = malloc(H5_NSPECTRA * s->spec_floats * sizeof(float));
+      if(!s->h5_buf
+      || fbh5_open(&s->h5, &s->hdr, H5_NSPECTRA, 0, FBH5_QUANT_F32, fname, 0)) {
+        fprintf(stderr, "cannot open %s\n", fname);
+        return -1;
+      }
+    } else {
+      s->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+      if(s->fd == -1 || fb_fd_write_header(s->fd, &s->hdr) < 0) {
+        perror(fname);
+        return -1;
+      }
+    }
+  }
+
+  // Place buffered packets
+  for(off=0; off < s->learn_len; off += LEARN_RECORD_BYTES(len)) {
+    len = *(size_t *)(s->learn_buf + off);
+    fb_buf_read_header(s->learn_buf + off + sizeof(size_t), &hdr, &hdr_len);
+    if(place_packet(s, s->learn_buf + off + sizeof(size_t), len, &hdr, hdr_len)) {
+      return -1;
+    }
+  }
+  free(s->learn_buf);
+  s->learn_buf = NULL;
+  s->learn_len = 0;
+
+  return 0;
+}
+
+// Buffers packet `pkt` of `len` bytes while stream `s` is learning.  Returns
+// 0 on success, -1 on error.
+static int learn_packet(stream_t * s, const char * pkt, size_t len)
+{
+  char * p;
+
+  p = realloc(s->learn_buf, s->learn_len + LEARN_RECORD_BYTES(len));
+  if(!p) {
+    fprintf(stderr, "cannot allocate packet buffer\n");
+    return -1;
+  }
+  s->learn_buf = p;
+  *(size_t *)(s->learn_buf + s->learn_len) = len;
+  memcpy(s->learn_buf + s->learn_len + sizeof(size_t), pkt, len);
+  s->learn_len += LEARN_RECORD_BYTES(len);
+  return 0;
+}
+
+// Outputs the remaining spectra of stream `s` and closes its output file.
+// Returns 0 on success, -1 on error.
+static int finish_stream(stream_t * s, int idx, const recv_opts_t * opts)
+{
+  int rc = 0;
+  int64_t top;
+  unsigned int i;
+
+  if(s->learning && start_stream(s, idx, opts)) {
+    return -1;
+  }
+
+  // Output up to the last spectrum with any received channels
+  for(top = s->base + s->window; top > s->base; top--) {
+    if(s->nrecv[(top - 1) % s->window]) {
+      break;
+    }
+  }
+  while(s->base < top && rc == 0) {
+    rc = emit_spectrum(s);
+  }
+
+  if(s->fd != -1) {
+    close(s->fd);
+  }
+  if(s->h5.active) {
+    if(s->h5_n > 0
+    && (fbh5_write(&s->h5, &s->hdr, s->h5_buf,
+                   s->h5_n * s->spec_floats * sizeof(float), 0)
+     || fbh5_write_valid_frac(&s->h5, s->h5_valid, s->h5_n, 0))) {
+      rc = -1;
+    }
+    if(fbh5_close(&s->h5, 0)) {
+      rc = -1;
+    }
+  }
+
+  free(s->win);
+  free(s->nrecv);
+  free(s->h5_buf);
+  for(i=0; i<H5_NSPECTRA; i++) {
+    s->h5_valid[i] = 0;
+  }
+  return rc;
+}
+
+// Opens a TCP socket listening on `host` (or any address if NULL) and `port`.
+// Returns the socket or -1 on error.
+static int open_listen_socket(const char * host, const char * port)
+{
+  int rc;
+  int sfd;
+  int one = 1;
+  struct addrinfo hints;
+  struct addrinfo * result;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;        // Allow IPv4 only (for now)
+  hints.ai_socktype = SOCK_STREAM;  // Stream socket
+  hints.ai_flags = AI_PASSIVE;
+
+  rc = getaddrinfo(host, port, &hints, &result);
+  if (rc != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+    return -1;
+  }
+
+  sfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if(sfd == -1) {
+    perror("socket");
+    freeaddrinfo(result);
+    return -1;
+  }
+  setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+
+  if(bind(sfd, result->ai_addr, result->ai_addrlen) == -1
+  || listen(sfd, MAX_CONNS) == -1) {
+    perror("bind");
+    freeaddrinfo(result);
+    close(sfd);
+    return -1;
+  }
+  freeaddrinfo(result);
+
+  return sfd;
+}
+
+// Accepts a connection on listening socket `sfd` into `c`, requesting a
+// receive buffer of `rcvbuf` bytes.  Returns 0 on success, -1 on error.
+static int accept_conn(int sfd, int rcvbuf, conn_t * c)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+
+  c->fd = accept(sfd, (struct sockaddr *)&addr, &addrlen);
+  if(c->fd == -1) {
+    perror("accept");
+    return -1;
+  }
+  if(setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) < 0) {
+    perror("setsockopt");
+  }
+  c->size = sizeof(rawspec_tcp_frame_t);
+  c->buf = malloc(c->size);
+  c->len = 0;
+  c->need = sizeof(rawspec_tcp_frame_t);
+  if(!c->buf) {
+    fprintf(stderr, "cannot allocate frame buffer\n");
+    close(c->fd);
+    return -1;
+  }
+  printf("connection from %s:%d\n", inet_ntoa(addr.sin_addr),
+      ntohs(addr.sin_port));
+  return 0;
+}
+
+// Reads from TCP connection `c` into its current frame.  Returns 1 when the
+// frame is complete, 0 if more data is needed, or -1 at the end of the
+// connection or on error (including an invalid frame).
+static int read_frame(conn_t * c)
+{
+  ssize_t n;
+  char * p;
+  rawspec_tcp_frame_t * prefix;
+
+  n = read(c->fd, c->buf + c->len, c->need - c->len);
+  if(n <= 0) {
+    if(n == -1 && (errno == EINTR || errno == EAGAIN)) {
+      return 0;
+    }
+    if(n == -1) {
+      perror("read");
+    } else if(c->len > 0) {
+      fprintf(stderr, "connection closed within a frame\n");
+    }
+    return -1;
+  }
+  c->len += n;
+  if(c->len < c->need) {
+    return 0;
+  }
+
+  // The prefix gives the size of the rest of the frame
+  if(c->need == sizeof(rawspec_tcp_frame_t)) {
+    prefix = (rawspec_tcp_frame_t *)c->buf;
+    if(prefix->magic != RAWSPEC_TCP_MAGIC
+    || prefix->hdr_size > MAX_FRAME_HEADER_BYTES) {
+      fprintf(stderr, "invalid frame, closing connection\n");
+      return -1;
+    }
+    c->need += prefix->hdr_size + prefix->data_size;
+    if(c->need > c->size) {
+      p = realloc(c->buf, c->need);
+      if(!p) {
+        fprintf(stderr, "cannot allocate %lu byte frame\n", c->need);
+        return -1;
+      }
+      c->buf = p;
+      c->size = c->need;
+    }
+    return c->len == c->need ? 1 : 0;
+  }
+
+  return 1;
+}
+
+// Handles packet (or TCP frame without its prefix) `pkt` of `len` bytes:
+// finds its stream among the `*nstreams` streams of `streams` (creating it if
+// needed), tracks its sequence keywords (if any), and buffers it while the
+// stream is learning or places it in the stream's window.  Invalid packets
+// are counted in `*bad`.  Returns 0 on success, -1 on error.
+static int handle_packet(char * pkt, size_t len, stream_t * streams,
+                         int * nstreams, const recv_opts_t * opts,
+                         loss_hist_t * hist, uint64_t * bad)
+{
+  fb_hdr_t hdr;
+  size_t hdr_len;
+  stream_t * s;
+  char hdr_end[16];
+  size_t hdr_end_len;
+
+  // Every header ends with the "HEADER_END" keyword
+  hdr_end_len = (char *)fb_buf_write_string(hdr_end, "HEADER_END") - hdr_end;
+
+  // Make sure the packet holds a complete header before parsing it
+  if(!memmem(pkt, len, hdr_end, hdr_end_len)
+  || fb_buf_read_header(pkt, &hdr, &hdr_len) == pkt
+  || hdr_len > len || hdr.nifs <= 0 || hdr.tsamp <= 0 || hdr.foff == 0) {
+    (*bad)++;
+    return 0;
+  }
+
+  s = find_stream(streams, nstreams, &hdr, opts);
+  if(!s) {
+    (*bad)++;
+    return 0;
+  }
+  s->packets++;
+  s->bytes += len;
+  if(hdr.net_npkts > 0) {
+    track_seq(s, &hdr, hist);
+  }
+
+  if(s->learning) {
+    // Buffer the packets of the first few spectra (at least one packet, which
+    // may be a large TCP frame)
+    if(s->learn_len == 0
+    || (llabs(llrint((hdr.tstart - s->tstart0) * 86400.0 / hdr.tsamp))
+          < LEARN_SPECTRA && s->learn_len + len <= LEARN_BYTES)) {
+      return learn_packet(s, pkt, len);
+    }
+    if(start_stream(s, s - streams, opts)) {
+      return -1;
+    }
+  }
+
+  return place_packet(s, pkt, len, &hdr, hdr_len);
+}
+
+int main(int argc, char * argv[])
+{
+  int opt;
+  int i;
+  int n;
+  int rc = 0;
+  int sfd;
+  int rcvbuf = 64*1024*1024;
+  double timeout = 2.0;
+  recv_opts_t opts;
+  char * host = NULL;
+  char * port;
+  char * pchar;
+  char * bufs = NULL;
+  struct mmsghdr msgs[BATCH_PACKETS];
+  struct iovec iov[BATCH_PACKETS];
+  char cmsgbufs[BATCH_PACKETS][CMSG_SPACE(sizeof(uint32_t))];
+  struct cmsghdr * cmsg;
+  uint32_t drops = 0;
+  int tcp = 0;
+  conn_t conns[MAX_CONNS];
+  int nconns = 0;
+  int total_conns = 0;
+  struct pollfd pfds[MAX_CONNS+1];
+  stream_t streams[MAX_STREAMS];
+  stream_t * s;
+  int nstreams = 0;
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t bad = 0;
+  uint64_t values = 0;
+  uint64_t missing = 0;
+  double lost_packets = 0;
+  uint64_t seq_lost = 0;
+  uint64_t seq_reordered = 0;
+  int have_seq = 0;
+  loss_hist_t hist;
+  seq_t * q;
+  int j;
+  struct timespec ts_first = {0}, ts_last = {0}, ts_now;
+  double elapsed;
+
+  memset(&opts, 0, sizeof(opts));
+  memset(&hist, 0, sizeof(hist));
+
+  while((opt=getopt_long(argc,argv,"b:c:jo:t:w:h",long_opts,NULL))!=-1) {
+    switch (opt) {
+      case 'h': // Help
+        usage(argv[0]);
+        return 0;
+        break;
+
+      case 'b': // Receive buffer size
+        rcvbuf = strtol(optarg, NULL, 0);
+        break;
+
+      case 'c': // Number of coarse channels
+        opts.ncoarse = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'j': // FBH5 output
+        opts.fbh5 = 1;
+        break;
+
+      case 'o': // Output stem
+        opts.output_stem = optarg;
+        break;
+
+      case 't': // Idle timeout
+        timeout = strtod(optarg, NULL);
+        break;
+
+      case 'w': // Window size
+        opts.window = strtoul(optarg, NULL, 0);
+        break;
+
+      case '?': // Command line parsing error
+      default:
+        usage(argv[0]);
+        return 1;
+        break;
+    }
+  }
+
+  if(optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  port = argv[optind];
+  if(!strncmp(port, "tcp://", 6)) {
+    tcp = 1;
+    port += 6;
+  }
+  pchar = strrchr(port, ':');
+  if(pchar) {
+    *pchar++ = '\0';
+    host = port;
+    port = pchar;
+  }
+
+  if(tcp) {
+    sfd = open_listen_socket(host, port);
+  } else {
+    sfd = open_input_socket(host, port, rcvbuf);
+  }
+  if(sfd == -1) {
+    return 1;
+  }
+
+  if(!tcp) {
+    bufs = malloc(BATCH_PACKETS * MAX_PACKET_BYTES);
+    if(!bufs) {
+      fprintf(stderr, "cannot allocate packet buffers\n");
+      return 1;
+    }
+  }
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  printf("receiving on %s%s:%s\n", tcp ? "tcp://" : "", host ? host : "*",
+      port);
+
+  // TCP input: accept connections and handle their frames as they arrive
+  while(tcp && !stop && rc == 0) {
+    pfds[0].fd = sfd;
+    pfds[0].events = nconns < MAX_CONNS ? POLLIN : 0;
+    for(i=0; i<nconns; i++) {
+      pfds[i+1].fd = conns[i].fd;
+      pfds[i+1].events = POLLIN;
+    }
+
+    // Wake up periodically to check for timeout and signals
+    n = poll(pfds, nconns + 1, 100);
+    clock_gettime(CLOCK_MONOTONIC, &ts_now);
+    if(n == -1 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    if(n <= 0) {
+      // Stop when idle for timeout after the last connection has closed
+      if(total_conns > 0 && nconns == 0
+      && ELAPSED_NS(ts_last, ts_now) > timeout * 1e9) {
+        break;
+      }
+      continue;
+    }
+
+    // Connections are removed by moving the last one into their place, so
+    // go backwards
+    for(i=nconns-1; i>=0 && rc == 0; i--) {
+      if(!(pfds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      ts_last = ts_now;
+      n = read_frame(&conns[i]);
+      if(n == 1) {
+        if(packets == 0) {
+          ts_first = ts_now;
+        }
+        packets++;
+        bytes += conns[i].len;
+        rc = handle_packet(conns[i].buf + sizeof(rawspec_tcp_frame_t),
+                           conns[i].len - sizeof(rawspec_tcp_frame_t),
+                           streams, &nstreams, &opts, &hist, &bad);
+        conns[i].len = 0;
+        conns[i].need = sizeof(rawspec_tcp_frame_t);
+      } else if(n == -1) {
+        close(conns[i].fd);
+        free(conns[i].buf);
+        conns[i] = conns[--nconns];
+      }
+    }
+
+    if(pfds[0].revents & POLLIN) {
+      if(accept_conn(sfd, rcvbuf, &conns[nconns]) == 0) {
+        nconns++;
+        total_conns++;
+        ts_last = ts_now;
+      }
+    }
+  }
+
+  // UDP input
+  while(!tcp && !stop && rc == 0) {
+    for(i=0; i<BATCH_PACKETS; i++) {
+      iov[i].iov_base = bufs + i * MAX_PACKET_BYTES;
+      iov[i].iov_len = MAX_PACKET_BYTES;
+      memset(&msgs[i], 0, sizeof(struct mmsghdr));
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = cmsgbufs[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(cmsgbufs[i]);
+    }
+
+    n = recvmmsg(sfd, msgs, BATCH_PACKETS, MSG_WAITFORONE, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts_now);
+    if(n == -1) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recvmmsg");
+        break;
+      }
+      // Stop when idle for timeout after first packet
+      if(packets > 0 && ELAPSED_NS(ts_last, ts_now) > timeout * 1e9) {
+        break;
+      }
+      continue;
+    }
+
+    if(packets == 0) {
+      ts_first = ts_now;
+    }
+    ts_last = ts_now;
+
+    for(i=0; i<n && rc == 0; i++) {
+      char * pkt = iov[i].iov_base;
+      size_t len = msgs[i].msg_len;
+
+      // Kernel drop counter (cumulative)
+      for(cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+          cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+          memcpy(&drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+        }
+      }
+
+      packets++;
+      bytes += len;
+      rc = handle_packet(pkt, len, streams, &nstreams, &opts, &hist, &bad);
+    }
+  }
+
+  // Output remaining spectra and report
+  elapsed = packets > 1 ? ELAPSED_NS(ts_first, ts_last) / 1e9 : 0;
+  for(i=0; i<nstreams; i++) {
+    s = &streams[i];
+    if(finish_stream(s, i, &opts)) {
+      rc = -1;
+    }
+    printf("stream %d: %lu spectra, %lu packets, %lu of %lu values lost (%.4f%%)",
+        i, s->spectra, s->packets, s->missing, s->missing + s->values,
+        s->missing + s->values ? 100.0 * s->missing / (s->missing + s->values) : 0);
+    if(s->late || s->outside) {
+      printf(", %lu late and %lu out of range packets", s->late, s->outside);
+    }
+    printf("\n");
+    values += s->values;
+    missing += s->missing;
+    if(s->values) {
+      lost_packets += (double)s->missing * s->packets / s->values;
+    }
+
+    for(j=0; j<MAX_ROUTES; j++) {
+      q = &s->seqs[j];
+      if(!q->valid) {
+        continue;
+      }
+      // Packets missing from the end of the last dump
+      if(q->next % q->npkts) {
+        count_lost(q, q->next, q->npkts - q->next % q->npkts, &hist);
+      }
+      printf("stream %d route %d: %lu packets (%d per dump), %lu lost, "
+          "%lu reordered\n", i, j, q->packets, q->npkts, q->lost,
+          q->reordered);
+      seq_lost += q->lost;
+      seq_reordered += q->reordered;
+      have_seq = 1;
+    }
+  }
+
+  printf("received %lu %s (%lu bytes) in %.3f s", packets,
+      tcp ? "frames" : "packets", bytes, elapsed);
+  if(elapsed > 0) {
+    printf(" (%.3f Gbps, %.1f k%s)", 8e-9 * bytes / elapsed,
+        1e-3 * packets / elapsed, tcp ? "frames/s" : "pps");
+  }
+  printf("\n");
+  if(tcp) {
+    printf("%d connections", total_conns);
+  } else if(have_seq) {
+    printf("lost packets %lu (%.4f%%), reordered packets %lu, "
+        "socket buffer drops %u", seq_lost,
+        packets ? 100.0 * seq_lost / (packets + seq_lost) : 0,
+        seq_reordered, drops);
+  } else {
+    printf("estimated lost packets %.0f (%.4f%%), socket buffer drops %u",
+        lost_packets, packets ? 100.0 * lost_packets / (packets + lost_packets) : 0,
+        drops);
+  }
+  if(bad) {
+    printf(", %lu invalid %s", bad, tcp ? "frames" : "packets");
+  }
+  printf("\n");
+
+  if(seq_lost > 0) {
+    printf("runs of lost packets by length:");
+    for(j=0; j<NBURST; j++) {
+      if(hist.burst[j]) {
+        if(j == 0) {
+          printf(" 1: %lu", hist.burst[j]);
+        } else if(j == NBURST-1) {
+          printf(" %d+: %lu", 1 << j, hist.burst[j]);
+        } else {
+          printf(" %d-%d: %lu", 1 << j, (2 << j) - 1, hist.burst[j]);
+        }
+      }
+    }
+    printf("\n");
+    printf("lost packets by position in dump:");
+    for(j=0; j<NPOS; j++) {
+      printf(" %d%%: %lu", j * 100 / NPOS, hist.pos[j]);
+    }
+    printf("\n");
+  }
+
+  for(i=0; i<nconns; i++) {
+    close(conns[i].fd);
+    free(conns[i].buf);
+  }
+  free(bufs);
+  close(sfd);
+  return rc ? 1 : 0;
+}
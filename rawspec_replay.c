@@ -0,0 +1,320 @@
+// rawspec_replay - Replays the RAW files of a stem into a shared memory ring
+// buffer (see rawspec_shm_ring_t in rawspec_input.h) so that rawspec's
+// shared memory input can be tested without a live recorder.  Optionally, the
+// blocks are replayed at the real-time rate of the recording, in which case the
+// number of blocks that were not freed by the consumer in time is reported.
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include "rawspec_input.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+// Size of the ring buffer's control area (keeps blocks page aligned)
+#define RING_HEADER_SIZE (4096)
+
+// Default number of blocks in the ring buffer
+#define RING_NBLOCKS (8)
+
+// Linux requires callers of semctl() to define this
+union semun {
+  int val;
+  struct semid_ds * buf;
+  unsigned short * array;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig)
+{
+  stop = 1;
+}
+
+static struct option long_opts[] = {
+  {"hdrsize",  1, NULL, 'H'},
+  {"key",      1, NULL, 'k'},
+  {"nblocks",  1, NULL, 'n'},
+  {"realtime", 0, NULL, 'r'},
+  {"help",     0, NULL, 'h'},
+  {0,0,0,0}
+};
+
+void usage(const char * argv0) {
+  fprintf(stderr,
+    "Usage: %s [options] STEM\n"
+    "\n"
+    "Options:\n"
+    "  -H, --hdrsize=BYTES    Size of header area of each block [%d]\n"
+    "  -k, --key=KEY          SysV IPC key of ring buffer [0x%x]\n"
+    "  -n, --nblocks=N        Number of blocks in ring buffer [%d]\n"
+    "  -r, --realtime         Replay blocks at the real-time rate\n"
+    "\n"
+    "  -h, --help             Show this message\n",
+    argv0, RAWSPEC_INPUT_SHM_HDR_SIZE, 0x72617773, RING_NBLOCKS
+  );
+}
+
+// Waits for block `bi` to be free.  Returns 0 when it is free, -1 if
+// interrupted.
+static int wait_free(int semid, int bi)
+{
+  struct sembuf op = {.sem_num = bi, .sem_op = 0, .sem_flg = 0};
+
+  while(semop(semid, &op, 1) == -1) {
+    if(errno != EINTR || stop) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Returns non-zero if block `bi` is free.
+static int is_free(int semid, int bi)
+{
+  struct sembuf op = {.sem_num = bi, .sem_op = 0, .sem_flg = IPC_NOWAIT};
+
+  return semop(semid, &op, 1) == 0;
+}
+
+// Marks block `bi` as filled.
+static void set_filled(int semid, int bi)
+{
+  struct sembuf op = {.sem_num = bi, .sem_op = +1, .sem_flg = 0};
+
+  semop(semid, &op, 1);
+}
+
+int main(int argc, char * argv[])
+{
+  int opt;
+  key_t key = 0x72617773; // "raws"
+  int n_block = RING_NBLOCKS;
+  size_t hdr_size = RAWSPEC_INPUT_SHM_HDR_SIZE;
+  int realtime = 0;
+  const char * stem;
+  rawspec_input_t in;
+  rawspec_raw_hdr_t raw_hdr;
+  off_t pos;
+  size_t block_size;
+  int shmid = -1;
+  int semid = -1;
+  rawspec_shm_ring_t * ring = (void *)-1;
+  union semun arg;
+  char * blk;
+  int bi;
+  int i;
+  uint64_t nblocks = 0;
+  uint64_t nlate = 0;
+  int64_t late_ns;
+  int64_t max_late_ns = 0;
+  int64_t block_ns;
+  int64_t data_ns = 0;
+  int64_t elapsed_ns;
+  struct timespec ts_start, ts_due, ts_now;
+  struct sigaction sa;
+  int rc = 1;
+
+  while((opt=getopt_long(argc,argv,"H:k:n:rh",long_opts,NULL))!=-1) {
+    switch (opt) {
+      case 'h': // Help
+        usage(argv[0]);
+        return 0;
+        break;
+
+      case 'H': // Header area size
+        hdr_size = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'k': // IPC key
+        key = (key_t)strtol(optarg, NULL, 0);
+        break;
+
+      case 'n': // Number of blocks
+        n_block = strtol(optarg, NULL, 0);
+        break;
+
+      case 'r': // Real-time pacing
+        realtime = 1;
+        break;
+
+      case '?': // Command line parsing error
+      default:
+        usage(argv[0]);
+        return 1;
+        break;
+    }
+  }
+
+  if(optind != argc-1) {
+    usage(argv[0]);
+    return 1;
+  }
+  stem = argv[optind];
+
+  if(n_block <= 0 || hdr_size < 80) {
+    fprintf(stderr, "invalid ring geometry\n");
+    return 1;
+  }
+
+  // Interrupt blocking semops on SIGINT/SIGTERM so the ring gets removed
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  in.follow_timeout = 0;
+  if(rawspec_input_open(&in, stem, 0)) {
+    return 1;
+  }
+  pos = rawspec_input_read_header(&in, &raw_hdr);
+  if(pos <= 0) {
+    rawspec_input_close(&in);
+    return 1;
+  }
+
+  // Size blocks for the first block of the stem
+  block_size = hdr_size + raw_hdr.blocsize;
+  block_size = (block_size + 4095) & ~(size_t)4095;
+
+  shmid = shmget(key, RING_HEADER_SIZE + n_block * block_size,
+                 IPC_CREAT | IPC_EXCL | 0666);
+  if(shmid == -1) {
+    perror("shmget");
+    goto done;
+  }
+  ring = shmat(shmid, NULL, 0);
+  if(ring == (void *)-1) {
+    perror("shmat");
+    goto done;
+  }
+  semid = semget(key, n_block, IPC_CREAT | IPC_EXCL | 0666);
+  if(semid == -1) {
+    perror("semget");
+    goto done;
+  }
+  for(i=0; i<n_block; i++) {
+    arg.val = 0;
+    semctl(semid, i, SETVAL, arg);
+  }
+
+  memset(ring, 0, RING_HEADER_SIZE);
+  strncpy(ring->data_type, "GUPPI", sizeof(ring->data_type));
+  ring->header_size = RING_HEADER_SIZE;
+  ring->block_size = block_size;
+  ring->n_block = n_block;
+  ring->shmid = shmid;
+  ring->semid = semid;
+
+  printf("replaying %s into shm:0x%x:%lu (%d blocks of %lu bytes)\n",
+      stem, key, hdr_size, n_block, block_size);
+  fflush(stdout);
+
+  bi = 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  ts_due = ts_start;
+  while(!stop && pos > 0) {
+    if(raw_hdr.hdr_size > hdr_size
+    || raw_hdr.blocsize > block_size - hdr_size) {
+      fprintf(stderr, "block does not fit in ring buffer block\n");
+      break;
+    }
+
+    // Time span of block from sample time and number of time samples per block
+    block_ns = 1e9 * raw_hdr.tbin * raw_hdr.blocsize
+             / ((2 * raw_hdr.npol * raw_hdr.obsnchan * raw_hdr.nbits)/8);
+    data_ns += block_ns;
+
+    if(realtime) {
+      // Wait until block is due
+      while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts_due, NULL)
+          == EINTR && !stop);
+      if(!is_free(semid, bi)) {
+        nlate++;
+      }
+    }
+
+    if(wait_free(semid, bi)) {
+      break;
+    }
+
+    if(realtime) {
+      clock_gettime(CLOCK_MONOTONIC, &ts_now);
+      late_ns = ELAPSED_NS(ts_due, ts_now);
+      if(late_ns > max_late_ns) {
+        max_late_ns = late_ns;
+      }
+      ts_due.tv_nsec += block_ns;
+      ts_due.tv_sec += ts_due.tv_nsec / 1000000000;
+      ts_due.tv_nsec %= 1000000000;
+    }
+
+    // Copy header and data into block
+    blk = (char *)ring + RING_HEADER_SIZE + bi * block_size;
+    memset(blk, ' ', hdr_size);
+    if(pread(in.fd, blk, raw_hdr.hdr_size, raw_hdr.hdr_pos)
+        != raw_hdr.hdr_size
+    || rawspec_input_read(&in, blk + hdr_size, raw_hdr.blocsize)
+        != raw_hdr.blocsize) {
+      fprintf(stderr, "error reading block from %s\n", in.fname);
+      break;
+    }
+
+    set_filled(semid, bi);
+    nblocks++;
+    bi = (bi + 1) % n_block;
+
+    pos = rawspec_input_read_header(&in, &raw_hdr);
+  }
+
+  // Send end-of-stream block and wait for consumer to free all blocks
+  if(!stop && wait_free(semid, bi) == 0) {
+    blk = (char *)ring + RING_HEADER_SIZE + bi * block_size;
+    memset(blk, ' ', 80);
+    memcpy(blk, "END", 3);
+    set_filled(semid, bi);
+    for(i=0; i<n_block && !stop; i++) {
+      wait_free(semid, i);
+    }
+    rc = 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_now);
+  elapsed_ns = ELAPSED_NS(ts_start, ts_now);
+
+  // When not pacing, the consumer's speed relative to the real-time rate is
+  // its real-time headroom.
+  printf("replayed %lu blocks in %.3f s (%.2fx real-time)",
+      nblocks, elapsed_ns / 1e9, elapsed_ns ? (double)data_ns / elapsed_ns : 0);
+  if(realtime) {
+    printf(", %lu late (max %.3f ms)", nlate, max_late_ns / 1e6);
+  }
+  printf("\n");
+
+done:
+  rawspec_input_close(&in);
+  if(ring != (void *)-1) {
+    shmdt(ring);
+  }
+  if(semid != -1) {
+    semctl(semid, 0, IPC_RMID);
+  }
+  if(shmid != -1) {
+    shmctl(shmid, IPC_RMID, NULL);
+  }
+
+  return rc;
+}
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "rawspec_sendq.h"
+
+// Maximum number of frames gathered into one sendmsg() call
+#define SENDQ_BATCH_FRAMES (64)
+
+struct rawspec_sendq_frame {
+  rawspec_sendq_frame_t * next;
+  size_t size;
+  char data[];
+};
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds.
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000*1000*1000 + ts.tv_nsec;
+}
+
+// Sends all `n` buffers of `iov` (which is modified) to socket `fd`, adding
+// the number of system calls made to `*nsyscalls`.  Returns 0 on success or
+// an errno value on error.
+static int send_all(int fd, struct iovec * iov, int n, uint64_t * nsyscalls)
+{
+  ssize_t rc;
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  while(n > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    // MSG_NOSIGNAL reports a closed connection as EPIPE rather than SIGPIPE
+    rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    (*nsyscalls)++;
+    if(rc < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    // Skip the buffers (and part of a buffer) that were sent
+    while(n > 0 && (size_t)rc >= iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if(n > 0) {
+      iov->iov_base = (char *)iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return 0;
+}
+
+static void * sendq_thread_func(void * arg)
+{
+  int i;
+  int n;
+  int error;
+  size_t nbytes;
+  uint64_t nsyscalls;
+  rawspec_sendq_frame_t * batch[SENDQ_BATCH_FRAMES];
+  struct iovec iov[SENDQ_BATCH_FRAMES];
+  rawspec_sendq_t * q = (rawspec_sendq_t *)arg;
+
+  for(;;) {
+    // Take as many frames as possible off the queue
+    pthread_mutex_lock(&q->mutex);
+    while(!q->head && !q->closing) {
+      pthread_cond_wait(&q->cond_frames, &q->mutex);
+    }
+    if(!q->head) {
+      pthread_mutex_unlock(&q->mutex);
+      break;
+    }
+    for(n=0; q->head && n<SENDQ_BATCH_FRAMES; n++) {
+      batch[n] = q->head;
+      q->head = q->head->next;
+    }
+    if(!q->head) {
+      q->tail = NULL;
+    }
+    error = q->error;
+    pthread_mutex_unlock(&q->mutex);
+
+    nbytes = 0;
+    for(i=0; i<n; i++) {
+      iov[i].iov_base = batch[i]->data;
+      iov[i].iov_len = batch[i]->size;
+      nbytes += batch[i]->size;
+    }
+
+    // Frames are discarded once the connection has failed
+    nsyscalls = 0;
+    if(!error) {
+      error = send_all(q->fd, iov, n, &nsyscalls);
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    q->syscalls += nsyscalls;
+    if(error) {
+      if(!q->error) {
+        q->error = error;
+        fprintf(stderr, "%s: %s, dropping further output\n", q->name,
+            strerror(error));
+      }
+      q->dropped += n;
+    } else {
+      q->frames += n;
+      q->bytes += nbytes;
+      q->stop_ns = now_ns();
+    }
+    q->queued -= nbytes;
+    pthread_cond_broadcast(&q->cond_space);
+    pthread_mutex_unlock(&q->mutex);
+
+    for(i=0; i<n; i++) {
+      free(batch[i]);
+    }
+  }
+
+  return NULL;
+}
+
+int rawspec_sendq_init(rawspec_sendq_t * q, const char * name, int fd,
+                       size_t capacity)
+{
+  int rc;
+
+  memset(q, 0, sizeof(rawspec_sendq_t));
+  snprintf(q->name, sizeof(q->name), "%s", name);
+  q->fd = fd;
+  q->capacity = capacity;
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->cond_frames, NULL);
+  pthread_cond_init(&q->cond_space, NULL);
+
+  if((rc=pthread_create(&q->thread, NULL, sendq_thread_func, q))) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+    return -1;
+  }
+  q->thread_valid = 1;
+
+  return 0;
+}
+
+void * rawspec_sendq_reserve(rawspec_sendq_t * q, size_t size)
+{
+  uint64_t wait_start = 0;
+  rawspec_sendq_frame_t * frame;
+
+  pthread_mutex_lock(&q->mutex);
+  if(q->start_ns == 0) {
+    q->start_ns = now_ns();
+  }
+  // Wait for room, but always accept a frame into an empty queue
+  while(!q->error && q->queued > 0 && q->queued + size > q->capacity) {
+    if(wait_start == 0) {
+      wait_start = now_ns();
+    }
+    pthread_cond_wait(&q->cond_space, &q->mutex);
+  }
+  if(wait_start != 0) {
+    q->waits++;
+    q->blocked_ns += now_ns() - wait_start;
+  }
+  if(q->error) {
+    q->dropped++;
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+  }
+  q->queued += size;
+  if(q->max_queued < q->queued) {
+    q->max_queued = q->queued;
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  frame = malloc(offsetof(rawspec_sendq_frame_t, data) + size);
+  if(!frame) {
+    fprintf(stderr, "%s: cannot allocate %lu byte frame\n", q->name, size);
+    pthread_mutex_lock(&q->mutex);
+    q->queued -= size;
+    q->dropped++;
+    pthread_cond_broadcast(&q->cond_space);
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+  }
+  frame->next = NULL;
+  frame->size = size;
+
+  return frame->data;
+}
+
+void rawspec_sendq_commit(rawspec_sendq_t * q, void * buf)
+{
+  rawspec_sendq_frame_t * frame = (rawspec_sendq_frame_t *)
+      ((char *)buf - offsetof(rawspec_sendq_frame_t, data));
+
+  pthread_mutex_lock(&q->mutex);
+  if(q->tail) {
+    q->tail->next = frame;
+  } else {
+    q->head = frame;
+  }
+  q->tail = frame;
+  pthread_cond_signal(&q->cond_frames);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+void rawspec_sendq_close(rawspec_sendq_t * q)
+{
+  int rc;
+
+  if(q->thread_valid) {
+    pthread_mutex_lock(&q->mutex);
+    q->closing = 1;
+    pthread_cond_signal(&q->cond_frames);
+    pthread_mutex_unlock(&q->mutex);
+
+    if((rc=pthread_join(q->thread, NULL))) {
+      fprintf(stderr, "pthread_join: %s\n", strerror(rc));
+    }
+    q->thread_valid = 0;
+  }
+
+  pthread_cond_destroy(&q->cond_space);
+  pthread_cond_destroy(&q->cond_frames);
+  pthread_mutex_destroy(&q->mutex);
+}
+
+double rawspec_sendq_gbps(const rawspec_sendq_t * q)
+{
+  if(q->stop_ns <= q->start_ns) {
+    return 0;
+  }
+  return 8.0 * q->bytes / (q->stop_ns - q->start_ns);
+}
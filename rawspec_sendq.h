@@ -0,0 +1,85 @@
+#ifndef _RAWSPEC_SENDQ_H_
+#define _RAWSPEC_SENDQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Bounded send queue for TCP network output
+//
+// Each TCP destination has a send queue that is shared by the output threads
+// of all output products (of all jobs) sent to it.  An output thread reserves
+// room for a whole frame with rawspec_sendq_reserve(), fills it in, and queues
+// it with rawspec_sendq_commit().  The destination's sender thread writes the
+// queued frames to the socket in order, gathering as many of them as possible
+// into each sendmsg() call.
+//
+// The queue holds at most `capacity` bytes of reserved and queued frames.  An
+// output thread that would exceed it waits for the sender rather than
+// dropping the frame, which in turn holds up the next dump of its output
+// product, so a slow receiver slows rawspec down rather than losing data.  A
+// frame larger than the capacity is accepted when the queue is empty.  Frames
+// are only dropped once the connection has failed, after which rawspec stops
+// and exits with a non-zero status.
+
+// Default capacity of a send queue
+#define RAWSPEC_SENDQ_BYTES (256*1024*1024)
+
+typedef struct rawspec_sendq_frame rawspec_sendq_frame_t;
+
+typedef struct {
+  char name[128];               // Destination (for messages)
+  int fd;                       // Connected TCP socket
+  size_t capacity;              // Maximum bytes reserved and queued
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_frames;   // Signaled when frames are queued or closing
+  pthread_cond_t cond_space;    // Signaled when queued frames have been sent
+  rawspec_sendq_frame_t * head; // Oldest queued frame
+  rawspec_sendq_frame_t * tail; // Newest queued frame
+  size_t queued;                // Bytes reserved and queued
+  int closing;                  // Non-zero once no more frames will be queued
+  int error;                    // errno of failed send (0 if none)
+  int thread_valid;
+  pthread_t thread;
+  // Statistics
+  uint64_t frames;              // Frames sent
+  uint64_t bytes;               // Bytes sent
+  uint64_t syscalls;            // sendmsg() calls
+  uint64_t dropped;             // Frames dropped after an error
+  uint64_t waits;               // Reservations that waited for space
+  uint64_t blocked_ns;          // Time spent waiting for space
+  size_t max_queued;            // High water mark of queued
+  uint64_t start_ns;            // Time first frame was queued (0 if none)
+  uint64_t stop_ns;             // Time last frame was sent
+} rawspec_sendq_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Initializes `q` for connected socket `fd` of destination `name` with room
+// for `capacity` bytes and starts its sender thread.  Returns 0 on success, -1
+// on error.
+int rawspec_sendq_init(rawspec_sendq_t * q, const char * name, int fd,
+                       size_t capacity);
+
+// Waits until `size` bytes fit in `q` and returns a buffer of `size` bytes for
+// a frame, or NULL if the connection has failed (or on allocation failure),
+// in which case the frame is counted as dropped.
+void * rawspec_sendq_reserve(rawspec_sendq_t * q, size_t size);
+
+// Queues the frame `buf` returned by rawspec_sendq_reserve() for sending.
+void rawspec_sendq_commit(rawspec_sendq_t * q, void * buf);
+
+// Sends the remaining frames of `q`, stops its sender thread, and frees its
+// resources.  The socket is not closed.
+void rawspec_sendq_close(rawspec_sendq_t * q);
+
+// Returns the rate at which `q` has sent in Gbps (0 if nothing has been sent).
+double rawspec_sendq_gbps(const rawspec_sendq_t * q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RAWSPEC_SENDQ_H_
@@ -0,0 +1,395 @@
+// Shared memory output rings (see rawspec_shmout.h).  Notification uses
+// shared (i.e. not FUTEX_PRIVATE_FLAG) futexes on the ring header's sequence
+// numbers so that it works between processes.
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "rawspec_shmout.h"
+#include "rawspec_callback.h"
+
+#define ALIGN(n, a) ((((n) + (a) - 1) / (a)) * (a))
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+// Interval at which a waiting producer checks that the reader still exists
+#define READER_CHECK_MS (100)
+
+// Waits for `*addr` to differ from `val` for up to `timeout_ms` milliseconds
+// (forever if negative).
+static void futex_wait(uint32_t * addr, uint32_t val, int timeout_ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts,
+          NULL, 0);
+}
+
+// Wakes all waiters on `addr`.
+static void futex_wake(uint32_t * addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void rawspec_shmout_init(rawspec_shmout_t * r, const char * stem, int idx,
+                         int product, int ics, unsigned int nslots)
+{
+  memset(r, 0, sizeof(rawspec_shmout_t));
+  snprintf(r->name, sizeof(r->name), "/%s%s.rawspec.%04d", stem,
+           ics ? "-ics" : "", idx);
+  r->product = product;
+  r->ics = ics;
+  r->nslots = nslots;
+  r->fd = -1;
+  pthread_mutex_init(&r->mutex, NULL);
+}
+
+// Creates the shared memory object of ring `r` (see rawspec_shmout_create)
+// with its mutex held.
+static int shmout_create(rawspec_shmout_t * r, uint32_t nds, uint64_t data_size)
+{
+  uint64_t slot_size;
+  int rc;
+
+  slot_size = ALIGN(ALIGN(sizeof(rawspec_shmout_slot_t), 64)
+                    + nds * sizeof(float), RAWSPEC_SHMOUT_ALIGN)
+            + ALIGN(data_size, RAWSPEC_SHMOUT_ALIGN);
+  r->map_size = RAWSPEC_SHMOUT_ALIGN + r->nslots * slot_size;
+
+  // Truncate any stale object of the same name
+  r->fd = shm_open(r->name, O_RDWR | O_CREAT | O_TRUNC, 0664);
+  if(r->fd == -1) {
+    perror(r->name);
+    return -1;
+  }
+  if(ftruncate(r->fd, r->map_size) == -1) {
+    perror(r->name);
+    close(r->fd);
+    shm_unlink(r->name);
+    r->fd = -1;
+    return -1;
+  }
+  // Reserve the ring's pages now so that a too small /dev/shm is reported
+  // here rather than by SIGBUS on the first dump
+  if((rc = posix_fallocate(r->fd, 0, r->map_size))) {
+    fprintf(stderr, "%s: cannot allocate %zu bytes of shared memory: %s\n",
+        r->name, r->map_size, strerror(rc));
+    close(r->fd);
+    shm_unlink(r->name);
+    r->fd = -1;
+    return -1;
+  }
+  r->hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                r->fd, 0);
+  if(r->hdr == MAP_FAILED) {
+    perror(r->name);
+    r->hdr = NULL;
+    close(r->fd);
+    shm_unlink(r->name);
+    r->fd = -1;
+    return -1;
+  }
+
+  r->hdr->version = RAWSPEC_SHMOUT_VERSION;
+  r->hdr->product = r->product;
+  r->hdr->ics = r->ics;
+  r->hdr->nslots = r->nslots;
+  r->hdr->max_nds = nds;
+  r->hdr->slot_size = slot_size;
+  r->hdr->max_data_size = data_size;
+  // Consumers check the magic number before using the ring
+  __atomic_store_n(&r->hdr->magic, RAWSPEC_SHMOUT_MAGIC, __ATOMIC_RELEASE);
+
+  printf("publishing output product %d%s to shared memory %s "
+      "(%u slots of %lu bytes)\n", r->product, r->ics ? " (ICS)" : "",
+      r->name, r->nslots, slot_size);
+  return 0;
+}
+
+int rawspec_shmout_create(rawspec_shmout_t * r, uint32_t nds,
+                          uint64_t data_size)
+{
+  int rc = 0;
+
+  pthread_mutex_lock(&r->mutex);
+  if(!r->hdr) {
+    rc = shmout_create(r, nds, data_size);
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return rc;
+}
+
+int rawspec_shmout_publish(rawspec_shmout_t * r, rawspec_shmout_slot_t * slot,
+                           const float * valid_frac, const void * data)
+{
+  uint32_t seq;
+  uint32_t read_seq;
+  int32_t pid;
+  int waited = 0;
+  char * p;
+  struct timespec ts_start, ts_stop;
+
+  pthread_mutex_lock(&r->mutex);
+
+  if(!r->hdr && shmout_create(r, slot->nds, slot->data_size)) {
+    pthread_mutex_unlock(&r->mutex);
+    return -1;
+  }
+
+  if(slot->nds > r->hdr->max_nds || slot->data_size > r->hdr->max_data_size) {
+    if(r->dropped++ == 0) {
+      fprintf(stderr, "%s: dump of %lu bytes does not fit ring, dropping\n",
+          r->name, slot->data_size);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return 0;
+  }
+
+  // Wait for the registered reader (if any) to release the oldest slot
+  seq = r->hdr->write_seq;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  for(;;) {
+    pid = __atomic_load_n(&r->hdr->reader_pid, __ATOMIC_ACQUIRE);
+    read_seq = __atomic_load_n(&r->hdr->read_seq, __ATOMIC_ACQUIRE);
+    if(pid == 0 || seq - read_seq < r->nslots) {
+      break;
+    }
+    waited = 1;
+    futex_wait(&r->hdr->read_seq, read_seq, READER_CHECK_MS);
+    // Unregister a reader that has exited without detaching
+    if(kill(pid, 0) == -1 && errno == ESRCH) {
+      fprintf(stderr, "%s: reader %d has exited, unregistering\n",
+          r->name, pid);
+      __atomic_compare_exchange_n(&r->hdr->reader_pid, &pid, 0, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+  }
+  if(waited) {
+    clock_gettime(CLOCK_MONOTONIC, &ts_stop);
+    r->waits++;
+    r->blocked_ns += ELAPSED_NS(ts_start, ts_stop);
+  }
+
+  // Fill slot
+  p = (char *)r->hdr + RAWSPEC_SHMOUT_ALIGN + (seq % r->nslots) * r->hdr->slot_size;
+  slot->seq = seq;
+  slot->valid_offset = ALIGN(sizeof(rawspec_shmout_slot_t), 64);
+  slot->data_offset = ALIGN(slot->valid_offset + r->hdr->max_nds * sizeof(float),
+                            RAWSPEC_SHMOUT_ALIGN);
+  memcpy(p, slot, sizeof(rawspec_shmout_slot_t));
+  if(valid_frac) {
+    memcpy(p + slot->valid_offset, valid_frac, slot->nds * sizeof(float));
+  } else {
+    memset(p + slot->valid_offset, 0, slot->nds * sizeof(float));
+  }
+  memcpy(p + slot->data_offset, data, slot->data_size);
+
+  // Publish and notify consumers
+  __atomic_store_n(&r->hdr->write_seq, seq + 1, __ATOMIC_RELEASE);
+  futex_wake(&r->hdr->write_seq);
+  r->dumps++;
+
+  pthread_mutex_unlock(&r->mutex);
+  return 0;
+}
+
+void rawspec_shmout_close(rawspec_shmout_t * r)
+{
+  if(r->hdr) {
+    __atomic_store_n(&r->hdr->end, 1, __ATOMIC_RELEASE);
+    // Bump write_seq's futex waiters without publishing
+    futex_wake(&r->hdr->write_seq);
+    munmap(r->hdr, r->map_size);
+    r->hdr = NULL;
+    close(r->fd);
+    r->fd = -1;
+    shm_unlink(r->name);
+  }
+  pthread_mutex_destroy(&r->mutex);
+}
+
+int rawspec_shmout_attach(rawspec_shmout_reader_t * rd, const char * name,
+                          int reg)
+{
+  struct stat st;
+  int32_t zero = 0;
+
+  memset(rd, 0, sizeof(rawspec_shmout_reader_t));
+  rd->fd = shm_open(name, O_RDWR, 0);
+  if(rd->fd == -1) {
+    return -1;
+  }
+  if(fstat(rd->fd, &st) == -1 || st.st_size < RAWSPEC_SHMOUT_ALIGN) {
+    close(rd->fd);
+    errno = EAGAIN;
+    return -1;
+  }
+  rd->map_size = st.st_size;
+  rd->hdr = mmap(NULL, rd->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 rd->fd, 0);
+  if(rd->hdr == MAP_FAILED) {
+    close(rd->fd);
+    return -1;
+  }
+  if(__atomic_load_n(&rd->hdr->magic, __ATOMIC_ACQUIRE) != RAWSPEC_SHMOUT_MAGIC
+  || rd->hdr->version != RAWSPEC_SHMOUT_VERSION) {
+    rawspec_shmout_detach(rd);
+    errno = EPROTO;
+    return -1;
+  }
+
+  rd->next = __atomic_load_n(&rd->hdr->write_seq, __ATOMIC_ACQUIRE);
+  if(reg) {
+    // Release everything before the next dump, then register
+    __atomic_store_n(&rd->hdr->read_seq, rd->next, __ATOMIC_RELEASE);
+    if(!__atomic_compare_exchange_n(&rd->hdr->reader_pid, &zero, getpid(), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      rawspec_shmout_detach(rd);
+      errno = EBUSY;
+      return -1;
+    }
+    rd->registered = 1;
+  }
+  return 0;
+}
+
+int rawspec_shmout_next(rawspec_shmout_reader_t * rd,
+                        rawspec_shmout_slot_t ** slot, int timeout_ms)
+{
+  uint32_t write_seq;
+
+  write_seq = __atomic_load_n(&rd->hdr->write_seq, __ATOMIC_ACQUIRE);
+  if(write_seq == rd->next) {
+    if(__atomic_load_n(&rd->hdr->end, __ATOMIC_ACQUIRE)) {
+      return -1;
+    }
+    futex_wait(&rd->hdr->write_seq, write_seq, timeout_ms);
+    write_seq = __atomic_load_n(&rd->hdr->write_seq, __ATOMIC_ACQUIRE);
+    if(write_seq == rd->next) {
+      return __atomic_load_n(&rd->hdr->end, __ATOMIC_ACQUIRE) ? -1 : 0;
+    }
+  }
+
+  // Skip dumps that have been overwritten (only without registration)
+  if(write_seq - rd->next > rd->hdr->nslots) {
+    rd->overruns += write_seq - rd->next - rd->hdr->nslots;
+    rd->next = write_seq - rd->hdr->nslots;
+  }
+
+  *slot = (rawspec_shmout_slot_t *)((char *)rd->hdr + RAWSPEC_SHMOUT_ALIGN
+        + (rd->next % rd->hdr->nslots) * rd->hdr->slot_size);
+  return 1;
+}
+
+void rawspec_shmout_release(rawspec_shmout_reader_t * rd)
+{
+  rd->next++;
+  if(rd->registered) {
+    __atomic_store_n(&rd->hdr->read_seq, rd->next, __ATOMIC_RELEASE);
+    futex_wake(&rd->hdr->read_seq);
+  }
+}
+
+void rawspec_shmout_detach(rawspec_shmout_reader_t * rd)
+{
+  int32_t pid = getpid();
+
+  if(rd->registered) {
+    __atomic_compare_exchange_n(&rd->hdr->reader_pid, &pid, 0, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    futex_wake(&rd->hdr->read_seq);
+    rd->registered = 0;
+  }
+  munmap(rd->hdr, rd->map_size);
+  rd->hdr = NULL;
+  close(rd->fd);
+  rd->fd = -1;
+}
+
+// Publishes the dump of `cb_data` to its rings.
+static void * dump_shm_thread_func(void *arg)
+{
+  callback_data_t * cb_data = (callback_data_t *)arg;
+  rawspec_shmout_slot_t slot;
+
+  memset(&slot, 0, sizeof(slot));
+  slot.nds = cb_data->Nds;
+  slot.nifs = cb_data->fb_hdr.nifs;
+  slot.nbits = cb_data->fb_hdr.nbits;
+  slot.fch1 = cb_data->fb_hdr.fch1;
+  slot.foff = cb_data->fb_hdr.foff;
+  slot.tsamp = cb_data->fb_hdr.tsamp;
+  slot.tstart = fb_spectrum_mjd(&cb_data->fb_hdr, cb_data->stem_spectra);
+
+  if(cb_data->shm && cb_data->h_pwrbuf) {
+    slot.nchans = cb_data->Nf;
+    slot.nants = cb_data->Nant;
+    slot.data_size = cb_data->h_pwrbuf_size;
+    if(rawspec_shmout_publish(cb_data->shm, &slot, cb_data->h_validfrac,
+                              cb_data->h_pwrbuf)) {
+      cb_data->exit_soon = 1;
+    }
+  }
+
+  if(cb_data->shm_ics && cb_data->h_icsbuf) {
+    slot.nchans = cb_data->Nf / cb_data->Nant;
+    slot.nants = 1;
+    slot.data_size = cb_data->h_pwrbuf_size / cb_data->Nant;
+    if(rawspec_shmout_publish(cb_data->shm_ics, &slot, cb_data->h_validfrac,
+                              cb_data->h_icsbuf)) {
+      cb_data->exit_soon = 1;
+    }
+  }
+
+  cb_data->stem_spectra += cb_data->Nds;
+  cb_data->total_spectra += cb_data->Nds;
+
+  return NULL;
+}
+
+void dump_shm_callback(
+    rawspec_context * ctx,
+    int output_product,
+    int callback_type)
+{
+  int rc;
+  callback_data_t * cb_data =
+    &((callback_data_t *)ctx->user_data)[output_product];
+
+  ctx->exit_soon = cb_data->exit_soon;
+
+  if(callback_type == RAWSPEC_CALLBACK_PRE_DUMP) {
+    if(cb_data->output_thread_valid) {
+      // Join output thread
+      if((rc=pthread_join(cb_data->output_thread, NULL))) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(rc));
+      }
+      // Flag thread as invalid
+      cb_data->output_thread_valid = 0;
+    }
+  } else if(callback_type == RAWSPEC_CALLBACK_POST_DUMP) {
+    // Create output thread
+    if((rc=pthread_create(&cb_data->output_thread, NULL,
+                      dump_shm_thread_func, cb_data))) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+    } else {
+      cb_data->output_thread_valid = 1;
+    }
+  }
+}
@@ -0,0 +1,156 @@
+#ifndef _RAWSPEC_SHMOUT_H_
+#define _RAWSPEC_SHMOUT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rawspec.h"
+
+// Shared memory output rings
+//
+// Each output product (and its incoherent sum) can be published to a POSIX
+// shared memory ring (see shm_overview(7)) so that consumers on the same host
+// can map the spectra without copying them through files or sockets.  A ring
+// consists of a rawspec_shmout_hdr_t followed by `nslots` slots.  Each slot
+// holds one dump: a rawspec_shmout_slot_t describing the dump, the valid
+// sample fraction of each of its Nds spectra (at `valid_offset`), and the
+// spectra themselves (at the page aligned `data_offset`) in the same layout as
+// the data of a SIGPROC filterbank file.
+//
+// rawspec increments `write_seq` after filling slot `write_seq % nslots` and
+// wakes any consumers waiting on it with futex(2).  Without a registered
+// reader, rawspec never waits and overwrites the oldest slot, so consumers
+// must check that a slot's `seq` is unchanged after using it.  A single reader
+// may register itself by storing its pid in `reader_pid` (see
+// rawspec_shmout_attach).  rawspec then never overwrites a slot that the
+// reader has not released by advancing `read_seq`, waiting on `read_seq` when
+// the ring is full.  The time rawspec spends waiting (i.e. the backpressure
+// from the reader) is reported at the end.
+
+// Value of rawspec_shmout_hdr_t.magic ("RSHM")
+#define RAWSPEC_SHMOUT_MAGIC (0x4d485352)
+#define RAWSPEC_SHMOUT_VERSION (1)
+
+// Default number of slots per ring
+#define RAWSPEC_SHMOUT_NSLOTS (8)
+
+// Alignment of the ring header, slots, and spectra
+#define RAWSPEC_SHMOUT_ALIGN (4096)
+
+// Ring header (at the start of the shared memory object)
+typedef struct {
+  uint32_t magic;               // RAWSPEC_SHMOUT_MAGIC
+  uint32_t version;             // RAWSPEC_SHMOUT_VERSION
+  int32_t product;              // Output product
+  int32_t ics;                  // Non-zero for incoherent sum
+  uint32_t nslots;              // Number of slots
+  uint32_t max_nds;             // Maximum spectra per slot
+  uint64_t slot_size;           // Bytes per slot
+  uint64_t max_data_size;       // Maximum bytes of spectra per slot
+  uint32_t write_seq;           // Number of dumps published (futex)
+  uint32_t read_seq;            // Number of dumps released by reader (futex)
+  int32_t reader_pid;           // Registered reader (0 if none)
+  uint32_t end;                 // Non-zero when rawspec has finished
+} rawspec_shmout_hdr_t;
+
+// Slot header
+typedef struct {
+  uint32_t seq;                 // Dump number (value of write_seq when filled)
+  uint32_t nds;                 // Number of spectra
+  int32_t nchans;               // Fine channels per spectrum (of all antennas)
+  int32_t nifs;                 // Polarization products per spectrum
+  int32_t nants;                // Antennas (nchans/nants channels each)
+  int32_t nbits;                // Bits per value (32, float)
+  double fch1;                  // Frequency of first channel (MHz)
+  double foff;                  // Channel width (MHz)
+  double tstart;                // MJD of first spectrum
+  double tsamp;                 // Time between spectra (s)
+  uint64_t valid_offset;        // Offset of valid sample fractions in slot
+  uint64_t data_offset;         // Offset of spectra in slot
+  uint64_t data_size;           // Bytes of spectra
+} rawspec_shmout_slot_t;
+
+// Producer side of a ring (private to rawspec).  A ring may be shared by the
+// jobs processing different stems concurrently.
+typedef struct rawspec_shmout {
+  char name[256];               // Name of shared memory object
+  int product;
+  int ics;
+  unsigned int nslots;
+  pthread_mutex_t mutex;
+  int fd;                       // Shared memory object (-1 until created)
+  rawspec_shmout_hdr_t * hdr;   // Mapped ring (NULL until created)
+  size_t map_size;
+  // Statistics
+  uint64_t dumps;               // Dumps published
+  uint64_t dropped;             // Dumps too large for the ring
+  uint64_t waits;               // Dumps that waited for the reader
+  uint64_t blocked_ns;          // Time spent waiting for the reader
+} rawspec_shmout_t;
+
+// Consumer side of a ring
+typedef struct {
+  int fd;
+  rawspec_shmout_hdr_t * hdr;   // Mapped ring
+  size_t map_size;
+  int registered;               // Non-zero if registered as the reader
+  uint32_t next;                // Sequence number of next dump to read
+  uint64_t overruns;            // Dumps overwritten before they were read
+} rawspec_shmout_reader_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Initializes ring `r` named `/STEM.rawspec.NNNN` (or `/STEM-ics.rawspec.NNNN`
+// if `ics` is non-zero), where NNNN is `idx`, for output product `product`.
+void rawspec_shmout_init(rawspec_shmout_t * r, const char * stem, int idx,
+                         int product, int ics, unsigned int nslots);
+
+// Creates the shared memory object of ring `r`, unless it already exists, with
+// slots for up to `nds` spectra and `data_size` bytes of spectra.  Returns 0
+// on success, -1 on error.
+int rawspec_shmout_create(rawspec_shmout_t * r, uint32_t nds,
+                          uint64_t data_size);
+
+// Publishes a dump of `slot->nds` spectra described by `slot` (whose seq and
+// offset fields are filled in) with valid sample fractions `valid_frac` (may
+// be NULL) and `slot->data_size` bytes of spectra `data`, waiting for the
+// registered reader (if any) to release a slot.  The ring is created if
+// needed.  Dumps that are larger than the ring's slots are dropped.  Returns 0
+// on success, -1 on error.
+int rawspec_shmout_publish(rawspec_shmout_t * r, rawspec_shmout_slot_t * slot,
+                           const float * valid_frac, const void * data);
+
+// Marks the ring as ended, wakes consumers, and removes its name.  Consumers
+// that have the ring mapped can still read the remaining dumps.
+void rawspec_shmout_close(rawspec_shmout_t * r);
+
+// Attaches `rd` to ring `name` (e.g. "/STEM.rawspec.0000").  If `reg` is
+// non-zero, registers as the ring's reader so that rawspec waits rather than
+// overwriting dumps that have not been released.  Reading starts at the next
+// dump published.  Returns 0 on success, -1 on error (errno is EBUSY if
+// another reader is registered).
+int rawspec_shmout_attach(rawspec_shmout_reader_t * rd, const char * name,
+                          int reg);
+
+// Waits up to `timeout_ms` milliseconds (forever if negative) for the next
+// dump and stores its slot in `*slot`.  Returns 1 if a dump is available, 0 on
+// timeout, or -1 if rawspec has finished and all dumps have been read.
+int rawspec_shmout_next(rawspec_shmout_reader_t * rd,
+                        rawspec_shmout_slot_t ** slot, int timeout_ms);
+
+// Releases the dump returned by rawspec_shmout_next.
+void rawspec_shmout_release(rawspec_shmout_reader_t * rd);
+
+// Unregisters (if registered) and unmaps the ring.
+void rawspec_shmout_detach(rawspec_shmout_reader_t * rd);
+
+void dump_shm_callback(
+    rawspec_context * ctx, int output_product, int callback_type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RAWSPEC_SHMOUT_H_
@@ -1,7 +1,12 @@
+#define _GNU_SOURCE 1
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
 #include <time.h>
@@ -9,10 +14,28 @@
 
 #include "rawspec_socket.h"
 #include "rawspec_callback.h"
+#include "rawspec_pacer.h"
 
 #define MIN_MTU (8600)
+
+// Time-to-live of multicast packets (i.e. the number of routers they may
+// traverse)
+#define MULTICAST_TTL (8)
 #define MAX_FLOATS_PER_PACKET (8192 / sizeof(float))
 
+// Maximum size of a packet header (including padding)
+#define MAX_HEADER_BYTES (4096)
+
+// Number of packets sent per sendmmsg() call
+#define BATCH_PACKETS (64)
+
+// Limits of UDP GSO datagrams (see udp(7))
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT (103)
+#endif
+#define GSO_MAX_SEGMENTS (64)
+#define GSO_MAX_BYTES (65507)
+
 #define MIN(a,b) ((a < b) ? (a) : (b))
 
 #define ELAPSED_NS(start,stop) \
@@ -54,6 +77,15 @@ int open_output_socket(const char * host, const char * port)
     if (sfd == -1)
       continue;
 
+    // Limit the scope of multicast output
+    if(IN_MULTICAST(ntohl(((struct sockaddr_in *)rp->ai_addr)->sin_addr.s_addr))) {
+      mtu = MULTICAST_TTL;
+      if(setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_TTL, &mtu, sizeof(int)) < 0) {
+        perror("setsockopt");
+        fprintf(stderr, "warning: could not set IP_MULTICAST_TTL\n");
+      }
+    }
+
     if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
       break; // Success
 
@@ -94,6 +126,126 @@ int open_output_socket(const char * host, const char * port)
   return sfd;
 }
 
+int open_tcp_socket(const char * host, const char * port)
+{
+  int rc;
+  int sfd;
+  struct addrinfo hints;
+  struct addrinfo * result;
+  struct addrinfo * rp;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;        // Allow IPv4 only (for now)
+  hints.ai_socktype = SOCK_STREAM;  // Stream socket
+
+  rc = getaddrinfo(host, port, &hints, &result);
+  if (rc != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+    return -1;
+  }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sfd == -1)
+      continue;
+
+    if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+      break; // Success
+
+    close(sfd);
+  }
+
+  if (rp == NULL) {
+    fprintf(stderr, "could not connect to %s:%s: %s\n", host, port,
+        strerror(errno));
+    freeaddrinfo(result);
+    return -1;
+  }
+
+  freeaddrinfo(result); // No longer needed
+
+  return sfd;
+}
+
+int set_socket_sndbuf(int fd, int bufsize)
+{
+  int actual = 0;
+  socklen_t ss = sizeof(int);
+
+  if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(int)) < 0) {
+    perror("setsockopt");
+    return -1;
+  }
+
+  // Linux reports twice the usable size
+  if(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &actual, &ss) == 0
+  && actual / 2 < bufsize) {
+    fprintf(stderr, "warning: send buffer limited to %d bytes "
+        "(see net.core.wmem_max)\n", actual / 2);
+  }
+
+  return 0;
+}
+
+int rawspec_parse_dest(char * spec, rawspec_dest_t * dest)
+{
+  char * pchar;
+  char * pend;
+
+  memset(dest, 0, sizeof(rawspec_dest_t));
+  dest->product = -1;
+  dest->chan_lo = 0;
+  dest->chan_hi = -1;
+  dest->fd = -1;
+
+  // Optional tcp:// prefix
+  if(!strncmp(spec, "tcp://", 6)) {
+    dest->tcp = 1;
+    spec += 6;
+  }
+
+  // Optional @PRODUCT[/FIRST-LAST]
+  pchar = strchr(spec, '@');
+  if(pchar) {
+    *pchar++ = '\0';
+    dest->product = strtol(pchar, &pend, 0);
+    if(pend == pchar || dest->product < 0) {
+      fprintf(stderr, "error: invalid output product in destination %s\n", spec);
+      return -1;
+    }
+    if(*pend == '/') {
+      pchar = pend + 1;
+      dest->chan_lo = strtol(pchar, &pend, 0);
+      if(pend == pchar || *pend != '-') {
+        fprintf(stderr, "error: invalid channel range in destination %s\n", spec);
+        return -1;
+      }
+      pchar = pend + 1;
+      dest->chan_hi = strtol(pchar, &pend, 0);
+      if(pend == pchar || dest->chan_lo < 0 || dest->chan_hi < dest->chan_lo) {
+        fprintf(stderr, "error: invalid channel range in destination %s\n", spec);
+        return -1;
+      }
+    }
+    if(*pend != '\0') {
+      fprintf(stderr, "error: invalid destination %s\n", spec);
+      return -1;
+    }
+  }
+
+  // HOST:PORT
+  pchar = strrchr(spec, ':');
+  if(!pchar) {
+    fprintf(stderr, "error: destination %s is not HOST:PORT\n", spec);
+    return -1;
+  }
+  *pchar++ = '\0';
+  dest->host = spec;
+  dest->port = pchar;
+
+  return 0;
+}
+
 #if 0
 void set_socket_options(rawspec_context * ctx)
 {
@@ -131,28 +283,221 @@ void set_socket_options(rawspec_context * ctx)
 }
 #endif
 
-void * dump_net_thread_func(void *arg)
+// Finds the value of keyword `kw` in the filterbank header `hdr` of length
+// `len`.  Returns a pointer to the value or NULL if `kw` is not found.  The
+// keywords patched by dump_net_thread_func all precede the free form strings
+// of the header, so the first match is the keyword itself.
+static char * find_hdr_value(char * hdr, size_t len, const char * kw)
+{
+  char key[32];
+  char * p;
+  size_t keylen;
+
+  keylen = (char *)fb_buf_write_string(key, kw) - key;
+  p = memmem(hdr, len, key, keylen);
+  return p ? p + keylen : NULL;
+}
+
+// Sends the `npkts` packets described by `iov` (one iovec per packet) with as
+// few sendmmsg() calls as possible.  If `*gso` is non-zero, runs of
+// consecutive equal size packets are sent as single UDP GSO datagrams that
+// the kernel (or NIC) segments back into the original packets.  If GSO is not
+// supported, `*gso` is cleared and the packets are sent individually.
+// Returns the number of packets that could not be sent and adds the number of
+// system calls made to `*nsyscalls`.
+static int send_packets(int fd, struct iovec * iov, int npkts, int * gso,
+                        struct mmsghdr * msgs, char * cmsgbuf,
+                        unsigned int * nsyscalls)
 {
   int i;
-  char pkt[90000];
-  char * ppkt = pkt;
+  int j;
+  int nmsgs = 0;
+  int nsent;
+  int first = 0;
+  int error_packets = 0;
+  int retried = 0;
+  size_t msg_len;
+  int npkts_msg[BATCH_PACKETS];
+  struct cmsghdr * cmsg;
+
+  // Group packets into messages
+  for(i=0; i<npkts; i=j) {
+    memset(&msgs[nmsgs], 0, sizeof(struct mmsghdr));
+    msgs[nmsgs].msg_hdr.msg_iov = &iov[i];
+    msg_len = iov[i].iov_len;
+    j = i + 1;
+    if(*gso) {
+      // GSO segments must all be gso_size bytes except for the last one,
+      // which may be shorter.
+      while(j < npkts && j - i < GSO_MAX_SEGMENTS
+      && msg_len + iov[j].iov_len <= GSO_MAX_BYTES
+      && iov[j-1].iov_len == iov[i].iov_len
+      && iov[j].iov_len <= iov[i].iov_len) {
+        msg_len += iov[j].iov_len;
+        j++;
+      }
+      if(j - i > 1) {
+        msgs[nmsgs].msg_hdr.msg_control =
+          cmsgbuf + nmsgs * CMSG_SPACE(sizeof(uint16_t));
+        msgs[nmsgs].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        cmsg = CMSG_FIRSTHDR(&msgs[nmsgs].msg_hdr);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cmsg) = iov[i].iov_len;
+      }
+    }
+    msgs[nmsgs].msg_hdr.msg_iovlen = j - i;
+    npkts_msg[nmsgs++] = j - i;
+  }
+
+  while(first < nmsgs) {
+    nsent = sendmmsg(fd, &msgs[first], nmsgs - first, 0);
+    (*nsyscalls)++;
+    if(nsent == -1) {
+      if(*gso && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT)) {
+        // GSO not supported by this kernel or device
+        fprintf(stderr, "warning: UDP GSO not supported (%s), disabling\n",
+            strerror(errno));
+        *gso = 0;
+        return error_packets + send_packets(fd,
+            msgs[first].msg_hdr.msg_iov, npkts - (msgs[first].msg_hdr.msg_iov - iov),
+            gso, msgs, cmsgbuf, nsyscalls);
+      } else if(errno == ENOTCONN && !retried) {
+        // ENOTCONN means that there is no listener on the receive side.
+        // Eventually we might want to stop sending packets if there is
+        // no remote listener, but for now we try to send packet again
+        // in case the remote side is capturing packets with packet sockets
+        // (e.g. hashpipe or libpcap/tcpdump).
+        retried = 1;
+        continue;
+      }
+      // Drop the message that could not be sent and carry on
+      error_packets += npkts_msg[first];
+      first++;
+    } else {
+      first += nsent;
+    }
+    retried = 0;
+  }
+
+  return error_packets;
+}
+
+// Network output route: the spectra of one output product that are sent to
+// one destination.  Each route is sent by its own thread.
+struct rawspec_route {
+  callback_data_t * cb_data;
+  rawspec_dest_t * dest;
+  double tstart;                // tstart of the first spectrum of the dump
+  int dump;                     // Dump number (for packet sequence keywords)
+  int thread_valid;
+  pthread_t thread;
+  // Statistics of the last dump
+  int packets;
+  int error_packets;
+  unsigned int syscalls;
+  uint64_t bytes;
+  uint64_t ns;
+};
+
+// Queues the spectra of the current dump of `route` as one frame on its TCP
+// destination's send queue, with filterbank header `fb_hdr` (whose fch1 and
+// tstart are those of the route's first channel and spectrum).  Waits if the
+// send queue is full.
+static void send_tcp_frame(rawspec_route_t * route, fb_hdr_t * fb_hdr,
+                           int chan_lo, int route_nchans)
+{
+  int i;
+  char hdr[MAX_HEADER_BYTES];
+  char * frame;
+  char * p;
+  size_t hdr_size;
+  size_t data_size;
+  size_t row_size;
+  rawspec_tcp_frame_t prefix;
+  rawspec_dest_t * dest = route->dest;
+  callback_data_t * cb_data = route->cb_data;
+  int nrows = cb_data->Nds * fb_hdr->nifs;
+  int nchans = fb_hdr->nchans;
+
+  fb_hdr->nchans = route_nchans;
+  if(dest->seq) {
+    fb_hdr->net_route = route - cb_data->routes;
+    fb_hdr->net_dump = route->dump;
+    fb_hdr->net_npkts = 1;
+  }
+  hdr_size = (char *)fb_buf_write_header(hdr, fb_hdr) - hdr;
+
+  row_size = route_nchans * sizeof(float);
+  data_size = nrows * row_size;
+
+  frame = rawspec_sendq_reserve(&dest->sendq,
+                                sizeof(prefix) + hdr_size + data_size);
+  if(!frame) {
+    // The frame was dropped, so stop rather than silently losing the rest
+    cb_data->exit_soon = 1;
+    return;
+  }
+
+  prefix.magic = RAWSPEC_TCP_MAGIC;
+  prefix.hdr_size = hdr_size;
+  prefix.data_size = data_size;
+  p = frame;
+  memcpy(p, &prefix, sizeof(prefix));
+  p += sizeof(prefix);
+  memcpy(p, hdr, hdr_size);
+  p += hdr_size;
+
+  // Copy the route's channels of each spectrum and polarization product
+  if(route_nchans == nchans) {
+    memcpy(p, cb_data->h_pwrbuf, data_size);
+  } else {
+    for(i=0; i<nrows; i++) {
+      memcpy(p, cb_data->h_pwrbuf + (size_t)i * nchans + chan_lo, row_size);
+      p += row_size;
+    }
+  }
+
+  rawspec_sendq_commit(&dest->sendq, frame);
+}
+
+static void * dump_net_thread_func(void *arg)
+{
+  int i;
+  char hdr[MAX_HEADER_BYTES];
+  char * ppkt;
+  char * batch_buf = NULL;
+  struct iovec iov[BATCH_PACKETS];
+  struct mmsghdr msgs[BATCH_PACKETS];
+  char cmsgbuf[BATCH_PACKETS * CMSG_SPACE(sizeof(uint16_t))];
+  int npkts = 0;
   float * ppwr;
   int32_t data_offset;
+  size_t hdr_size;
   size_t pkt_size;
-  double sec_per_packet;
-  double modf_int;
-  struct timespec sleep_time = {0, 0};
-  uint64_t elapsed_ns=0;
-  uint64_t pkt_ns=0;
-  int64_t sleep_ns=0;
+  size_t slot_size;
+  size_t batch_bytes = 0;
+  size_t quantum;
+  char * hdr_nchans_val;
+  char * hdr_fch1_val;
+  char * hdr_tstart_val;
+  char * hdr_pkt_val = NULL;
+  double pkt_fch1;
+  double pkt_tstart;
   struct timespec ts_start, ts_stop;
 
-  callback_data_t * cb_data = (callback_data_t *)arg;
-  fb_hdr_t * fb_hdr = &cb_data->fb_hdr;
+  rawspec_route_t * route = (rawspec_route_t *)arg;
+  rawspec_dest_t * dest = route->dest;
+  callback_data_t * cb_data = route->cb_data;
+  fb_hdr_t fb_hdr = cb_data->fb_hdr;
 
-  // Fields to remember from header
-  int hdr_nchans = fb_hdr->nchans;
-  double hdr_fch1 = fb_hdr->fch1;
+  // Channels of the product that are sent to this destination
+  int nchans = fb_hdr.nchans;
+  int nifs = fb_hdr.nifs;
+  int chan_lo = dest->chan_lo;
+  int chan_hi = dest->chan_hi;
+  int route_nchans;
 
   int channels_per_packet;
   int spectra_per_packet;
@@ -161,31 +506,108 @@ void * dump_net_thread_func(void *arg)
 
   int pkt_nchan;
   int pkt_nspec;
+  int pkt_index = 0;
 
-  uint64_t total_bytes = 0;
-  int total_packets = 0;
-  int error_packets = 0;
+  route->packets = 0;
+  route->error_packets = 0;
+  route->syscalls = 0;
+  route->bytes = 0;
+  route->ns = 0;
+
+  if(chan_hi < 0 || chan_hi >= nchans) {
+    chan_hi = nchans - 1;
+  }
+  if(chan_lo > chan_hi) {
+    return NULL;
+  }
+  route_nchans = chan_hi - chan_lo + 1;
+  fb_hdr.fch1 += chan_lo * fb_hdr.foff;
+  fb_hdr.tstart = route->tstart;
+
+  // TCP destinations get the whole dump as one frame
+  if(dest->tcp) {
+    send_tcp_frame(route, &fb_hdr, chan_lo, route_nchans);
+    return NULL;
+  }
 
   // Get time at start of output
   clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-  if(hdr_nchans >= MAX_FLOATS_PER_PACKET) {
-    channels_per_packet = MAX_FLOATS_PER_PACKET;
+  // Batches are limited to the pacer's quantum (but contain at least one
+  // packet).
+  quantum = rawspec_pacer_quantum(&dest->pacer);
+
+  // Each packet holds one or more spectra of one range of channels, with the
+  // nifs polarization products of each spectrum one after the other (the
+  // same layout as the data of a SIGPROC filterbank file).
+  if(route_nchans * nifs >= MAX_FLOATS_PER_PACKET) {
+    channels_per_packet = MAX_FLOATS_PER_PACKET / nifs;
     spectra_per_packet = 1;
   } else {
-    channels_per_packet = hdr_nchans;
-    spectra_per_packet = MAX_FLOATS_PER_PACKET / hdr_nchans;
+    channels_per_packet = route_nchans;
+    spectra_per_packet = MAX_FLOATS_PER_PACKET / (route_nchans * nifs);
     if(spectra_per_packet > spec_remaining) {
       spectra_per_packet = spec_remaining;
     }
   }
 
+  // Packet sequence keywords let receivers tell lost packets from reordered
+  // ones.  Each route numbers the packets of each dump from 0 to net_npkts-1.
+  if(dest->seq) {
+    fb_hdr.net_route = route - cb_data->routes;
+    fb_hdr.net_dump = route->dump;
+    fb_hdr.net_npkts =
+      ((route_nchans + channels_per_packet - 1) / channels_per_packet)
+      * ((spec_remaining + spectra_per_packet - 1) / spectra_per_packet);
+  }
+
+  // Build the packet header template.  Only nchans, fch1, tstart, and net_pkt
+  // vary from packet to packet and they do not change the size of the header,
+  // so the template is built once per dump and these values are patched into
+  // each packet.
+  fb_hdr.nchans = channels_per_packet;
+  ppkt = fb_buf_write_header(hdr, &fb_hdr);
+
+  // Calculate data offset as next multiple of 512 in packet socket UDP
+  // frame (which starts 0x6c bytes from start of page aligned frame).
+  data_offset = 0x6c + (ppkt - hdr);
+  if(data_offset % 512 != 0) {
+    data_offset += 512 - (data_offset % 512);
+  }
+  // If data offset is beyond header
+  if(data_offset > (0x6c + ppkt - hdr)) {
+    // If data offset is less than 20 bytes beyond header
+    if(data_offset < (0x6c + ppkt - hdr) + 20) {
+      // Add 512 more bytes since less than 20 is not paddable
+      data_offset += 512;
+    }
+    // Output padded header to template
+    ppkt = fb_buf_write_padded_header(hdr, &fb_hdr, data_offset - 0x6c);
+  }
+  hdr_size = ppkt - hdr;
+
+  hdr_nchans_val = find_hdr_value(hdr, hdr_size, "nchans");
+  hdr_fch1_val = find_hdr_value(hdr, hdr_size, "fch1");
+  hdr_tstart_val = find_hdr_value(hdr, hdr_size, "tstart");
+  if(dest->seq) {
+    hdr_pkt_val = find_hdr_value(hdr, hdr_size, "net_pkt");
+  }
+
+  slot_size = hdr_size
+            + channels_per_packet * spectra_per_packet * nifs * sizeof(float);
+  batch_buf = malloc(BATCH_PACKETS * slot_size);
+  if(!batch_buf) {
+    fprintf(stderr, "fine channels %10d: cannot allocate packet buffer\n",
+        cb_data->Nf);
+    return NULL;
+  }
+
 #if defined(DEBUG_CALLBACKS) && DEBUG_CALLBACKS != 0
   if(cb_data->debug_callback) {
     fprintf(stderr,
-        "tsamp %.4g * spec/pkt %u * chan/pkt %u / Nf %u = sec/pkt %.4g\n",
-        fb_hdr->tsamp, spectra_per_packet, channels_per_packet, cb_data->Nf,
-        sec_per_packet);
+        "tsamp %.4g * spec/pkt %u * chan/pkt %u / Nf %u, hdr %lu bytes\n",
+        fb_hdr.tsamp, spectra_per_packet, channels_per_packet, cb_data->Nf,
+        hdr_size);
   }
 #endif
 
@@ -194,161 +616,187 @@ void * dump_net_thread_func(void *arg)
     pkt_nspec = MIN(spectra_per_packet, spec_remaining);
 
     // Restore header fch1
-    fb_hdr->fch1 = hdr_fch1;
+    pkt_fch1 = fb_hdr.fch1;
+
+    // Header tstart
+    pkt_tstart = route->tstart
+               + (cb_data->Nds - spec_remaining) * fb_hdr.tsamp / 86400.0;
 
     // Set ppwr to start of current output spectrum
-    ppwr = cb_data->h_pwrbuf + (cb_data->Nds - spec_remaining) * hdr_nchans;
+    ppwr = cb_data->h_pwrbuf
+         + (cb_data->Nds - spec_remaining) * nifs * nchans + chan_lo;
 
     // Inner loop over all channels for this dump
-    chan_remaining = hdr_nchans;
+    chan_remaining = route_nchans;
     while(chan_remaining) {
       pkt_nchan = MIN(channels_per_packet, chan_remaining);
 
-      // Update header nchans
-      fb_hdr->nchans = pkt_nchan;
-
-      // Output header to packet buffer
-      ppkt = fb_buf_write_header(pkt, fb_hdr);
-
-      // Calculate data offset as next multiple of 512 in packet socket UDP
-      // frame (which starts 0x6c bytes from start of page aligned frame).
-      data_offset = 0x6c + (ppkt - pkt);
-      if(data_offset % 512 != 0) {
-        data_offset += 512 - (data_offset % 512);
-      }
-      // If data offset is beyond header
-      if(data_offset > (0x6c + ppkt - pkt)) {
-        // If data offset is less than 20 bytes beyond header
-        if(data_offset < (0x6c + ppkt - pkt) + 20) {
-          // Add 512 more bytes since less than 20 is not paddable
-          data_offset += 512;
-        }
-        // Output padded header to packet buffer
-        ppkt = fb_buf_write_padded_header(pkt, fb_hdr,
-                                          data_offset - 0x6c);
+      // Output header to packet buffer from template
+      ppkt = batch_buf + npkts * slot_size;
+      memcpy(ppkt, hdr, hdr_size);
+      fb_buf_write_int(ppkt + (hdr_nchans_val - hdr), pkt_nchan);
+      fb_buf_write_double(ppkt + (hdr_fch1_val - hdr), pkt_fch1);
+      fb_buf_write_double(ppkt + (hdr_tstart_val - hdr), pkt_tstart);
+      if(hdr_pkt_val) {
+        fb_buf_write_int(ppkt + (hdr_pkt_val - hdr), pkt_index++);
       }
+      ppkt += hdr_size;
 
       // Copy spectra to buffer
-      for(i=0; i<pkt_nspec; i++) {
-        memcpy(ppkt, ppwr + i*hdr_nchans, pkt_nchan*sizeof(float));
+      for(i=0; i<pkt_nspec*nifs; i++) {
+        memcpy(ppkt, ppwr + i*nchans, pkt_nchan*sizeof(float));
         ppkt += pkt_nchan*sizeof(float);
       }
 
-      // Send packet
-      // TODO Handle EMSGSIZE errors from send()?
-      total_packets++;
-      pkt_size = ppkt - pkt;
-      total_bytes += pkt_size;
-      if(send(cb_data->fd[0], pkt, pkt_size, 0) == -1) {
-        if(errno == ENOTCONN) {
-          // ENOTCONN means that there is no listener on the receive side.
-          // Eventually we might want to stop sending packets if there is
-          // no remote listener, but for now we try to send packet again
-          // in case the remote side is capturing packets with packet sockets
-          // (e.g. hashpipe or libpcap/tcpdump).
-          if(send(cb_data->fd[0], pkt, pkt_size, 0) == -1) {
-            error_packets++;
-          }
-        }
-      }
-
-      clock_gettime(CLOCK_MONOTONIC, &ts_stop);
-      elapsed_ns = ELAPSED_NS(ts_start, ts_stop);
-      sleep_ns = ((int64_t)(8.0 * total_bytes / cb_data->rate)) - elapsed_ns;
-
-      // Sleep to throttle output rate.  Wait for sleep time to build up to 100
-      // usec to minimize oversleeping due to timer granularity problems.
-      if(sleep_ns > 100*1000) {
-        sleep_time.tv_sec  = sleep_ns / (1000*1000*1000);
-        sleep_time.tv_nsec = sleep_ns % (1000*1000*1000);
-        nanosleep(&sleep_time, NULL);
-      }
+      // Queue packet
+      // TODO Handle EMSGSIZE errors from sendmmsg()?
+      pkt_size = ppkt - (batch_buf + npkts * slot_size);
+      iov[npkts].iov_base = batch_buf + npkts * slot_size;
+      iov[npkts].iov_len = pkt_size;
+      npkts++;
+      batch_bytes += pkt_size;
+      route->packets++;
+      route->bytes += pkt_size;
 
       // Advance ppwr
       ppwr += pkt_nchan;
 
       // Update header fch1
-      fb_hdr->fch1 += pkt_nchan * fb_hdr->foff;
+      pkt_fch1 += pkt_nchan * fb_hdr.foff;
 
       // Decrement chan_remaining
       chan_remaining -= pkt_nchan;
 
-    } // Inner loop over all channels
+      // Send batch if full, if another packet would exceed the pacer's
+      // quantum, or if this is the last packet of the dump.  The
+      // destination's pacer throttles the combined output rate of all
+      // products sent to it.
+      if(npkts == BATCH_PACKETS || batch_bytes + pkt_size > quantum
+      || (chan_remaining == 0 && spec_remaining == pkt_nspec)) {
+        rawspec_pacer_wait(&dest->pacer, batch_bytes);
+        route->error_packets += send_packets(dest->fd, iov, npkts,
+                                             &dest->udp_gso, msgs, cmsgbuf,
+                                             &route->syscalls);
+        rawspec_pacer_sent(&dest->pacer);
+        npkts = 0;
+        batch_bytes = 0;
+      }
 
-    // Update header tstart
-    fb_hdr->tstart += pkt_nspec * fb_hdr->tsamp / 86400.0;
+    } // Inner loop over all channels
 
     // Decrement spec_remaining
     spec_remaining -= pkt_nspec;
 
   } // Outer loop over all spectra
 
-  // Restore fch1
-  fb_hdr->fch1 = hdr_fch1;
-
-  // Restore nchans
-  fb_hdr->nchans = hdr_nchans;
-
-  if(error_packets > 0) {
-    printf("fine channels %10d: error packets %d/%d\n",
-        cb_data->Nf, error_packets, total_packets);
-  }
-
-  // Final sleep to throttle output rate.  Don't worry about granularity for
-  // this final sleep.
-  clock_gettime(CLOCK_MONOTONIC, &ts_stop);
-  elapsed_ns = ELAPSED_NS(ts_start, ts_stop);
-      sleep_ns = ((int64_t)(8.0 * total_bytes / cb_data->rate)) - elapsed_ns;
-  sleep_time.tv_sec  = sleep_ns / (1000*1000*1000);
-  sleep_time.tv_nsec = sleep_ns % (1000*1000*1000);
-  nanosleep(&sleep_time, NULL);
+  free(batch_buf);
 
   clock_gettime(CLOCK_MONOTONIC, &ts_stop);
-  elapsed_ns = ELAPSED_NS(ts_start, ts_stop);
+  route->ns = ELAPSED_NS(ts_start, ts_stop);
 
 #if defined(DEBUG_CALLBACKS) && DEBUG_CALLBACKS != 0
   if(cb_data->debug_callback) {
-    cb_data->debug_callback--;
     fprintf(stderr,
-        "fine channels %10d: output thread took %.6f ms elapsed (%.3f Gbps)\n",
-        cb_data->Nf, elapsed_ns / 1e6, (8.0 * total_bytes) / elapsed_ns);
+        "fine channels %10d to %s:%s: output thread took %.6f ms elapsed "
+        "(%.3f Gbps, %.1f packets/syscall)\n",
+        cb_data->Nf, dest->host, dest->port, route->ns / 1e6,
+        (8.0 * route->bytes) / route->ns,
+        (double)route->packets / route->syscalls);
   }
 #endif
 
-  // Increment total spectra and total packets counters
-  cb_data->total_spectra += cb_data->Nds;
-  cb_data->total_packets += total_packets;
-  cb_data->total_bytes += total_bytes;
-  cb_data->total_ns += elapsed_ns;
-
   return NULL;
 }
 
+int rawspec_net_init_routes(callback_data_t * cb_data, int output_product,
+                            rawspec_dest_t * dests, int ndests)
+{
+  int i;
+
+  cb_data->routes = malloc(ndests * sizeof(rawspec_route_t));
+  if(!cb_data->routes) {
+    fprintf(stderr, "cannot allocate network output routes\n");
+    return -1;
+  }
+
+  cb_data->nroutes = 0;
+  for(i=0; i<ndests; i++) {
+    if(dests[i].product == -1 || dests[i].product == output_product) {
+      memset(&cb_data->routes[cb_data->nroutes], 0, sizeof(rawspec_route_t));
+      cb_data->routes[cb_data->nroutes].cb_data = cb_data;
+      cb_data->routes[cb_data->nroutes].dest = &dests[i];
+      cb_data->nroutes++;
+    }
+  }
+
+  return 0;
+}
+
+void rawspec_net_free_routes(callback_data_t * cb_data)
+{
+  free(cb_data->routes);
+  cb_data->routes = NULL;
+  cb_data->nroutes = 0;
+}
+
 void dump_net_callback(
     rawspec_context * ctx,
     int output_product,
     int callback_type)
 {
+  int i;
   int rc;
+  uint64_t dump_ns = 0;
   callback_data_t * cb_data =
       &((callback_data_t *)ctx->user_data)[output_product];
+  rawspec_route_t * route;
+
+  ctx->exit_soon = cb_data->exit_soon;
 
   if(callback_type == RAWSPEC_CALLBACK_PRE_DUMP) {
-    if(cb_data->output_thread_valid) {
-      // Join output thread
-      if((rc=pthread_join(cb_data->output_thread, NULL))) {
-        fprintf(stderr, "pthread_join: %s\n", strerror(rc));
+    for(i=0; i<cb_data->nroutes; i++) {
+      route = &cb_data->routes[i];
+      if(route->thread_valid) {
+        // Join output thread
+        if((rc=pthread_join(route->thread, NULL))) {
+          fprintf(stderr, "pthread_join: %s\n", strerror(rc));
+        }
+        // Flag thread as invalid
+        route->thread_valid = 0;
+
+        if(route->error_packets > 0) {
+          printf("fine channels %10d to %s:%s: error packets %d/%d\n",
+              cb_data->Nf, route->dest->host, route->dest->port,
+              route->error_packets, route->packets);
+        }
+
+        // Increment total packets counters
+        cb_data->total_packets += route->packets;
+        cb_data->total_error_packets += route->error_packets;
+        cb_data->total_syscalls += route->syscalls;
+        cb_data->total_bytes += route->bytes;
+        if(dump_ns < route->ns) {
+          dump_ns = route->ns;
+        }
       }
-      // Flag thread as invalid
-      cb_data->output_thread_valid = 0;
     }
+    cb_data->total_ns += dump_ns;
   } else if(callback_type == RAWSPEC_CALLBACK_POST_DUMP) {
-    // Create output thread
-    if((rc=pthread_create(&cb_data->output_thread, NULL,
-                      dump_net_thread_func, cb_data))) {
-      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
-    } else {
-      cb_data->output_thread_valid = 1;
+    // Each route sends the spectra of this dump
+    for(i=0; i<cb_data->nroutes; i++) {
+      route = &cb_data->routes[i];
+      route->tstart = fb_spectrum_mjd(&cb_data->fb_hdr, cb_data->stem_spectra);
+      route->dump = cb_data->total_spectra / cb_data->Nds;
+
+      // Create output thread
+      if((rc=pthread_create(&route->thread, NULL,
+                        dump_net_thread_func, route))) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      } else {
+        route->thread_valid = 1;
+      }
     }
+    cb_data->stem_spectra += cb_data->Nds;
+    cb_data->total_spectra += cb_data->Nds;
   }
 }